@@ -10,6 +10,7 @@
 #include "Evaluator.h"
 #include "Utility.h"
 #include "LBFGS.h"
+#include "Decoder.h"
 /// standard headers
 #include <cassert>
 #include <cfloat>
@@ -22,15 +23,44 @@
 
 #define MAT3(I, X, Y)	((m_state_size * m_state_size * (I)) + (m_state_size * (X)) + Y)
 #define MAT2(I, X)		((m_state_size * (I)) + X)
+#define DENSE_BLOCK		8	///< columns of the dense kernel in a block (a cache line of doubles)
 
 using namespace std;
 
 namespace tricrf {
 
+/**	Dense matrix-vector product of the forward-backward ; y[j] = sum_k x[k] * mat[k][j].
+	The columns are blocked so that the partial sums of a block stay in registers while
+	the rows are streamed, and the fixed-size inner loop is vectorized by the compiler.
+	@param x		input vector (n elements)
+	@param mat		n rows of stride elements
+	@param y		output vector (stride elements)
+*/
+static void denseProduct(const vector<double>& x, const vector<double>& mat, size_t n, size_t stride, vector<double>& y) {
+	for (size_t jb = 0; jb < stride; jb += DENSE_BLOCK) {
+		double acc[DENSE_BLOCK];
+		for (size_t t = 0; t < DENSE_BLOCK; t++)
+			acc[t] = 0.0;
+		for (size_t k = 0; k < n; k++) {
+			double a = x[k];
+			if (a == 0.0)
+				continue;
+			const double* row = &mat[k * stride + jb];
+			for (size_t t = 0; t < DENSE_BLOCK; t++)
+				acc[t] += a * row[t];
+		}
+		for (size_t t = 0; t < DENSE_BLOCK; t++)
+			y[jb + t] = acc[t];
+	}
+}
+
 /** Constructor.
 */
 CRF::CRF() {
 	m_default_oid = 0;
+	m_dense = false;
+	m_density = 0.0;
+	m_dense_stride = 0;
 }
 
 CRF::CRF(Logger *logger) {
@@ -38,10 +68,14 @@ CRF::CRF(Logger *logger) {
 	logger->report(MAX_HEADER);
 	logger->report(">> Conditional Random Fields << \n\n");
 	m_default_oid = 0;
+	m_dense = false;
+	m_density = 0.0;
+	m_dense_stride = 0;
 }
 
 void CRF::clear() {
 	m_Param.clear();
+	m_EdgeTheta.clear();
 }
 
 /** Save the model.
@@ -121,12 +155,30 @@ bool CRF::loadModel(const std::string& filename) {
 	return ret;
 }
 
+/**	Drop the zero-weight parameters of the model.
+	@return	# of dropped parameters
+*/
+size_t CRF::compact() {
+	timer stop_watch;
+	logger->report("[Model compaction]\n");
+
+	size_t n_param = m_Param.size();
+	size_t dropped = m_Param.compact();
+	logger->report("  # of Parameters = \t%d -> %d\n", n_param, m_Param.size());
+	logger->report("  compaction time = \t%.3f\n\n", stop_watch.elapsed());
+
+	/// to be used in inference
+	m_Param.makeStateIndex();
+
+	return dropped;
+}
+
 /**	Read the data from file
 */
 void CRF::readTrainData(const string& filename) {
 	/// File stream
 	string line;
-	ifstream f(filename.c_str());
+	InputStream f(filename, true);
 	if (!f)
 		throw runtime_error("cannot open data file");
 
@@ -157,8 +209,8 @@ void CRF::readTrainData(const string& filename) {
 
 	/// initializing
 	Sequence seq;
-	m_TrainSet.clear();
-	m_TrainSetCount.clear();
+	Data<Sequence>& train_set = m_TrainSet.reset();
+	vector<double>& train_count = m_TrainSetCount.reset();
 
 	size_t count = 0;
 	string prev_label = "";
@@ -169,15 +221,16 @@ void CRF::readTrainData(const string& filename) {
 	map<vector<vector<string> >, size_t> train_data_map;
 	vector<vector<string> > token_list;
 
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty() || tokens.size() <= 0) {	 ///< sequence break
+	DataReader reader(f, &m_Template);
+	vector<string> tokens;
+	while (reader.next(tokens)) {
+		if (tokens.size() <= 0) {	 ///< sequence break
 			if (train_data_map.find(token_list) == train_data_map.end()) {
-				m_TrainSet.append(seq);
-				train_data_map.insert(make_pair(token_list, m_TrainSetCount.size()));
-				m_TrainSetCount.push_back(1.0);
+				train_set.append(seq);
+				train_data_map.insert(make_pair(token_list, train_count.size()));
+				train_count.push_back(1.0);
 			} else {
-				m_TrainSetCount[train_data_map[token_list]] += 1.0;
+				train_count[train_data_map[token_list]] += 1.0;
 			}
 			seq.clear();
 			token_list.clear();
@@ -208,6 +261,7 @@ void CRF::readTrainData(const string& filename) {
 	}	// while
 	m_Param.endUpdate();
 
+	m_dedup_bytes = max(m_dedup_bytes, bytesOf(train_data_map));
 	logger->report("  # of data = \t\t%d\n", count);
 	logger->report("  loading time = \t%.3f\n\n", stop_watch.elapsed());
 
@@ -220,14 +274,14 @@ void CRF::readTrainData(const string& filename) {
 void CRF::readDevData(const string& filename) {
 	/// File stream
 	string line;
-	ifstream f(filename.c_str());
+	InputStream f(filename);
 	if (!f)
 		throw runtime_error("cannot open data file");
 
 	/// initializing
 	Sequence seq;
-	m_DevSet.clear();
-	m_DevSetCount.clear();
+	Data<Sequence>& dev_set = m_DevSet.reset();
+	vector<double>& dev_count = m_DevSetCount.reset();
 	size_t count = 0;
 	string prev_label = "";
 	timer stop_watch;
@@ -237,15 +291,16 @@ void CRF::readDevData(const string& filename) {
 	map<vector<vector<string> >, size_t> dev_data_map;
 	vector<vector<string> > token_list;
 
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty() || tokens.size() <= 0) {	 ///< sequence break
+	DataReader reader(f, &m_Template);
+	vector<string> tokens;
+	while (reader.next(tokens)) {
+		if (tokens.size() <= 0) {	 ///< sequence break
 			if (dev_data_map.find(token_list) == dev_data_map.end()) {
-				m_DevSet.append(seq);
-				dev_data_map.insert(make_pair(token_list, m_DevSetCount.size()));
-				m_DevSetCount.push_back(1.0);
+				dev_set.append(seq);
+				dev_data_map.insert(make_pair(token_list, dev_count.size()));
+				dev_count.push_back(1.0);
 			} else {
-				m_DevSetCount[dev_data_map[token_list]] += 1.0;
+				dev_count[dev_data_map[token_list]] += 1.0;
 			}
 			seq.clear();
 			token_list.clear();
@@ -262,6 +317,7 @@ void CRF::readDevData(const string& filename) {
 
 	}	// while
 
+	m_dedup_bytes = max(m_dedup_bytes, bytesOf(dev_data_map));
 	logger->report("  # of data = \t\t%d\n", count);
 	logger->report("  loading time = \t%.3f\n\n", stop_watch.elapsed());
 }
@@ -273,9 +329,60 @@ void CRF::calculateEdge() {
 	// state transition is independent of time t and training set
 	m_M2.resize(m_state_size * m_state_size);
 	fill(m_M2.begin(), m_M2.end(), 1.0);
+	m_EdgeTheta.clear();
 	vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin();
 	for (; iter != m_Param.m_StateIndex.end(); ++iter) {
 		m_M2[MAT2(iter->y1,iter->y2)] *= exp(theta[iter->fid] * iter->fval);
+		m_EdgeTheta.push_back(theta[iter->fid]);
+	}
+	selectKernel();
+}
+
+/**	Check whether the transition weights have changed since the last calculateEdge().
+	eval() and evals() decode one sequence at a time with fixed weights, so the edge factors
+	are calculated again only after the weights have changed (training, loading).
+	@return true if calculateEdge() has to be called
+*/
+bool CRF::edgeChanged() {
+	if (m_M2.size() != m_state_size * m_state_size || m_EdgeTheta.size() != m_Param.m_StateIndex.size())
+		return true;
+	if (m_dense != (m_state_size > 0 && m_density >= m_dense_transition))
+		return true;	///< the kernel setting has changed
+	double* theta = m_Param.getWeight();
+	for (size_t x = 0; x < m_EdgeTheta.size(); x++) {
+		if (m_EdgeTheta[x] != theta[m_Param.m_StateIndex[x].fid])
+			return true;
+	}
+	return false;
+}
+
+/**	Choose the kernel of the forward-backward from the density of the active transitions.
+	The sparse kernel gathers the active transitions of each state, which is slower than
+	streaming the whole matrix once most of the transitions are active. The dense matrices
+	hold only the active transitions, so both kernels compute the same sums.
+*/
+void CRF::selectKernel() {
+	size_t n_active = 0;
+	for (size_t j = 0; j < m_Param.m_SelectedStateList1.size(); j++)
+		n_active += m_Param.m_SelectedStateList1[j].size();
+	m_density = (m_state_size > 0 ? (double)n_active / (m_state_size * m_state_size) : 0.0);
+	m_dense = (m_state_size > 0 && m_density >= m_dense_transition);
+	if (!m_dense)
+		return;
+
+	m_dense_stride = (m_state_size + DENSE_BLOCK - 1) / DENSE_BLOCK * DENSE_BLOCK;
+	m_DenseM.assign(m_state_size * m_dense_stride, 0.0);
+	m_DenseMT.assign(m_state_size * m_dense_stride, 0.0);
+	m_DenseIn.assign(m_dense_stride, 0.0);
+	m_DenseOut.assign(m_dense_stride, 0.0);
+	for (size_t j = 0; j < m_Param.m_SelectedStateList1.size(); j++) {
+		vector<size_t> &selectedState = m_Param.m_SelectedStateList1[j];
+		for (size_t x = 0; x < selectedState.size(); x++) {
+			size_t k = selectedState[x];
+			double m = (double)(m_M2[MAT2(k,j)] - 1.0);
+			m_DenseM[k * m_dense_stride + j] += m;
+			m_DenseMT[j * m_dense_stride + k] += m;
+		}
 	}
 }
 
@@ -284,7 +391,7 @@ void CRF::calculateEdge() {
 		1)	J. Lafferty et al., Conditional Random Fields: Probabilistic Models for Segmenting and Labeling Sequence Data, 2001, ICML.
 		2) C. Sutton and A. McCallum, An Introduction to Conditional Random Fields for Relational Learning, 2006, Introduction to Statistical Relational Learning. Edited by Lise Getoor and Ben Taskar. MIT Press. 2006.
 */
-void CRF::calculateFactors(Sequence &seq) {
+void CRF::calculateFactors(const Sequence &seq) {
 	/// Initialization
 	m_seq_size = seq.size() + 1;	///< sequence length
 	double* theta = m_Param.getWeight();
@@ -318,9 +425,9 @@ void CRF::calculateFactors(Sequence &seq) {
 			//}
 		}
 		*/
-		vector<pair<size_t, double> >::iterator iter = seq[i].obs.begin();
+		vector<pair<size_t, double> >::const_iterator iter = seq[i].obs.begin();
 		for (; iter != seq[i].obs.end(); iter++) {
-			vector<pair<size_t, size_t> >& param = m_Param.m_ParamIndex[iter->first];
+			const vector<pair<size_t, size_t> >& param = (*m_Param.m_ParamIndex)[iter->first];
 			for (size_t j = 0; j < param.size(); ++j) {
 				m_R[MAT2(i, param[j].first)] *= exp(theta[param[j].second] * iter->second);
 			}
@@ -350,7 +457,7 @@ void CRF::forward() {
 	scale.resize(m_seq_size);
 	fill(scale.begin(), scale.end(), 1.0);
 
-	long double sum = 0.0;
+	double sum = 0.0;
 	for (size_t j = 0; j < m_state_size; j++) {
 	//vector<size_t> &indexR = m_IndexR[0];
 	//for (size_t y = 0; y < indexR.size(); y++) {
@@ -364,7 +471,21 @@ void CRF::forward() {
 	scale[0] = sum;
 
     for (size_t i = 1; i < m_seq_size-1; i++) {
-		long double sum = 0.0;
+		double sum = 0.0;
+		if (m_dense) {	///< alpha(i) = R(i) * (alpha(i-1) * (M2-1) + 1)
+			for (size_t k = 0; k < m_state_size; k++)
+				m_DenseIn[k] = (double)m_Alpha[MAT2(i-1, k)];
+			denseProduct(m_DenseIn, m_DenseM, m_state_size, m_dense_stride, m_DenseOut);
+			for (size_t j = 0; j < m_state_size; j++) {
+				size_t index = MAT2(i, j);
+				m_Alpha[index] = m_R[index] * m_DenseOut[j] + m_R[index];
+				sum += m_Alpha[index];
+			}
+			for (size_t j = 0; j < m_state_size; j++)
+				m_Alpha[MAT2(i, j)] /= sum;
+			scale[i] = sum;
+			continue;
+		}
         for (size_t j = 0; j < m_state_size; j++) {
 		//vector<size_t> &indexR = m_IndexR[i];
 		//for (size_t y = 0; y < indexR.size(); y++) {
@@ -402,7 +523,7 @@ void CRF::backward() {
 	fill(scale2.begin(), scale2.end(), 1.0);
 
 	m_Beta[MAT2(m_seq_size-1, m_default_oid)] = 1.0; // / scale[m_seq_size-1];
-	long double sum = 0.0;
+	double sum = 0.0;
 
 	for (size_t k = 0; k < m_state_size; k++) {
 	//vector<size_t> &indexR = m_IndexR[m_seq_size-2];
@@ -416,11 +537,26 @@ void CRF::backward() {
 	scale2[m_seq_size-2] = sum;
 
     for (int i = m_seq_size-2; i >= 1; i--) {
-		long double sum = 0.0;
-		long double constant = 0.0;
+		double sum = 0.0;
+		double constant = 0.0;
 		for (size_t k = 0; k < m_state_size; k++)
 			constant += m_R[MAT2(i,k)] * m_Beta[MAT2(i, k)];
 
+		if (m_dense) {	///< beta(i-1) = (M2-1) * (R(i) beta(i)) + constant
+			for (size_t k = 0; k < m_state_size; k++)
+				m_DenseIn[k] = (double)(m_R[MAT2(i,k)] * m_Beta[MAT2(i, k)]);
+			denseProduct(m_DenseIn, m_DenseMT, m_state_size, m_dense_stride, m_DenseOut);
+			for (size_t j = 0; j < m_state_size; j++) {
+				size_t index = MAT2(i-1, j);
+				m_Beta[index] = m_DenseOut[j] + constant;
+				sum += m_Beta[index];
+			}
+			for (size_t j = 0; j < m_state_size; j++)
+				m_Beta[MAT2(i-1, j)] /= sum;
+			scale2[i-1] = sum;
+			continue;
+		}
+
 		for (size_t j = 0; j < m_state_size; j++) {
 		//vector<size_t> &indexR = m_IndexR[i-1];
 		//for (size_t y = 0; y < indexR.size(); y++) {
@@ -455,7 +591,7 @@ long double CRF::getPartitionZ() {
 	@param seq			given data (y, x)
 	@return probability
 */
-long double CRF::calculateProb(Sequence& seq) {
+long double CRF::calculateProb(const Sequence& seq) {
 	long double z = getPartitionZ();
 
     long double seq_prob = 1.0;
@@ -493,7 +629,8 @@ long double CRF::calculateProb(Sequence& seq) {
 vector<size_t> CRF::viterbiSearch(long double& prob) {
 	/// Initialization
 	vector<vector<size_t> > psi;
-    vector<vector<long double> > delta;
+    vector<vector<double> > delta;
+	long double log_scale = 0.0;	///< log of the scales of delta
 
 	/// Search
     size_t i, j, k;
@@ -525,13 +662,13 @@ vector<size_t> CRF::viterbiSearch(long double& prob) {
 	// 1 ~ T
     for (i=0; i < m_seq_size-1; i++) {
         vector<size_t> psi_i;
-        vector<long double> delta_i;
+        vector<double> delta_i;
 
-		long double maxj = -10000.0;
+		double maxj = -10000.0;
 		size_t max_j = 0;
 
         for (j=0; j < m_state_size; j++) {
-            long double max = -10000.0;
+            double max = -10000.0;
             size_t max_k = 0;
             if (i == 0) {
                 max = 1.0; //m_M[MAT3(i,m_default_oid,j)];
@@ -567,6 +704,12 @@ vector<size_t> CRF::viterbiSearch(long double& prob) {
 			}
         } // for j
 
+		/// scaling ; the best path does not change
+		if (maxj > 0.0) {
+			for (j = 0; j < m_state_size; j++)
+				delta_i[j] /= maxj;
+			log_scale += log(maxj);
+		}
         delta.push_back(delta_i);
         psi.push_back(psi_i);
 
@@ -577,7 +720,7 @@ vector<size_t> CRF::viterbiSearch(long double& prob) {
 
 	// last path
 	vector<size_t> psi_i(m_state_size, 0);
-	vector<long double> delta_i(m_state_size, -10000.0);
+	vector<double> delta_i(m_state_size, -10000.0);
 	long double max = -10000.0;
 	size_t max_k = 0;
 	for (size_t k=0; k < m_state_size; k++) {
@@ -602,7 +745,7 @@ vector<size_t> CRF::viterbiSearch(long double& prob) {
         prev_y = y;
     }
     reverse(y_seq.begin(), y_seq.end());
-    prob = delta[m_seq_size-1][m_default_oid];
+    prob = delta[m_seq_size-1][m_default_oid] * expl(log_scale);
 
 	return y_seq;
 }
@@ -633,14 +776,29 @@ bool CRF::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta)
 	double old_obj = 1e+37;
 	int converge = 0;
 
+	/// Distributed training ; a worker runs until the coordinator stops
+	bool worker = isWorker();
+	size_t shard_begin, shard_end;
+	getShard(m_TrainSet->size(), shard_begin, shard_end);
+
 	/// Training iteration
 	m_Param.makeActiveIndex(0.0);
+	m_KernelSwitch.clear();
+	m_n_dense_iter = m_n_sparse_iter = 0;
+	m_dense_time = m_sparse_time = 0.0;
 
-    for (size_t niter = 0 ;niter < (int)max_iter; ++niter) {
+    for (size_t niter = 0 ; worker || niter < (int)max_iter; ++niter) {
+		if (!syncTheta(theta, m_Param.size()))
+			break;
+		if (worker)
+			m_Param.makeActiveIndex(0.0);
 
 		/// Initializing local variables
         timer t2;	///< elapsed time for one iteration
-		m_Param.initializeGradient();	///< gradient vector initialization
+		if (worker)
+			m_Param.initializeGradient2();	///< the empirical counts are added by the coordinator
+		else
+			m_Param.initializeGradient();	///< gradient vector initialization
 		eval.initialize();	///< evaluator intialization
 		double time_for_inference = 0.0;
 		double time_for_inference2 = 0.0;
@@ -651,13 +809,17 @@ bool CRF::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta)
 
 
 		calculateEdge();
+		if (m_KernelSwitch.empty() || m_dense != (m_KernelSwitch.back().second >= m_dense_transition))
+			m_KernelSwitch.push_back(make_pair(niter, m_density));
 
 		/// for each training set
-        vector<Sequence>::iterator sit = m_TrainSet.begin();
-		vector<double>::iterator count_it = m_TrainSetCount.begin();
-        for (; sit != m_TrainSet.end(); ++sit, ++count_it) {
-			Sequence::iterator it = sit->begin();
+        vector<Sequence>::const_iterator sit = m_TrainSet->begin() + shard_begin;
+		vector<double>::const_iterator count_it = m_TrainSetCount->begin() + shard_begin;
+        for (; sit != m_TrainSet->begin() + shard_end; ++sit, ++count_it) {
+			Sequence::const_iterator it = sit->begin();
 			double count = *count_it;
+			if (count == 0.0)	///< out of the fold (see fold())
+				continue;
 			vector<size_t> reference, hypothesis;
 
 			/// Forward-Backward
@@ -725,9 +887,9 @@ bool CRF::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta)
 					gradient[iter->fid] += prob * iter->fval * count;
 				}
 				*/
-				vector<pair<size_t, double> >::iterator iter = it->obs.begin();
+				vector<pair<size_t, double> >::const_iterator iter = it->obs.begin();
 				for (; iter != it->obs.end(); iter++) {
-					vector<pair<size_t, size_t> >& param = m_Param.m_ParamIndex[iter->first];
+					const vector<pair<size_t, size_t> >& param = (*m_Param.m_ParamIndex)[iter->first];
 					for (size_t j = 0; j < param.size(); ++j) {
 						long double prob =  m_Alpha[MAT2(i, param[j].first)] * m_Beta[MAT2(i, param[j].first)] / zval;
 						prob *= scale_factor;
@@ -778,8 +940,19 @@ bool CRF::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta)
 		cout << "time for estimation : " << time_for_estimation <<  endl;
 		cout << "total : " << time_for_fb.elapsed() << endl;
 		*/
+		if (m_dense) {
+			m_n_dense_iter++;
+			m_dense_time += time_for_inference + time_for_inference2;
+		} else {
+			m_n_sparse_iter++;
+			m_sparse_time += time_for_inference + time_for_inference2;
+		}
 		time_for_inference = 0.0;
 
+		/// summing up the shards
+		if (!syncGradient(gradient, m_Param.size(), eval))
+			continue;
+
 		/////////////////////////////////////////////////////////////////////////////////
 		/// Evaluation for dev set
 		////////////////////////////////////////////////////////////////////////////////
@@ -788,11 +961,13 @@ bool CRF::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta)
 		timer stop_watch;
 		double time_for_dev = 0.0;
 		/// for each dev data
-        sit = m_DevSet.begin();
-		count_it = m_DevSetCount.begin();
-        for (; sit != m_DevSet.end(); ++sit, ++count_it) {
-			Sequence::iterator it = sit->begin();
+        sit = m_DevSet->begin();
+		count_it = m_DevSetCount->begin();
+        for (; sit != m_DevSet->end(); ++sit, ++count_it) {
+			Sequence::const_iterator it = sit->begin();
 			double count = *count_it;
+			if (count == 0.0)	///< out of the fold (see fold())
+				continue;
 			calculateFactors(*sit);
   			forward();
 			long double zval = getPartitionZ();
@@ -812,6 +987,14 @@ bool CRF::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta)
 		} ///< for each dev
 		time_for_dev = stop_watch.elapsed();
 
+		/// early stopping ; checked before the optimizer moves the weights
+		bool stop = false;
+		if (m_DevSet->size() > 0) {
+			dev_eval.calculateF1();
+			setDevScore(dev_eval);
+			stop = checkEarlyStop(niter);
+		}
+
 		/// applying regularization
 		size_t n_nonzero = 0;
 		if (sigma) {
@@ -848,8 +1031,7 @@ bool CRF::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta)
 			return true;
 
 		eval.calculateF1();
-		if (m_DevSet.size() > 0) {
-			dev_eval.calculateF1();
+		if (m_DevSet->size() > 0) {
 			logger->report("%4d %15E %8.3f %8.3f %8.3f %8.3f  |  %8.3f %8.3f %8.3f\n",
 				niter, eval.getLoglikelihood(),
 				eval.getAccuracy(), eval.getMicroF1()[2], eval.getMacroF1()[2], t2.elapsed(),
@@ -860,15 +1042,106 @@ bool CRF::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta)
 		}
 
 		m_Param.makeActiveIndex(0.0);
+		if (stop)
+			break;
 
 	} ///< for iter
 
 	logger->report("  training time = \t%.3f\n\n", t.elapsed());
 
-	return true;
+	return !clusterFailed();
 
 }
 
+/**	Accumulate the PL gradient and evaluation of the sequences in a shard.
+	The transitions of the previous state are read from m_OutState.
+*/
+void CRF::estimateShard(TrainShard& shard) {
+	double* theta = m_Param.getWeight();
+	double* gradient = shard.gradient[0];
+	Evaluator& eval = *shard.eval[0];
+	size_t n_state = m_Param.sizeStateVec();
+	vector<double>& q = shard.prob1;
+	vector<size_t>& reference = shard.reference1;
+	vector<size_t>& hypothesis = shard.hypothesis1;
+	q.resize(n_state);
+
+	const Data<Sequence>& train_set = *m_TrainSet;
+	const vector<double>& train_count = *m_TrainSetCount;
+	for (size_t s = shard.begin; s < shard.end; s++) {
+		Sequence::const_iterator it = train_set[s].begin();
+		double count = train_count[s];
+		if (count == 0.0)	///< out of the fold (see fold())
+			continue;
+		size_t prev_outcome = m_default_oid;
+		reference.clear();
+		hypothesis.clear();
+
+		for (; it != train_set[s].end(); ++it) {	 /// for each node
+			/// evaluation
+			size_t max_outcome = 0;
+			fill(q.begin(), q.end(), 0.0);
+
+			/// w * f (for all classes)
+			vector<pair<size_t, double> >::const_iterator iter = it->obs.begin();
+			for (; iter != it->obs.end(); iter++) {
+				const vector<pair<size_t, size_t> >& param = (*m_Param.m_ParamIndex)[iter->first];
+				for (size_t j = 0; j < param.size(); ++j) {
+					q[param[j].first] += theta[param[j].second] * iter->second;
+				}
+			}
+
+			// y_{t-1} state
+			vector<StateParam>& trans = m_OutState[prev_outcome];
+			for (vector<StateParam>::iterator iter = trans.begin(); iter != trans.end(); ++iter)
+				q[iter->y2] += theta[iter->fid] * iter->fval;
+
+			/// normalize
+			double sum = 0.0;
+			double max = 0.0;
+			for (size_t j=0; j < n_state; j++) {
+				q[j] = exp(q[j]); // * y_prob[j];
+				sum += q[j];
+				if (q[j] > max) {
+					max = q[j];
+					max_outcome = j;
+				}
+			}
+			for (size_t j=0; j < n_state; j++) {
+				q[j] /= sum;
+			}
+
+			reference.push_back(it->label);
+			hypothesis.push_back(max_outcome);
+
+			/// calculate the expectation
+			/// E[p] - E[~p]
+			iter = it->obs.begin();
+			for (; iter != it->obs.end(); iter++) {
+				const vector<pair<size_t, size_t> >& param = (*m_Param.m_ParamIndex)[iter->first];
+				for (size_t j = 0; j < param.size(); ++j) {
+					gradient[param[j].second] += q[param[j].first] * iter->second * count;
+				}
+			}
+			for (vector<StateParam>::iterator iter = trans.begin(); iter != trans.end(); ++iter)
+				shard.assign(0, iter->fid, q[iter->y2] * iter->fval * count);
+
+			/// loglikelihood
+			for (size_t c = 0; c < count; c++) {
+				eval.addLikelihood(q[it->label]);
+			}
+
+			prev_outcome = it->label;
+
+		} ///< for sequence
+
+		/// evaluation (accuracy and f1 score)
+		for (size_t c = 0; c < count; c++) {
+			eval.append(reference, hypothesis);
+		}
+	} ///< for shard
+}
+
 /** Training with Pseudo-Likelihood
 	@param max_iter	maximum number of iteration
 	@param sigma	Gaussian prior variance
@@ -879,6 +1152,7 @@ bool CRF::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta) {
 	double* gradient = m_Param.getGradient();
 
 	Evaluator eval(m_Param);	///< Evaluator
+	vector<Evaluator*> evals(1, &eval);
 	timer t;		///< timer
 
 	/// Reporting
@@ -893,6 +1167,9 @@ bool CRF::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta) {
 	double old_obj = 1e+37;
 	int converge = 0;
 
+	/// transitions grouped by the previous state, instead of scanning the state index at each node
+	m_OutState = m_Param.groupStateIndex(true, m_Param.sizeStateVec());
+
 	/// Training iteration
     for (size_t niter = 0 ;niter < (int)max_iter; ++niter) {
 
@@ -901,100 +1178,9 @@ bool CRF::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta) {
 		m_Param.initializeGradient();	///< gradient vector initialization
 		eval.initialize();	///< evaluator intialization
 
-		/// for each training set
-        vector<Sequence>::iterator sit = m_TrainSet.begin();
-		vector<double>::iterator count_it = m_TrainSetCount.begin();
-        for (; sit != m_TrainSet.end(); ++sit, ++count_it) {
-			Sequence::iterator it = sit->begin();
-			double count = *count_it;
-			size_t prev_outcome = m_default_oid;
-			vector<size_t> reference, hypothesis;
-
-			for (; it != sit->end(); ++it) {	 /// for each node
-				/// evaluation
-				size_t max_outcome = 0;
-				vector<double> q(m_Param.sizeStateVec());
-				fill(q.begin(), q.end(), 0.0);
-
-				/// w * f (for all classes)
-				/*
-				vector<ObsParam> obs_param = m_Param.makeObsIndex(it->obs);
-				vector<ObsParam>::iterator iter = obs_param.begin();
-				for(; iter != obs_param.end(); ++iter) {
-					q[iter->y] += theta[iter->fid] * iter->fval;
-				}*/
-				vector<pair<size_t, double> >::iterator iter = it->obs.begin();
-				for (; iter != it->obs.end(); iter++) {
-					vector<pair<size_t, size_t> >& param = m_Param.m_ParamIndex[iter->first];
-					for (size_t j = 0; j < param.size(); ++j) {
-						q[param[j].first] += theta[param[j].second] * iter->second;
-					}
-				}
-
-				// y_{t-1} state
-				for (vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin();
-						iter != m_Param.m_StateIndex.end(); ++iter) {
-					if (iter->y1 == prev_outcome)
-						q[iter->y2] += theta[iter->fid] * iter->fval;
-				}
-
-				/// normalize
-				double sum = 0.0;
-				double max = 0.0;
-				for (size_t j=0; j < m_Param.sizeStateVec(); j++) {
-					q[j] = exp(q[j]); // * y_prob[j];
-					sum += q[j];
-					if (q[j] > max) {
-						max = q[j];
-						max_outcome = j;
-					}
-				}
-				for (size_t j=0; j < m_Param.sizeStateVec(); j++) {
-					q[j] /= sum;
-				}
-
-				reference.push_back(it->label);
-				hypothesis.push_back(max_outcome);
-
-				/// calculate the expectation
-				/// E[p] - E[~p]
-				/*
-				obs_param = m_Param.makeObsIndex(it->obs);
-				iter = obs_param.begin();
-				for(; iter != obs_param.end(); ++iter) {
-					gradient[iter->fid] += q[iter->y] * iter->fval * count;
-				}
-				*/
-				iter = it->obs.begin();
-				for (; iter != it->obs.end(); iter++) {
-					vector<pair<size_t, size_t> >& param = m_Param.m_ParamIndex[iter->first];
-					for (size_t j = 0; j < param.size(); ++j) {
-						gradient[param[j].second] += q[param[j].first] * iter->second * count;
-					}
-				}
-
-				for (vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin();
-						iter != m_Param.m_StateIndex.end(); ++iter) {
-					if (iter->y1 == prev_outcome)
-						gradient[iter->fid] = q[iter->y2] * iter->fval * count;
-				}
-
-				/// loglikelihood
-				for (size_t c = 0; c < count; c++) {
-					eval.addLikelihood(q[it->label]);
-				}
+		/// for each training set (in shards)
+		accumulateShards(0, m_TrainSet->size(), evals);
 
-				prev_outcome = it->label;
-
-			} ///< for sequence
-
-			/// evaluation (accuracy and f1 score)
-			for (size_t c = 0; c < count; c++) {
-				eval.append(reference, hypothesis);
-			}
-
-
-		} ///< for m_TrainSet
 		Evaluator dev_eval(m_Param);		///< Evaluator (sequence)
 		dev_eval.initialize();	///< evaluator intialization
 
@@ -1034,8 +1220,9 @@ bool CRF::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta) {
 			return true;
 
 		eval.calculateF1();
-		if (m_DevSet.size() > 0) {
+		if (m_DevSet->size() > 0) {
 			dev_eval.calculateF1();
+			setDevScore(dev_eval);
 			logger->report("%4d %15E %8.3f %8.3f %8.3f %8.3f  |  %8.3f %8.3f %8.3f\n",
 				niter, eval.getLoglikelihood(),
 				eval.getAccuracy(), eval.getMicroF1()[2], eval.getMacroF1()[2], t2.elapsed(),
@@ -1058,11 +1245,33 @@ bool CRF::pretrain(size_t max_iter, double sigma, bool L1) {
 }
 
 bool CRF::train(size_t max_iter, double sigma, bool L1) {
-		return estimateWithLBFGS(max_iter, sigma, L1);
+	beginEarlyStop();
+	bool ok = estimateWithLBFGS(max_iter, sigma, L1);
+	reportKernel();
+	if (endEarlyStop())
+		m_Param.makeActiveIndex(0.0);	///< transitions of the restored weights
+	return ok;
+}
+
+/**	Report the kernels of the forward-backward in the training.
+*/
+void CRF::reportKernel() {
+	logger->report("[Forward-backward kernel]\n");
+	logger->report("  dense transition = \t%.3f\n", m_dense_transition);
+	for (size_t i = 0; i < m_KernelSwitch.size(); i++)
+		logger->report("  iter %d = \t\t%s (density %.3f)\n", m_KernelSwitch[i].first,
+			(m_KernelSwitch[i].second >= m_dense_transition ? "dense" : "sparse"), m_KernelSwitch[i].second);
+	logger->report("  dense iterations = \t%d (%.3f sec)\n", m_n_dense_iter, m_dense_time);
+	logger->report("  sparse iterations = \t%d (%.3f sec)\n\n", m_n_sparse_iter, m_sparse_time);
 }
 
+/**	Decode a sequence with the label distribution of its last node.
+	The decoding goes through the model's own tables, so a model decodes one sequence at a time ;
+	concurrent decoding uses compile() and a DecoderSession for each thread.
+*/
 void CRF::evals(Sequence seq, std::vector<std::string> &output, std::vector<long double> &prob) {
-	calculateEdge();
+	if (edgeChanged())
+		calculateEdge();
 	calculateFactors(seq);
 	forward();
 
@@ -1074,7 +1283,7 @@ void CRF::evals(Sequence seq, std::vector<std::string> &output, std::vector<long
 	Sequence::iterator it = seq.begin();
 	size_t prev_y = m_default_oid;
 	for (size_t i = 0; it != seq.end(); ++it, ++i) {	 /// for each node
-		string y_seq_s = m_Param.getState().second[y_seq[i]];
+		string y_seq_s = m_Param.getStateVec()[y_seq[i]];
 		output.push_back(y_seq_s);
 	}
 
@@ -1085,8 +1294,11 @@ void CRF::evals(Sequence seq, std::vector<std::string> &output, std::vector<long
 
 }
 
+/**	Decode a sequence with the probability of the best path.
+*/
 void CRF::eval(Sequence seq, std::vector<std::string> &output, long double &prob) {
-	calculateEdge();
+	if (edgeChanged())
+		calculateEdge();
 	calculateFactors(seq);
 	forward();
 
@@ -1098,7 +1310,7 @@ void CRF::eval(Sequence seq, std::vector<std::string> &output, long double &prob
 	Sequence::iterator it = seq.begin();
 	size_t prev_y = m_default_oid;
 	for (size_t i = 0; it != seq.end(); ++it, ++i) {	 /// for each node
-		string y_seq_s = m_Param.getState().second[y_seq[i]];
+		string y_seq_s = m_Param.getStateVec()[y_seq[i]];
 		output.push_back(y_seq_s);
 	}
 
@@ -1109,8 +1321,11 @@ void CRF::eval(Sequence seq, std::vector<std::string> &output, long double &prob
 
 }
 
+/**	Decode a sequence with the marginal probability of each label.
+*/
 void CRF::eval(Sequence seq, std::vector<std::string> &output, std::vector<long double> &prob) {
-	calculateEdge();
+	if (edgeChanged())
+		calculateEdge();
 	calculateFactors(seq);
 	forward();
 	backward();
@@ -1145,7 +1360,7 @@ void CRF::eval(Sequence seq, std::vector<std::string> &output, std::vector<long
 	Sequence::iterator it = seq.begin();
 	size_t prev_y = m_default_oid;
 	for (size_t i = 0; it != seq.end(); ++it, ++i) {	 /// for each node
-		string y_seq_s = m_Param.getState().second[y_seq[i]];
+		string y_seq_s = m_Param.getStateVec()[y_seq[i]];
 		output.push_back(y_seq_s);
 
 		size_t outcome = it->label;
@@ -1159,105 +1374,140 @@ void CRF::eval(Sequence seq, std::vector<std::string> &output, std::vector<long
 
 }
 
-bool CRF::test(const std::string& filename, const std::string& outputfile, bool confidence) {
-	/// File stream
-	string line;
-	ifstream f(filename.c_str());
-	if (!f)
-		throw runtime_error("cannot open data file");
-
-	/// output
-	ofstream out;
-	vector<string> state_vec;
-	if (outputfile != "") {
-		out.open(outputfile.c_str());
-		out.precision(20);
-		state_vec = m_Param.getState().second;
+/**	Evaluation of the compiled decoding in CRF::test().
+	@class CRFEvaluator
+*/
+class CRFEvaluator : public DecodeEvaluator {
+public:
+	Evaluator eval;
+	const Map* state_map;	///< label -> id
+	size_t n_state;	///< id of the unknown labels (out of class)
+	vector<size_t> reference;
+
+	CRFEvaluator(Parameter& param) : eval(param) {
+		eval.initialize();
+		state_map = &param.getStateMap();
+		n_state = param.sizeStateVec();
 	}
 
-	/// initializing
-	size_t count = 0;
-	Sequence seq;
-	logger->report("[Testing begins ...]\n");
-	timer stop_watch;
-	Evaluator test_eval(m_Param); ///< Evaluator
-	test_eval.initialize(); ///< Evaluator intialization
-
-	calculateEdge();
-
-	/// reading the text
-	while (getline(f,line)) {
-		if (line.empty()) {
-			/// test
-			calculateFactors(seq);
-  			forward();
-
-			long double zval = getPartitionZ();
-            long double dummy_prob;
-			vector<size_t> y_seq = viterbiSearch(dummy_prob);
-			assert(y_seq.size() == seq.size());
-
-			vector<string> reference, hypothesis;
-
-			Sequence::iterator it = seq.begin();
-			size_t prev_y = m_default_oid;
-
-			for (size_t i = 0; it != seq.end(); ++it, ++i) {	 /// for each node
-
-				string outcome_s;
-				if (m_Param.sizeStateVec() <= it->label)
-					outcome_s = "!OUT_OF_CLASS!";
-				else
-					outcome_s = m_Param.getState().second[it->label];
-				string y_seq_s = m_Param.getState().second[y_seq[i]];
-				reference.push_back(outcome_s);
-				hypothesis.push_back(y_seq_s);
-
-				if (outputfile != "") {
-					out << state_vec[y_seq[i]];
-					if (confidence) {
-						double norm = 0.0;
-						for (size_t j = 0; j < m_state_size; j++) {
-							if (i > 0)
-								norm += m_R[MAT2(i, j)] * m_M2[MAT2(prev_y, j)];
-							else
-								norm += m_R[MAT2(i, j)];
-						}
-						double prob;
-						if (i > 0)
-							prob = m_R[MAT2(i,y_seq[i])] * m_M2[MAT2(prev_y,y_seq[i])] / norm;
-						else
-							prob = m_R[MAT2(i,y_seq[i])] / norm;
-						out << " " << prob;
-						prev_y = y_seq[i];
-					}
-					out << endl;
-				}
-			}
-			if (outputfile != "")
-				out << endl;
+	DecodeEvaluator* clone() const {
+		CRFEvaluator* copy = new CRFEvaluator(*this);
+		copy->clear();
+		return copy;
+	}
 
+	void clear() {
+		eval.initialize();
+	}
 
-			test_eval.append(m_Param, reference, hypothesis);
-			seq.clear();
-			++count;
-		} else {
-			vector<string> tokens = tokenize(line);
-			Event ev = packEvent(tokens, &m_Param, true);	///< observation features
-			seq.push_back(ev);						///< append
+	void append(const vector<string>& lines, const DecodeResult& result) {
+		if (result.label_ids.size() != lines.size())
+			return;	///< not decoded
+		reference.clear();
+		for (size_t i = 0; i < lines.size(); i++) {
+			Map::const_iterator it = state_map->find(referenceLabel(lines[i]));
+			reference.push_back(it != state_map->end() ? it->second : n_state);
+		}
+		eval.append(&reference[0], &result.label_ids[0], reference.size());
+	}
 
-		}	///< else
-	}	///< while
+	void merge(const DecodeEvaluator& other) {
+		eval.merge(((const CRFEvaluator&)other).eval);
+	}
+};
+
+/**	Test the model on a data file.
+	The file is decoded by the compiled model (see decodeFile()) in batches of m_decode_batch,
+	over m_decode_thread decoder threads, and the results are evaluated in the order of the input.
+	@param filename		data file
+	@param outputfile	output file (labels, and the local probability of each label with confidence)
+	@param confidence	writing the probabilities
+	@return true if succeeded
+*/
+bool CRF::test(const std::string& filename, const std::string& outputfile, bool confidence) {
+	logger->report("[Testing begins ...]\n");
+	timer stop_watch;
+	CRFEvaluator evaluator(m_Param);
+	CompiledModel* compiled = compile();
+	decodeFile(*compiled, filename, outputfile, (confidence ? CONFIDENCE_LOCAL : CONFIDENCE_NONE),
+		m_decode_batch, logger, m_decode_thread, &evaluator);
+	delete compiled;
 
+	Evaluator& test_eval = evaluator.eval;
 	test_eval.calculateF1();
-	logger->report("  # of data = \t\t%d\n", count);
 	logger->report("  testing time = \t%.3f\n\n", stop_watch.elapsed());
 	logger->report("  Acc = \t\t%8.3f\n", test_eval.getAccuracy());
 	logger->report("  MicroF1 = \t\t%8.3f\n", test_eval.getMicroF1()[2]);
 	//logger->report("  MacroF1 = \t\t%8.3f\n", test_eval.getMacroF1()[2]);
 	test_eval.Print(logger);
+	return true;
+}
+
+
+/**	Compile the model for the decoder sessions.
+	CRF is compiled as a single topic ; <start> and <end> transitions are 1.0.
+	@return compiled model (owned by the caller)
+*/
+CompiledModel* CRF::compile() {
+	CompiledModel* model = new CompiledModel();
+	model->setFeatures(m_Param);
+
+	vector<string> states = m_Param.getStateVec();
+	vector<size_t> l2g(m_state_size);
+	for (size_t y = 0; y < m_state_size; y++)
+		l2g[y] = y;
+	size_t z = model->addTopic("", states, l2g);
+
+	calculateEdge();
+	vector<double> start(m_state_size, 1.0), end(m_state_size, 1.0), node(m_state_size, 1.0);
+	model->setEdge(z, start, m_M2, end, node);
+	model->setPrune(m_prune_threshold);
+	model->setViterbiBound(m_viterbi_bound);
+	model->setTemplate(m_Template);
+
+	return model;
 }
 
+MaxEnt* CRF::clone() {
+	return new CRF(*this);
+}
+
+void CRF::countFeatures() {
+	MaxEnt::countFeatures();
+
+	/// state transition features
+	const Vec& state_vec = m_Param.getStateVec();
+	const Data<Sequence>& train_set = *m_TrainSet;
+	const vector<double>& train_count = *m_TrainSetCount;
+	for (size_t i = 0; i < train_set.size(); i++) {
+		const Sequence& seq = train_set[i];
+		for (size_t j = 1; j < seq.size(); j++) {
+			int pid = m_Param.findObs("@" + state_vec[seq[j-1].label]);
+			if (pid >= 0)
+				m_Param.addCount(seq[j].label, pid, train_count[i] * seq[j].fval);
+		}
+	}
+}
+
+/**	Bytes held by the structures of the model ; the DP tables are sized to the longest sequence so far.
+*/
+void CRF::measureMemory(MemoryUsage& usage) {
+	MaxEnt::measureMemory(usage);
+	usage.add("DP tables", bytesOf(m_M) + bytesOf(m_M2) + bytesOf(m_R) + bytesOf(m_Alpha) + bytesOf(m_Beta)
+		+ bytesOf(scale) + bytesOf(scale2) + bytesOf(m_IndexR)
+		+ bytesOf(m_DenseM) + bytesOf(m_DenseMT) + bytesOf(m_DenseIn) + bytesOf(m_DenseOut));
+	usage.add("PL index", bytesOf(m_OutState) + bytesOf(m_Beam) + bytesOf(m_BeamMap));
+}
+
+/**	Bytes predicted from the statistics of the training file ; the transitions are L x L parameters
+	and the DP tables are sized to the longest sequence (the dense kernel is counted).
+*/
+void CRF::estimateMemory(const CorpusStats& stats, MemoryUsage& usage) {
+	MaxEnt::estimateMemory(stats, usage);
+	size_t L = stats.n_label;
+	estimateParam(usage, L, L * L, 0);
+	usage.add("DP tables", (3 * stats.max_len * L + 2 * stats.max_len + 3 * L * L) * sizeof(double));
+}
 
 }	///< namespace tricrf
 
@@ -24,11 +24,12 @@ namespace tricrf {
 */
 class CRF : public MaxEnt {
 protected:
-	std::vector<long double> m_M;			///< M matrix ; edge transition
-	std::vector<long double> m_M2;			///< M matrix ; edge transition
-	std::vector<long double> m_R;			///< R matrix ; node observation
-	std::vector<long double> m_Alpha;	///< Alpha matrix
-	std::vector<long double> m_Beta;		///< Beta matrix
+	/// The tables are in double ; alpha and beta are scaled at each position (see scale, scale2)
+	std::vector<double> m_M;			///< M matrix ; edge transition
+	std::vector<double> m_M2;			///< M matrix ; edge transition
+	std::vector<double> m_R;			///< R matrix ; node observation
+	std::vector<double> m_Alpha;	///< Alpha matrix
+	std::vector<double> m_Beta;		///< Beta matrix
 
 	/* too slow
 	virtual inline size_t MAT3(size_t I, size_t X, size_t Y) {
@@ -46,23 +47,50 @@ protected:
 
 	/// Inference
 	virtual void calculateEdge();	///< Calculating the factors
-	virtual void calculateFactors(Sequence &seq);	///< Calculating the factors
+	bool edgeChanged();	///< the transition weights differ from the last calculateEdge()
+	std::vector<double> m_EdgeTheta;	///< transition weights of the last calculateEdge()
+	virtual void calculateFactors(const Sequence &seq);	///< Calculating the factors
 	virtual void forward();	 ///< Forward recursion
 	virtual void backward();	///< Backward recursion
 	virtual long double getPartitionZ();	///< Z
+
+	/// Dense kernel of the forward-backward ; chosen in calculateEdge() from the density of the active transitions
+	bool m_dense;	///< the dense kernel is used
+	double m_density;	///< fraction of the active transitions
+	size_t m_dense_stride;	///< row length of the dense matrices (padded to a block)
+	std::vector<double> m_DenseM;	///< (M2 - 1) of the active transitions ; [y1][y2]
+	std::vector<double> m_DenseMT;	///< transposed ; [y2][y1]
+	std::vector<double> m_DenseIn;	///< input vector of the kernel
+	std::vector<double> m_DenseOut;	///< output vector of the kernel
+	void selectKernel();
+	std::vector<std::pair<size_t, double> > m_KernelSwitch;	///< (iteration, density) where the kernel changed in the training
+	size_t m_n_dense_iter;	///< training iterations of each kernel
+	size_t m_n_sparse_iter;
+	double m_dense_time;	///< forward-backward time of each kernel
+	double m_sparse_time;
+	void reportKernel();
 	virtual std::vector<size_t> viterbiSearch(long double& prob);	///< Find the best path
 
 	/// Parameter Estimation
 	virtual bool estimateWithLBFGS(size_t max_iter, double sigma, bool L1 = false, double eta = 1E-05);
 	virtual bool estimateWithPL(size_t max_iter, double sigma, bool L1 = false, double eta = 1E-05);
-	virtual bool averageParam() {};
+	virtual bool averageParam() { return true; };
+	virtual void countFeatures();
+
+	/// PL training
+	std::vector<std::vector<StateParam> > m_OutState;	///< transitions from each state
+	virtual void estimateShard(TrainShard& shard);
 
 	std::vector<std::vector<size_t> > m_Beam;
 	std::vector<std::map<size_t, size_t> > m_BeamMap;
-	std::vector<long double> scale;
-	std::vector<long double> scale2;
+	std::vector<double> scale;	///< scale of the alpha at each position
+	std::vector<double> scale2;	///< scale of the beta at each position
 	std::vector<std::vector<size_t> > m_IndexR;
 
+	/// Memory accounting
+	virtual void measureMemory(MemoryUsage& usage);
+	virtual void estimateMemory(const CorpusStats& stats, MemoryUsage& usage);
+
 public:
 	CRF();
 	CRF(Logger *logger);
@@ -74,9 +102,12 @@ public:
 	/// Model
 	virtual bool loadModel(const std::string& filename);
 	virtual bool saveModel(const std::string& filename);
+	virtual size_t compact();
 
 	/// Testing
 	virtual bool test(const std::string& filename, const std::string& outputfile = "", bool confidence = false);
+	virtual CompiledModel* compile();
+	virtual MaxEnt* clone();
 	virtual void eval(Sequence seq, std::vector<std::string> &output, long double &prob);
 	virtual void eval(Sequence seq, std::vector<std::string> &output, std::vector<long double> &prob);
 	virtual void evals(Sequence seq, std::vector<std::string> &output, std::vector<long double> &prob);
@@ -85,7 +116,7 @@ public:
 	virtual void clear();
 	virtual bool pretrain(size_t max_iter = 100, double sigma = 20, bool L1 = false);
 	virtual bool train(size_t max_iter = 100, double sigma = 20, bool L1 = false);
-	virtual long double calculateProb(Sequence& seq);	///< Prob(y|x)
+	virtual long double calculateProb(const Sequence& seq);	///< Prob(y|x)
 
 };	///< CRF
 
@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/// max header
+#include "Cluster.h"
+/// standard headers
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+/// socket headers
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+namespace tricrf {
+
+/// Commands from the coordinator
+enum { CMD_STOP = 0, CMD_RUN = 1, CMD_FINISH = 2 };
+
+/// A peer that has gone away is a send error instead of SIGPIPE
+#ifdef MSG_NOSIGNAL
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+
+static void noSigPipe(int sock) {
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#else
+	(void)sock;
+#endif
+}
+
+/// Constructor
+Cluster::Cluster() {
+	m_rank = 0;
+	m_size = 1;
+	m_stopped = false;
+	m_failed = false;
+}
+
+/// Destructor
+Cluster::~Cluster() {
+	stop();
+	close();
+}
+
+bool Cluster::sendAll(int sock, const void* buf, size_t len) {
+	const char* p = (const char*)buf;
+	while (len > 0) {
+		ssize_t n = ::send(sock, p, len, SEND_FLAGS);
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool Cluster::recvAll(int sock, void* buf, size_t len) {
+	char* p = (char*)buf;
+	while (len > 0) {
+		ssize_t n = ::recv(sock, p, len, 0);
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/**	Wait for the workers (coordinator).
+	A connection with a wrong key, or with a rank out of range or already connected, is dropped,
+	and the coordinator keeps waiting.
+	@param port			TCP port
+	@param n_worker		# of workers to be connected
+	@param bind_addr	IPv4 address to listen on (0.0.0.0 for all the interfaces)
+	@param key			key the workers have to send
+	@return true if all workers are connected
+*/
+bool Cluster::listen(int port, size_t n_worker, const string& bind_addr, const string& key) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, bind_addr.c_str(), &addr.sin_addr) != 1) {
+		cerr << "invalid bind address: " << bind_addr << endl;
+		return false;
+	}
+
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	if (server < 0) {
+		cerr << "cannot create a socket\n";
+		return false;
+	}
+	int on = 1;
+	setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0 || ::listen(server, n_worker) < 0) {
+		cerr << "cannot listen on " << bind_addr << ":" << port << endl;
+		::close(server);
+		return false;
+	}
+
+	/// workers are ordered by their ranks
+	m_Socket.assign(n_worker, -1);
+	for (size_t i = 0; i < n_worker; ) {
+		int sock = accept(server, NULL, NULL);
+		if (sock < 0) {
+			cerr << "worker connection error\n";
+			::close(server);
+			return false;
+		}
+		noSigPipe(sock);
+		size_t rank = 0, key_size = 0;
+		string worker_key;
+		bool ok = recvAll(sock, &rank, sizeof(rank)) && recvAll(sock, &key_size, sizeof(key_size)) && key_size <= 1024;
+		if (ok && key_size > 0) {
+			worker_key.resize(key_size);
+			ok = recvAll(sock, &worker_key[0], key_size);
+		}
+		if (!ok || worker_key != key) {
+			cerr << "worker refused (handshake error or wrong key)\n";
+			::close(sock);
+			continue;
+		}
+		if (rank < 1 || rank > n_worker || m_Socket[rank - 1] >= 0) {
+			cerr << "worker refused (invalid or duplicate rank: " << rank << ")\n";
+			::close(sock);
+			continue;
+		}
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		m_Socket[rank - 1] = sock;
+		i++;
+	}
+	::close(server);
+
+	m_rank = 0;
+	m_size = n_worker + 1;
+	for (size_t i = 0; i < m_Socket.size(); i++) {
+		if (!sendAll(m_Socket[i], &m_size, sizeof(m_size)))
+			return false;
+	}
+	return true;
+}
+
+/**	Connect to the coordinator (worker).
+	The connection is retried for a minute, so workers can be started before the coordinator.
+	@param host	coordinator host
+	@param port	coordinator port
+	@param rank	worker rank (1, 2, ...)
+	@param key	key of the coordinator
+	@return true if connected
+*/
+bool Cluster::connect(const string& host, int port, size_t rank, const string& key) {
+	char port_str[16];
+	sprintf(port_str, "%d", port);
+	struct addrinfo hints, *res = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), port_str, &hints, &res) != 0 || res == NULL) {
+		cerr << "cannot resolve the coordinator: " << host << endl;
+		return false;
+	}
+
+	int sock = -1;
+	for (size_t retry = 0; retry < 60; retry++) {
+		sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (sock >= 0 && ::connect(sock, res->ai_addr, res->ai_addrlen) == 0)
+			break;
+		if (sock >= 0)
+			::close(sock);
+		sock = -1;
+		sleep(1);
+	}
+	freeaddrinfo(res);
+	if (sock < 0) {
+		cerr << "cannot connect to the coordinator: " << host << ":" << port << endl;
+		return false;
+	}
+	int on = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	noSigPipe(sock);
+
+	m_Socket.assign(1, sock);
+	m_rank = rank;
+	size_t key_size = key.size();
+	if (!sendAll(sock, &m_rank, sizeof(m_rank)) || !sendAll(sock, &key_size, sizeof(key_size))
+			|| !sendAll(sock, key.data(), key_size) || !recvAll(sock, &m_size, sizeof(m_size))) {
+		cerr << "coordinator connection error\n";
+		return false;
+	}
+	return true;
+}
+
+void Cluster::close() {
+	for (size_t i = 0; i < m_Socket.size(); i++) {
+		if (m_Socket[i] >= 0)
+			::close(m_Socket[i]);
+	}
+	m_Socket.clear();
+}
+
+bool Cluster::isCoordinator() const {
+	return (m_rank == 0 && m_size > 1);
+}
+
+bool Cluster::isWorker() const {
+	return (m_rank > 0);
+}
+
+size_t Cluster::rank() const {
+	return m_rank;
+}
+
+size_t Cluster::size() const {
+	return m_size;
+}
+
+/**	Contiguous shard of the training set for this process.
+	@param n		# of training sequences
+	@param begin	first sequence of the shard
+	@param end		end of the shard
+*/
+void Cluster::range(size_t n, size_t& begin, size_t& end) const {
+	begin = n * m_rank / m_size;
+	end = n * (m_rank + 1) / m_size;
+}
+
+/**	Send theta to the workers (coordinator).
+*/
+bool Cluster::broadcast(const double* theta, size_t n) {
+	int cmd = CMD_RUN;
+	for (size_t i = 0; i < m_Socket.size(); i++) {
+		if (!sendAll(m_Socket[i], &cmd, sizeof(cmd)) || !sendAll(m_Socket[i], &n, sizeof(n))
+				|| !sendAll(m_Socket[i], theta, n * sizeof(double))) {
+			m_failed = true;
+			return false;
+		}
+	}
+	return true;
+}
+
+/**	Add the partial gradients and evaluation counts of the workers (coordinator).
+	The workers are summed up in the order of their ranks.
+	@param gradient	gradient of the coordinator's shard (updated)
+	@param n		size of the gradient
+	@param stats	sum of the worker statistics
+*/
+bool Cluster::reduce(double* gradient, size_t n, vector<double>& stats) {
+	vector<double> buf;
+	stats.clear();
+	for (size_t i = 0; i < m_Socket.size(); i++) {
+		size_t size = 0;
+		if (!recvAll(m_Socket[i], &size, sizeof(size))) {
+			m_failed = true;
+			return false;
+		}
+		if (size != n) {
+			cerr << "gradient size mismatch error (worker " << i + 1 << ")" << endl;
+			m_failed = true;
+			return false;
+		}
+		buf.resize(n);
+		if (n > 0 && !recvAll(m_Socket[i], &buf[0], n * sizeof(double))) {
+			m_failed = true;
+			return false;
+		}
+		for (size_t j = 0; j < n; j++)
+			gradient[j] += buf[j];
+
+		if (!recvAll(m_Socket[i], &size, sizeof(size))) {
+			m_failed = true;
+			return false;
+		}
+		buf.resize(size);
+		if (size > 0 && !recvAll(m_Socket[i], &buf[0], size * sizeof(double))) {
+			m_failed = true;
+			return false;
+		}
+		if (stats.empty())
+			stats.resize(size, 0.0);
+		for (size_t j = 0; j < size && j < stats.size(); j++)
+			stats[j] += buf[j];
+	}
+	return true;
+}
+
+/**	Finish the training of the current file (coordinator).
+	The workers leave their training loop and go on to the next training file.
+*/
+void Cluster::finish() {
+	if (!isCoordinator() || m_stopped)
+		return;
+	int cmd = CMD_FINISH;
+	for (size_t i = 0; i < m_Socket.size(); i++)
+		sendAll(m_Socket[i], &cmd, sizeof(cmd));
+}
+
+/**	Stop the workers (coordinator).
+	It is sent once, after the last training file or when the coordinator gives up.
+*/
+void Cluster::stop() {
+	if (!isCoordinator() || m_stopped)
+		return;
+	int cmd = CMD_STOP;
+	for (size_t i = 0; i < m_Socket.size(); i++)
+		sendAll(m_Socket[i], &cmd, sizeof(cmd));
+	m_stopped = true;
+}
+
+/**	Receive theta from the coordinator (worker).
+	A lost coordinator or a size mismatch stops the worker as failed.
+	@return false when the coordinator finishes the current file or stops the training
+*/
+bool Cluster::receive(double* theta, size_t n) {
+	int cmd = CMD_STOP;
+	size_t size = 0;
+	if (m_Socket.empty() || !recvAll(m_Socket[0], &cmd, sizeof(cmd))) {
+		m_stopped = m_failed = true;
+		return false;
+	}
+	if (cmd == CMD_STOP) {
+		m_stopped = true;
+		return false;
+	}
+	if (cmd == CMD_FINISH)
+		return false;
+	if (!recvAll(m_Socket[0], &size, sizeof(size))) {
+		m_stopped = m_failed = true;
+		return false;
+	}
+	if (size != n) {
+		cerr << "parameter size mismatch error: " << size << " != " << n << endl;
+		m_stopped = m_failed = true;
+		return false;
+	}
+	if (n > 0 && !recvAll(m_Socket[0], theta, n * sizeof(double))) {
+		m_stopped = m_failed = true;
+		return false;
+	}
+	return true;
+}
+
+/**	Return true if the coordinator has stopped the training (worker).
+*/
+bool Cluster::stopped() const {
+	return m_stopped;
+}
+
+/**	Send the partial gradient and evaluation counts to the coordinator (worker).
+*/
+bool Cluster::send(const double* gradient, size_t n, const vector<double>& stats) {
+	size_t size = stats.size();
+	if (m_Socket.empty() || !sendAll(m_Socket[0], &n, sizeof(n)) || !sendAll(m_Socket[0], gradient, n * sizeof(double))
+			|| !sendAll(m_Socket[0], &size, sizeof(size))
+			|| (size > 0 && !sendAll(m_Socket[0], &stats[0], size * sizeof(double)))) {
+		m_stopped = m_failed = true;
+		return false;
+	}
+	return true;
+}
+
+/**	Return true if a peer has gone away or broken the protocol.
+*/
+bool Cluster::failed() const {
+	return m_failed;
+}
+
+} // namespace tricrf
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+/// standard headers
+#include <vector>
+#include <string>
+
+namespace tricrf {
+
+/** Coordinator/worker channel for the distributed gradient computation.
+	The coordinator (rank 0) broadcasts theta, every process computes the partial gradient and
+	evaluation counts of its shard of the training set, and the coordinator sums them up and
+	runs the optimizer. Processes are connected with TCP sockets (localhost or across hosts
+	of the same architecture; the values are sent in the native binary format). The coordinator
+	listens on the loopback address unless another one is given, and a worker whose key or rank
+	does not match is refused. A connection or protocol error is reported by the calls (and
+	failed()) rather than ending the process.
+	@class Cluster
+*/
+class Cluster {
+private:
+	size_t m_rank;	///< 0 = coordinator
+	size_t m_size;	///< # of processes (coordinator + workers)
+	std::vector<int> m_Socket;	///< coordinator: workers of rank 1.., worker: coordinator
+	bool m_stopped;	///< the workers are stopped (coordinator), or the coordinator stopped (worker)
+	bool m_failed;	///< a peer has gone away or broken the protocol ; the training fails
+
+	bool sendAll(int sock, const void* buf, size_t len);
+	bool recvAll(int sock, void* buf, size_t len);
+
+public:
+	Cluster();
+	~Cluster();	///< stops the workers if the coordinator has not done it
+
+	/// Connection
+	bool listen(int port, size_t n_worker, const std::string& bind_addr = "127.0.0.1", const std::string& key = "");
+	bool connect(const std::string& host, int port, size_t rank, const std::string& key = "");
+	void close();
+
+	bool isCoordinator() const;
+	bool isWorker() const;
+	size_t rank() const;
+	size_t size() const;
+	void range(size_t n, size_t& begin, size_t& end) const;	///< shard of n training sequences
+
+	/// Coordinator
+	bool broadcast(const double* theta, size_t n);
+	bool reduce(double* gradient, size_t n, std::vector<double>& stats);
+	void finish();	///< end of the training of a file ; the workers go on to the next one
+	void stop();	///< end of the training ; the workers exit
+
+	/// Worker
+	bool receive(double* theta, size_t n);	///< false when the coordinator finishes or stops
+	bool send(const double* gradient, size_t n, const std::vector<double>& stats);
+	bool stopped() const;
+
+	bool failed() const;
+};
+
+} // namespace tricrf
+
+#endif
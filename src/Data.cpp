@@ -17,11 +17,260 @@
 #include <stdexcept>
 #include <iostream>
 #include <fstream>
+#include <cstdio>
 
 using namespace std;
 
 namespace tricrf {
 
+InputBuffer::InputBuffer() {
+	m_File = NULL;
+	m_Pipe = m_Keep = m_Replay = false;
+}
+
+InputBuffer::~InputBuffer() {
+	close();
+}
+
+/**	Open a data file.
+	@param filename	data file (.gz and .zst are decompressed)
+	@param rewind	keep the decompressed text for a rewind
+	@return true if the file is opened
+*/
+bool InputBuffer::open(const string& filename, bool rewind) {
+	close();
+	FILE* f = fopen(filename.c_str(), "rb");
+	if (!f)
+		return false;
+
+	string command;
+	if (filename.size() > 3 && filename.compare(filename.size() - 3, 3, ".gz") == 0)
+		command = "gzip -dc ";
+	else if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".zst") == 0)
+		command = "zstd -dc ";
+
+	if (command == "") {
+		m_File = f;
+	} else {
+		fclose(f);
+		/// quoting the file name for the shell
+		command += "'";
+		for (size_t i = 0; i < filename.size(); i++)
+			command += (filename[i] == '\'' ? string("'\\''") : string(1, filename[i]));
+		command += "'";
+		if (!(m_File = popen(command.c_str(), "r")))
+			return false;
+		m_Pipe = true;
+		m_Keep = rewind;
+	}
+	m_Buffer.resize(1 << 16);
+	setg(NULL, NULL, NULL);
+	return true;
+}
+
+void InputBuffer::close() {
+	if (m_File) {
+		if (m_Pipe) {
+			if (pclose(m_File) != 0)
+				cerr << "decompression error\n";
+		} else
+			fclose(m_File);
+	}
+	m_File = NULL;
+	m_Pipe = m_Keep = m_Replay = false;
+	string().swap(m_Record);
+	setg(NULL, NULL, NULL);
+}
+
+InputBuffer::int_type InputBuffer::underflow() {
+	if (gptr() < egptr())
+		return traits_type::to_int_type(*gptr());
+	if (m_Replay) {	///< the kept text is over ; back to the pipe
+		m_Replay = false;
+		setg(NULL, NULL, NULL);
+		string().swap(m_Record);
+	}
+	if (!m_File)
+		return traits_type::eof();
+
+	size_t n = fread(&m_Buffer[0], 1, m_Buffer.size(), m_File);
+	if (n == 0)
+		return traits_type::eof();
+	if (m_Keep)
+		m_Record.append(&m_Buffer[0], n);
+	setg(&m_Buffer[0], &m_Buffer[0], &m_Buffer[0] + n);
+	return traits_type::to_int_type(*gptr());
+}
+
+InputBuffer::pos_type InputBuffer::seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which) {
+	if (off == 0 && dir == ios_base::beg)
+		return seekpos(0, which);
+	return pos_type(off_type(-1));
+}
+
+/**	Rewind to the beginning (the other positions are not supported).
+*/
+InputBuffer::pos_type InputBuffer::seekpos(pos_type pos, ios_base::openmode) {
+	if (pos != pos_type(0) || !m_File)
+		return pos_type(off_type(-1));
+	if (!m_Pipe) {
+		if (fseek(m_File, 0, SEEK_SET) != 0)
+			return pos_type(off_type(-1));
+		setg(NULL, NULL, NULL);
+		return pos;
+	}
+	if (!m_Keep)
+		return pos_type(off_type(-1));
+
+	/// the pipe continues after the kept text, which is not kept again
+	m_Keep = false;
+	if (m_Record.empty()) {
+		setg(NULL, NULL, NULL);
+	} else {
+		m_Replay = true;
+		setg(&m_Record[0], &m_Record[0], &m_Record[0] + m_Record.size());
+	}
+	return pos;
+}
+
+/**	Constructor.
+	@param filename	data file (.gz and .zst are decompressed)
+	@param rewind	the stream can seek back to the beginning once
+*/
+InputStream::InputStream(const string& filename, bool rewind) : istream(NULL) {
+	if (m_Buffer.open(filename, rewind))
+		rdbuf(&m_Buffer);
+	else
+		setstate(ios::failbit);
+}
+
+/**	Load a template file.
+	@param filename	template file
+	@return true if the templates are loaded
+*/
+bool FeatureTemplate::load(const string& filename) {
+	ifstream f(filename.c_str());
+	if (!f)
+		return false;
+
+	m_Literal.clear();
+	m_Macro.clear();
+	string line;
+	while (getline(f, line)) {
+		vector<string> tok = tokenize(line);
+		if (tok.size() == 0 || tok[0][0] == '#' || tok[0][0] == 'B')
+			continue;
+		const string& str = tok[0];
+		vector<string> literal(1, "");
+		vector<pair<int, size_t> > macro;
+		size_t pos = 0;
+		while (pos < str.size()) {
+			int row, col, n = 0;
+			if (str.compare(pos, 3, "%x[") == 0 && sscanf(str.c_str() + pos, "%%x[%d,%d]%n", &row, &col, &n) >= 2 && n > 0 && col >= 0) {
+				macro.push_back(make_pair(row, (size_t)col));
+				literal.push_back("");
+				pos += n;
+			} else {
+				literal.back() += (str[pos] == ':' ? '=' : str[pos]);
+				pos++;
+			}
+		}
+		m_Literal.push_back(literal);
+		m_Macro.push_back(macro);
+	}
+	return true;
+}
+
+bool FeatureTemplate::empty() const {
+	return m_Literal.empty();
+}
+
+size_t FeatureTemplate::size() const {
+	return m_Literal.size();
+}
+
+/**	Expand the raw columns of a sequence to the features.
+	Each row is replaced by the label and the generated features ; positions out of the
+	sequence are "_B-1", "_B+1", ...
+	@param rows		tokens of the lines (label and columns)
+	@param begin	first token line (the lines before are not expanded)
+*/
+void FeatureTemplate::expand(vector<vector<string> >& rows, size_t begin) const {
+	if (rows.size() <= begin)
+		return;
+	vector<vector<string> > columns(rows.begin() + begin, rows.end());
+	int n = columns.size();
+	char pad[32];
+	for (int i = 0; i < n; i++) {
+		vector<string>& out = rows[begin + i];
+		out.resize(1);	///< label
+		out.reserve(m_Literal.size() + 1);
+		for (size_t t = 0; t < m_Literal.size(); t++) {
+			string fstr = m_Literal[t][0];
+			for (size_t m = 0; m < m_Macro[t].size(); m++) {
+				int row = i + m_Macro[t][m].first;
+				size_t col = m_Macro[t][m].second + 1;
+				if (row < 0 || row >= n) {
+					sprintf(pad, "_B%+d", (row < 0 ? row : row - n + 1));
+					fstr += pad;
+				} else if (col < columns[row].size()) {
+					const string& value = columns[row][col];
+					for (size_t c = 0; c < value.size(); c++)
+						fstr += (value[c] == ':' ? '_' : value[c]);	///< ':' would be read as a feature value
+				}
+				fstr += m_Literal[t][m + 1];
+			}
+			out.push_back(fstr);
+		}
+	}
+}
+
+/**	Constructor.
+	@param f		data stream
+	@param tmpl		feature template (NULL or empty ; the lines are read as they are)
+	@param topic	the first line of each sequence is a topic line
+*/
+DataReader::DataReader(istream& f, const FeatureTemplate* tmpl, bool topic) : m_File(f) {
+	m_Template = (tmpl && !tmpl->empty() ? tmpl : NULL);
+	m_Topic = topic;
+	m_Pos = 0;
+}
+
+/**	Read the next line.
+	@param tokens	tokens of the line (empty at a sequence break)
+	@return false at the end of the file
+*/
+bool DataReader::next(vector<string>& tokens) {
+	string line;
+	if (!m_Template) {
+		if (!getline(m_File, line))
+			return false;
+		tokens = tokenize(line, " \t");
+		return true;
+	}
+
+	if (m_Pos >= m_Block.size()) {
+		/// reading a whole sequence ; the break is kept only if the file has it
+		m_Block.clear();
+		m_Pos = 0;
+		bool eos = false;
+		while (getline(m_File, line)) {
+			vector<string> tok = tokenize(line, " \t");
+			if (tok.size() == 0) {
+				eos = true;
+				break;
+			}
+			m_Block.push_back(tok);
+		}
+		m_Template->expand(m_Block, (m_Topic ? 1 : 0));
+		if (eos)
+			m_Block.push_back(vector<string>());
+		if (m_Block.empty())
+			return false;
+	}
+	tokens.swap(m_Block[m_Pos++]);
+	return true;
+}
 
 }	// namespace tricrf
 
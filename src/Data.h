@@ -12,6 +12,9 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <istream>
+#include <streambuf>
+#include <cstdio>
 
 namespace tricrf {
 
@@ -45,14 +48,14 @@ class TriSequence {
 public:
 	Event topic;
 	Sequence seq;
-	size_t size() { return seq.size(); };
+	size_t size() const { return seq.size(); };
 };
 
 class TriStringSequence {
 public:
 	Event topic;
 	StringSequence seq;
-	size_t size() { return seq.size(); };
+	size_t size() const { return seq.size(); };
 };
 
 /**	Data.
@@ -64,8 +67,107 @@ class Data : public std::vector<T> {
 private:
 	size_t n_element;
 public:
+	Data() : n_element(0) {};
 	void append(T element) { this->push_back(element); n_element += element.size(); };
-	size_t size_element() { return n_element; };
+	size_t size_element() const { return n_element; };
+};
+
+/**	Split the counts for the cross-validation.
+	The i-th element belongs to the fold (i % n_fold). The folds share the elements ; an element
+	out of a fold has zero count, and is skipped by the training and the evaluation.
+	@param count		counts of the elements
+	@param k			held-out fold
+	@param n_fold		# of folds
+	@param train_count	counts of the other folds
+	@param held_count	counts of the held-out fold
+*/
+inline void splitFold(const std::vector<double>& count, size_t k, size_t n_fold,
+		std::vector<double>& train_count, std::vector<double>& held_count) {
+	train_count.assign(count.size(), 0.0);
+	held_count.assign(count.size(), 0.0);
+	for (size_t i = 0; i < count.size(); i++) {
+		if (i % n_fold == k)
+			held_count[i] = count[i];
+		else
+			train_count[i] = count[i];
+	}
+}
+
+/** Stream buffer of a data file.
+	A compressed file (.gz, .zst) is decompressed by a child process (gzip -dc, zstd -dc)
+	while the caller is parsing, and read through a pipe.
+	@class InputBuffer
+*/
+class InputBuffer : public std::streambuf {
+private:
+	FILE* m_File;
+	bool m_Pipe;	///< decompressed through a pipe
+	bool m_Keep;	///< the decompressed text is kept for a rewind
+	bool m_Replay;	///< reading the kept text
+	std::vector<char> m_Buffer;
+	std::string m_Record;	///< decompressed text read so far
+
+protected:
+	virtual int_type underflow();
+	virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which);
+	virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which);
+
+public:
+	InputBuffer();
+	~InputBuffer();
+	bool open(const std::string& filename, bool rewind = false);
+	void close();
+};
+
+/** Input stream of a data file (plain or compressed).
+	With rewind, the stream can seek back to the beginning once ; a compressed file is then
+	replayed from memory instead of being decompressed twice.
+	@class InputStream
+*/
+class InputStream : public std::istream {
+private:
+	InputBuffer m_Buffer;
+public:
+	InputStream(const std::string& filename, bool rewind = false);
+};
+
+/** Feature template (CRF++ style).
+	Each line such as "U01:%x[-1,0]/%x[0,0]" generates one feature of a token from its raw
+	columns ; %x[row,col] is the column col (0 = the first column after the label) of the
+	token at the relative position row. ':' in the names is written as '=' because ':' separates
+	a feature value in the data. Bigram ("B") lines are ignored since the transition features
+	are always generated.
+	@class FeatureTemplate
+*/
+class FeatureTemplate {
+private:
+	/// parsed templates ; literal[0] macro[0] literal[1] macro[1] ... literal[n]
+	std::vector<std::vector<std::string> > m_Literal;
+	std::vector<std::vector<std::pair<int, size_t> > > m_Macro;	///< (row, col)
+
+public:
+	bool load(const std::string& filename);
+	bool empty() const;
+	size_t size() const;
+	void expand(std::vector<std::vector<std::string> >& rows, size_t begin = 0) const;
+};
+
+/** Reader of the data files.
+	It returns the tokens of each line, and an empty line at each sequence break. With a
+	feature template, the raw columns of a sequence are expanded to the features in memory.
+	@class DataReader
+*/
+class DataReader {
+private:
+	std::istream& m_File;
+	const FeatureTemplate* m_Template;
+	bool m_Topic;	///< the first line of each sequence is a topic line (not expanded)
+	std::vector<std::vector<std::string> > m_Block;	///< expanded lines of a sequence
+	size_t m_Pos;
+
+public:
+	DataReader(std::istream& f, const FeatureTemplate* tmpl = NULL, bool topic = false);
+	bool next(std::vector<std::string>& tokens);
 };
 
 } // namespace tricrf
@@ -0,0 +1,1853 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/// max headers
+#include "Decoder.h"
+#include "Utility.h"
+/// standard headers
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <deque>
+/// thread headers
+#include <pthread.h>
+
+using namespace std;
+
+/// Slack of the Viterbi bound against the rounding of the scaled search
+#define VITERBI_BOUND_SLACK	1E-06
+
+namespace tricrf {
+
+/**	Convert a float to float16 (round to nearest).
+*/
+static unsigned short floatToHalf(float value) {
+	union { float f; unsigned int u; } v;
+	v.f = value;
+	unsigned int sign = (v.u >> 16) & 0x8000;
+	int exponent = (int)((v.u >> 23) & 0xff) - 127 + 15;
+	unsigned int mantissa = v.u & 0x7fffff;
+
+	if (exponent <= 0) {	///< subnormal
+		if (exponent < -10)
+			return sign;
+		mantissa |= 0x800000;
+		unsigned int shift = 14 - exponent;
+		unsigned int half = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1)
+			half++;
+		return sign | half;
+	}
+	if (exponent >= 31)	///< overflow
+		return sign | 0x7c00;
+	unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000)
+		half++;
+	return half;
+}
+
+/**	Convert a float16 to float.
+*/
+static float halfToFloat(unsigned short half) {
+	unsigned int sign = (half & 0x8000) << 16;
+	unsigned int exponent = (half >> 10) & 0x1f;
+	unsigned int mantissa = half & 0x3ff;
+	union { float f; unsigned int u; } v;
+
+	if (exponent == 0) {	///< subnormal
+		float value = ldexp((float)mantissa, -24);
+		return (sign ? -value : value);
+	}
+	if (exponent == 31)
+		v.u = sign | 0x7f800000 | (mantissa << 13);
+	else
+		v.u = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	return v.f;
+}
+
+/// binary I/O
+template <typename T>
+static void writeVector(ofstream& f, const vector<T>& vec) {
+	size_t n = vec.size();
+	f.write((const char*)&n, sizeof(n));
+	if (n > 0)
+		f.write((const char*)&vec[0], n * sizeof(T));
+}
+
+template <typename T>
+static void readVector(ifstream& f, vector<T>& vec) {
+	size_t n = 0;
+	f.read((char*)&n, sizeof(n));
+	vec.resize(n);
+	if (n > 0)
+		f.read((char*)&vec[0], n * sizeof(T));
+}
+
+template <typename T>
+static void writeVectors(ofstream& f, const vector<vector<T> >& vec) {
+	size_t n = vec.size();
+	f.write((const char*)&n, sizeof(n));
+	for (size_t i = 0; i < n; i++)
+		writeVector(f, vec[i]);
+}
+
+template <typename T>
+static void readVectors(ifstream& f, vector<vector<T> >& vec) {
+	size_t n = 0;
+	f.read((char*)&n, sizeof(n));
+	vec.resize(n);
+	for (size_t i = 0; i < n && f; i++)
+		readVector(f, vec[i]);
+}
+
+static void writeString(ofstream& f, const string& str) {
+	size_t n = str.size();
+	f.write((const char*)&n, sizeof(n));
+	f.write(str.data(), n);
+}
+
+static void readString(ifstream& f, string& str) {
+	size_t n = 0;
+	f.read((char*)&n, sizeof(n));
+	str.resize(n);
+	if (n > 0)
+		f.read(&str[0], n);
+}
+
+static void writeStrings(ofstream& f, const vector<string>& vec) {
+	size_t n = vec.size();
+	f.write((const char*)&n, sizeof(n));
+	for (size_t i = 0; i < n; i++)
+		writeString(f, vec[i]);
+}
+
+static void readStrings(ifstream& f, vector<string>& vec) {
+	size_t n = 0;
+	f.read((char*)&n, sizeof(n));
+	vec.resize(n);
+	for (size_t i = 0; i < n && f; i++)
+		readString(f, vec[i]);
+}
+
+static void writeMap(ofstream& f, const Map& map) {
+	size_t n = map.size();
+	f.write((const char*)&n, sizeof(n));
+	for (Map::const_iterator it = map.begin(); it != map.end(); ++it) {
+		writeString(f, it->first);
+		f.write((const char*)&it->second, sizeof(it->second));
+	}
+}
+
+static void readMap(ifstream& f, Map& map) {
+	size_t n = 0;
+	f.read((char*)&n, sizeof(n));
+	map.clear();
+	for (size_t i = 0; i < n && f; i++) {
+		string key;
+		size_t id = 0;
+		readString(f, key);
+		f.read((char*)&id, sizeof(id));
+		map.insert(make_pair(key, id));
+	}
+}
+
+/**	Check that the compact index of the compiled model can hold a parameter.
+	@param n_label	# of labels (or topics)
+	@param n_entry	# of weights
+*/
+static void checkIndex(size_t n_label, size_t n_entry) {
+	if (n_label > numeric_limits<Label16>::max() || n_entry > numeric_limits<Offset32>::max())
+		throw runtime_error("too many labels or weights for the compiled model");
+}
+
+/// Constructor
+QuantizedWeight::QuantizedWeight() {
+	m_mode = QUANT_NONE;
+}
+
+/**	Quantize the log-weights.
+	@param weight	exp'd weights
+	@param offset	CSR offsets (a row is a feature block)
+	@param mode		QUANT_FP16 or QUANT_INT8
+*/
+void QuantizedWeight::quantize(const vector<double>& weight, const vector<Offset32>& offset, int mode) {
+	m_mode = mode;
+	m_Half.clear();
+	m_Code.clear();
+	m_Scale.clear();
+
+	if (mode == QUANT_FP16) {
+		m_Half.resize(weight.size());
+		for (size_t e = 0; e < weight.size(); e++)
+			m_Half[e] = floatToHalf((float)log(weight[e]));
+	} else if (mode == QUANT_INT8) {
+		m_Code.resize(weight.size());
+		m_Scale.resize(offset.size() > 0 ? offset.size() - 1 : 0);
+		for (size_t row = 0; row + 1 < offset.size(); row++) {
+			double max = 0.0;
+			for (size_t e = offset[row]; e < offset[row + 1]; e++)
+				max = std::max(max, fabs((double)log(weight[e])));
+			m_Scale[row] = (float)(max / 127.0);
+			for (size_t e = offset[row]; e < offset[row + 1]; e++) {
+				double code = (max > 0.0 ? floor(log(weight[e]) / m_Scale[row] + 0.5) : 0.0);
+				m_Code[e] = (signed char)std::max(-127.0, std::min(127.0, code));
+			}
+		}
+	}
+}
+
+/**	Return the log-weight of an entry.
+	@param row	feature (row of the CSR index)
+	@param e	entry
+*/
+long double QuantizedWeight::get(size_t row, size_t e) const {
+	if (m_mode == QUANT_FP16)
+		return halfToFloat(m_Half[e]);
+	return m_Code[e] * m_Scale[row];
+}
+
+size_t QuantizedWeight::bytes() const {
+	return m_Half.size() * sizeof(unsigned short) + m_Code.size() * sizeof(signed char) + m_Scale.size() * sizeof(float);
+}
+
+bool QuantizedWeight::save(ofstream& f) const {
+	f.write((const char*)&m_mode, sizeof(m_mode));
+	writeVector(f, m_Half);
+	writeVector(f, m_Code);
+	writeVector(f, m_Scale);
+	return f.good();
+}
+
+bool QuantizedWeight::load(ifstream& f) {
+	f.read((char*)&m_mode, sizeof(m_mode));
+	readVector(f, m_Half);
+	readVector(f, m_Code);
+	readVector(f, m_Scale);
+	return f.good();
+}
+
+/// Constructor
+CompiledModel::CompiledModel() {
+	m_global_size = 0;
+	m_prune_threshold = 1000;
+	m_viterbi_bound = true;
+	m_quant = QUANT_NONE;
+	m_ObsOffset.push_back(0);
+	m_GammaOffset.push_back(0);
+}
+
+/**	Build the observation index from the (shared) sequence parameter.
+	Its feature dictionary becomes the dictionary of the compiled model.
+	@param param	sequence parameter
+*/
+void CompiledModel::setFeatures(Parameter& param) {
+	checkIndex(param.sizeStateVec(), param.size());
+	double* theta = param.getWeight();
+	m_FeatureMap = param.getFeatureMap();
+	m_global_size = param.sizeStateVec();
+
+	m_ObsOffset.clear();
+	m_ObsLabel.clear();
+	m_ObsWeight.clear();
+	m_ObsOffset.push_back(0);
+	for (size_t pid = 0; pid < param.m_ParamIndex->size(); pid++) {
+		const vector<pair<size_t, size_t> >& index = (*param.m_ParamIndex)[pid];
+		for (size_t i = 0; i < index.size(); i++) {
+			m_ObsLabel.push_back((Label16)index[i].first);
+			m_ObsWeight.push_back(exp(theta[index[i].second]));
+		}
+		m_ObsOffset.push_back(m_ObsLabel.size());
+	}
+}
+
+/**	Build the topic observation index.
+	@param param	topic parameter
+*/
+void CompiledModel::setTopicFeatures(Parameter& param) {
+	checkIndex(param.sizeStateVec(), param.size());
+	double* theta = param.getWeight();
+	m_TopicFeatureMap = param.getFeatureMap();
+
+	m_GammaOffset.clear();
+	m_GammaTopic.clear();
+	m_GammaWeight.clear();
+	m_GammaOffset.push_back(0);
+	for (size_t pid = 0; pid < param.m_ParamIndex->size(); pid++) {
+		const vector<pair<size_t, size_t> >& index = (*param.m_ParamIndex)[pid];
+		for (size_t i = 0; i < index.size(); i++) {
+			m_GammaTopic.push_back((Label16)index[i].first);
+			m_GammaWeight.push_back(exp(theta[index[i].second]));
+		}
+		m_GammaOffset.push_back(m_GammaTopic.size());
+	}
+}
+
+/**	Build the topic-specific observation index.
+	The features are looked up by name, so the index follows the compiled dictionary.
+	@param z		topic
+	@param param	topic-specific sequence parameter (local labels)
+*/
+void CompiledModel::addTopicFeatures(size_t z, Parameter& param) {
+	assert(z < m_TopicObsOffset.size());
+	checkIndex(param.sizeStateVec(), param.size());
+	double* theta = param.getWeight();
+
+	vector<Offset32>& offset = m_TopicObsOffset[z];
+	vector<Label16>& label = m_TopicObsLabel[z];
+	vector<double>& weight = m_TopicObsWeight[z];
+	offset.assign(m_ObsOffset.size(), 0);
+	label.clear();
+	weight.clear();
+
+	Map::iterator it = m_FeatureMap.begin();
+	vector<int> pids(m_ObsOffset.size() - 1, -1);
+	for (; it != m_FeatureMap.end(); ++it)
+		pids[it->second] = param.findObs(it->first);
+
+	for (size_t cid = 0; cid < pids.size(); cid++) {
+		if (pids[cid] >= 0) {
+			const vector<pair<size_t, size_t> >& index = (*param.m_ParamIndex)[(size_t)pids[cid]];
+			for (size_t i = 0; i < index.size(); i++) {
+				label.push_back((Label16)index[i].first);
+				weight.push_back(exp(theta[index[i].second]));
+			}
+		}
+		offset[cid + 1] = label.size();
+	}
+}
+
+/**	Add a topic (a linear chain over its local labels).
+	@param name		topic name
+	@param states	local label names
+	@param l2g		global label of each local label (m_global_size = none)
+	@return topic id
+*/
+size_t CompiledModel::addTopic(const string& name, const vector<string>& states, const vector<size_t>& l2g) {
+	assert(states.size() == l2g.size());
+	m_TopicVec.push_back(name);
+	m_state_size.push_back(states.size());
+	m_StateVec.push_back(states);
+	m_L2G.push_back(l2g);
+	m_Start.push_back(vector<double>(states.size(), 1.0));
+	m_Trans.push_back(vector<double>(states.size() * states.size(), 1.0));
+	m_Node.push_back(vector<double>(states.size(), 1.0));
+	m_End.push_back(vector<double>(states.size(), 1.0));
+	m_MaxIn.push_back(vector<double>(states.size(), 1.0));
+	m_TopicObsOffset.push_back(vector<Offset32>());
+	m_TopicObsLabel.push_back(vector<Label16>());
+	m_TopicObsWeight.push_back(vector<double>());
+	return m_TopicVec.size() - 1;
+}
+
+/**	Largest transition into each label.
+	@param trans	y1 -> y2 (row major)
+	@param size		# of labels
+	@param max_in	largest transition into each label
+*/
+static void setMaxIn(const vector<double>& trans, size_t size, vector<double>& max_in) {
+	max_in.assign(size, 0.0);
+	for (size_t k = 0; k < size; k++) {
+		for (size_t j = 0; j < size; j++)
+			max_in[j] = max(max_in[j], trans[size * k + j]);
+	}
+}
+
+/**	Set the exp'd edge factors of a topic.
+	@param z		topic
+	@param start	<start> -> y
+	@param trans	y1 -> y2 (row major)
+	@param end		y -> <end>
+	@param node		static factor of each label
+*/
+void CompiledModel::setEdge(size_t z, const vector<double>& start, const vector<double>& trans,
+		const vector<double>& end, const vector<double>& node) {
+	size_t size = m_state_size[z];
+	assert(start.size() == size && end.size() == size && node.size() == size && trans.size() == size * size);
+	m_Start[z] = start;
+	m_Trans[z] = trans;
+	m_End[z] = end;
+	m_Node[z] = node;
+	setMaxIn(m_Trans[z], size, m_MaxIn[z]);
+}
+
+void CompiledModel::setPrune(long double prune) {
+	m_prune_threshold = prune;
+}
+
+void CompiledModel::setViterbiBound(bool bound) {
+	m_viterbi_bound = bound;
+}
+
+void CompiledModel::setTemplate(const FeatureTemplate& tmpl) {
+	m_Template = tmpl;
+}
+
+/**	Quantize the observation weights.
+	The exp'd weights are released, and the decoder sessions use the quantized log-weights.
+	The edge factors are kept in full precision.
+	@param mode		QUANT_FP16 or QUANT_INT8
+*/
+void CompiledModel::quantize(int mode) {
+	if (mode == QUANT_NONE || m_quant != QUANT_NONE)
+		return;
+
+	m_ObsQ.quantize(m_ObsWeight, m_ObsOffset, mode);
+	m_TopicObsQ.resize(m_TopicVec.size());
+	for (size_t z = 0; z < m_TopicVec.size(); z++) {
+		m_TopicObsQ[z].quantize(m_TopicObsWeight[z], m_TopicObsOffset[z], mode);
+		vector<double>().swap(m_TopicObsWeight[z]);
+	}
+	m_GammaQ.quantize(m_GammaWeight, m_GammaOffset, mode);
+	vector<double>().swap(m_ObsWeight);
+	vector<double>().swap(m_GammaWeight);
+
+	m_quant = mode;
+}
+
+/**	Save the compiled model (binary).
+	@param filename	model file
+	@return true if succeeded
+*/
+bool CompiledModel::save(const string& filename) const {
+	ofstream f(filename.c_str(), ios::out | ios::binary);
+	if (!f)
+		throw runtime_error("fail to open model file");
+
+	f << "# TriCRF compiled model\n";
+
+	/// Dictionary
+	writeMap(f, m_FeatureMap);
+	writeMap(f, m_TopicFeatureMap);
+	writeStrings(f, m_TopicVec);
+
+	/// Observation index
+	writeVector(f, m_ObsOffset);
+	writeVector(f, m_ObsLabel);
+	writeVector(f, m_ObsWeight);
+	writeVectors(f, m_TopicObsOffset);
+	writeVectors(f, m_TopicObsLabel);
+	writeVectors(f, m_TopicObsWeight);
+	writeVector(f, m_GammaOffset);
+	writeVector(f, m_GammaTopic);
+	writeVector(f, m_GammaWeight);
+
+	/// Per-topic chain
+	f.write((const char*)&m_global_size, sizeof(m_global_size));
+	writeVector(f, m_state_size);
+	size_t n_topic = m_StateVec.size();
+	f.write((const char*)&n_topic, sizeof(n_topic));
+	for (size_t z = 0; z < n_topic; z++)
+		writeStrings(f, m_StateVec[z]);
+	writeVectors(f, m_L2G);
+	writeVectors(f, m_Start);
+	writeVectors(f, m_Trans);
+	writeVectors(f, m_Node);
+	writeVectors(f, m_End);
+	f.write((const char*)&m_prune_threshold, sizeof(m_prune_threshold));
+
+	/// Quantized weights
+	f.write((const char*)&m_quant, sizeof(m_quant));
+	if (m_quant != QUANT_NONE) {
+		m_ObsQ.save(f);
+		for (size_t z = 0; z < m_TopicObsQ.size(); z++)
+			m_TopicObsQ[z].save(f);
+		m_GammaQ.save(f);
+	}
+
+	return f.good();
+}
+
+/**	Load the compiled model (binary).
+	@param filename	model file
+	@return true if succeeded
+*/
+bool CompiledModel::load(const string& filename) {
+	ifstream f(filename.c_str(), ios::in | ios::binary);
+	if (!f)
+		throw runtime_error("fail to open model file");
+
+	string line;
+	getline(f, line);
+	if (line != "# TriCRF compiled model")
+		return false;
+
+	/// Dictionary
+	readMap(f, m_FeatureMap);
+	readMap(f, m_TopicFeatureMap);
+	readStrings(f, m_TopicVec);
+
+	/// Observation index
+	readVector(f, m_ObsOffset);
+	readVector(f, m_ObsLabel);
+	readVector(f, m_ObsWeight);
+	readVectors(f, m_TopicObsOffset);
+	readVectors(f, m_TopicObsLabel);
+	readVectors(f, m_TopicObsWeight);
+	readVector(f, m_GammaOffset);
+	readVector(f, m_GammaTopic);
+	readVector(f, m_GammaWeight);
+
+	/// Per-topic chain
+	f.read((char*)&m_global_size, sizeof(m_global_size));
+	readVector(f, m_state_size);
+	size_t n_topic = 0;
+	f.read((char*)&n_topic, sizeof(n_topic));
+	m_StateVec.resize(n_topic);
+	for (size_t z = 0; z < n_topic && f; z++)
+		readStrings(f, m_StateVec[z]);
+	readVectors(f, m_L2G);
+	readVectors(f, m_Start);
+	readVectors(f, m_Trans);
+	readVectors(f, m_Node);
+	readVectors(f, m_End);
+	f.read((char*)&m_prune_threshold, sizeof(m_prune_threshold));
+	m_MaxIn.resize(n_topic);
+	for (size_t z = 0; z < n_topic && z < m_Trans.size() && z < m_state_size.size(); z++)
+		setMaxIn(m_Trans[z], m_state_size[z], m_MaxIn[z]);
+
+	/// Quantized weights
+	f.read((char*)&m_quant, sizeof(m_quant));
+	if (m_quant != QUANT_NONE) {
+		m_ObsQ.load(f);
+		m_TopicObsQ.resize(n_topic);
+		for (size_t z = 0; z < n_topic; z++)
+			m_TopicObsQ[z].load(f);
+		m_GammaQ.load(f);
+	}
+
+	return f.good();
+}
+
+/**	Return true if the model has a topic classifier (TriCRF).
+*/
+bool CompiledModel::hasTopic() const {
+	return m_GammaOffset.size() > 1 || m_TopicVec.size() > 1;
+}
+
+size_t CompiledModel::sizeTopic() const {
+	return m_TopicVec.size();
+}
+
+int CompiledModel::findObs(const string& key) const {
+	Map::const_iterator it = m_FeatureMap.find(key);
+	return (it == m_FeatureMap.end() ? -1 : (int)it->second);
+}
+
+int CompiledModel::findTopicObs(const string& key) const {
+	Map::const_iterator it = m_TopicFeatureMap.find(key);
+	return (it == m_TopicFeatureMap.end() ? -1 : (int)it->second);
+}
+
+int CompiledModel::getQuant() const {
+	return m_quant;
+}
+
+/**	Return the bytes of the observation weights (double or quantized) and their CSR index.
+*/
+size_t CompiledModel::sizeWeight() const {
+	size_t bytes = (m_ObsOffset.size() + m_GammaOffset.size()) * sizeof(Offset32)
+		+ (m_ObsLabel.size() + m_GammaTopic.size()) * sizeof(Label16);
+	for (size_t z = 0; z < m_TopicObsOffset.size(); z++)
+		bytes += m_TopicObsOffset[z].size() * sizeof(Offset32) + m_TopicObsLabel[z].size() * sizeof(Label16);
+
+	if (m_quant != QUANT_NONE) {
+		bytes += m_ObsQ.bytes() + m_GammaQ.bytes();
+		for (size_t z = 0; z < m_TopicObsQ.size(); z++)
+			bytes += m_TopicObsQ[z].bytes();
+		return bytes;
+	}
+	size_t n = m_ObsWeight.size() + m_GammaWeight.size();
+	for (size_t z = 0; z < m_TopicObsWeight.size(); z++)
+		n += m_TopicObsWeight[z].size();
+	return bytes + n * sizeof(double);
+}
+
+/// Constructor
+DecoderSession::DecoderSession(const CompiledModel& model) : m_Model(model) {
+	m_seq_size = 0;
+	m_n_viterbi_topic = 0;
+	m_n_viterbi_search = 0;
+}
+
+size_t DecoderSession::sizeViterbiTopic() const {
+	return m_n_viterbi_topic;
+}
+
+size_t DecoderSession::sizeViterbiSearch() const {
+	return m_n_viterbi_search;
+}
+
+/**	Parse the observation lines.
+	The first token of a line is the label, and the remains are the features ("feature[:value]")
+	or the raw columns of the feature template. For TriCRF, the first line is the topic line.
+	@param lines	lines of a sequence
+*/
+void DecoderSession::parse(const vector<string>& lines) {
+	size_t n_topic = m_Model.sizeTopic();
+	bool quant = (m_Model.m_quant != QUANT_NONE);	///< log-weights are summed up
+	m_Gamma.assign(n_topic, (quant ? 0.0 : 1.0));
+
+	size_t start = 0;
+	if (m_Model.hasTopic() && lines.size() > 0) {
+		vector<string> tokens = tokenize(lines[0], " \t");
+		for (size_t t = 1; t < tokens.size(); t++) {
+			vector<string> tok = tokenize(tokens[t], ":");
+			int pid = m_Model.findTopicObs(tok.size() > 1 ? tok[0] : tokens[t]);
+			if (pid < 0)
+				continue;
+			for (size_t e = m_Model.m_GammaOffset[pid]; e < m_Model.m_GammaOffset[pid + 1]; e++) {
+				if (quant)
+					m_Gamma[m_Model.m_GammaTopic[e]] += m_Model.m_GammaQ.get(pid, e);
+				else
+					m_Gamma[m_Model.m_GammaTopic[e]] *= m_Model.m_GammaWeight[e];
+			}
+		}
+		start = 1;
+	}
+	if (quant) {
+		for (size_t z = 0; z < n_topic; z++)
+			m_Gamma[z] = exp(m_Gamma[z]);
+	}
+
+	m_seq_size = lines.size() - start;
+	vector<vector<string> > rows(m_seq_size);
+	for (size_t i = 0; i < m_seq_size; i++)
+		rows[i] = tokenize(lines[i + start], " \t");
+	if (!m_Model.m_Template.empty())
+		m_Model.m_Template.expand(rows);	///< raw columns to the features
+
+	m_Obs.resize(m_seq_size);
+	for (size_t i = 0; i < m_seq_size; i++) {
+		m_Obs[i].clear();
+		vector<string>& tokens = rows[i];
+		for (size_t t = 1; t < tokens.size(); t++) {
+			vector<string> tok = tokenize(tokens[t], ":");
+			int pid = m_Model.findObs(tok.size() > 1 ? tok[0] : tokens[t]);
+			if (pid >= 0)
+				m_Obs[i].push_back((size_t)pid);
+		}
+	}
+
+	/// shared node factor
+	size_t n_global = m_Model.m_global_size;
+	m_RG.resize(m_seq_size * n_global);
+	fill(m_RG.begin(), m_RG.end(), (quant ? 0.0 : 1.0));
+	for (size_t i = 0; i < m_seq_size; i++) {
+		for (size_t f = 0; f < m_Obs[i].size(); f++) {
+			size_t pid = m_Obs[i][f];
+			for (size_t e = m_Model.m_ObsOffset[pid]; e < m_Model.m_ObsOffset[pid + 1]; e++) {
+				if (quant)
+					m_RG[n_global * i + m_Model.m_ObsLabel[e]] += m_Model.m_ObsQ.get(pid, e);
+				else
+					m_RG[n_global * i + m_Model.m_ObsLabel[e]] *= m_Model.m_ObsWeight[e];
+			}
+		}
+	}
+	if (quant) {
+		for (size_t x = 0; x < m_RG.size(); x++)
+			m_RG[x] = exp(m_RG[x]);
+	}
+}
+
+/**	Calculate the node factors of a topic.
+	@param z	topic
+*/
+void DecoderSession::calculateFactors(size_t z) {
+	size_t size = m_Model.m_state_size[z];
+	size_t n_global = m_Model.m_global_size;
+	const vector<size_t>& l2g = m_Model.m_L2G[z];
+	const vector<double>& node = m_Model.m_Node[z];
+
+	vector<double>& R = m_R[z];
+	R.resize(m_seq_size * size);
+	for (size_t i = 0; i < m_seq_size; i++) {
+		for (size_t j = 0; j < size; j++)
+			R[size * i + j] = (l2g[j] < n_global ? m_RG[n_global * i + l2g[j]] : 1.0) * node[j];
+	}
+
+	if (m_Model.m_TopicObsOffset[z].empty())
+		return;
+	const vector<Offset32>& offset = m_Model.m_TopicObsOffset[z];
+	const vector<Label16>& label = m_Model.m_TopicObsLabel[z];
+	if (m_Model.m_quant != QUANT_NONE) {
+		const QuantizedWeight& q = m_Model.m_TopicObsQ[z];
+		m_LogR.assign(m_seq_size * size, 0.0);
+		for (size_t i = 0; i < m_seq_size; i++) {
+			for (size_t f = 0; f < m_Obs[i].size(); f++) {
+				size_t pid = m_Obs[i][f];
+				for (size_t e = offset[pid]; e < offset[pid + 1]; e++)
+					m_LogR[size * i + label[e]] += q.get(pid, e);
+			}
+		}
+		for (size_t x = 0; x < m_LogR.size(); x++)
+			R[x] *= exp(m_LogR[x]);
+		return;
+	}
+
+	const vector<double>& weight = m_Model.m_TopicObsWeight[z];
+	for (size_t i = 0; i < m_seq_size; i++) {
+		for (size_t f = 0; f < m_Obs[i].size(); f++) {
+			size_t pid = m_Obs[i][f];
+			for (size_t e = offset[pid]; e < offset[pid + 1]; e++)
+				R[size * i + label[e]] *= weight[e];
+		}
+	}
+}
+
+/**	Forward Recursion (scaled).
+	@param z	topic
+	@return log partition function of the topic (without the topic prior)
+*/
+long double DecoderSession::forward(size_t z) {
+	size_t size = m_Model.m_state_size[z];
+	const vector<double>& R = m_R[z];
+	const vector<double>& M = m_Model.m_Trans[z];
+	const vector<double>& start = m_Model.m_Start[z];
+	const vector<double>& end = m_Model.m_End[z];
+
+	vector<double>& alpha = m_Alpha[z];
+	alpha.resize(m_seq_size * size);
+	fill(alpha.begin(), alpha.end(), 0.0);
+
+	long double logz = 0.0;
+	for (size_t i = 0; i < m_seq_size; i++) {
+		double sum = 0.0;
+		for (size_t j = 0; j < size; j++) {
+			double val = 0.0;
+			if (i == 0)
+				val = start[j];
+			else {
+				for (size_t k = 0; k < size; k++)
+					val += alpha[size * (i-1) + k] * M[size * k + j];
+			}
+			alpha[size * i + j] = val * R[size * i + j];
+			sum += alpha[size * i + j];
+		}
+		if (sum <= 0.0)
+			return -numeric_limits<long double>::infinity();
+		for (size_t j = 0; j < size; j++)
+			alpha[size * i + j] /= sum;
+		logz += log((long double)sum);
+	}
+
+	double sum = 0.0;
+	for (size_t k = 0; k < size; k++)
+		sum += alpha[size * (m_seq_size-1) + k] * end[k];
+	return logz + log((long double)sum);
+}
+
+/**	Backward Recursion (scaled).
+	@param z	topic
+*/
+void DecoderSession::backward(size_t z) {
+	size_t size = m_Model.m_state_size[z];
+	const vector<double>& R = m_R[z];
+	const vector<double>& M = m_Model.m_Trans[z];
+	const vector<double>& end = m_Model.m_End[z];
+
+	m_Beta.resize(m_seq_size * size);
+	for (int i = m_seq_size-1; i >= 0; i--) {
+		double sum = 0.0;
+		for (size_t k = 0; k < size; k++) {
+			double val = 0.0;
+			if (i == (int)m_seq_size-1)
+				val = end[k];
+			else {
+				for (size_t j = 0; j < size; j++)
+					val += M[size * k + j] * R[size * (i+1) + j] * m_Beta[size * (i+1) + j];
+			}
+			m_Beta[size * i + k] = val;
+			sum += val;
+		}
+		if (sum > 0.0) {
+			for (size_t k = 0; k < size; k++)
+				m_Beta[size * i + k] /= sum;
+		}
+	}
+}
+
+/** Viterbi search (scaled).
+	Each row of delta is divided by its maximum, and the log of the scales is kept ; the best path does not change.
+	@param z		topic
+	@param y_seq	best label sequence (local labels)
+	@return log score of the best path (without the topic prior)
+*/
+long double DecoderSession::viterbiSearch(size_t z, vector<size_t>& y_seq) {
+	size_t size = m_Model.m_state_size[z];
+	const vector<double>& R = m_R[z];
+	const vector<double>& M = m_Model.m_Trans[z];
+	const vector<double>& start = m_Model.m_Start[z];
+	const vector<double>& end = m_Model.m_End[z];
+
+	long double log_scale = 0.0;	///< log of the scales of delta
+	m_Delta.resize(m_seq_size * size);
+	m_Psi.resize(m_seq_size * size);
+	for (size_t i = 0; i < m_seq_size; i++) {
+		double max_delta = 0.0;
+		for (size_t j = 0; j < size; j++) {
+			double max = -1.0;
+			size_t max_k = 0;
+			if (i == 0)
+				max = start[j];
+			else {
+				for (size_t k = 0; k < size; k++) {
+					double val = m_Delta[size * (i-1) + k] * M[size * k + j];
+					if (val > max) {
+						max = val;
+						max_k = k;
+					}
+				}
+			}
+			m_Delta[size * i + j] = max * R[size * i + j];
+			m_Psi[size * i + j] = max_k;
+			if (m_Delta[size * i + j] > max_delta)
+				max_delta = m_Delta[size * i + j];
+		}
+		/// scaling
+		if (max_delta > 0.0) {
+			for (size_t j = 0; j < size; j++)
+				m_Delta[size * i + j] /= max_delta;
+			log_scale += log((long double)max_delta);
+		}
+	}
+
+	/// last path
+	double max = -1.0;
+	size_t max_k = 0;
+	for (size_t k = 0; k < size; k++) {
+		double val = m_Delta[size * (m_seq_size-1) + k] * end[k];
+		if (val > max) {
+			max = val;
+			max_k = k;
+		}
+	}
+
+	/// Back-tracking
+	y_seq.resize(m_seq_size);
+	size_t y = max_k;
+	for (int i = m_seq_size-1; i >= 0; i--) {
+		y_seq[i] = y;
+		y = m_Psi[size * i + y];
+	}
+	return log((long double)max) + log_scale;
+}
+
+/**	Upper bound of the log-score of the best path of a topic.
+	Each position contributes its best label with the largest transition into it (m_MaxIn) ;
+	the first position takes the start factor instead, and the last one the end factor too.
+	@param z		topic
+	@param R		node factors of the topic
+	@param stride	# of sequences interleaved in R (1 for a single sequence)
+	@param b		sequence in R
+	@return log-score bound (without the topic prior)
+*/
+long double DecoderSession::boundPath(size_t z, const vector<double>& R, size_t stride, size_t b) const {
+	size_t size = m_Model.m_state_size[z];
+	const vector<double>& start = m_Model.m_Start[z];
+	const vector<double>& end = m_Model.m_End[z];
+	const vector<double>& max_in = m_Model.m_MaxIn[z];
+
+	long double bound = 0.0;
+	for (size_t i = 0; i < m_seq_size; i++) {
+		double max_node = 0.0;
+		for (size_t j = 0; j < size; j++) {
+			double val = R[(size * i + j) * stride + b] * (i == 0 ? start[j] : max_in[j]);
+			if (i == m_seq_size-1)
+				val *= end[j];
+			max_node = max(max_node, val);
+		}
+		bound += log((long double)max_node);
+	}
+	return bound;
+}
+
+/**	Local probability of each label on a path.
+	The factor of y_i given y_(i-1) (the start factor at i = 0) is normalized over the labels at i.
+	@param z		topic
+	@param R		node factors of the topic
+	@param stride	# of sequences interleaved in R (1 for a single sequence)
+	@param b		sequence in R
+	@param y_seq	label sequence (local labels)
+	@param prob		probability of each label
+*/
+void DecoderSession::localProb(size_t z, const vector<double>& R, size_t stride, size_t b,
+		const vector<size_t>& y_seq, vector<long double>& prob) const {
+	size_t size = m_Model.m_state_size[z];
+	const vector<double>& M = m_Model.m_Trans[z];
+	const vector<double>& start = m_Model.m_Start[z];
+
+	prob.clear();
+	for (size_t i = 0; i < m_seq_size; i++) {
+		const double* in = (i == 0 ? &start[0] : &M[size * y_seq[i-1]]);
+		double norm = 0.0;
+		for (size_t j = 0; j < size; j++)
+			norm += R[(size * i + j) * stride + b] * in[j];
+		double p = R[(size * i + y_seq[i]) * stride + b] * in[y_seq[i]] / norm;
+		prob.push_back(p);
+	}
+}
+
+/**	Decode a sequence.
+	Topics less probable than (the best one / prune threshold) are pruned before the Viterbi search.
+	With the bound (m_viterbi_bound), a surviving topic is searched only if the bound of its best path
+	beats the best path so far, and the search stops when no remaining topic can ; the result is the same.
+	@param lines		lines of a sequence (the first line is the topic line for TriCRF)
+	@param result		decoding result
+	@param confidence	probability of each label (Confidence)
+	@return true if succeeded
+*/
+bool DecoderSession::decode(const vector<string>& lines, DecodeResult& result, int confidence) {
+	result.topic = "";
+	result.topic_id = 0;
+	result.topic_prob = 0.0;
+	result.labels.clear();
+	result.label_ids.clear();
+	result.label_prob.clear();
+
+	parse(lines);
+	if (m_seq_size == 0)
+		return false;
+
+	/// topic posterior
+	size_t n_topic = m_Model.sizeTopic();
+	m_R.resize(n_topic);
+	m_Alpha.resize(n_topic);
+	m_LogZ.resize(n_topic);
+	long double max_logz = -numeric_limits<long double>::infinity();
+	for (size_t z = 0; z < n_topic; z++) {
+		calculateFactors(z);
+		m_LogZ[z] = forward(z) + log((long double)m_Gamma[z]);
+		if (m_LogZ[z] > max_logz)
+			max_logz = m_LogZ[z];
+	}
+	if (!(max_logz > -numeric_limits<long double>::infinity()))
+		return false;
+
+	long double zval = 0.0;
+	m_prune.clear();
+	for (size_t z = 0; z < n_topic; z++) {
+		long double prob = exp(m_LogZ[z] - max_logz);
+		zval += prob;
+		m_prune.push_back(make_pair(prob, z));
+	}
+	for (size_t z = 0; z < n_topic; z++)
+		m_prune[z].first /= zval;
+	sort(m_prune.rbegin(), m_prune.rend());
+
+	/// pruning
+	long double threshold = m_prune[0].first / m_Model.m_prune_threshold;
+	vector<pair<long double, size_t> >::iterator pit = m_prune.begin();
+	for (; pit != m_prune.end(); pit++) {
+		if (pit->first < threshold) {
+			m_prune.erase(pit, m_prune.end());
+			break;
+		}
+	}
+
+	/// Bounds of the surviving topics, and their maximum over the remaining topics
+	bool bound = m_Model.m_viterbi_bound;
+	if (bound) {
+		m_PathBound.resize(m_prune.size());
+		m_RestBound.resize(m_prune.size() + 1);
+		m_RestBound[m_prune.size()] = -numeric_limits<long double>::infinity();
+		for (size_t prune = m_prune.size(); prune > 0; prune--) {
+			size_t z = m_prune[prune-1].second;
+			m_PathBound[prune-1] = boundPath(z, m_R[z], 1, 0) + log((long double)m_Gamma[z]) + VITERBI_BOUND_SLACK;
+			m_RestBound[prune-1] = max(m_RestBound[prune], m_PathBound[prune-1]);
+		}
+	}
+	m_n_viterbi_topic += m_prune.size();
+
+	/// Viterbi search over the surviving topics
+	long double max_score = -numeric_limits<long double>::infinity();
+	size_t max_z = m_prune[0].second;
+	long double max_prob = m_prune[0].first;
+	vector<size_t> y_seq, max_y;
+	for (size_t prune = 0; prune < m_prune.size(); prune++) {
+		size_t z = m_prune[prune].second;
+		if (bound && prune > 0) {
+			if (m_RestBound[prune] <= max_score)
+				break;
+			if (m_PathBound[prune] <= max_score)
+				continue;
+		}
+		m_n_viterbi_search++;
+		long double score = viterbiSearch(z, y_seq) + log((long double)m_Gamma[z]);
+		if (score > max_score || max_y.empty()) {
+			max_score = score;
+			max_z = z;
+			max_prob = m_prune[prune].first;
+			max_y = y_seq;
+		}
+	}
+
+	result.topic = m_Model.m_TopicVec[max_z];
+	result.topic_id = max_z;
+	result.topic_prob = max_prob;
+	for (size_t i = 0; i < m_seq_size; i++) {
+		result.labels.push_back(m_Model.m_StateVec[max_z][max_y[i]]);
+		result.label_ids.push_back(m_Model.m_L2G[max_z][max_y[i]]);
+	}
+
+	if (confidence == CONFIDENCE_LOCAL)
+		localProb(max_z, m_R[max_z], 1, 0, max_y, result.label_prob);
+
+	/// marginal probability ; P(y_i, z | x)
+	if (confidence == CONFIDENCE_MARGINAL) {
+		size_t size = m_Model.m_state_size[max_z];
+		const vector<double>& alpha = m_Alpha[max_z];
+		backward(max_z);
+		for (size_t i = 0; i < m_seq_size; i++) {
+			double norm = 0.0;
+			for (size_t j = 0; j < size; j++)
+				norm += alpha[size * i + j] * m_Beta[size * i + j];
+			long double p = alpha[size * i + max_y[i]] * m_Beta[size * i + max_y[i]];
+			result.label_prob.push_back(norm > 0.0 ? p / norm * max_prob : 0.0);
+		}
+	}
+
+	return true;
+}
+
+/**	Forward Recursion over a bucket (scaled).
+	The recursion runs over all the sequences at once ; the inner loop is over the sequences.
+	@param z		topic
+	@param n_batch	# of sequences
+	@param logz		log partition function of each sequence (without the topic prior)
+*/
+void DecoderSession::forwardBatch(size_t z, size_t n_batch, vector<long double>& logz) {
+	size_t size = m_Model.m_state_size[z];
+	const vector<double>& R = m_BR[z];
+	const vector<double>& M = m_Model.m_Trans[z];
+	const vector<double>& start = m_Model.m_Start[z];
+	const vector<double>& end = m_Model.m_End[z];
+
+	vector<double>& alpha = m_BAlpha[z];
+	alpha.assign(m_seq_size * size * n_batch, 0.0);
+	logz.assign(n_batch, 0.0);
+	m_BSum.resize(n_batch);
+
+	for (size_t i = 0; i < m_seq_size; i++) {
+		fill(m_BSum.begin(), m_BSum.end(), 0.0);
+		for (size_t j = 0; j < size; j++) {
+			double* a = &alpha[(size * i + j) * n_batch];
+			if (i == 0) {
+				for (size_t b = 0; b < n_batch; b++)
+					a[b] = start[j];
+			} else {
+				for (size_t k = 0; k < size; k++) {
+					double m = M[size * k + j];
+					const double* prev = &alpha[(size * (i-1) + k) * n_batch];
+					for (size_t b = 0; b < n_batch; b++)
+						a[b] += prev[b] * m;
+				}
+			}
+			const double* r = &R[(size * i + j) * n_batch];
+			for (size_t b = 0; b < n_batch; b++) {
+				a[b] *= r[b];
+				m_BSum[b] += a[b];
+			}
+		}
+		for (size_t b = 0; b < n_batch; b++) {
+			if (m_BSum[b] <= 0.0) {
+				logz[b] = -numeric_limits<long double>::infinity();
+				m_BSum[b] = 1.0;
+			} else
+				logz[b] += log((long double)m_BSum[b]);
+		}
+		for (size_t j = 0; j < size; j++) {
+			double* a = &alpha[(size * i + j) * n_batch];
+			for (size_t b = 0; b < n_batch; b++)
+				a[b] /= m_BSum[b];
+		}
+	}
+
+	fill(m_BSum.begin(), m_BSum.end(), 0.0);
+	for (size_t k = 0; k < size; k++) {
+		const double* a = &alpha[(size * (m_seq_size-1) + k) * n_batch];
+		for (size_t b = 0; b < n_batch; b++)
+			m_BSum[b] += a[b] * end[k];
+	}
+	for (size_t b = 0; b < n_batch; b++)
+		logz[b] += log((long double)m_BSum[b]);
+}
+
+/**	Backward Recursion over the members of a bucket (scaled).
+	@param z		topic
+	@param n_batch	# of sequences in the bucket
+	@param members	sequences to be computed
+*/
+void DecoderSession::backwardBatch(size_t z, size_t n_batch, const vector<size_t>& members) {
+	size_t size = m_Model.m_state_size[z];
+	size_t n = members.size();
+	const vector<double>& R = m_BR[z];
+	const vector<double>& M = m_Model.m_Trans[z];
+	const vector<double>& end = m_Model.m_End[z];
+
+	m_BBeta.resize(m_seq_size * size * n);
+	m_BSum.resize(n);
+	for (int i = m_seq_size-1; i >= 0; i--) {
+		fill(m_BSum.begin(), m_BSum.end(), 0.0);
+		for (size_t k = 0; k < size; k++) {
+			double* beta = &m_BBeta[(size * i + k) * n];
+			if (i == (int)m_seq_size-1) {
+				for (size_t c = 0; c < n; c++)
+					beta[c] = end[k];
+			} else {
+				fill(beta, beta + n, 0.0);
+				for (size_t j = 0; j < size; j++) {
+					double m = M[size * k + j];
+					const double* r = &R[(size * (i+1) + j) * n_batch];
+					const double* next = &m_BBeta[(size * (i+1) + j) * n];
+					for (size_t c = 0; c < n; c++)
+						beta[c] += m * r[members[c]] * next[c];
+				}
+			}
+			for (size_t c = 0; c < n; c++)
+				m_BSum[c] += beta[c];
+		}
+		for (size_t k = 0; k < size; k++) {
+			double* beta = &m_BBeta[(size * i + k) * n];
+			for (size_t c = 0; c < n; c++) {
+				if (m_BSum[c] > 0.0)
+					beta[c] /= m_BSum[c];
+			}
+		}
+	}
+}
+
+/** Viterbi search over the members of a bucket (scaled).
+	Each row of delta is divided by its maximum for each member, as in viterbiSearch().
+	@param z		topic
+	@param n_batch	# of sequences in the bucket
+	@param members	sequences to be searched
+	@param score	log score of the best path of each member (without the topic prior)
+	@param y_seq	best label sequence of each member (local labels)
+*/
+void DecoderSession::viterbiBatch(size_t z, size_t n_batch, const vector<size_t>& members,
+		vector<long double>& score, vector<vector<size_t> >& y_seq) {
+	size_t size = m_Model.m_state_size[z];
+	size_t n = members.size();
+	const vector<double>& R = m_BR[z];
+	const vector<double>& M = m_Model.m_Trans[z];
+	const vector<double>& start = m_Model.m_Start[z];
+	const vector<double>& end = m_Model.m_End[z];
+
+	m_BDelta.resize(m_seq_size * size * n);
+	m_BPsi.resize(m_seq_size * size * n);
+	m_BSum.resize(n);
+	m_BLogScale.assign(n, 0.0);
+	for (size_t i = 0; i < m_seq_size; i++) {
+		fill(m_BSum.begin(), m_BSum.end(), 0.0);
+		for (size_t j = 0; j < size; j++) {
+			double* delta = &m_BDelta[(size * i + j) * n];
+			size_t* psi = &m_BPsi[(size * i + j) * n];
+			fill(psi, psi + n, 0);
+			if (i == 0)
+				fill(delta, delta + n, start[j]);
+			else {
+				fill(delta, delta + n, -1.0);
+				for (size_t k = 0; k < size; k++) {
+					double m = M[size * k + j];
+					const double* prev = &m_BDelta[(size * (i-1) + k) * n];
+					for (size_t c = 0; c < n; c++) {
+						double val = prev[c] * m;
+						if (val > delta[c]) {
+							delta[c] = val;
+							psi[c] = k;
+						}
+					}
+				}
+			}
+			const double* r = &R[(size * i + j) * n_batch];
+			for (size_t c = 0; c < n; c++) {
+				delta[c] *= r[members[c]];
+				if (delta[c] > m_BSum[c])
+					m_BSum[c] = delta[c];
+			}
+		}
+		/// scaling
+		for (size_t c = 0; c < n; c++) {
+			if (m_BSum[c] > 0.0)
+				m_BLogScale[c] += log((long double)m_BSum[c]);
+			else
+				m_BSum[c] = 1.0;
+		}
+		for (size_t j = 0; j < size; j++) {
+			double* delta = &m_BDelta[(size * i + j) * n];
+			for (size_t c = 0; c < n; c++)
+				delta[c] /= m_BSum[c];
+		}
+	}
+
+	/// last path and back-tracking
+	score.resize(n);
+	y_seq.resize(n);
+	for (size_t c = 0; c < n; c++) {
+		double max = -1.0;
+		size_t max_k = 0;
+		for (size_t k = 0; k < size; k++) {
+			double val = m_BDelta[(size * (m_seq_size-1) + k) * n + c] * end[k];
+			if (val > max) {
+				max = val;
+				max_k = k;
+			}
+		}
+		score[c] = log((long double)max) + m_BLogScale[c];
+		y_seq[c].resize(m_seq_size);
+		size_t y = max_k;
+		for (int i = m_seq_size-1; i >= 0; i--) {
+			y_seq[c][i] = y;
+			y = m_BPsi[(size * i + y) * n + c];
+		}
+	}
+}
+
+/**	Decode a bucket of sequences of the same length.
+	@param batch		sequences
+	@param bucket		indexes of the sequences in the bucket
+	@param results		decoding results (indexed as batch)
+	@param confidence	probability of each label (Confidence)
+*/
+void DecoderSession::decodeBucket(const vector<vector<string> >& batch, const vector<size_t>& bucket,
+		vector<DecodeResult>& results, int confidence) {
+	size_t n_batch = bucket.size();
+	size_t n_topic = m_Model.sizeTopic();
+	const long double NEG_INF = -numeric_limits<long double>::infinity();
+	m_R.resize(n_topic);
+	m_BR.resize(n_topic);
+	m_BAlpha.resize(n_topic);
+
+	/// Factors of the whole bucket
+	vector<double> gamma(n_topic * n_batch);
+	for (size_t b = 0; b < n_batch; b++) {
+		parse(batch[bucket[b]]);
+		for (size_t z = 0; z < n_topic; z++) {
+			calculateFactors(z);
+			size_t cells = m_seq_size * m_Model.m_state_size[z];
+			m_BR[z].resize(cells * n_batch);
+			for (size_t x = 0; x < cells; x++)
+				m_BR[z][x * n_batch + b] = m_R[z][x];
+			gamma[n_batch * z + b] = m_Gamma[z];
+		}
+	}
+
+	/// Topic posterior and pruning
+	vector<long double> logz(n_topic * n_batch), tmp;
+	for (size_t z = 0; z < n_topic; z++) {
+		forwardBatch(z, n_batch, tmp);
+		for (size_t b = 0; b < n_batch; b++)
+			logz[n_batch * z + b] = tmp[b] + log((long double)gamma[n_batch * z + b]);
+	}
+
+	vector<vector<pair<long double, size_t> > > prunes(n_batch);
+	for (size_t b = 0; b < n_batch; b++) {
+		long double max_logz = NEG_INF;
+		for (size_t z = 0; z < n_topic; z++) {
+			if (logz[n_batch * z + b] > max_logz)
+				max_logz = logz[n_batch * z + b];
+		}
+		if (!(max_logz > NEG_INF))
+			continue;
+
+		vector<pair<long double, size_t> >& prune = prunes[b];
+		long double zval = 0.0;
+		for (size_t z = 0; z < n_topic; z++) {
+			long double prob = exp(logz[n_batch * z + b] - max_logz);
+			zval += prob;
+			prune.push_back(make_pair(prob, z));
+		}
+		for (size_t z = 0; z < n_topic; z++)
+			prune[z].first /= zval;
+		sort(prune.rbegin(), prune.rend());
+
+		long double threshold = prune[0].first / m_Model.m_prune_threshold;
+		vector<pair<long double, size_t> >::iterator pit = prune.begin();
+		for (; pit != prune.end(); pit++) {
+			if (pit->first < threshold) {
+				prune.erase(pit, prune.end());
+				break;
+			}
+		}
+		m_n_viterbi_topic += prune.size();
+	}
+
+	/// Bounds of the surviving topics, and their maximum over the remaining topics
+	bool bound = m_Model.m_viterbi_bound;
+	vector<vector<long double> > path_bound(n_batch), rest_bound(n_batch);
+	for (size_t b = 0; b < n_batch && bound; b++) {
+		size_t n = prunes[b].size();
+		path_bound[b].resize(n);
+		rest_bound[b].resize(n + 1);
+		rest_bound[b][n] = NEG_INF;
+		for (size_t p = n; p > 0; p--) {
+			size_t z = prunes[b][p-1].second;
+			path_bound[b][p-1] = boundPath(z, m_BR[z], n_batch, b) + log((long double)gamma[n_batch * z + b]) + VITERBI_BOUND_SLACK;
+			rest_bound[b][p-1] = max(rest_bound[b][p], path_bound[b][p-1]);
+		}
+	}
+
+	/// Viterbi search over the surviving topics, in rounds by their rank ;
+	/// each round searches the members of a topic at once, so the bound sees the best path of the earlier ranks
+	vector<long double> max_score(n_batch, NEG_INF), max_prob(n_batch, 0.0);
+	vector<size_t> max_z(n_batch, 0);
+	vector<vector<size_t> > max_y(n_batch);
+	vector<vector<size_t> > members(n_topic);
+	vector<long double> scores;
+	vector<vector<size_t> > paths;
+	for (size_t rank = 0; ; rank++) {
+		bool more = false;
+		for (size_t z = 0; z < n_topic; z++)
+			members[z].clear();
+		for (size_t b = 0; b < n_batch; b++) {
+			if (rank >= prunes[b].size())
+				continue;
+			if (bound && rank > 0 && rest_bound[b][rank] <= max_score[b])
+				continue;
+			more = true;
+			if (bound && rank > 0 && path_bound[b][rank] <= max_score[b])
+				continue;
+			members[prunes[b][rank].second].push_back(b);
+		}
+		if (!more)
+			break;
+
+		for (size_t z = 0; z < n_topic; z++) {
+			if (members[z].empty())
+				continue;
+			viterbiBatch(z, n_batch, members[z], scores, paths);
+			m_n_viterbi_search += members[z].size();
+			for (size_t c = 0; c < members[z].size(); c++) {
+				size_t b = members[z][c];
+				long double score = scores[c] + log((long double)gamma[n_batch * z + b]);
+				if (score > max_score[b] || max_y[b].empty()) {
+					max_score[b] = score;
+					max_z[b] = z;
+					max_prob[b] = prunes[b][rank].first;
+					max_y[b].swap(paths[c]);
+				}
+			}
+		}
+	}
+
+	vector<vector<size_t> > best(n_topic);
+	for (size_t b = 0; b < n_batch; b++) {
+		DecodeResult& result = results[bucket[b]];
+		if (prunes[b].empty())
+			continue;
+		result.topic = m_Model.m_TopicVec[max_z[b]];
+		result.topic_id = max_z[b];
+		result.topic_prob = max_prob[b];
+		for (size_t i = 0; i < m_seq_size; i++) {
+			result.labels.push_back(m_Model.m_StateVec[max_z[b]][max_y[b][i]]);
+			result.label_ids.push_back(m_Model.m_L2G[max_z[b]][max_y[b][i]]);
+		}
+		if (confidence == CONFIDENCE_LOCAL)
+			localProb(max_z[b], m_BR[max_z[b]], n_batch, b, max_y[b], result.label_prob);
+		best[max_z[b]].push_back(b);
+	}
+
+	/// marginal probability ; P(y_i, z | x)
+	if (confidence != CONFIDENCE_MARGINAL)
+		return;
+	for (size_t z = 0; z < n_topic; z++) {
+		if (best[z].empty())
+			continue;
+		size_t size = m_Model.m_state_size[z];
+		size_t n = best[z].size();
+		const vector<double>& alpha = m_BAlpha[z];
+		backwardBatch(z, n_batch, best[z]);
+		for (size_t c = 0; c < n; c++) {
+			size_t b = best[z][c];
+			DecodeResult& result = results[bucket[b]];
+			vector<size_t>& y_seq = max_y[b];
+			for (size_t i = 0; i < m_seq_size; i++) {
+				double norm = 0.0;
+				for (size_t j = 0; j < size; j++)
+					norm += alpha[(size * i + j) * n_batch + b] * m_BBeta[(size * i + j) * n + c];
+				long double p = alpha[(size * i + y_seq[i]) * n_batch + b] * m_BBeta[(size * i + y_seq[i]) * n + c];
+				result.label_prob.push_back(norm > 0.0 ? p / norm * result.topic_prob : 0.0);
+			}
+		}
+	}
+}
+
+/**	Decode a batch of sequences.
+	The sequences are grouped by length, and each bucket is decoded at once in structure-of-arrays layout.
+	@param batch		sequences (the first line is the topic line for TriCRF)
+	@param results		decoding results (empty if a sequence cannot be decoded)
+	@param confidence	probability of each label (Confidence)
+	@param stats		throughput of each bucket (optional)
+	@return true if all the sequences are decoded
+*/
+bool DecoderSession::decodeBatch(const vector<vector<string> >& batch, vector<DecodeResult>& results,
+		int confidence, vector<BucketStat>* stats) {
+	results.clear();
+	results.resize(batch.size());
+	for (size_t b = 0; b < batch.size(); b++) {
+		results[b].topic_id = 0;
+		results[b].topic_prob = 0.0;
+	}
+
+	/// grouping by length
+	size_t header = (m_Model.hasTopic() ? 1 : 0);
+	map<size_t, vector<size_t> > buckets;
+	for (size_t b = 0; b < batch.size(); b++) {
+		if (batch[b].size() > header)
+			buckets[batch[b].size() - header].push_back(b);
+	}
+
+	map<size_t, vector<size_t> >::iterator it = buckets.begin();
+	for (; it != buckets.end(); ++it) {
+		timer stop_watch;
+		decodeBucket(batch, it->second, results, confidence);
+		if (stats) {
+			BucketStat stat;
+			stat.length = it->first;
+			stat.count = it->second.size();
+			stat.time = stop_watch.elapsed();
+			stats->push_back(stat);
+		}
+	}
+
+	for (size_t b = 0; b < batch.size(); b++) {
+		if (results[b].labels.empty())
+			return false;
+	}
+	return true;
+}
+
+/**	Write the decoding results in the infer output format.
+	Lines end with '\n' rather than endl, so the stream is not flushed for every label.
+*/
+static void writeResults(ostream& out, const vector<DecodeResult>& results, bool topic, int confidence) {
+	for (size_t b = 0; b < results.size(); b++) {
+		const DecodeResult& result = results[b];
+		if (topic) {
+			out << result.topic;
+			if (confidence)
+				out << " " << (double)result.topic_prob;
+			out << '\n';
+		}
+		for (size_t i = 0; i < result.labels.size(); i++) {
+			out << result.labels[i];
+			if (confidence)
+				out << " " << result.label_prob[i];
+			out << '\n';
+		}
+		out << '\n';
+	}
+}
+
+/**	Return the reference label of a data line.
+	The label is the first column, without its value ("label[:value]").
+*/
+string DecodeEvaluator::referenceLabel(const string& line) {
+	size_t begin = line.find_first_not_of(" \t");
+	if (begin == string::npos)
+		return "";
+	size_t end = line.find_first_of(" \t:", begin);
+	return line.substr(begin, (end == string::npos ? line.size() : end) - begin);
+}
+
+/**	Read the next batch of sequences.
+	@return false if there is no more sequence
+*/
+static bool readBatch(istream& f, size_t batch_size, vector<vector<string> >& batch) {
+	string line;
+	vector<string> lines;
+	batch.clear();
+	bool eof = false;
+	while (!eof && batch.size() < batch_size) {
+		eof = !getline(f, line);
+		if (!eof && !line.empty()) {
+			lines.push_back(line);
+			continue;
+		}
+		if (lines.size() > 0) {
+			batch.push_back(lines);
+			lines.clear();
+		}
+	}
+	return !batch.empty();
+}
+
+/**	Pipeline of the batch decoding.
+	A parser thread reads the batches into a bounded queue, decoder threads (each with its own
+	session on the shared model) decode them, and a writer thread writes the outputs in the
+	order of the input. At most `capacity' batches wait in the queue or for the writer.
+	With an evaluator, each decoder thread evaluates its batch with an empty copy, and the writer
+	merges the copies in the order of the input.
+	@class DecodePipeline
+*/
+class DecodePipeline {
+public:
+	const CompiledModel* model;
+	istream* in;
+	ostream* out;	///< NULL if no output
+	int confidence;
+	DecodeEvaluator* evaluator;	///< NULL if no evaluation
+	DecodeEvaluator* prototype;	///< empty copy of the evaluator, cloned for the batches
+	size_t batch_size;
+	size_t capacity;
+
+	pthread_mutex_t lock;
+	pthread_cond_t can_push;	///< the queue has a room
+	pthread_cond_t can_pop;	///< the queue has a batch (or the input ends)
+	pthread_cond_t can_store;	///< the writer has moved on
+	pthread_cond_t can_write;	///< the next output is ready (or all are written)
+
+	deque<pair<size_t, vector<vector<string> > > > jobs;	///< (index, batch)
+	map<size_t, string> done;	///< index -> output
+	map<size_t, DecodeEvaluator*> evaluated;	///< index -> evaluation of the batch
+	vector<DecodeEvaluator*> spare;	///< merged evaluators for reuse
+	size_t n_read;	///< # of batches read
+	size_t n_written;	///< # of batches written
+	bool eof;
+
+	/// statistics
+	size_t count;
+	map<size_t, pair<size_t, double> > total;	///< length -> (# of data, time)
+	size_t n_viterbi_topic;	///< topics given to the Viterbi search
+	size_t n_viterbi_search;	///< topics actually searched
+
+	DecodePipeline() {
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&can_push, NULL);
+		pthread_cond_init(&can_pop, NULL);
+		pthread_cond_init(&can_store, NULL);
+		pthread_cond_init(&can_write, NULL);
+		n_read = n_written = count = 0;
+		n_viterbi_topic = n_viterbi_search = 0;
+		eof = false;
+		evaluator = prototype = NULL;
+	}
+	~DecodePipeline() {
+		for (size_t e = 0; e < spare.size(); e++)
+			delete spare[e];
+		delete prototype;
+		pthread_mutex_destroy(&lock);
+		pthread_cond_destroy(&can_push);
+		pthread_cond_destroy(&can_pop);
+		pthread_cond_destroy(&can_store);
+		pthread_cond_destroy(&can_write);
+	}
+
+	/// parser thread
+	static void* runParser(void* arg) {
+		DecodePipeline* p = (DecodePipeline*)arg;
+		vector<vector<string> > batch;
+		while (readBatch(*p->in, p->batch_size, batch)) {
+			pthread_mutex_lock(&p->lock);
+			while (p->jobs.size() >= p->capacity)
+				pthread_cond_wait(&p->can_push, &p->lock);
+			p->jobs.push_back(make_pair(p->n_read++, vector<vector<string> >()));
+			p->jobs.back().second.swap(batch);
+			pthread_cond_signal(&p->can_pop);
+			pthread_mutex_unlock(&p->lock);
+		}
+		pthread_mutex_lock(&p->lock);
+		p->eof = true;
+		pthread_cond_broadcast(&p->can_pop);
+		pthread_cond_broadcast(&p->can_write);
+		pthread_mutex_unlock(&p->lock);
+		return NULL;
+	}
+
+	/// decoder thread
+	static void* runDecoder(void* arg) {
+		DecodePipeline* p = (DecodePipeline*)arg;
+		DecoderSession session(*p->model);
+		vector<vector<string> > batch;
+		vector<DecodeResult> results;
+		vector<BucketStat> stats;
+		ostringstream buf;
+		buf.precision(20);
+		DecodeEvaluator* batch_eval = NULL;
+		while (true) {
+			pthread_mutex_lock(&p->lock);
+			while (p->jobs.empty() && !p->eof)
+				pthread_cond_wait(&p->can_pop, &p->lock);
+			if (p->jobs.empty()) {
+				pthread_mutex_unlock(&p->lock);
+				break;
+			}
+			size_t index = p->jobs.front().first;
+			batch.swap(p->jobs.front().second);
+			p->jobs.pop_front();
+			pthread_cond_signal(&p->can_push);
+			if (p->evaluator && !p->spare.empty()) {
+				batch_eval = p->spare.back();
+				p->spare.pop_back();
+			} else if (p->evaluator)
+				batch_eval = p->prototype->clone();
+			/// the writer waits for the earliest batch, which is always being decoded
+			while (index >= p->n_written + p->capacity)
+				pthread_cond_wait(&p->can_store, &p->lock);
+			pthread_mutex_unlock(&p->lock);
+
+			stats.clear();
+			session.decodeBatch(batch, results, p->confidence, &stats);
+			buf.str("");
+			if (p->out)
+				writeResults(buf, results, p->model->hasTopic(), p->confidence);
+			for (size_t b = 0; batch_eval && b < batch.size(); b++)
+				batch_eval->append(batch[b], results[b]);
+
+			pthread_mutex_lock(&p->lock);
+			p->done[index] = buf.str();
+			if (batch_eval)
+				p->evaluated[index] = batch_eval;
+			batch_eval = NULL;
+			for (size_t s = 0; s < stats.size(); s++) {
+				p->total[stats[s].length].first += stats[s].count;
+				p->total[stats[s].length].second += stats[s].time;
+			}
+			p->count += batch.size();
+			pthread_cond_signal(&p->can_write);
+			pthread_mutex_unlock(&p->lock);
+		}
+		pthread_mutex_lock(&p->lock);
+		p->n_viterbi_topic += session.sizeViterbiTopic();
+		p->n_viterbi_search += session.sizeViterbiSearch();
+		pthread_mutex_unlock(&p->lock);
+		return NULL;
+	}
+
+	/// writer thread
+	static void* runWriter(void* arg) {
+		DecodePipeline* p = (DecodePipeline*)arg;
+		string output;
+		DecodeEvaluator* batch_eval = NULL;
+		pthread_mutex_lock(&p->lock);
+		while (true) {
+			map<size_t, string>::iterator it;
+			while ((it = p->done.find(p->n_written)) == p->done.end() && !(p->eof && p->n_written == p->n_read))
+				pthread_cond_wait(&p->can_write, &p->lock);
+			if (it == p->done.end())
+				break;
+			output.swap(it->second);
+			p->done.erase(it);
+			if (p->evaluator) {
+				batch_eval = p->evaluated[p->n_written];
+				p->evaluated.erase(p->n_written);
+			}
+			p->n_written++;
+			pthread_cond_broadcast(&p->can_store);
+			pthread_mutex_unlock(&p->lock);
+
+			if (p->out)
+				*p->out << output;
+			if (batch_eval) {
+				p->evaluator->merge(*batch_eval);
+				batch_eval->clear();
+			}
+
+			pthread_mutex_lock(&p->lock);
+			if (batch_eval)
+				p->spare.push_back(batch_eval);
+			batch_eval = NULL;
+		}
+		pthread_mutex_unlock(&p->lock);
+		return NULL;
+	}
+};
+
+/**	Decode a data file in batches.
+	The output has the same format as TriCRF3::infer() ; the topic line is omitted for CRF.
+	With n_thread > 0, reading, decoding and writing are pipelined over a parser thread,
+	n_thread decoder threads and a writer thread ; the output is the same.
+	@param model		compiled model
+	@param filename		data file
+	@param outputfile	output file
+	@param confidence	writing the probabilities (Confidence)
+	@param batch_size	# of sequences in a batch
+	@param logger		logger
+	@param n_thread		# of decoder threads (0 = decoding in this thread)
+	@param evaluator	evaluation of the results against the reference labels (optional)
+	@return true if succeeded
+*/
+bool decodeFile(const CompiledModel& model, const string& filename, const string& outputfile,
+		int confidence, size_t batch_size, Logger* logger, size_t n_thread, DecodeEvaluator* evaluator) {
+	/// File stream
+	InputStream f(filename);
+	if (!f)
+		throw runtime_error("cannot open data file");
+
+	/// output
+	ofstream out;
+	if (outputfile != "") {
+		out.open(outputfile.c_str());
+		out.precision(20);
+	}
+
+	logger->report("[Batch decoding begins ...]\n");
+	timer stop_watch;
+	if (batch_size == 0)
+		batch_size = 1;
+
+	size_t count = 0;
+	map<size_t, pair<size_t, double> > total;	///< length -> (# of data, time)
+	size_t n_viterbi_topic = 0, n_viterbi_search = 0;
+
+	if (n_thread > 0) {
+		DecodePipeline pipeline;
+		pipeline.model = &model;
+		pipeline.in = &f;
+		pipeline.out = (outputfile != "" ? &out : NULL);
+		pipeline.confidence = confidence;
+		pipeline.evaluator = evaluator;
+		pipeline.prototype = (evaluator ? evaluator->clone() : NULL);
+		pipeline.batch_size = batch_size;
+		pipeline.capacity = 4 * n_thread;
+
+		vector<pthread_t> threads(n_thread + 2);
+		pthread_create(&threads[0], NULL, DecodePipeline::runParser, &pipeline);
+		pthread_create(&threads[1], NULL, DecodePipeline::runWriter, &pipeline);
+		for (size_t t = 0; t < n_thread; t++)
+			pthread_create(&threads[t + 2], NULL, DecodePipeline::runDecoder, &pipeline);
+		for (size_t t = 0; t < threads.size(); t++)
+			pthread_join(threads[t], NULL);
+
+		count = pipeline.count;
+		total = pipeline.total;
+		n_viterbi_topic = pipeline.n_viterbi_topic;
+		n_viterbi_search = pipeline.n_viterbi_search;
+		logger->report("  # of threads = \t%d\n", n_thread);
+	} else {
+		DecoderSession session(model);
+		vector<vector<string> > batch;
+		vector<DecodeResult> results;
+		vector<BucketStat> stats;
+		while (readBatch(f, batch_size, batch)) {
+			stats.clear();
+			session.decodeBatch(batch, results, confidence, &stats);
+			for (size_t s = 0; s < stats.size(); s++) {
+				total[stats[s].length].first += stats[s].count;
+				total[stats[s].length].second += stats[s].time;
+			}
+
+			if (outputfile != "")
+				writeResults(out, results, model.hasTopic(), confidence);
+			for (size_t b = 0; evaluator && b < batch.size(); b++)
+				evaluator->append(batch[b], results[b]);
+			count += batch.size();
+		}
+		n_viterbi_topic = session.sizeViterbiTopic();
+		n_viterbi_search = session.sizeViterbiSearch();
+	}
+
+	logger->report("  # of data = \t\t%d\n", count);
+	if (model.hasTopic())
+		logger->report("  searched topics = \t%d / %d\n", n_viterbi_search, n_viterbi_topic);
+	logger->report("  decoding time = \t%.3f\n\n", stop_watch.elapsed());
+	logger->report("  length\t# of data\tseq/sec\n");
+	map<size_t, pair<size_t, double> >::iterator it = total.begin();
+	for (; it != total.end(); ++it) {
+		double time = it->second.second;
+		logger->report("  %d\t\t%d\t\t%.1f\n", it->first, it->second.first, (time > 0 ? it->second.first / time : 0.0));
+	}
+	logger->report("\n");
+
+	return true;
+}
+
+/**	Report the agreement of a quantized model with the full-precision model.
+	Both models decode the data file, and the outputs are compared with each other and with the
+	reference labels (the first column).
+	@param full		full-precision model
+	@param quant	quantized model
+	@param filename	data file
+	@param logger	logger
+	@return true if succeeded
+*/
+bool reportAgreement(const CompiledModel& full, const CompiledModel& quant, const string& filename, Logger* logger) {
+	/// File stream
+	string line;
+	InputStream f(filename);
+	if (!f)
+		throw runtime_error("cannot open data file");
+
+	logger->report("[Agreement with the full-precision model]\n");
+	timer stop_watch;
+	DecoderSession session1(full), session2(quant);
+	DecodeResult result1, result2;
+	size_t header = (full.hasTopic() ? 1 : 0);
+
+	size_t count = 0, n_label = 0;
+	size_t topic_agree = 0, label_agree = 0, seq_agree = 0;
+	size_t topic_correct1 = 0, topic_correct2 = 0, label_correct1 = 0, label_correct2 = 0;
+	long double max_diff = 0.0;
+
+	vector<string> lines;
+	bool eof = false;
+	while (!eof) {
+		eof = !getline(f, line);
+		if (!eof && !line.empty()) {
+			lines.push_back(line);
+			continue;
+		}
+		if (lines.size() <= header) {
+			lines.clear();
+			continue;
+		}
+
+		session1.decode(lines, result1);
+		session2.decode(lines, result2);
+
+		/// reference labels
+		vector<string> reference;
+		for (size_t i = 0; i < lines.size(); i++) {
+			vector<string> tokens = tokenize(lines[i], " \t");
+			vector<string> tok = tokenize(tokens.size() > 0 ? tokens[0] : "", ":");
+			reference.push_back(tok.size() > 0 ? tok[0] : "");
+		}
+
+		if (header) {
+			topic_agree += (result1.topic == result2.topic);
+			topic_correct1 += (result1.topic == reference[0]);
+			topic_correct2 += (result2.topic == reference[0]);
+			if (result1.topic == result2.topic)
+				max_diff = std::max(max_diff, fabs(result1.topic_prob - result2.topic_prob));
+		}
+		bool same = (result1.labels.size() == result2.labels.size());
+		for (size_t i = 0; i < result1.labels.size() && i < result2.labels.size(); i++) {
+			label_agree += (result1.labels[i] == result2.labels[i]);
+			label_correct1 += (result1.labels[i] == reference[i + header]);
+			label_correct2 += (result2.labels[i] == reference[i + header]);
+			same = same && (result1.labels[i] == result2.labels[i]);
+		}
+		seq_agree += (same && result1.topic == result2.topic);
+		n_label += lines.size() - header;
+		++count;
+		lines.clear();
+	}
+
+	if (count == 0 || n_label == 0)
+		return false;
+
+	logger->report("  # of data = \t\t%d\n", count);
+	logger->report("  testing time = \t%.3f\n\n", stop_watch.elapsed());
+	logger->report("  sequence agreement = \t%8.3f\n", 100.0 * seq_agree / count);
+	logger->report("  label agreement = \t%8.3f\n", 100.0 * label_agree / n_label);
+	logger->report("  label acc = \t\t%8.3f -> %8.3f\n", 100.0 * label_correct1 / n_label, 100.0 * label_correct2 / n_label);
+	if (header) {
+		logger->report("  topic agreement = \t%8.3f\n", 100.0 * topic_agree / count);
+		logger->report("  topic acc = \t\t%8.3f -> %8.3f\n", 100.0 * topic_correct1 / count, 100.0 * topic_correct2 / count);
+		logger->report("  max topic prob. diff = \t%g\n", (double)max_diff);
+	}
+	logger->report("\n");
+
+	return true;
+}
+
+} // namespace tricrf
+
@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+#ifndef __DECODER_H__
+#define __DECODER_H__
+
+/// max headers
+#include "Param.h"
+#include "Data.h"
+#include "Utility.h"
+/// standard headers
+#include <vector>
+#include <string>
+#include <map>
+#include <fstream>
+
+namespace tricrf {
+
+/** Decoding result of a sequence.
+	@class DecodeResult
+*/
+struct DecodeResult {
+	std::string topic;	///< best topic (empty for CRF)
+	size_t topic_id;	///< best topic (0 for CRF)
+	long double topic_prob;	///< posterior of the best topic
+	std::vector<std::string> labels;	///< best label sequence
+	std::vector<size_t> label_ids;	///< best label sequence (global labels of the model)
+	std::vector<long double> label_prob;	///< probability of each label (with confidence)
+};
+
+/** Probability of each decoded label.
+	The marginal is P(y_i, z | x) ; the local one is the factor of y_i given y_(i-1) on the best path,
+	normalized over the labels at i (CRF::test()).
+*/
+enum Confidence { CONFIDENCE_NONE = 0, CONFIDENCE_MARGINAL, CONFIDENCE_LOCAL };
+
+/** Evaluation stage of the batch decoding.
+	A model implements it to score the decoding results against the reference labels in the
+	data (test()). Each batch is evaluated by an empty copy (clone()), and the copies are merged
+	in the order of the input, so the scores are the same as with one evaluator.
+	@class DecodeEvaluator
+*/
+class DecodeEvaluator {
+public:
+	virtual ~DecodeEvaluator() {}
+	virtual DecodeEvaluator* clone() const = 0;	///< evaluator of the same classes with no counts
+	virtual void clear() = 0;	///< remove the counts
+	virtual void append(const std::vector<std::string>& lines, const DecodeResult& result) = 0;
+	virtual void merge(const DecodeEvaluator& other) = 0;
+
+protected:
+	static std::string referenceLabel(const std::string& line);	///< label of a data line (the first column)
+};
+
+/** Quantization of the compiled weights.
+*/
+enum QuantMode { QUANT_NONE = 0, QUANT_FP16, QUANT_INT8 };
+
+/// Index types of the compiled model ; labels (and topics) fit in 16 bits, and the CSR offsets in 32 bits
+typedef unsigned short Label16;
+typedef unsigned int Offset32;
+
+/** Quantized log-weights of a CSR index.
+	float16, or int8 with a scale for each row (feature block).
+	@class QuantizedWeight
+*/
+class QuantizedWeight {
+private:
+	int m_mode;
+	std::vector<unsigned short> m_Half;	///< float16 codes
+	std::vector<signed char> m_Code;	///< int8 codes
+	std::vector<float> m_Scale;	///< int8 scale of each row
+
+public:
+	QuantizedWeight();
+
+	void quantize(const std::vector<double>& weight, const std::vector<Offset32>& offset, int mode);
+	long double get(size_t row, size_t e) const;	///< log-weight of entry e in the row
+	size_t bytes() const;
+
+	bool save(std::ofstream& f) const;
+	bool load(std::ifstream& f);
+};
+
+/** Throughput of a length bucket in the batch decoding.
+	@class BucketStat
+*/
+struct BucketStat {
+	size_t length;	///< sequence length of the bucket
+	size_t count;	///< # of sequences
+	double time;	///< decoding time (sec)
+};
+
+/** Compiled model for decoding.
+	All tables (exp'd transition matrices, observation index and dictionaries) are built once
+	from a loaded model and are never modified after that, so one compiled model can be
+	shared by many threads. CRF is compiled as a single topic.
+	@class CompiledModel
+*/
+class CompiledModel {
+protected:
+	/// Dictionary
+	Map m_FeatureMap;	///< sequence features
+	Map m_TopicFeatureMap;	///< topic features
+	std::vector<std::string> m_TopicVec;	///< topic names
+
+	/// Observation index (CSR) ; feature id -> (global label, exp(weight))
+	std::vector<Offset32> m_ObsOffset;
+	std::vector<Label16> m_ObsLabel;
+	std::vector<double> m_ObsWeight;
+
+	/// Topic-specific observation index (CSR) ; feature id -> (local label, exp(weight))
+	std::vector<std::vector<Offset32> > m_TopicObsOffset;
+	std::vector<std::vector<Label16> > m_TopicObsLabel;
+	std::vector<std::vector<double> > m_TopicObsWeight;
+
+	/// Topic observation index (CSR) ; topic feature id -> (topic, exp(weight))
+	std::vector<Offset32> m_GammaOffset;
+	std::vector<Label16> m_GammaTopic;
+	std::vector<double> m_GammaWeight;
+
+	/// Per-topic chain
+	size_t m_global_size;	///< # of global labels
+	std::vector<size_t> m_state_size;	///< # of local labels
+	std::vector<std::vector<std::string> > m_StateVec;	///< local label names
+	std::vector<std::vector<size_t> > m_L2G;	///< local -> global label (m_global_size = none)
+	std::vector<std::vector<double> > m_Start;	///< <start> -> y
+	std::vector<std::vector<double> > m_Trans;	///< y1 -> y2
+	std::vector<std::vector<double> > m_Node;	///< static factor of each label
+	std::vector<std::vector<double> > m_End;	///< y -> <end>
+	std::vector<std::vector<double> > m_MaxIn;	///< largest transition into each label (bound of the Viterbi search)
+
+	long double m_prune_threshold;
+	bool m_viterbi_bound;	///< the Viterbi search skips the topics by the bound of their best path
+
+	/// Quantized weights (replacing the exp'd weights above)
+	int m_quant;
+	QuantizedWeight m_ObsQ;
+	std::vector<QuantizedWeight> m_TopicObsQ;
+	QuantizedWeight m_GammaQ;
+
+	FeatureTemplate m_Template;	///< expansion of the raw columns (empty = pre-expanded features)
+
+	friend class DecoderSession;
+
+public:
+	CompiledModel();
+
+	/// Construction
+	void setFeatures(Parameter& param);
+	void setTopicFeatures(Parameter& param);
+	void addTopicFeatures(size_t z, Parameter& param);
+	size_t addTopic(const std::string& name, const std::vector<std::string>& states, const std::vector<size_t>& l2g);
+	void setEdge(size_t z, const std::vector<double>& start, const std::vector<double>& trans,
+		const std::vector<double>& end, const std::vector<double>& node);
+	void setPrune(long double prune);
+	void setViterbiBound(bool bound);
+	void quantize(int mode);
+	void setTemplate(const FeatureTemplate& tmpl);
+
+	/// save and load
+	bool save(const std::string& filename) const;
+	bool load(const std::string& filename);
+
+	/// Accessors
+	bool hasTopic() const;
+	size_t sizeTopic() const;
+	int findObs(const std::string& key) const;
+	int findTopicObs(const std::string& key) const;
+	int getQuant() const;
+	size_t sizeWeight() const;	///< bytes of the observation weights and their index
+};
+
+/** Decoder session.
+	A session holds only the scratch memory of the dynamic programming, so each thread
+	creates its own session on a shared compiled model. The tables are scaled double
+	as in the model classes ; only the log scales and the topic scores are long double.
+	@class DecoderSession
+*/
+class DecoderSession {
+private:
+	const CompiledModel& m_Model;
+
+	/// Scratch
+	std::vector<std::vector<size_t> > m_Obs;	///< feature ids of each node
+	std::vector<double> m_RG;	///< shared node factor (global labels)
+	std::vector<std::vector<double> > m_R;	///< node factor of each topic
+	std::vector<std::vector<double> > m_Alpha;	///< scaled alpha of each topic
+	std::vector<double> m_Beta;
+	std::vector<double> m_Delta;	///< scaled delta (the row maximum is 1)
+	std::vector<size_t> m_Psi;
+	std::vector<double> m_Gamma;
+	std::vector<long double> m_LogZ;
+	std::vector<std::pair<long double, size_t> > m_prune;
+	std::vector<long double> m_PathBound;	///< bound of the best path of each surviving topic
+	std::vector<long double> m_RestBound;	///< maximum bound over the remaining topics
+	size_t m_seq_size;
+
+	/// Scratch for the batch decoding (structure-of-arrays ; [position][label][sequence])
+	std::vector<std::vector<double> > m_BR;	///< node factor of each topic
+	std::vector<std::vector<double> > m_BAlpha;	///< scaled alpha of each topic
+	std::vector<double> m_BDelta;
+	std::vector<size_t> m_BPsi;
+	std::vector<double> m_BBeta;
+	std::vector<double> m_BSum;
+	std::vector<long double> m_BLogScale;	///< log of the scales of the delta of each sequence
+
+	std::vector<double> m_LogR;	///< log-weight sums (quantized model)
+
+	/// Statistics
+	size_t m_n_viterbi_topic;	///< topics given to the Viterbi search
+	size_t m_n_viterbi_search;	///< topics actually searched
+
+	void parse(const std::vector<std::string>& lines);
+	void calculateFactors(size_t z);
+	long double forward(size_t z);
+	void backward(size_t z);
+	long double viterbiSearch(size_t z, std::vector<size_t>& y_seq);
+	long double boundPath(size_t z, const std::vector<double>& R, size_t stride, size_t b) const;
+	void localProb(size_t z, const std::vector<double>& R, size_t stride, size_t b,
+		const std::vector<size_t>& y_seq, std::vector<long double>& prob) const;
+
+	/// Batch recursions over sequences of the same length
+	void forwardBatch(size_t z, size_t n_batch, std::vector<long double>& logz);
+	void backwardBatch(size_t z, size_t n_batch, const std::vector<size_t>& members);
+	void viterbiBatch(size_t z, size_t n_batch, const std::vector<size_t>& members,
+		std::vector<long double>& score, std::vector<std::vector<size_t> >& y_seq);
+	void decodeBucket(const std::vector<std::vector<std::string> >& batch, const std::vector<size_t>& bucket,
+		std::vector<DecodeResult>& results, int confidence);
+
+public:
+	DecoderSession(const CompiledModel& model);
+
+	bool decode(const std::vector<std::string>& lines, DecodeResult& result, int confidence = CONFIDENCE_NONE);
+	bool decodeBatch(const std::vector<std::vector<std::string> >& batch, std::vector<DecodeResult>& results,
+		int confidence = CONFIDENCE_NONE, std::vector<BucketStat>* stats = NULL);
+
+	size_t sizeViterbiTopic() const;
+	size_t sizeViterbiSearch() const;
+};
+
+/// Agreement of a quantized model with the full-precision model on a data file
+bool reportAgreement(const CompiledModel& full, const CompiledModel& quant, const std::string& filename, Logger* logger);
+
+/// Batch decoding of a data file with a compiled model (infer output format)
+bool decodeFile(const CompiledModel& model, const std::string& filename, const std::string& outputfile,
+	int confidence, size_t batch_size, Logger* logger, size_t n_thread = 0, DecodeEvaluator* evaluator = NULL);
+
+} // namespace tricrf
+
+#endif
+
@@ -71,8 +71,8 @@ void Evaluator::initialize() {
 /** Encode the class information
 */
 void Evaluator::encode(Parameter& param, bool bio) {
-	map<string, size_t> m_StateMap = param.getState().first;
-	vector<string> m_StateVec = param.getState().second;
+	const Map& m_StateMap = param.getStateMap();
+	const Vec& m_StateVec = param.getStateVec();
 
 	if (!bio) {	/// does not use BIO encoding scheme
 		class_map = m_StateMap;
@@ -84,7 +84,7 @@ void Evaluator::encode(Parameter& param, bool bio) {
 
 		is_bio_encoding = false;
 	} else {	 /// use BIO encoding scheme
-		vector<string>::iterator it = m_StateVec.begin();
+		vector<string>::const_iterator it = m_StateVec.begin();
 		for (; it != m_StateVec.end(); ++it) {
 			vector<string> tok = tokenize(*it, "-");
 			if (tok.size() > 1 && (tok[0] == "B" || tok[0] == "I")) {
@@ -95,13 +95,13 @@ void Evaluator::encode(Parameter& param, bool bio) {
 				} else
 					bio_index.push_back(class_map[tok[1]]);
 				if (tok[0] == "B")
-					is_begin.insert(make_pair(m_StateMap[*it], 1));
+					is_begin.insert(make_pair(m_StateMap.find(*it)->second, 1));
 			} else {
 				// std::cout << "insert: " << *it << std::endl;
 				class_map.insert(make_pair(*it, class_vec.size()));
 				bio_index.push_back(class_vec.size());
 				class_vec.push_back(*it);
-				is_begin.insert(make_pair(m_StateMap[*it], 1));
+				is_begin.insert(make_pair(m_StateMap.find(*it)->second, 1));
 			}
 		} // for
 		is_bio_encoding = true;
@@ -122,24 +122,34 @@ void Evaluator::encode(Parameter& param, bool bio) {
 }
 
 /** Chunking the sequence.
-	Using BIO encoding, this function does chunking for a given sequence.
-	@return chunk phrase
+	Using BIO encoding, this function extracts the next chunk of a given sequence,
+	so the phrases are scanned incrementally without building a phrase list.
+	@param seq		label sequence
+	@param n		length of the sequence
+	@param pos		position to scan from (updated to the position after the phrase)
+	@param phrase	chunk phrase (label, (start, end))
+	@return false if there is no more phrase
 */
-vector<pair<size_t, pair<size_t, size_t> > > Evaluator::chunk(vector<size_t> seq) {
-	vector<pair<size_t, pair<size_t, size_t> > > phrase;	///< return
-
+bool Evaluator::nextChunk(const size_t* seq, size_t n, size_t& pos, pair<size_t, pair<size_t, size_t> >& phrase) {
 	size_t label, spos, epos;
 	bool isinphrase = false, isempty = true;
 
-	for (size_t i = 0; i < seq.size(); i++) {
+	for (size_t i = pos; i < n; i++) {
+		/// a phrase ends at i ; scanning restarts at i, which yields the same state
 		if (seq[i] == outside_class) {	/// outside class
-			if (!isempty)
-				phrase.push_back(make_pair(label, make_pair(spos, epos)));
+			if (!isempty) {
+				pos = i;
+				phrase = make_pair(label, make_pair(spos, epos));
+				return true;
+			}
 			isempty = true;
 			isinphrase = false;
 		} else if (is_begin.find(seq[i]) != is_begin.end()) {	/// B-X class
-			if (!isempty)
-				phrase.push_back(make_pair(label, make_pair(spos, epos)));
+			if (!isempty) {
+				pos = i;
+				phrase = make_pair(label, make_pair(spos, epos));
+				return true;
+			}
 			label = bio_index[seq[i]];
 			spos = i; epos = i;
 			isempty = false;
@@ -149,19 +159,12 @@ vector<pair<size_t, pair<size_t, size_t> > > Evaluator::chunk(vector<size_t> seq
 			if (bio_index.size() > seq[i])
 				label2 = bio_index[seq[i]];
 			if (label != label2) {	 /// but ...
-				if (!isempty)
-					phrase.push_back(make_pair(label, make_pair(spos, epos)));
-				if (bio_index.size() > seq[i])
-					label = bio_index[seq[i]];
-				else
-					label = OUT_OF_CLASS;
-				spos = i; epos = i;
-				isempty = false;
+				pos = i;
+				phrase = make_pair(label, make_pair(spos, epos));
+				return true;
 			} else
 				epos = i;
 		} else {
-			if (!isempty)
-				phrase.push_back(make_pair(label, make_pair(spos, epos)));
 			if (bio_index.size() > seq[i])
 				label = bio_index[seq[i]];
 			else
@@ -171,29 +174,30 @@ vector<pair<size_t, pair<size_t, size_t> > > Evaluator::chunk(vector<size_t> seq
 			isinphrase = true;
 		}
 	}
+	pos = n;
 	if (!isempty)
-		phrase.push_back(make_pair(label, make_pair(spos, epos)));
-
-	return phrase;
+		phrase = make_pair(label, make_pair(spos, epos));
+	return !isempty;
 }
 
-size_t Evaluator::append(Parameter& param, vector<string> ref, vector<string> hyp) {
+size_t Evaluator::append(Parameter& param, const vector<string>& ref, const vector<string>& hyp) {
 	vector<size_t> ref_d, hyp_d;
-	map<string, size_t> m_StateMap = param.getState().first;
-	vector<string> m_StateVec = param.getState().second;
+	const Map& m_StateMap = param.getStateMap();
+	const Vec& m_StateVec = param.getStateVec();
 
 	for (size_t i = 0; i < ref.size(); i++) {
-		if (m_StateMap.find(ref[i]) != m_StateMap.end()) {
+		Map::const_iterator it;
+		if ((it = m_StateMap.find(ref[i])) != m_StateMap.end()) {
 			// std::cout << "ref found:" << ref[i] << "-->"  << m_StateMap[ref[i]];
-			ref_d.push_back(m_StateMap[ref[i]]);
+			ref_d.push_back(it->second);
 		}
 		else {
 			// std::cout << "ref not found:" << ref[i] << "-->"  << m_StateVec.size();
 			ref_d.push_back(m_StateVec.size());
 		}
-		if (m_StateMap.find(hyp[i]) != m_StateMap.end()) {
+		if ((it = m_StateMap.find(hyp[i])) != m_StateMap.end()) {
 			// std::cout << "   > hyp found:" << hyp[i] << "-->"  << m_StateMap[hyp[i]] << std::endl;
-			hyp_d.push_back(m_StateMap[hyp[i]]);
+			hyp_d.push_back(it->second);
 		}
 		else {
 			// std::cout << "   > hyp not found:" << hyp[i] << "-->"  << m_StateVec.size() << std::endl;
@@ -210,11 +214,23 @@ size_t Evaluator::append(Parameter& param, vector<string> ref, vector<string> hy
 
 /** Append the reference and hypothesis.
 */
-size_t Evaluator::append(vector<size_t> ref, vector<size_t> hyp) {
+size_t Evaluator::append(const vector<size_t>& ref, const vector<size_t>& hyp) {
 	assert(ref.size() == hyp.size());
+	if (ref.empty())
+		return append(NULL, NULL, 0);
+	return append(&ref[0], &hyp[0], ref.size());
+}
 
+/** Append the reference and hypothesis.
+	No memory is allocated, so the evaluators can be fed from a reused buffer.
+	@param ref	reference label ids
+	@param hyp	hypothesis label ids
+	@param n	length of the sequence
+	@return # of sequences
+*/
+size_t Evaluator::append(const size_t* ref, const size_t* hyp, size_t n) {
 	// accuracy
-	for (size_t i = 0; i < ref.size(); i++) {
+	for (size_t i = 0; i < n; i++) {
 		// std::cout << "ref" << ref[i] << "hyp:" << hyp[i] << std::endl;
 		if (ref[i] == hyp[i])
 			n_correct ++;
@@ -225,60 +241,52 @@ size_t Evaluator::append(vector<size_t> ref, vector<size_t> hyp) {
 	/// f1-score
 	size_t g_index, t_index;
 	if (is_bio_encoding) { /// bio enconding
-		vector<pair<size_t, pair<size_t, size_t> > > ref_class, hyp_class;
-		ref_class = chunk(ref);
-		hyp_class = chunk(hyp);
-		// for (int i=0; i<ref_class.size(); i++) {
-		// 	std::cout << "ref_class: " << ref_class[i].first << "; (" << ref_class[i].second.first  << "; " << ref_class[i].second.second << ")"<<std::endl;
-		// }
-		// for (int i=0; i<hyp_class.size(); i++) {
-		// 	std::cout << "hyp_class: " << hyp_class[i].first << "; (" << hyp_class[i].second.first  << "; " << hyp_class[i].second.second << ")" <<std::endl;
-		// }
-		// std::cout << std::endl;
-		// std::cout << std::endl;
-
-		/// for reference
-		vector<pair<size_t, pair<size_t, size_t> > >::iterator rit = ref_class.begin();
-		for (; rit != ref_class.end(); ++rit ) {
-			if (rit->first != OUT_OF_CLASS) {
-				true_class[rit->first] ++;
-			} else {
-				std::cout << rit->first << " tag not found" << std::endl;
+		pair<size_t, pair<size_t, size_t> > rit, hit;
+		size_t rpos = 0, hpos = 0;
+		bool has_ref = nextChunk(ref, n, rpos, rit);
+		bool has_hyp = nextChunk(hyp, n, hpos, hit);
+		bool next_ref, next_hyp;
+		while (has_ref || has_hyp) {
+			next_ref = has_ref;
+			next_hyp = has_hyp;
+			/// correct
+			if (has_ref && has_hyp) {
+				g_index = hit.first;
+				t_index = rit.first;
+				if (rit.second.first == hit.second.first && rit.second.second == hit.second.second) {
+					if (g_index == t_index) {
+						correct_class[t_index] ++;
+						nCorrectPhrase_ ++;
+					}
+				} else if (rit.second.second < hit.second.first) {
+					next_hyp = false;
+				} else if (rit.second.first > hit.second.second) {
+					next_ref = false;
+				}
 			}
-			nTruePhrase_ ++;
-		}
-		/// for hypothesis
-		vector<pair<size_t, pair<size_t, size_t> > >::iterator hit = hyp_class.begin();
-		for (; hit != hyp_class.end(); ++hit ) {
-			if (hit->first != OUT_OF_CLASS) {
-				guess_class[hit->first] ++;
-			} else {
-				std::cout << hit->first << " tag not found" << std::endl;
+			/// for reference
+			if (next_ref) {
+				if (rit.first != OUT_OF_CLASS) {
+					true_class[rit.first] ++;
+				} else {
+					std::cout << rit.first << " tag not found" << std::endl;
+				}
+				nTruePhrase_ ++;
+				has_ref = nextChunk(ref, n, rpos, rit);
 			}
-			nGuessPhrase_ ++;
-		}
-		/// correct
-		rit = ref_class.begin();
-		hit = hyp_class.begin();
-		for (; rit != ref_class.end() && hit != hyp_class.end(); ) {
-			g_index = hit->first;
-			t_index = rit->first;
-			if (rit->second.first == hit->second.first && rit->second.second == hit->second.second) {
-				if (g_index == t_index) {
-					correct_class[t_index] ++;
-					nCorrectPhrase_ ++;
+			/// for hypothesis
+			if (next_hyp) {
+				if (hit.first != OUT_OF_CLASS) {
+					guess_class[hit.first] ++;
+				} else {
+					std::cout << hit.first << " tag not found" << std::endl;
 				}
-				++rit; ++hit;
-			} else if (rit->second.second < hit->second.first) {
-				++rit;
-			} else if (rit->second.first > hit->second.second) {
-				++hit;
-			} else {
-				++rit; ++hit;
+				nGuessPhrase_ ++;
+				has_hyp = nextChunk(hyp, n, hpos, hit);
 			}
 		}
 	} else { ///< no bio encoding
-		for (size_t i = 0; i < ref.size(); i++) {
+		for (size_t i = 0; i < n; i++) {
 			g_index = hyp[i];
 			t_index = ref[i];
 			guess_class[g_index] ++;
@@ -376,6 +384,7 @@ double Evaluator::addLikelihood(double p, double w) {
 */
 double Evaluator::subLoglikelihood(double p) {
 	loglikelihood += p;
+	return loglikelihood;
 }
 
 /** Get loglikelihood.
@@ -393,6 +402,67 @@ double Evaluator::getLoglikelihood() {
 	return -loglikelihood;
 }
 
+/** Append the counts and log-likelihood to a buffer.
+	@param buf	buffer
+*/
+void Evaluator::packCounts(vector<double>& buf) {
+	buf.push_back(loglikelihood);
+	buf.push_back(n_correct);
+	buf.push_back(n_event);
+	buf.push_back(n_sequence);
+	buf.push_back(nTruePhrase_);
+	buf.push_back(nGuessPhrase_);
+	buf.push_back(nCorrectPhrase_);
+	buf.insert(buf.end(), true_class.begin(), true_class.end());
+	buf.insert(buf.end(), guess_class.begin(), guess_class.end());
+	buf.insert(buf.end(), correct_class.begin(), correct_class.end());
+}
+
+/** Add the counts packed by another evaluator of the same classes.
+	@param buf		buffer
+	@param offset	position of the counts in the buffer
+	@return	position after the counts
+*/
+size_t Evaluator::addCounts(const vector<double>& buf, size_t offset) {
+	if (buf.size() < offset + 7 + 3 * true_class.size())
+		return buf.size();
+	loglikelihood += buf[offset++];
+	n_correct += (size_t)buf[offset++];
+	n_event += (size_t)buf[offset++];
+	n_sequence += (size_t)buf[offset++];
+	nTruePhrase_ += (size_t)buf[offset++];
+	nGuessPhrase_ += (size_t)buf[offset++];
+	nCorrectPhrase_ += (size_t)buf[offset++];
+	for (size_t i = 0; i < true_class.size(); i++)
+		true_class[i] += (size_t)buf[offset++];
+	for (size_t i = 0; i < guess_class.size(); i++)
+		guess_class[i] += (size_t)buf[offset++];
+	for (size_t i = 0; i < correct_class.size(); i++)
+		correct_class[i] += (size_t)buf[offset++];
+	return offset;
+}
+
+/** Add the counts and log-likelihood of another evaluator of the same classes.
+	All the counts are integers, so the evaluators of parallel workers give the same
+	accuracy and F1 scores as the sequential evaluation when they are merged.
+	@param other	evaluator
+*/
+void Evaluator::merge(const Evaluator& other) {
+	assert(true_class.size() == other.true_class.size());
+	loglikelihood += other.loglikelihood;
+	n_correct += other.n_correct;
+	n_event += other.n_event;
+	n_sequence += other.n_sequence;
+	nTruePhrase_ += other.nTruePhrase_;
+	nGuessPhrase_ += other.nGuessPhrase_;
+	nCorrectPhrase_ += other.nCorrectPhrase_;
+	for (size_t i = 0; i < true_class.size(); i++) {
+		true_class[i] += other.true_class[i];
+		guess_class[i] += other.guess_class[i];
+		correct_class[i] += other.correct_class[i];
+	}
+}
+
 /** Get accuracy.
 	@return accuracy
 */
@@ -59,7 +59,7 @@ private:
 	size_t nTruePhrase_, nGuessPhrase_, nCorrectPhrase_;
 
 	/// private methods
-	std::vector<std::pair<size_t, std::pair<size_t, size_t> > > chunk(std::vector<size_t> seq);
+	bool nextChunk(const size_t* seq, size_t n, size_t& pos, std::pair<size_t, std::pair<size_t, size_t> >& phrase);
 
 public:
 
@@ -70,8 +70,10 @@ public:
 
 	/// encoding and calculating
 	void encode(Parameter& param, bool bio = true);
-	size_t append(Parameter& param, std::vector<std::string> ref, std::vector<std::string> hyp);
-	size_t append(std::vector<size_t> ref, std::vector<size_t> hyp);
+	size_t append(Parameter& param, const std::vector<std::string>& ref, const std::vector<std::string>& hyp);
+	size_t append(const std::vector<size_t>& ref, const std::vector<size_t>& hyp);	///< label ids of the encoded parameter
+	size_t append(const size_t* ref, const size_t* hyp, size_t n);
+	void merge(const Evaluator& other);	///< add the counts of another evaluator of the same classes
 	void calculateF1();
 
 	/// log-likelihood
@@ -82,6 +84,10 @@ public:
 	double getLoglikelihood();
 	size_t sizeClass();
 
+	/// counts of the distributed training
+	void packCounts(std::vector<double>& buf);
+	size_t addCounts(const std::vector<double>& buf, size_t offset = 0);
+
 	/// accuracy and f1-scores
 	double getAccuracy();
 	std::vector<double> getMacroF1();
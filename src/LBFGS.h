@@ -8,6 +8,7 @@
 #ifndef __LBFGS_H_
 #define __LBFGS_H_
 
+#include "Mmap.h"
 #include <vector>
 #include <iostream>
 
@@ -21,11 +22,12 @@ namespace tricrf {
 
   class LBFGS {
   private:
+    enum { MSIZE = 5 };  // # of corrections kept in the history
     class Mcsrch;
     int iflag_, iscn, nfev, iycn, point, npt, iter, info, ispt, isyt, iypt, maxfev;
     double stp, stp1;
-    std::vector <double> diag_;
-    std::vector <double> w_;
+    HistoryVector diag_;
+    HistoryVector w_;
     Mcsrch *mcsrch_;
 
     void lbfgs_optimize(int size,
@@ -45,8 +47,13 @@ namespace tricrf {
 
     void clear();
 
+    // # of doubles of the history for the given # of parameters
+    static size_t historySize(size_t size) {
+      return size * (2 * MSIZE + 1) + 2 * MSIZE + size;
+    }
+
     int optimize(size_t size, double *x, double f, double *g, bool orthant, double C) {
-      static const int msize = 5;
+      static const int msize = MSIZE;
       if (w_.empty()) {
         iflag_ = 0;
         w_.resize(size * (2 * msize + 1) + 2 * msize);
@@ -11,6 +11,9 @@
 #include "TriCRF1.h"
 #include "TriCRF2.h"
 #include "TriCRF3.h"
+#include "Decoder.h"
+#include "Cluster.h"
+#include "Sweep.h"
 /// standard headers
 #include <cassert>
 #include <cfloat>
@@ -19,10 +22,20 @@
 #include <algorithm>
 #include <stdexcept>
 #include <iostream>
+#include <fstream>
 #include <string.h>
 
 using namespace std;
 
+/// Numeric values of a configuration key
+static vector<double> getValues(tricrf::Configurator& config, const string& key) {
+	vector<string> tokens = config.gets(key);
+	vector<double> values;
+	for (size_t i = 0; i < tokens.size(); i++)
+		values.push_back(atof(tokens[i].c_str()));
+	return values;
+}
+
 int main(int argc, char** argv) {
 	////////////////////////////////////////////////////////////////
 	///	 Model
@@ -36,9 +49,13 @@ int main(int argc, char** argv) {
 	string initialize_method, estimation_method;
 	size_t max_iter, init_iter;
 	double l1_prior, l2_prior;
-	enum {MaxEnt = 0, CRF, TriCRF1, TriCRF2, TriCRF3} model_type;
+	enum {MaxEnt = 0, CRF, TriCRF1, TriCRF2, TriCRF3} model_type = MaxEnt;
 	bool train_mode = false, testing_mode = false;
 	bool infer_mode = false;
+	bool quantize_mode = false;
+	bool compact_mode = false;
+	bool sweep_mode = false;
+	bool cv_mode = false;
 	bool confidence = false;
 
 	////////////////////////////////////////////////////////////////
@@ -118,6 +135,14 @@ int main(int argc, char** argv) {
 		testing_mode = (config.get("mode") == "test" || config.get("mode") == "both" ? true : false);
 	if (config.isValid("mode"))
 		infer_mode = (config.get("mode") == "infer");
+	if (config.isValid("mode"))
+		quantize_mode = (config.get("mode") == "quantize");
+	if (config.isValid("mode"))
+		compact_mode = (config.get("mode") == "compact");
+	if (config.isValid("mode"))
+		sweep_mode = (config.get("mode") == "sweep");
+	if (config.isValid("mode"))
+		cv_mode = (config.get("mode") == "cv");
 
 	////////////////////////////////////////////////////////////////
 	///	 Data Files
@@ -145,6 +170,59 @@ int main(int argc, char** argv) {
 	}
 	else
 		model->setPrune(1000);
+	/// topics surviving the pruning are cached between full refreshes (TriCRF1, TriCRF3)
+	if (config.isValid("prune_refresh"))
+		model->setPruneRefresh(atoi(config.get("prune_refresh").c_str()));
+	/// the CRF forward-backward is dense when this fraction of the transitions is active
+	if (config.isValid("dense_transition"))
+		model->setDenseTransition(atof(config.get("dense_transition").c_str()));
+	/// the Viterbi search (TriCRF3 and the compiled models) skips the topics whose best path cannot beat the best one so far
+	if (config.isValid("viterbi_bound"))
+		model->setViterbiBound(config.get("viterbi_bound") == "true");
+	/// bytes of the structures are reported before loading (estimate), after loading, training and testing
+	bool memory_report = (config.isValid("memory_report") && config.get("memory_report") == "true");
+	bool topic_data = (model_type == TriCRF1 || model_type == TriCRF2 || model_type == TriCRF3);
+
+	////////////////////////////////////////////////////////////////
+	///	 Dev set
+	////////////////////////////////////////////////////////////////
+	/// dev score for the model selection and the early stopping {acc, f1, macro_f1, topic}
+	size_t dev_metric = 1;
+	if (config.isValid("dev_metric")) {
+		string metric_str = config.get("dev_metric");
+		dev_metric = (metric_str == "acc" ? 0 : (metric_str == "macro_f1" ? 2 : (metric_str == "topic" ? 3 : 1)));
+		if (dev_metric == 3 && (model_type == MaxEnt || model_type == CRF)) {
+			cerr << "Topic accuracy is only for TriCRF\n";
+			return -1;
+		}
+	}
+	/// training stops after this many iterations without improvement, and the best weights are restored
+	if (config.isValid("early_stop_patience"))
+		model->setEarlyStop(atoi(config.get("early_stop_patience").c_str()), dev_metric);
+
+	////////////////////////////////////////////////////////////////
+	///	 Feature template
+	////////////////////////////////////////////////////////////////
+	/// the data files have raw columns, which are expanded to the features when read
+	tricrf::FeatureTemplate feature_template;
+	if (config.isValid("template_file")) {
+		if (!feature_template.load(config.get("template_file"))) {
+			cerr << "Template file loading error\n";
+			return -1;
+		}
+		model->setTemplate(feature_template);
+	}
+
+	////////////////////////////////////////////////////////////////
+	///	 Out-of-core storage
+	////////////////////////////////////////////////////////////////
+	/// weight, gradient, count vectors and the LBFGS history are mapped to scratch files
+	if (config.isValid("mmap_dir")) {
+		size_t min_bytes = 1 << 20;
+		if (config.isValid("mmap_min_size"))
+			min_bytes = atol(config.get("mmap_min_size").c_str());
+		tricrf::setMmap(config.get("mmap_dir"), min_bytes);
+	}
 
 	////////////////////////////////////////////////////////////////
 	///	 Training mode
@@ -156,17 +234,69 @@ int main(int argc, char** argv) {
 			return -1;
 		}
 
+		/// distributed training ; the coordinator waits for n_worker workers, and a worker
+		/// connects to the coordinator and computes the gradient of its shard
+		/// the cluster stops the workers when it goes out of scope, on the error paths as well
+		tricrf::Cluster cluster;
+		bool worker = false;
+		string cluster_key = (config.isValid("cluster_key") ? config.get("cluster_key") : "");
+		if (config.isValid("coordinator")) {
+			string addr = config.get("coordinator");
+			size_t pos = addr.rfind(':');
+			size_t rank = (config.isValid("worker_rank") ? atoi(config.get("worker_rank").c_str()) : 1);
+			if (pos == string::npos || !cluster.connect(addr.substr(0, pos), atoi(addr.substr(pos + 1).c_str()), rank, cluster_key)) {
+				cerr << "Invalid coordinator: " << addr << endl;
+				return -1;
+			}
+			log->report("Worker %d / %d (coordinator = %s)\n", cluster.rank(), cluster.size() - 1, addr.data());
+			worker = true;
+		} else if (config.isValid("n_worker") && atoi(config.get("n_worker").c_str()) > 0) {
+			size_t n_worker = atoi(config.get("n_worker").c_str());
+			int port = (config.isValid("cluster_port") ? atoi(config.get("cluster_port").c_str()) : 7700);
+			string bind_addr = (config.isValid("cluster_bind") ? config.get("cluster_bind") : "127.0.0.1");
+			log->report("Waiting for %d workers (%s:%d)\n", n_worker, bind_addr.c_str(), port);
+			if (!cluster.listen(port, n_worker, bind_addr, cluster_key)) {
+				cerr << "Worker connection error\n";
+				return -1;
+			}
+		}
+		model->setCluster(&cluster);
+
+		/// warm start from existing models
+		vector<string> init_model;
+		if (config.isValid("init_model")) {
+			init_model = config.gets("init_model");
+			assert(train_file.size() == init_model.size());
+		}
+
 		for (size_t iter = 0; iter < train_file.size(); iter++) {
+			/// the coordinator has stopped or gone away
+			if (worker && cluster.stopped())
+				break;
 			log->report("\n\nTraining File = %s\n\n", train_file[iter].data());
 			model->clear();
+			bool warm_start = (iter < init_model.size());
+			if (warm_start) {
+				/// the dictionaries are extended with the new data and the new weights start at zero
+				log->report("Initial Model = %s\n\n", init_model[iter].data());
+				if (!model->loadModel(init_model[iter])) {
+					cerr << "Model loading error\n";
+					return -1;
+				}
+			}
+			if (memory_report)
+				model->predictMemory(train_file[iter], topic_data);
 			model->readTrainData(train_file[iter]);
-			model->initializeModel();	// initialize the model
-			if (dev_file.size() != 0) {
+			if (!warm_start)
+				model->initializeModel();	// initialize the model
+			if (dev_file.size() != 0 && !worker) {
 				assert(train_file.size() == dev_file.size());
 				model->readDevData(dev_file[iter]);
 			}
-			if (initialize_method == "")
+			if (initialize_method == "" && !warm_start)
 				model->initializeModel();
+			if (memory_report)
+				model->reportMemory("after loading");
 
 			if (config.isValid("iter"))
 				max_iter = atoi(config.get("iter").c_str());
@@ -175,7 +305,7 @@ int main(int argc, char** argv) {
 
 			// initializing the parameter
 			bool init_param = false;
-			if (config.isValid("initialize")) {
+			if (config.isValid("initialize") && !warm_start && !worker) {
 				if (config.get("initialize") == "PL") {
 					if (config.isValid("initialize_iter"))
 						init_iter = atoi(config.get("initialize_iter").c_str());
@@ -184,6 +314,9 @@ int main(int argc, char** argv) {
 				}
 				init_param = true;
 			}
+			/// the PL sums (and the LBFGS sums of MaxEnt) over the training set are split into this many threads
+			if (config.isValid("n_thread"))
+				model->setThread(atoi(config.get("n_thread").c_str()));
 
 			string type_str = "LBFGS-L2";	///< default estimation method
 			if (config.isValid("estimation")) {
@@ -207,6 +340,10 @@ int main(int argc, char** argv) {
 					cerr << "training terminates with error\n\n";
 					return -1;
 				}
+				cluster.finish();
+				/// most weights are zero after L1 training
+				if (!worker)
+					model->compact();
 			} else {
 				/// LBFGS-L2
 				if (config.isValid("l2_prior"))
@@ -224,15 +361,119 @@ int main(int argc, char** argv) {
 					cerr << "training terminates with error\n\n";
 					return -1;
 				}
+				cluster.finish();
 			}
 
-			if (config.isValid("model_file")) {
+			if (memory_report)
+				model->reportMemory("after training");
+			if (config.isValid("model_file") && !worker) {
 				model->saveModel(model_file[iter]);
 			}
 
 		} // iteration
+		cluster.stop();
+		tricrf::reportMmap(log);
+
+		/// the models are saved and tested by the coordinator
+		if (worker)
+			return 0;
+	}
+	////////////////////////////////////////////////////////////////
+	///	 Sweep mode
+	////////////////////////////////////////////////////////////////
+	if (sweep_mode) {
+		log->report("\n\nSWEEP\n\n");
+		if (train_file.size() == 0 || dev_file.size() == 0 || !config.isValid("log_file")) {
+			cerr << "Invalid setting. Please see the configuration\n";
+			return -1;
+		}
+
+		/// the data sets are read once and shared by all the settings
+		model->clear();
+		if (memory_report)
+			model->predictMemory(train_file[0], topic_data);
+		model->readTrainData(train_file[0]);
+		model->initializeModel();
+		model->readDevData(dev_file[0]);
+		if (memory_report)
+			model->reportMemory("after loading");
+
+		bool L1 = (config.isValid("estimation") && config.get("estimation") == "LBFGS-L1");
+		size_t init_iter = 0;
+		if (config.isValid("initialize") && config.get("initialize") == "PL")
+			init_iter = (config.isValid("initialize_iter") ? atoi(config.get("initialize_iter").c_str()) : 30);
+
+		/// all combinations of the listed values
+		vector<double> priors = getValues(config, (L1 ? "l1_prior" : "l2_prior"));
+		vector<double> iters = getValues(config, "iter");
+		vector<double> prunes = getValues(config, "prune");
+		if (priors.empty())
+			priors.push_back(0.0);
+		if (iters.empty())
+			iters.push_back(100);
+		if (prunes.empty())
+			prunes.push_back(1000);
+
+		tricrf::Sweep sweep(model, log, config.get("log_file"), L1, init_iter, dev_metric);
+		for (size_t i = 0; i < priors.size(); i++)
+			for (size_t j = 0; j < iters.size(); j++)
+				for (size_t k = 0; k < prunes.size(); k++)
+					sweep.add(priors[i], (size_t)iters[j], prunes[k]);
+
+		size_t n_thread = (config.isValid("n_thread") ? atoi(config.get("n_thread").c_str()) : 1);
+		log->report("  # of settings = \t%d\n", priors.size() * iters.size() * prunes.size());
+		log->report("  # of threads = \t%d\n\n", n_thread);
+		if (!sweep.run(n_thread)) {
+			cerr << "No setting is trained\n";
+			return -1;
+		}
+		sweep.report();
+
+		if (model_file.size() > 0)
+			sweep.getBest()->saveModel(model_file[0]);
+	}
+
+	////////////////////////////////////////////////////////////////
+	///	 Cross-validation mode
+	////////////////////////////////////////////////////////////////
+	if (cv_mode) {
+		log->report("\n\nCROSS-VALIDATION\n\n");
+		size_t n_fold = (config.isValid("folds") ? atoi(config.get("folds").c_str()) : 10);
+		if (train_file.size() == 0 || !config.isValid("log_file") || n_fold < 2) {
+			cerr << "Invalid setting. Please see the configuration\n";
+			return -1;
+		}
+
+		/// the dictionaries are built once over the whole training set
+		model->clear();
+		if (memory_report)
+			model->predictMemory(train_file[0], topic_data);
+		model->readTrainData(train_file[0]);
+		model->initializeModel();
+		if (memory_report)
+			model->reportMemory("after loading");
 
+		bool L1 = (config.isValid("estimation") && config.get("estimation") == "LBFGS-L1");
+		double prior = 0.0;
+		if (config.isValid(L1 ? "l1_prior" : "l2_prior"))
+			prior = atof(config.get(L1 ? "l1_prior" : "l2_prior").c_str());
+		max_iter = (config.isValid("iter") ? atoi(config.get("iter").c_str()) : 100);
+		init_iter = 0;
+		if (config.isValid("initialize") && config.get("initialize") == "PL")
+			init_iter = (config.isValid("initialize_iter") ? atoi(config.get("initialize_iter").c_str()) : 30);
+
+		size_t n_thread = (config.isValid("n_thread") ? atoi(config.get("n_thread").c_str()) : 1);
+		log->report("  # of folds = \t%d\n", n_fold);
+		log->report("  # of threads = \t%d\n\n", n_thread);
+		tricrf::CrossValidation cv(model, log, config.get("log_file"), n_fold, prior, max_iter, L1, init_iter);
+		bool ok = cv.run(n_thread);
+		cv.report();
+		if (!ok) {
+			cerr << "training of a fold terminates with error\n";
+			return -1;
+		}
 	}
+
 	////////////////////////////////////////////////////////////////
 	///	 Testing mode
 	////////////////////////////////////////////////////////////////
@@ -248,6 +489,8 @@ int main(int argc, char** argv) {
 			if (config.isValid("confidence"))
 				confidence = (config.get("confidence") == "true" ? true : false);
 		}
+		size_t batch_size = (config.isValid("batch_size") ? atoi(config.get("batch_size").c_str()) : 0);
+		size_t n_thread = (config.isValid("n_thread") ? atoi(config.get("n_thread").c_str()) : 0);
 
 		for (size_t iter = 0; iter < test_file.size(); iter++) {
 			log->report("\n\nTest File = %s\n\n", test_file[iter].data());
@@ -256,10 +499,15 @@ int main(int argc, char** argv) {
 				cerr << "Model loading error\n";
 				return -1;
 			}
+			model->setDecoding(batch_size, n_thread);
+			if (memory_report)
+				model->reportMemory("after model loading");
 			if (config.isValid("output_file")) {
 				model->test(test_file[iter], output_file[iter], confidence);
 			} else
 				model->test(test_file[iter]);
+			if (memory_report)
+				model->reportMemory("after testing");
 		}
 	}
 	////////////////////////////////////////////////////////////////
@@ -281,15 +529,150 @@ int main(int argc, char** argv) {
 
 		for (size_t iter = 0; iter < test_file.size(); iter++) {
 			log->report("\n\nTest File = %s\n\n", test_file[iter].data());
+			/// batch decoding with the compiled model
+			size_t batch_size = (config.isValid("batch_size") ? atoi(config.get("batch_size").c_str()) : 0);
+			/// pipelined decoding with the compiled model
+			size_t n_thread = (config.isValid("n_thread") ? atoi(config.get("n_thread").c_str()) : 0);
+			if (n_thread > 0 && batch_size == 0)
+				batch_size = 1;
+			tricrf::CompiledModel* compiled = NULL;
+			/// the quantized model replaces the model file only when it is asked for
+			bool use_quantized = (config.isValid("use_quantized") && config.get("use_quantized") == "true");
+			if (use_quantized && !config.isValid("quantized_file")) {
+				cerr << "Invalid setting. Please see the configuration\n";
+				return -1;
+			}
+			if (use_quantized) {
+				compiled = new tricrf::CompiledModel();
+				if (!compiled->load(config.get("quantized_file"))) {
+					cerr << "Model loading error\n";
+					return -1;
+				}
+				compiled->setTemplate(feature_template);
+				if (config.isValid("viterbi_bound"))
+					compiled->setViterbiBound(config.get("viterbi_bound") == "true");
+				if (batch_size == 0)
+					batch_size = 1;
+			} else {
+				model->clear();
+				if (!model->loadModel(model_file[iter])) {
+					cerr << "Model loading error\n";
+					return -1;
+				}
+				if (memory_report)
+					model->reportMemory("after model loading");
+				compiled = (batch_size > 0 ? model->compile() : NULL);
+			}
+			if (compiled) {
+				tricrf::decodeFile(*compiled, test_file[iter], (config.isValid("output_file") ? output_file[iter] : ""),
+					confidence, batch_size, log, n_thread);
+				delete compiled;
+			} else {
+				if (config.isValid("output_file"))
+					model->infer(test_file[iter], output_file[iter], confidence);
+				else
+					model->infer(test_file[iter]);
+				if (memory_report)
+					model->reportMemory("after testing");
+			}
+		}
+	}
+
+	////////////////////////////////////////////////////////////////
+	///	 Quantize mode
+	////////////////////////////////////////////////////////////////
+	if (quantize_mode) {
+		log->report("\n\nQUANTIZE\n\n");
+		if (model_file.size() == 0 || !config.isValid("quantized_file")) {
+			cerr << "Invalid setting. Please see the configuration\n";
+			return -1;
+		}
+		int quant = tricrf::QUANT_FP16;
+		if (config.isValid("quantize"))
+			quant = (config.get("quantize") == "int8" ? tricrf::QUANT_INT8 : tricrf::QUANT_FP16);
+
+		model->clear();
+		if (!model->loadModel(model_file[0])) {
+			cerr << "Model loading error\n";
+			return -1;
+		}
+		tricrf::CompiledModel* full = model->compile();
+		tricrf::CompiledModel* compiled = model->compile();
+		if (!full || !compiled) {
+			cerr << "Quantization is not supported for this model type\n";
+			return -1;
+		}
+		compiled->quantize(quant);
+		compiled->save(config.get("quantized_file"));
+		ifstream f1(model_file[0].c_str(), ios::in | ios::binary | ios::ate);
+		size_t size1 = f1.tellg();
+		f1.close();
+		ifstream f2(config.get("quantized_file").c_str(), ios::in | ios::binary | ios::ate);
+		size_t size2 = f2.tellg();
+		f2.close();
+		log->report("  quantize = \t\t%s\n", (quant == tricrf::QUANT_INT8 ? "int8" : "fp16"));
+		log->report("  weight size = \t%d -> %d bytes (with the index)\n", full->sizeWeight(), compiled->sizeWeight());
+		log->report("  file size = \t\t%d -> %d bytes\n\n", size1, size2);
+
+		/// agreement with the full-precision model
+		if (test_file.size() > 0)
+			tricrf::reportAgreement(*full, *compiled, test_file[0], log);
+
+		delete full;
+		delete compiled;
+	}
+
+	////////////////////////////////////////////////////////////////
+	///	 Compact mode
+	////////////////////////////////////////////////////////////////
+	if (compact_mode) {
+		log->report("\n\nCOMPACT\n\n");
+		if (model_file.size() == 0) {
+			cerr << "Invalid setting. Please see the configuration\n";
+			return -1;
+		}
+		/// the compacted model overwrites the model file unless compact_file is given
+		vector<string> compact_file = model_file;
+		if (config.isValid("compact_file")) {
+			compact_file = config.gets("compact_file");
+			assert(compact_file.size() == model_file.size());
+		}
+
+		for (size_t iter = 0; iter < model_file.size(); iter++) {
+			log->report("\n\nModel File = %s\n\n", model_file[iter].data());
 			model->clear();
 			if (!model->loadModel(model_file[iter])) {
 				cerr << "Model loading error\n";
 				return -1;
 			}
-			if (config.isValid("output_file")) {
-				model->infer(test_file[iter], output_file[iter], confidence);
-			} else
-				model->infer(test_file[iter]);
+			ifstream f1(model_file[iter].c_str(), ios::in | ios::binary | ios::ate);
+			size_t size1 = f1.tellg();
+			f1.close();
+
+			/// decoding speed before and after the compaction
+			double time1 = 0.0, time2 = 0.0;
+			if (iter < test_file.size()) {
+				tricrf::timer stop_watch;
+				model->test(test_file[iter]);
+				time1 = stop_watch.elapsed();
+			}
+			model->compact();
+			if (iter < test_file.size()) {
+				tricrf::timer stop_watch;
+				model->test(test_file[iter]);
+				time2 = stop_watch.elapsed();
+			}
+
+			model->saveModel(compact_file[iter]);
+			ifstream f2(compact_file[iter].c_str(), ios::in | ios::binary | ios::ate);
+			size_t size2 = f2.tellg();
+			f2.close();
+
+			log->report("[Compaction]\n");
+			log->report("  model size = \t\t%d -> %d bytes\n", size1, size2);
+			if (iter < test_file.size())
+				log->report("  testing time = \t%.3f -> %.3f\n", time1, time2);
+			log->report("\n");
 		}
 	}
 
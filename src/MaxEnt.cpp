@@ -10,6 +10,8 @@
 #include "Evaluator.h"
 #include "Utility.h"
 #include "LBFGS.h"
+#include "Decoder.h"
+#include "Cluster.h"
 /// standard headers
 #include <cassert>
 #include <cfloat>
@@ -19,6 +21,7 @@
 #include <stdexcept>
 #include <iostream>
 #include <fstream>
+#include <pthread.h>
 
 #define MAT3(I,X,Y)    ((n_outcome * n_outcome * (I)) + (n_outcome * (X)) + Y)
 #define MAT2(I,X)    ((n_outcome * (I)) + X)
@@ -30,12 +33,32 @@ namespace tricrf {
 /// Constructor
 MaxEnt::MaxEnt() {
 	logger = new Logger();
+	m_prune_refresh = 0;
+	m_dense_transition = 0.3;
+	m_viterbi_bound = true;
+	m_decode_batch = 1;
+	m_decode_thread = 0;
+	m_Cluster = NULL;
+	m_patience = 0;
+	m_stop_metric = 1;
+	m_n_thread = 1;
+	m_dedup_bytes = 0;
 }
 
 MaxEnt::MaxEnt(Logger *logger_ptr) {
 	setLogger(logger_ptr);
 	logger->report(2, MAX_HEADER);
 	logger->report(2, ">> Maximum Entropy << \n\n");
+	m_prune_refresh = 0;
+	m_dense_transition = 0.3;
+	m_viterbi_bound = true;
+	m_decode_batch = 1;
+	m_decode_thread = 0;
+	m_Cluster = NULL;
+	m_patience = 0;
+	m_stop_metric = 1;
+	m_n_thread = 1;
+	m_dedup_bytes = 0;
 }
 
 void MaxEnt::setLogger(Logger *logger_ptr) {
@@ -46,6 +69,121 @@ void MaxEnt::setPrune(double prune) {
 	m_prune_threshold = prune;
 }
 
+void MaxEnt::setPruneRefresh(size_t refresh) {
+	m_prune_refresh = refresh;
+}
+
+void MaxEnt::setDenseTransition(double density) {
+	m_dense_transition = density;
+}
+
+void MaxEnt::setViterbiBound(bool bound) {
+	m_viterbi_bound = bound;
+}
+
+/**	Set the compiled decoding of test() (CRF, TriCRF2, TriCRF3).
+	@param batch_size	# of sequences in a batch (0 = 1)
+	@param n_thread		# of decoder threads of the pipeline (0 = decoding in the calling thread)
+*/
+void MaxEnt::setDecoding(size_t batch_size, size_t n_thread) {
+	m_decode_batch = (batch_size > 0 ? batch_size : 1);
+	m_decode_thread = n_thread;
+}
+
+/**	Turn on the early stopping.
+	@param patience	training stops after this many dev evaluations without improvement
+	@param metric	index of the dev score ; accuracy, micro-F1, macro-F1 (and topic accuracy for TriCRF)
+*/
+void MaxEnt::setEarlyStop(size_t patience, size_t metric) {
+	m_patience = patience;
+	m_stop_metric = metric;
+}
+
+/**	Set the # of threads of the PL training (and the LBFGS training of MaxEnt).
+*/
+void MaxEnt::setThread(size_t n_thread) {
+	m_n_thread = (n_thread > 0 ? n_thread : 1);
+}
+
+void MaxEnt::setCluster(Cluster* cluster) {
+	m_Cluster = cluster;
+}
+
+void MaxEnt::setTemplate(const FeatureTemplate& tmpl) {
+	m_Template = tmpl;
+}
+
+/**	Return true if this process is a worker of the distributed training.
+*/
+bool MaxEnt::isWorker() {
+	return (m_Cluster && m_Cluster->isWorker());
+}
+
+/**	Shard of the training set for this process (the whole set without the cluster).
+	@param n		# of training sequences
+	@param begin	first sequence of the shard
+	@param end		end of the shard
+*/
+void MaxEnt::getShard(size_t n, size_t& begin, size_t& end) {
+	begin = 0;
+	end = n;
+	if (m_Cluster)
+		m_Cluster->range(n, begin, end);
+}
+
+/**	Share theta at the beginning of an iteration.
+	The coordinator broadcasts theta, and a worker receives it.
+	@return false if the coordinator has stopped the training (worker), or the cluster has failed
+*/
+bool MaxEnt::syncTheta(double* theta, size_t n) {
+	if (!m_Cluster)
+		return true;
+	if (m_Cluster->failed())
+		return false;
+	if (m_Cluster->isWorker())
+		return m_Cluster->receive(theta, n);
+	if (m_Cluster->isCoordinator() && !m_Cluster->broadcast(theta, n)) {
+		cerr << "worker connection error\n";
+		return false;
+	}
+	return true;
+}
+
+/**	Sum up the partial gradients and evaluation counts of the shards.
+	The coordinator adds those of the workers to its own, and a worker sends its own.
+	On a connection error the iteration is skipped, and the next syncTheta() ends the training.
+	@return false for a worker, which skips the optimizer, or if the cluster has failed
+*/
+bool MaxEnt::syncGradient(double* gradient, size_t n, Evaluator& eval1, Evaluator* eval2) {
+	if (!m_Cluster || m_Cluster->size() <= 1)
+		return true;
+
+	vector<double> stats;
+	if (m_Cluster->isWorker()) {
+		eval1.packCounts(stats);
+		if (eval2)
+			eval2->packCounts(stats);
+		if (!m_Cluster->send(gradient, n, stats))
+			cerr << "coordinator connection error\n";
+		return false;
+	}
+
+	if (!m_Cluster->reduce(gradient, n, stats)) {
+		cerr << "worker connection error\n";
+		return false;
+	}
+	size_t offset = eval1.addCounts(stats);
+	if (eval2)
+		eval2->addCounts(stats, offset);
+	return true;
+}
+
+/**	Return true if the cluster has failed during the training ; the training fails.
+*/
+bool MaxEnt::clusterFailed() {
+	return (m_Cluster && m_Cluster->failed());
+}
+
 /// Deconstructor
 MaxEnt::~MaxEnt() {
 }
@@ -127,6 +265,22 @@ bool MaxEnt::loadModel(const std::string& filename) {
 	return ret;
 }
 
+/**	Drop the zero-weight parameters of the model.
+	Most weights are exactly zero after L1 regularization; the compacted model gives the same outputs.
+	@return	# of dropped parameters
+*/
+size_t MaxEnt::compact() {
+	timer stop_watch;
+	logger->report("[Model compaction]\n");
+
+	size_t n_param = m_Param.size();
+	size_t dropped = m_Param.compact();
+	logger->report("  # of Parameters = \t%d -> %d\n", n_param, m_Param.size());
+	logger->report("  compaction time = \t%.3f\n\n", stop_watch.elapsed());
+
+	return dropped;
+}
+
 /**	Add an event to memory.
 	@param tokens	string tokens to be packed
 	@param p_Param	parameter pointer
@@ -333,13 +487,13 @@ StringEvent MaxEnt::packStringEvent(vector<string>& tokens, Parameter* p_Param,
 void MaxEnt::readTrainData(const string& filename) {
 
 	// initializing
-	m_TrainSet.clear();
-	m_TrainSetCount.clear();
+	Data<Sequence>& train_set = m_TrainSet.reset();
+	vector<double>& train_count = m_TrainSetCount.reset();
 	map<vector<vector<string> >, size_t> train_data_map;	///<	To reduce the storage and computation
 	vector<vector<string> > token_list;
 
 	/// file stream
-	ifstream f(filename.c_str());
+	InputStream f(filename);
 	if (!f)
 		throw runtime_error("cannot open data file");
 	string line;
@@ -352,11 +506,11 @@ void MaxEnt::readTrainData(const string& filename) {
 	while (getline(f,line)) {
 		if (line.empty()) {
 			if (train_data_map.find(token_list) == train_data_map.end()) {
-				m_TrainSet.append(seq);
-				train_data_map.insert(make_pair(token_list, m_TrainSetCount.size()));
-				m_TrainSetCount.push_back(1.0);
+				train_set.append(seq);
+				train_data_map.insert(make_pair(token_list, train_count.size()));
+				train_count.push_back(1.0);
 			} else {
-				m_TrainSetCount[train_data_map[token_list]] += 1.0;
+				train_count[train_data_map[token_list]] += 1.0;
 			}
 			seq.clear();
 			token_list.clear();
@@ -371,18 +525,56 @@ void MaxEnt::readTrainData(const string& filename) {
 	}	///< while
 
 	m_Param.endUpdate();
-
+	m_dedup_bytes = max(m_dedup_bytes, bytesOf(train_data_map));
 	logger->report("  # of data = \t\t%d\n", count);
+	compressEvents();
 	logger->report("  loading time = \t%.3f\n\n", stop_watch.elapsed());
 }
 
+/**	Compress the training set into the unique events.
+	The events of MaxEnt are independent, so the identical events (the same label, value and
+	observations in any order) are merged into a single-event sequence with the summed count.
+*/
+void MaxEnt::compressEvents() {
+	Data<Sequence> train_set;
+	vector<double> train_count;
+	map<pair<pair<size_t, double>, vector<pair<size_t, double> > >, size_t> event_map;
+	double n_weighted = 0.0;
+
+	const Data<Sequence>& events = *m_TrainSet;
+	const vector<double>& event_count = *m_TrainSetCount;
+	for (size_t s = 0; s < events.size(); s++) {
+		for (Sequence::const_iterator it = events[s].begin(); it != events[s].end(); ++it) {
+			vector<pair<size_t, double> > obs = it->obs;
+			sort(obs.begin(), obs.end());
+			pair<pair<size_t, double>, vector<pair<size_t, double> > > key(make_pair(it->label, it->fval), obs);
+			map<pair<pair<size_t, double>, vector<pair<size_t, double> > >, size_t>::iterator found = event_map.find(key);
+			if (found == event_map.end()) {
+				event_map.insert(make_pair(key, train_count.size()));
+				train_set.append(Sequence(1, *it));
+				train_count.push_back(event_count[s]);
+			} else {
+				train_count[found->second] += event_count[s];
+			}
+			n_weighted += event_count[s];
+		}
+	}
+
+	m_TrainSet.reset().swap(train_set);
+	m_TrainSetCount.reset().swap(train_count);
+
+	logger->report("  # of events = \t%d\n", (size_t)n_weighted);
+	logger->report("  # of unique events = \t%d\n", m_TrainSet->size());
+	logger->report("  compression ratio = \t%.3f\n", (m_TrainSet->size() ? n_weighted / m_TrainSet->size() : 0.0));
+}
+
 /**	Read the data from file
 */
 void MaxEnt::readDevData(const string& filename) {
 
 	/// File stream
 	string line;
-	ifstream f(filename.c_str());
+	InputStream f(filename);
 	if (!f)
 		throw runtime_error("cannot open data file");
 
@@ -391,8 +583,8 @@ void MaxEnt::readDevData(const string& filename) {
 	Sequence seq;
 	logger->report("[Dev data file loading]\n");
 	timer stop_watch;
-	m_DevSet.clear();
-	m_DevSetCount.clear();
+	Data<Sequence>& dev_set = m_DevSet.reset();
+	vector<double>& dev_count = m_DevSetCount.reset();
 
 	///<	To reduce the storage and computation
 	map<vector<vector<string> >, size_t> dev_data_map;
@@ -402,11 +594,11 @@ void MaxEnt::readDevData(const string& filename) {
 	while (getline(f,line)) {
 		if (line.empty()) {
 			if (dev_data_map.find(token_list) == dev_data_map.end()) {
-				m_DevSet.append(seq);
-				dev_data_map.insert(make_pair(token_list, m_DevSetCount.size()));
-				m_DevSetCount.push_back(1.0);
+				dev_set.append(seq);
+				dev_data_map.insert(make_pair(token_list, dev_count.size()));
+				dev_count.push_back(1.0);
 			} else {
-				m_DevSetCount[dev_data_map[token_list]] += 1.0;
+				dev_count[dev_data_map[token_list]] += 1.0;
 			}
 			seq.clear();
 			token_list.clear();
@@ -420,6 +612,7 @@ void MaxEnt::readDevData(const string& filename) {
 
 	}	///< while
 
+	m_dedup_bytes = max(m_dedup_bytes, bytesOf(dev_data_map));
 	logger->report("  # of data = \t\t%d\n", count);
 	logger->report("  loading time = \t%.3f\n\n", stop_watch.elapsed());
 }
@@ -427,34 +620,161 @@ void MaxEnt::readDevData(const string& filename) {
 /** Evaluate the model.
 */
 vector<double> MaxEnt::evaluate(Event ev, size_t& max_outcome) {
+	vector<double> q;
+	score(ev, q, max_outcome);
+	return q;
+}
+
+/**	Make the dense block of the scoring kernel.
+	An observation with the weights of at least a quarter of the labels gets a row of the weights of
+	all the labels, which is added without the index ; the rare observations stay sparse.
+*/
+void MaxEnt::makeDenseBlock() {
+	size_t n_outcome = m_Param.sizeStateVec();
+	m_DenseRow.assign(m_Param.m_ParamIndex->size(), -1);
+	m_DenseFid.clear();
+	int n_row = 0;
+	for (size_t pid = 0; pid < m_Param.m_ParamIndex->size(); pid++) {
+		const vector<pair<size_t, size_t> >& param = (*m_Param.m_ParamIndex)[pid];
+		if (param.empty() || param.size() * 4 < n_outcome)
+			continue;
+		m_DenseRow[pid] = n_row++;
+		m_DenseFid.resize(n_row * n_outcome, m_Param.size());
+		size_t* row = &m_DenseFid[(n_row - 1) * n_outcome];
+		for (size_t j = 0; j < param.size(); ++j)
+			row[param[j].first] = param[j].second;
+	}
+	m_DenseWeight.resize(m_DenseFid.size());
+	refreshDenseBlock();
+}
+
+void MaxEnt::refreshDenseBlock() {
 	double* theta = m_Param.getWeight();
+	for (size_t i = 0; i < m_DenseFid.size(); i++)
+		m_DenseWeight[i] = (m_DenseFid[i] < m_Param.size() ? theta[m_DenseFid[i]] : 0.0);
+}
 
-	vector<double> q(m_Param.sizeStateVec());
+/**	Score an event.
+	The dense rows are up to date with the weights (see refreshDenseBlock()).
+	@param ev			event
+	@param q			p(y|x) ; a buffer of the caller (one per thread), reused over the events
+	@param max_outcome	best label
+*/
+void MaxEnt::score(const Event& ev, vector<double>& q, size_t& max_outcome) {
+	double* theta = m_Param.getWeight();
+	size_t n_outcome = m_Param.sizeStateVec();
+	q.resize(n_outcome);
 	fill(q.begin(), q.end(), 0.0);
-
-	/// w * f (for all classes)
-	vector<ObsParam> obs_param = m_Param.makeObsIndex(ev.obs);
-	vector<ObsParam>::iterator iter = obs_param.begin();
-	for(; iter != obs_param.end(); ++iter) {
-		q[iter->y] += theta[iter->fid] * iter->fval;
+	max_outcome = 0;
+	if (n_outcome == 0)
+		return;
+	double* s = &q[0];
+
+	/// w * f (for all classes) ; in the order of the observations
+	vector<pair<size_t, double> >::const_iterator iter = ev.obs.begin();
+	for (; iter != ev.obs.end(); ++iter) {
+		double fval = iter->second;
+		if (iter->first < m_DenseRow.size() && m_DenseRow[iter->first] >= 0) {
+			const double* w = &m_DenseWeight[m_DenseRow[iter->first] * n_outcome];
+			for (size_t y = 0; y < n_outcome; y++)
+				s[y] += w[y] * fval;
+			continue;
+		}
+		const vector<pair<size_t, size_t> >& param = (*m_Param.m_ParamIndex)[iter->first];
+		for (size_t j = 0; j < param.size(); ++j)
+			s[param[j].first] += theta[param[j].second] * fval;
 	}
 
-	/// normalize
-	double sum = 0.0;
-	double max = 0.0;
-	for (size_t j=0; j < m_Param.sizeStateVec(); j++) {
-		q[j] = exp(q[j]); // * y_prob[j];
-		sum += q[j];
-		if (q[j] > max) {
-			max = q[j];
-			max_outcome = j;
+	/// normalize (log-sum-exp)
+	double max = s[0];
+	for (size_t y = 1; y < n_outcome; y++) {
+		if (s[y] > max) {
+			max = s[y];
+			max_outcome = y;
 		}
 	}
-	for (size_t j=0; j < m_Param.sizeStateVec(); j++) {
-		q[j] /= sum;
+	double sum = 0.0;
+	for (size_t y = 0; y < n_outcome; y++) {
+		s[y] = exp(s[y] - max);
+		sum += s[y];
 	}
+	double inv = 1.0 / sum;
+	for (size_t y = 0; y < n_outcome; y++)
+		s[y] *= inv;
+}
 
-	return q;
+/**	Add the expectation of an event to the gradient.
+	The cells of the dense rows are added to the dense gradient, which is gathered from and scattered to
+	the gradient around the shard.
+*/
+void MaxEnt::addExpectation(const Event& ev, vector<double>& q, double count, double* gradient, double* dense) {
+	size_t n_outcome = q.size();
+	vector<pair<size_t, double> >::const_iterator iter = ev.obs.begin();
+	for (; iter != ev.obs.end(); ++iter) {
+		double fval = iter->second;
+		if (iter->first < m_DenseRow.size() && m_DenseRow[iter->first] >= 0) {
+			double* g = &dense[m_DenseRow[iter->first] * n_outcome];
+			for (size_t y = 0; y < n_outcome; y++)
+				g[y] += q[y] * fval * count;
+			continue;
+		}
+		const vector<pair<size_t, size_t> >& param = (*m_Param.m_ParamIndex)[iter->first];
+		for (size_t j = 0; j < param.size(); ++j)
+			gradient[param[j].second] += q[param[j].first] * fval * count;
+	}
+}
+
+/**	Accumulate the gradient and evaluation of the training events in a shard.
+*/
+void MaxEnt::estimateShard(TrainShard& shard) {
+	double* gradient = shard.gradient[0];
+	Evaluator& eval = *shard.eval[0];
+	vector<double>& q = shard.prob1;
+	vector<size_t>& reference = shard.reference1;
+	vector<size_t>& hypothesis = shard.hypothesis1;
+
+	/// the dense cells start from the gradient
+	vector<double>& dense = shard.dense;
+	dense.resize(m_DenseFid.size() + 1);
+	for (size_t i = 0; i < m_DenseFid.size(); i++)
+		dense[i] = (m_DenseFid[i] < m_Param.size() ? gradient[m_DenseFid[i]] : 0.0);
+
+	const Data<Sequence>& train_set = *m_TrainSet;
+	const vector<double>& train_count = *m_TrainSetCount;
+	for (size_t s = shard.begin; s < shard.end; s++) {
+		Sequence::const_iterator it = train_set[s].begin();
+		double count = train_count[s];
+		if (count == 0.0)	///< out of the fold (see fold())
+			continue;
+		reference.clear();
+		hypothesis.clear();
+
+		for (; it != train_set[s].end(); ++it) {	 /// for each node
+			/// evaluation
+			size_t max_outcome = 0;
+			score(*it, q, max_outcome);
+
+			reference.push_back(it->label);
+			hypothesis.push_back(max_outcome);
+
+			/// calculate the expectation
+			/// E[p] - E[~p]
+			addExpectation(*it, q, count, gradient, &dense[0]);
+
+			/// loglikelihood
+			eval.addLikelihood(q[it->label], count);
+
+		} ///< for sequence
+		/// evaluation (accuracy and f1 score)
+		for (size_t c = 0; c < count; c++) {
+			eval.append(reference, hypothesis);
+		}
+	} ///< for shard
+
+	for (size_t i = 0; i < m_DenseFid.size(); i++) {
+		if (m_DenseFid[i] < m_Param.size())
+			gradient[m_DenseFid[i]] = dense[i];
+	}
 }
 
 /** Training with LBFGS optimizer.
@@ -473,6 +793,7 @@ bool MaxEnt::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double et
 	double* gradient = m_Param.getGradient();
 
 	Evaluator eval(m_Param);	///< Evaluator
+	vector<Evaluator*> evals(1, &eval);
 	timer t;		///< timer
 
 	/// Reporting
@@ -488,49 +809,34 @@ bool MaxEnt::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double et
 	double old_obj = 1e+37;
 	int converge = 0;
 
+	makeDenseBlock();
+	vector<double> q;	///< scoring buffer
+
+	/// Distributed training ; a worker runs until the coordinator stops
+	bool worker = isWorker();
+	size_t shard_begin, shard_end;
+	getShard(m_TrainSet->size(), shard_begin, shard_end);
+
 	/// Training iteration
-    for (size_t niter = 0 ;niter < (int)max_iter; ++niter) {
+    for (size_t niter = 0 ; worker || niter < (int)max_iter; ++niter) {
+		if (!syncTheta(theta, m_Param.size()))
+			break;
+
 		/// Initializing local variables
         timer t2;	///< elapsed time for one iteration
-		m_Param.initializeGradient();	///< gradient vector initialization
+		if (worker)
+			m_Param.initializeGradient2();	///< the empirical counts are added by the coordinator
+		else
+			m_Param.initializeGradient();	///< gradient vector initialization
 		eval.initialize();	///< evaluator intialization
+		refreshDenseBlock();
 
-		/// for each training set
-        vector<Sequence>::iterator sit = m_TrainSet.begin();
-		vector<double>::iterator count_it = m_TrainSetCount.begin();
-        for (; sit != m_TrainSet.end(); ++sit, ++count_it) {
-			Sequence::iterator it = sit->begin();
-			double count = *count_it;
-			vector<size_t> reference, hypothesis;
-
-			for (; it != sit->end(); ++it) {	 /// for each node
-				/// evaluation
-				size_t max_outcome = 0;
-				vector<double> q = evaluate(*it, max_outcome);
-
-				reference.push_back(it->label);
-				hypothesis.push_back(max_outcome);
-
-				/// calculate the expectation
-				/// E[p] - E[~p]
-				vector<ObsParam> obs_param = m_Param.makeObsIndex(it->obs);
-				vector<ObsParam>::iterator iter = obs_param.begin();
-				for(; iter != obs_param.end(); ++iter) {
-					gradient[iter->fid] += q[iter->y] * iter->fval * count;
-				}
-
-				/// loglikelihood
-				for (size_t c = 0; c < count; c++) {
-					eval.addLikelihood(q[it->label]);
-				}
-
-			} ///< for sequence
-			/// evaluation (accuracy and f1 score)
-			for (size_t c = 0; c < count; c++) {
-				eval.append(reference, hypothesis);
-			}
+		/// for each training event (in shards)
+		accumulateShards(shard_begin, shard_end, evals);
 
-		} ///< for m_TrainSet
+		/// summing up the shards
+		if (!syncGradient(gradient, m_Param.size(), eval))
+			continue;
 
 		/////////////////////////////////////////////////////////////////////////////////
 		/// Evaluation for dev set
@@ -542,16 +848,18 @@ bool MaxEnt::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double et
 		timer stop_watch;
 		double time_for_dev = 0.0;
 		/// for each dev data
-        sit = m_DevSet.begin();
-		count_it = m_DevSetCount.begin();
-        for (; sit != m_DevSet.end(); ++sit, ++count_it) {
-			Sequence::iterator it = sit->begin();
+        vector<Sequence>::const_iterator sit = m_DevSet->begin();
+		vector<double>::const_iterator count_it = m_DevSetCount->begin();
+        for (; sit != m_DevSet->end(); ++sit, ++count_it) {
+			Sequence::const_iterator it = sit->begin();
 			double count = *count_it;
+			if (count == 0.0)	///< out of the fold (see fold())
+				continue;
 			vector<size_t> reference, hypothesis;
 			for (; it != sit->end(); ++it) {	 /// for each node
 				/// evaluation
 				size_t max_outcome = 0;
-				vector<double> q = evaluate(*it, max_outcome);
+				score(*it, q, max_outcome);
 
 				reference.push_back(it->label);
 				hypothesis.push_back(max_outcome);
@@ -562,6 +870,14 @@ bool MaxEnt::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double et
 		} ///< for each dev
 		time_for_dev = stop_watch.elapsed();
 
+		/// early stopping ; checked before the optimizer moves the weights
+		bool stop = false;
+		if (m_DevSet->size() > 0) {
+			dev_eval.calculateF1();
+			setDevScore(dev_eval);
+			stop = checkEarlyStop(niter);
+		}
+
 		/// applying regularization
 		size_t n_nonzero = 0;
 		if (sigma) {
@@ -598,8 +914,7 @@ bool MaxEnt::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double et
 			return true;
 
 		eval.calculateF1();
-		if (m_DevSet.size() > 0) {
-			dev_eval.calculateF1();
+		if (m_DevSet->size() > 0) {
 			logger->report("%4d %15E %8.3f %8.3f %8.3f %8.3f  |  %8.3f %8.3f %8.3f\n",
 				niter, eval.getLoglikelihood(),
 				eval.getAccuracy(), eval.getMicroF1()[2], eval.getMacroF1()[2], t2.elapsed(),
@@ -608,10 +923,12 @@ bool MaxEnt::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double et
 			logger->report("%4d %15E %8.3f %8.3f %8.3f %8.3f\n", niter, eval.getLoglikelihood(),
 				eval.getAccuracy(), eval.getMicroF1()[2], eval.getMacroF1()[2], t2.elapsed());
 		}
+		if (stop)
+			break;
 
 	} ///< for iter
 
-	return true;
+	return !clusterFailed();
 }
 
 void MaxEnt::initializeModel() {
@@ -623,23 +940,25 @@ bool MaxEnt::pretrain(size_t max_iter, double sigma, bool L1) {
 }
 
 bool MaxEnt::train(size_t max_iter, double sigma, bool L1) {
-	return estimateWithLBFGS(max_iter, sigma, L1);
+	beginEarlyStop();
+	bool ok = estimateWithLBFGS(max_iter, sigma, L1);
+	endEarlyStop();
+	return ok;
 }
 
 bool MaxEnt::test(const std::string& filename, const std::string& outputfile, bool confidence) {
 	/// File stream
 	string line;
-	ifstream f(filename.c_str());
+	InputStream f(filename);
 	if (!f)
 		throw runtime_error("cannot open data file");
 
 	/// output
 	ofstream out;
-	vector<string> state_vec;
+	const Vec& state_vec = m_Param.getStateVec();
 	if (outputfile != "") {
 		out.open(outputfile.c_str());
 		out.precision(20);
-		state_vec = m_Param.getState().second;
 	}
 
 	/// initializing
@@ -649,6 +968,8 @@ bool MaxEnt::test(const std::string& filename, const std::string& outputfile, bo
 	timer stop_watch;
 	Evaluator test_eval(m_Param);						///< Evaluator
 	test_eval.initialize();										///< Evaluator intialization
+	makeDenseBlock();
+	vector<double> q;	///< scoring buffer
 
 	/// reading the text
 	while (getline(f,line)) {
@@ -659,7 +980,7 @@ bool MaxEnt::test(const std::string& filename, const std::string& outputfile, bo
 			for (; it != seq.end(); ++it) {	 /// for each node
 				/// evaluation
 				size_t max_outcome = 0;
-				vector<double> q = evaluate(*it, max_outcome);
+				score(*it, q, max_outcome);
 
 				reference.push_back(it->label);
 				hypothesis.push_back(max_outcome);
@@ -667,11 +988,11 @@ bool MaxEnt::test(const std::string& filename, const std::string& outputfile, bo
 					out << state_vec[max_outcome];
 					if (confidence)
 						out << " " << q[max_outcome];
-					out << endl;
+					out << '\n';
 				}
 			}
 			if (outputfile != "")
-				out << endl;
+				out << '\n';
 			test_eval.append(reference, hypothesis);
 			seq.clear();
 			++count;
@@ -687,8 +1008,293 @@ bool MaxEnt::test(const std::string& filename, const std::string& outputfile, bo
 	logger->report("  Acc = \t\t%8.3f\n", test_eval.getAccuracy());
 	logger->report("  MicroF1 = \t\t%8.3f\n", test_eval.getMicroF1()[2]);
 	logger->report("  MacroF1 = \t\t%8.3f\n", test_eval.getMacroF1()[2]);
+	return true;
+}
+
+
+/**	Compile the model for the decoder sessions.
+	@return NULL ; MaxEnt is not supported
+*/
+CompiledModel* MaxEnt::compile() {
+	return NULL;
+}
+
+MaxEnt* MaxEnt::clone() {
+	return new MaxEnt(*this);
+}
+
+/**	Copy of the model for the cross-validation.
+	The dictionaries and the training set are shared by the folds. The training set is also the
+	dev set ; the counts are split instead, and the empirical counts are made again from the rest
+	of the folds.
+	@param k		held-out fold (dev set)
+	@param n_fold	# of folds
+*/
+MaxEnt* MaxEnt::fold(size_t k, size_t n_fold) {
+	MaxEnt* model = clone();
+	model->m_DevSet = m_TrainSet;
+	splitFold(*m_TrainSetCount, k, n_fold, model->m_TrainSetCount.reset(), model->m_DevSetCount.reset());
+	model->countFeatures();
+	return model;
+}
+
+void MaxEnt::countFeatures() {
+	m_Param.clearCount();
+	const Data<Sequence>& train_set = *m_TrainSet;
+	const vector<double>& train_count = *m_TrainSetCount;
+	for (size_t i = 0; i < train_set.size(); i++) {
+		const Sequence& seq = train_set[i];
+		for (size_t j = 0; j < seq.size(); j++) {
+			const Event& ev = seq[j];
+			for (size_t k = 0; k < ev.obs.size(); k++)
+				m_Param.addCount(ev.label, ev.obs[k].first, train_count[i] * ev.fval);
+		}
+	}
+}
+
+size_t MaxEnt::sizeParam() {
+	return m_Param.size();
+}
+
+/**	Record the scores of the dev set evaluation.
+	@param eval			evaluator of the labels
+	@param topic_eval	evaluator of the topics (TriCRF)
+*/
+void MaxEnt::setDevScore(Evaluator& eval, Evaluator* topic_eval) {
+	m_DevScore.clear();
+	m_DevScore.push_back(eval.getAccuracy());
+	m_DevScore.push_back(eval.getMicroF1()[2]);
+	m_DevScore.push_back(eval.getMacroF1()[2]);
+	if (topic_eval)
+		m_DevScore.push_back(topic_eval->getAccuracy());
+}
+
+vector<Parameter*> MaxEnt::getParams() {
+	vector<Parameter*> params;
+	params.push_back(&m_Param);
+	return params;
+}
+
+void MaxEnt::beginEarlyStop() {
+	m_n_worse = 0;
+	m_best_iter = -1;
+	m_BestDevScore.clear();
+	m_BestWeight.clear();
+}
+
+/**	Check the dev score of an iteration ; the weights are kept if the score is the best so far.
+	It is called after setDevScore() with the weights evaluated on the dev set.
+	@param iter	iteration
+	@return true if the training should stop
+*/
+bool MaxEnt::checkEarlyStop(size_t iter) {
+	if (m_patience == 0 || m_DevScore.size() <= m_stop_metric)
+		return false;
+	if (m_best_iter >= 0 && m_DevScore[m_stop_metric] <= m_BestDevScore[m_stop_metric])
+		return (++m_n_worse >= m_patience);
+
+	vector<Parameter*> params = getParams();
+	m_BestWeight.resize(params.size());
+	for (size_t i = 0; i < params.size(); i++) {
+		size_t n = params[i]->size();
+		m_BestWeight[i].resize(n);
+		if (n > 0)
+			copy(params[i]->getWeight(), params[i]->getWeight() + n, m_BestWeight[i].begin());
+	}
+	m_BestDevScore = m_DevScore;
+	m_best_iter = (int)iter;
+	m_n_worse = 0;
+	return false;
+}
+
+/**	Restore the weights at the best dev score.
+	@return true if the weights are restored
+*/
+bool MaxEnt::endEarlyStop() {
+	if (m_best_iter < 0)
+		return false;
+	vector<Parameter*> params = getParams();
+	for (size_t i = 0; i < params.size(); i++) {
+		if (m_BestWeight[i].size() > 0)
+			params[i]->setWeight(&m_BestWeight[i][0]);
+	}
+	m_DevScore = m_BestDevScore;
+	logger->report("[Early stopping]\n");
+	logger->report("  best iteration = \t%d\n", m_best_iter);
+	logger->report("  best dev score = \t%.3f\n\n", m_BestDevScore[m_stop_metric]);
+	m_BestWeight.clear();
+	return true;
+}
+
+void* MaxEnt::runShard(void* arg) {
+	TrainShard* shard = (TrainShard*)arg;
+	shard->model->estimateShard(*shard);
+	return NULL;
+}
+
+/**	Accumulate the gradients and evaluations of the training set in shards.
+	The gradients are initialized beforehand. With a single shard the sums are the same as
+	the sequential ones. The gradients assigned by a shard (TrainShard::assign) replace the merged
+	value, as the later sequences do in the sequential loop.
+	@param begin	first training sequence
+	@param end		end of the training sequences
+	@param evals	evaluators of the iteration
+*/
+void MaxEnt::accumulateShards(size_t begin, size_t end, const vector<Evaluator*>& evals) {
+	vector<Parameter*> params = getParams();
+	size_t n = end - begin;
+	size_t n_shard = min(m_n_thread, n);
+	if (n_shard == 0)
+		n_shard = 1;
+	m_Shard.resize(n_shard);
+	for (size_t k = 0; k < n_shard; k++) {
+		TrainShard& shard = m_Shard[k];
+		shard.model = this;
+		shard.begin = begin + n * k / n_shard;
+		shard.end = begin + n * (k + 1) / n_shard;
+		shard.gradient.resize(params.size());
+		shard.buffer.resize(params.size());
+		shard.assigned.resize(params.size());
+		for (size_t i = 0; i < params.size(); i++) {
+			if (k == 0) {
+				shard.gradient[i] = params[i]->getGradient();
+				continue;
+			}
+			shard.buffer[i].assign(params[i]->size() + 1, 0.0);
+			shard.assigned[i].assign(params[i]->size() + 1, 0);
+			shard.gradient[i] = &shard.buffer[i][0];
+		}
+		shard.eval.resize(evals.size());
+		for (size_t i = 0; i < evals.size(); i++)
+			shard.eval[i] = (k == 0 ? evals[i] : new Evaluator(*evals[i]));
+	}
+
+	/// the first shard runs on this thread
+	vector<pthread_t> threads(n_shard);
+	vector<bool> started(n_shard, false);
+	for (size_t k = 1; k < n_shard; k++)
+		started[k] = (pthread_create(&threads[k], NULL, MaxEnt::runShard, &m_Shard[k]) == 0);
+	estimateShard(m_Shard[0]);
+	for (size_t k = 1; k < n_shard; k++) {
+		if (started[k])
+			pthread_join(threads[k], NULL);
+		else
+			estimateShard(m_Shard[k]);
+	}
+
+	/// merging in the shard order
+	for (size_t k = 1; k < n_shard; k++) {
+		TrainShard& shard = m_Shard[k];
+		for (size_t i = 0; i < params.size(); i++) {
+			double* gradient = params[i]->getGradient();
+			for (size_t j = 0; j < params[i]->size(); j++) {
+				if (shard.assigned[i][j])
+					gradient[j] = shard.buffer[i][j];
+				else
+					gradient[j] += shard.buffer[i][j];
+			}
+		}
+		for (size_t i = 0; i < evals.size(); i++) {
+			evals[i]->merge(*shard.eval[i]);
+			delete shard.eval[i];
+		}
+		shard.eval.clear();
+	}
 }
 
+/**	Return the scores of the last dev set evaluation (empty if there is no dev set).
+*/
+const vector<double>& MaxEnt::getDevScore() {
+	return m_DevScore;
+}
+
+/**	Bytes held by the structures of the model.
+	The DP tables are at their peak, since they are reused over the sequences without shrinking.
+	@param usage	the items are added to it
+*/
+void MaxEnt::measureMemory(MemoryUsage& usage) {
+	vector<Parameter*> params = getParams();
+	size_t n_theta = 0;
+	for (size_t i = 0; i < params.size(); i++) {
+		params[i]->measureMemory(usage);
+		n_theta += params[i]->size();
+	}
+	usage.add("LBFGS history (training)", LBFGS::historySize(n_theta) * sizeof(double));
+	usage.add("training set", bytesOf(*m_TrainSet) + bytesOf(*m_TrainSetCount));
+	usage.add("dev set", bytesOf(*m_DevSet) + bytesOf(*m_DevSetCount));
+	usage.add("dedup maps (loading)", m_dedup_bytes);
+	usage.add("scoring tables", bytesOf(m_DenseRow) + bytesOf(m_DenseFid) + bytesOf(m_DenseWeight));
+
+	size_t buffer = bytesOf(m_BestWeight) + m_Shard.capacity() * sizeof(TrainShard);
+	for (size_t k = 0; k < m_Shard.size(); k++) {
+		TrainShard& shard = m_Shard[k];
+		buffer += bytesOf(shard.gradient) + bytesOf(shard.buffer) + bytesOf(shard.assigned) + bytesOf(shard.eval) + bytesOf(shard.prob1) + bytesOf(shard.prob2)
+			+ bytesOf(shard.reference1) + bytesOf(shard.hypothesis1) + bytesOf(shard.reference2) + bytesOf(shard.hypothesis2) + bytesOf(shard.dense);
+	}
+	usage.add("training buffers", buffer);
+}
+
+/**	Bytes of a parameter vector predicted from its size.
+	@param n_feature	# of observations in the dictionary
+	@param n_param		# of parameters
+	@param heap			average heap bytes of an observation string
+*/
+void MaxEnt::estimateParam(MemoryUsage& usage, size_t n_feature, size_t n_param, size_t heap) {
+	usage.add("dictionaries", n_feature * (MAP_NODE_BYTES + sizeof(pair<const string, size_t>) + sizeof(string) + 2 * heap));
+	usage.add("parameter index", n_feature * sizeof(vector<pair<size_t, size_t> >) + n_param * sizeof(pair<size_t, size_t>));
+	usage.add("weight, gradient, count", 3 * n_param * sizeof(double));
+	usage.add("LBFGS history (training)", LBFGS::historySize(n_param) * sizeof(double));
+}
+
+/**	Bytes of the training set (as observation ids) and its dedup map predicted from the statistics.
+	Every sequence is assumed to be unique.
+*/
+void MaxEnt::estimateData(MemoryUsage& usage, const CorpusStats& stats) {
+	usage.add("training set", stats.n_seq * (sizeof(Sequence) + sizeof(double)) + stats.n_event * sizeof(Event)
+		+ stats.n_obs * sizeof(pair<size_t, double>));
+	estimateDedup(usage, stats);
+}
+
+/**	Bytes of the dedup map of the training set ; its key is the token list of each sequence.
+*/
+void MaxEnt::estimateDedup(MemoryUsage& usage, const CorpusStats& stats) {
+	usage.add("dedup maps (loading)", stats.n_seq * (MAP_NODE_BYTES + sizeof(pair<const vector<vector<string> >, size_t>))
+		+ stats.n_event * sizeof(vector<string>) + (stats.n_event + stats.n_obs) * sizeof(string) + stats.obs_heap);
+}
+
+/**	Bytes of the structures predicted from the statistics of the training file.
+	@param stats	statistics of the training file
+	@param usage	the items are added to it
+*/
+void MaxEnt::estimateMemory(const CorpusStats& stats, MemoryUsage& usage) {
+	size_t heap = (stats.n_obs > 0 ? stats.obs_heap / stats.n_obs : 0);
+	estimateParam(usage, stats.n_feature, stats.n_param, heap);
+	estimateData(usage, stats);
+}
+
+/**	Report the bytes held by the structures of the model.
+	@param stage	when the usage is measured (e.g. "after loading")
+*/
+void MaxEnt::reportMemory(const string& stage) {
+	MemoryUsage usage;
+	measureMemory(usage);
+	usage.report(logger, "Memory usage " + stage);
+}
+
+/**	Report the bytes predicted from the statistics of a training file, before loading it.
+	@param filename	training file
+	@param topic	the first line of each sequence is a topic line (TriCRF)
+*/
+void MaxEnt::predictMemory(const string& filename, bool topic) {
+	CorpusStats stats;
+	if (!stats.scan(filename, &m_Template, topic))
+		return;	///< the loading reports the error
+	stats.report(logger);
+
+	MemoryUsage usage;
+	estimateMemory(stats, usage);
+	usage.report(logger, "Memory estimate");
+}
 
 }	///< namespace tricrf
 
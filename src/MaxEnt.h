@@ -11,6 +11,7 @@
 /// max headers
 #include "Param.h"
 #include "Data.h"
+#include "Memory.h"
 /// standard headers
 #include <vector>
 #include <string>
@@ -18,16 +19,49 @@
 
 namespace tricrf {
 
+class CompiledModel;
+class Evaluator;
+class Cluster;
+
+class MaxEnt;
+
+/** Shard of the training set in the parallel training (PL, and LBFGS of MaxEnt).
+	The first shard adds to the gradients and the evaluators of the iteration, and the others
+	to their own copies, which are merged in the shard order.
+	@class TrainShard
+*/
+struct TrainShard {
+	MaxEnt* model;
+	size_t begin;	///< first training sequence
+	size_t end;	///< end of the shard
+	std::vector<double*> gradient;	///< gradient of each parameter vector (see MaxEnt::getParams())
+	std::vector<std::vector<double> > buffer;	///< own gradients (other than the first shard)
+	std::vector<std::vector<char> > assigned;	///< gradients assigned (=) rather than added by the shard ; they replace the merged value
+	std::vector<Evaluator*> eval;
+
+	/// Scratch buffers ; reused over the sequences
+	std::vector<double> prob1, prob2;
+	std::vector<size_t> reference1, hypothesis1, reference2, hypothesis2;
+	std::vector<double> dense;	///< gradient of the dense block (MaxEnt)
+
+	/// Assign (=) a gradient instead of adding to it ; the merge keeps the value of the last shard that assigned it
+	void assign(size_t i, size_t fid, double value) {
+		gradient[i][fid] = value;
+		if (!assigned[i].empty())
+			assigned[i][fid] = 1;
+	}
+};
+
 /** Maximum Entropy Model.
 	@class MaxEnt
 */
 class MaxEnt {
 protected:
-	/// Data sets
-	Data<Sequence> m_TrainSet;	 ///< Train data
-	Data<Sequence> m_DevSet;	///< Development data (held-out data)
-	std::vector<double> m_TrainSetCount;	///< Counts for data
-	std::vector<double> m_DevSetCount;
+	/// Data sets ; shared by the copies of the model (see clone())
+	Shared<Data<Sequence> > m_TrainSet;	 ///< Train data
+	Shared<Data<Sequence> > m_DevSet;	///< Development data (held-out data)
+	Shared<std::vector<double> > m_TrainSetCount;	///< Counts for data
+	Shared<std::vector<double> > m_DevSetCount;
 
 	/// Parameter vector
 	Parameter m_Param;
@@ -38,6 +72,18 @@ protected:
 	/// Inference
 	virtual std::vector<double> evaluate(Event ev, size_t& max_outcome);
 
+	/// Scoring kernel ; the observations with the weights of many labels are scored from a dense block
+	std::vector<int> m_DenseRow;	///< row of each observation in the dense block (-1 = sparse)
+	std::vector<size_t> m_DenseFid;	///< parameter id of each cell (m_Param.size() = none)
+	std::vector<double> m_DenseWeight;	///< rows of the weights of all the labels
+	void makeDenseBlock();
+	void refreshDenseBlock();	///< copy the weights into the block
+	void score(const Event& ev, std::vector<double>& q, size_t& max_outcome);
+	void addExpectation(const Event& ev, std::vector<double>& q, double count, double* gradient, double* dense);
+
+	/// Unique weighted events ; the training set is compressed into single-event sequences
+	void compressEvents();
+
 	/// Parameter Estimation
 	virtual bool estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double eta = 1E-05);
 
@@ -45,12 +91,61 @@ protected:
 	/// for pruning
 	std::vector<std::pair<long double, size_t> > m_prune;
 	long double m_prune_threshold;
-
+	size_t m_prune_refresh;	///< full refresh interval of the topic pruning cache (0 = no cache)
+	double m_dense_transition;	///< fraction of the active transitions from which the CRF forward-backward is dense
+	bool m_viterbi_bound;	///< the Viterbi search (TriCRF3 and the compiled models) skips the topics by the bound of their best path
+	size_t m_decode_batch;	///< # of sequences in a batch of the compiled decoding in test()
+	size_t m_decode_thread;	///< # of decoder threads of the compiled decoding in test() (0 = decoding in the calling thread)
+
+	/// Distributed training
+	Cluster* m_Cluster;
+	bool isWorker();
+	void getShard(size_t n, size_t& begin, size_t& end);
+	bool syncTheta(double* theta, size_t n);
+	bool syncGradient(double* gradient, size_t n, Evaluator& eval1, Evaluator* eval2 = NULL);
+	bool clusterFailed();
+
+	/// Feature template ; raw columns of the sequences are expanded when the data is read
+	FeatureTemplate m_Template;
+
+	/// Scores of the last dev set evaluation ; accuracy, micro-F1, macro-F1 (and topic accuracy for TriCRF)
+	std::vector<double> m_DevScore;
+	void setDevScore(Evaluator& eval, Evaluator* topic_eval = NULL);
+
+	/// Empirical feature counts of the training set (the counts are also made while reading)
+	virtual void countFeatures();
+
+	/// Early stopping on the dev set
+	size_t m_patience;	///< # of dev evaluations without improvement before stopping (0 = off)
+	size_t m_stop_metric;	///< index of the dev score (see m_DevScore)
+	size_t m_n_worse;	///< dev evaluations since the best one
+	int m_best_iter;	///< iteration of the best dev score (-1 = none)
+	std::vector<double> m_BestDevScore;
+	std::vector<std::vector<double> > m_BestWeight;	///< weights at the best dev score
+	virtual std::vector<Parameter*> getParams();	///< all the parameter vectors of the model
+	void beginEarlyStop();
+	bool checkEarlyStop(size_t iter);
+	bool endEarlyStop();
+
+	/// Parallel training
+	size_t m_n_thread;	///< # of shards accumulated at the same time
+	std::vector<TrainShard> m_Shard;
+	void accumulateShards(size_t begin, size_t end, const std::vector<Evaluator*>& evals);
+	static void* runShard(void* arg);
+	virtual void estimateShard(TrainShard& shard);	///< gradient and evaluation of the sequences in the shard
+
+	/// Memory accounting
+	size_t m_dedup_bytes;	///< largest dedup map of the data loading (freed after loading)
+	virtual void measureMemory(MemoryUsage& usage);	///< bytes held by the structures
+	virtual void estimateMemory(const CorpusStats& stats, MemoryUsage& usage);	///< bytes predicted from the training file
+	void estimateParam(MemoryUsage& usage, size_t n_feature, size_t n_param, size_t heap);
+	void estimateData(MemoryUsage& usage, const CorpusStats& stats);
+	void estimateDedup(MemoryUsage& usage, const CorpusStats& stats);
 
 public:
 	MaxEnt();
 	MaxEnt(Logger *logger);
-	~MaxEnt();
+	virtual ~MaxEnt();
 
 	/// Data manipulation
 	Event packEvent(std::vector<std::string>& tokens, Parameter* p_Param = NULL, bool test = false);
@@ -62,11 +157,15 @@ public:
 	/// Model
 	virtual bool loadModel(const std::string& filename);
 	virtual bool saveModel(const std::string& filename);
-	virtual bool averageParam() {};
+	virtual bool averageParam() { return true; };
+	virtual size_t compact();	///< Drop the zero-weight parameters (L1)
 
 	/// Testing
 	virtual bool test(const std::string& filename, const std::string& outputfile = "", bool confidence = false);
 	virtual bool infer(const std::string& filename, const std::string& outputfile = "", bool confidence = false);
+	virtual CompiledModel* compile();	///< Immutable model for the decoder sessions (NULL if not supported)
+	virtual MaxEnt* clone();	///< Copy of the model ; the data sets, dictionaries and counts are shared, the weights are its own (the logger is shared)
+	virtual MaxEnt* fold(size_t k, size_t n_fold);	///< Copy of the model with the k-th fold of the training set as the dev set (by the counts)
 
 	/// Training
 	virtual void clear();
@@ -77,8 +176,22 @@ public:
 	/// Logger
 	void setLogger(Logger *logger);
 	void setPrune(double prune);
+	void setPruneRefresh(size_t refresh);
+	void setDenseTransition(double density);
+	void setViterbiBound(bool bound);
+	void setDecoding(size_t batch_size, size_t n_thread);
+	void setCluster(Cluster* cluster);
+	void setTemplate(const FeatureTemplate& tmpl);
+	void setEarlyStop(size_t patience, size_t metric = 1);
+	void setThread(size_t n_thread);
 
 	Parameter& getParam() { return m_Param; };
+	virtual size_t sizeParam();	///< # of parameters
+	const std::vector<double>& getDevScore();
+
+	/// Memory accounting
+	void reportMemory(const std::string& stage);
+	void predictMemory(const std::string& filename, bool topic = false);
 };
 
 } // namespace tricrf
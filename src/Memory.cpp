@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/// max headers
+#include "Memory.h"
+/// standard headers
+#include <set>
+#include <cmath>
+
+using namespace std;
+
+namespace tricrf {
+
+/// # of bits of the linear counting (1 MB each) ; the estimate is good up to a few times this many items
+#define SKETCH_BITS	(1 << 23)
+
+size_t bytesOf(const string& s) {
+	return (s.capacity() > SHORT_STRING ? s.capacity() + 1 : 0);
+}
+
+size_t bytesOf(const Event& ev) {
+	return bytesOf(ev.obs);
+}
+
+size_t bytesOf(const StringEvent& ev) {
+	return bytesOf(ev.obs);
+}
+
+size_t bytesOf(const TriSequence& seq) {
+	return bytesOf(seq.topic) + bytesOf(seq.seq);
+}
+
+size_t bytesOf(const TriStringSequence& seq) {
+	return bytesOf(seq.topic) + bytesOf(seq.seq);
+}
+
+void MemoryUsage::add(const string& name, size_t bytes) {
+	for (size_t i = 0; i < m_Item.size(); i++) {
+		if (m_Item[i].first == name) {
+			m_Item[i].second += bytes;
+			return;
+		}
+	}
+	m_Item.push_back(make_pair(name, bytes));
+}
+
+size_t MemoryUsage::total() const {
+	size_t bytes = 0;
+	for (size_t i = 0; i < m_Item.size(); i++)
+		bytes += m_Item[i].second;
+	return bytes;
+}
+
+/**	Report the items and their total.
+	@param logger	logger
+	@param title	title of the section
+*/
+void MemoryUsage::report(Logger* logger, const string& title) const {
+	logger->report("[%s]\n", title.c_str());
+	for (size_t i = 0; i < m_Item.size(); i++)
+		logger->report("  %s = \t%lu (%.1f MB)\n", m_Item[i].first.c_str(), (unsigned long)m_Item[i].second, m_Item[i].second / 1048576.0);
+	logger->report("  total = \t%lu (%.1f MB)\n\n", (unsigned long)total(), total() / 1048576.0);
+}
+
+/// FNV-1a hash
+static size_t hashString(const string& s, size_t h = 14695981039346656037ULL) {
+	for (size_t i = 0; i < s.size(); i++) {
+		h ^= (unsigned char)s[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/** Distinct count by linear counting.
+	@class Sketch
+*/
+class Sketch {
+private:
+	vector<unsigned int> m_Bits;
+	size_t m_n_add;
+
+public:
+	Sketch() : m_Bits(SKETCH_BITS / 32, 0), m_n_add(0) {}
+	void add(size_t h) {
+		h = (h ^ (h >> 29)) % SKETCH_BITS;
+		m_Bits[h / 32] |= (1U << (h % 32));
+		m_n_add++;
+	}
+	size_t count() const {
+		size_t zeros = 0;
+		for (size_t i = 0; i < m_Bits.size(); i++) {
+			unsigned int w = ~m_Bits[i];
+			for (; w; w &= w - 1)
+				zeros++;
+		}
+		if (zeros == 0)	///< saturated
+			return m_n_add;
+		double n = SKETCH_BITS * log((double)SKETCH_BITS / zeros);
+		return (size_t)(n < m_n_add ? n + 0.5 : m_n_add);
+	}
+};
+
+CorpusStats::CorpusStats() {
+	n_seq = n_event = n_obs = obs_heap = max_len = 0;
+	n_label = n_topic = n_topic_obs = 0;
+	n_feature = n_param = n_topic_param = 0;
+}
+
+/**	Read a data file and count its statistics.
+	@param filename	data file
+	@param tmpl		feature template (NULL or empty = none)
+	@param topic	the first line of each sequence is a topic line (TriCRF)
+	@return false if the file cannot be read
+*/
+bool CorpusStats::scan(const string& filename, const FeatureTemplate* tmpl, bool topic) {
+	InputStream f(filename);
+	if (!f)
+		return false;
+
+	set<string> labels, topics;
+	Sketch features, params, topic_params;
+	size_t len = 0;
+	bool topic_line = topic;
+	DataReader reader(f, tmpl, topic);
+	vector<string> tokens;
+	while (reader.next(tokens)) {
+		if (tokens.empty()) {	///< sequence break
+			if (len > 0 || !topic_line)
+				n_seq++;
+			max_len = max(max_len, len);
+			len = 0;
+			topic_line = topic;
+			continue;
+		}
+
+		string label = tokens[0].substr(0, tokens[0].find(':'));
+		size_t h_label = hashString(label);
+		if (topic_line) {
+			topics.insert(label);
+			for (size_t i = 1; i < tokens.size(); i++) {
+				size_t h = hashString(tokens[i].substr(0, tokens[i].find(':')));
+				topic_params.add(h ^ (h_label * 31));
+				n_topic_obs++;
+			}
+			topic_line = false;
+			continue;
+		}
+
+		labels.insert(label);
+		for (size_t i = 1; i < tokens.size(); i++) {
+			string obs = tokens[i].substr(0, tokens[i].find(':'));
+			size_t h = hashString(obs);
+			features.add(h);
+			params.add(h ^ (h_label * 31));
+			if (obs.size() > SHORT_STRING)
+				obs_heap += obs.size() + 1;
+		}
+		n_obs += tokens.size() - 1;
+		n_event++;
+		len++;
+	}
+	if (len > 0) {	///< no break at the end
+		n_seq++;
+		max_len = max(max_len, len);
+	}
+
+	n_label = labels.size();
+	n_topic = topics.size();
+	n_feature = features.count();
+	n_param = params.count();
+	n_topic_param = topic_params.count();
+	return true;
+}
+
+void CorpusStats::report(Logger* logger) const {
+	logger->report("[Corpus statistics]\n");
+	logger->report("  # of sequences = \t%lu\n", (unsigned long)n_seq);
+	logger->report("  # of events = \t%lu (longest %lu)\n", (unsigned long)n_event, (unsigned long)max_len);
+	logger->report("  # of observations = \t%lu\n", (unsigned long)n_obs);
+	logger->report("  # of labels = \t%lu\n", (unsigned long)n_label);
+	if (n_topic > 0)
+		logger->report("  # of topics = \t%lu\n", (unsigned long)n_topic);
+	logger->report("  # of features = \t%lu (estimated)\n", (unsigned long)n_feature);
+	logger->report("  # of parameters = \t%lu (estimated)\n\n", (unsigned long)(n_param + n_topic_param));
+}
+
+} // namespace tricrf
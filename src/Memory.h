@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+#ifndef __MEMORY_H__
+#define __MEMORY_H__
+
+/// max headers
+#include "Utility.h"
+#include "Data.h"
+/// standard headers
+#include <vector>
+#include <string>
+#include <map>
+#include <utility>
+
+namespace tricrf {
+
+/// Node overhead of std::map (color and three links)
+#define MAP_NODE_BYTES	32
+/// Longest string stored in place (libstdc++)
+#define SHORT_STRING	15
+
+/// Heap bytes held by an object ; the object itself (sizeof) is counted by its owner.
+/// The sizes are the capacities of the containers, so the tables reused over the sequences
+/// show their peak.
+size_t bytesOf(const std::string& s);
+size_t bytesOf(const Event& ev);
+size_t bytesOf(const StringEvent& ev);
+size_t bytesOf(const TriSequence& seq);
+size_t bytesOf(const TriStringSequence& seq);
+template <class T> size_t bytesOf(const T&);
+template <class A, class B> size_t bytesOf(const std::pair<A, B>& p);
+template <class T, class Alloc> size_t bytesOf(const std::vector<T, Alloc>& v);
+template <class K, class V, class C, class Alloc> size_t bytesOf(const std::map<K, V, C, Alloc>& m);
+template <class T> size_t bytesOf(const Data<T>& d);
+
+/// Plain values hold no heap
+template <class T> size_t bytesOf(const T&) {
+	return 0;
+}
+
+template <class A, class B> size_t bytesOf(const std::pair<A, B>& p) {
+	return bytesOf(p.first) + bytesOf(p.second);
+}
+
+template <class T, class Alloc> size_t bytesOf(const std::vector<T, Alloc>& v) {
+	size_t bytes = v.capacity() * sizeof(T);
+	for (typename std::vector<T, Alloc>::const_iterator it = v.begin(); it != v.end(); ++it)
+		bytes += bytesOf(*it);
+	return bytes;
+}
+
+template <class K, class V, class C, class Alloc> size_t bytesOf(const std::map<K, V, C, Alloc>& m) {
+	size_t bytes = m.size() * (MAP_NODE_BYTES + sizeof(std::pair<const K, V>));
+	for (typename std::map<K, V, C, Alloc>::const_iterator it = m.begin(); it != m.end(); ++it)
+		bytes += bytesOf(it->first) + bytesOf(it->second);
+	return bytes;
+}
+
+/// Data<> is a vector (the generic one would be chosen otherwise)
+template <class T> size_t bytesOf(const Data<T>& d) {
+	return bytesOf(static_cast<const std::vector<T>&>(d));
+}
+
+/** Bytes held by the structures of a model.
+	The items of the same name are summed up, in the order of their first appearance.
+	@class MemoryUsage
+*/
+class MemoryUsage {
+private:
+	std::vector<std::pair<std::string, size_t> > m_Item;
+
+public:
+	void add(const std::string& name, size_t bytes);
+	size_t total() const;
+	void report(Logger* logger, const std::string& title) const;
+};
+
+/** Statistics of a data file for the memory estimate.
+	The file is read once before loading ; the distinct observations and (observation, label)
+	pairs are estimated by linear counting on their hashes, without the dictionaries.
+	@class CorpusStats
+*/
+struct CorpusStats {
+	size_t n_seq;	///< # of sequences
+	size_t n_event;	///< # of events (the topic lines are not counted)
+	size_t n_obs;	///< # of observations of the events
+	size_t obs_heap;	///< heap bytes of the observation strings (see SHORT_STRING)
+	size_t max_len;	///< longest sequence
+	size_t n_label;	///< distinct labels
+	size_t n_topic;	///< distinct topics
+	size_t n_topic_obs;	///< # of observations of the topic lines
+	size_t n_feature;	///< distinct observations (estimated)
+	size_t n_param;	///< distinct (observation, label) pairs (estimated)
+	size_t n_topic_param;	///< distinct (topic observation, topic) pairs (estimated)
+
+	CorpusStats();
+	bool scan(const std::string& filename, const FeatureTemplate* tmpl, bool topic);
+	void report(Logger* logger) const;
+};
+
+} // namespace tricrf
+
+#endif
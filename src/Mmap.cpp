@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/// max headers
+#include "Mmap.h"
+/// standard headers
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <map>
+/// mapping headers
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <pthread.h>
+
+using namespace std;
+
+namespace tricrf {
+
+/// Settings and statistics of the file-mapped storage
+static bool g_mmap = false;
+static string g_mmap_dir;
+static size_t g_min_bytes = 1 << 20;
+static size_t g_n_file = 0;	///< # of mapped files so far
+static size_t g_mapped = 0;	///< bytes currently mapped
+static size_t g_peak = 0;	///< peak of mapped bytes
+static struct rusage g_usage;	///< resource usage at setMmap()
+/// Mapped blocks and their sizes ; a block not in the table came from the heap
+static map<void*, size_t> g_Block;
+/// Lock of the table and the statistics (the PL shards and the sweep/cv threads allocate concurrently)
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**	Turn on the file-mapped storage.
+	@param dir			scratch directory for the mapped files
+	@param min_bytes	smaller blocks are allocated from the heap
+*/
+void setMmap(const string& dir, size_t min_bytes) {
+	g_mmap = true;
+	g_mmap_dir = (dir == "" ? "." : dir);
+	g_min_bytes = min_bytes;
+	getrusage(RUSAGE_SELF, &g_usage);
+}
+
+bool isMmap() {
+	return g_mmap;
+}
+
+/**	Allocate a block.
+	The scratch file is unlinked right after mapping, so it disappears with the process.
+	@param bytes	size of the block
+	@param advice	madvise() hint on the access pattern
+	@return pointer to the block (NULL on failure)
+*/
+void* mmapAllocate(size_t bytes, int advice) {
+	if (!g_mmap || bytes < g_min_bytes)
+		return malloc(bytes);
+
+	string path = g_mmap_dir + "/tricrf.XXXXXX";
+	vector<char> buf(path.begin(), path.end());
+	buf.push_back('\0');
+	int fd = mkstemp(&buf[0]);
+	if (fd < 0) {
+		cerr << "cannot create a scratch file in " << g_mmap_dir << endl;
+		return NULL;
+	}
+	unlink(&buf[0]);
+	if (ftruncate(fd, bytes) != 0) {
+		cerr << "cannot extend a scratch file to " << bytes << " bytes\n";
+		close(fd);
+		return NULL;
+	}
+	void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		cerr << "cannot map a scratch file of " << bytes << " bytes\n";
+		return NULL;
+	}
+	madvise(p, bytes, advice);
+
+	pthread_mutex_lock(&g_lock);
+	g_Block[p] = bytes;
+	g_n_file++;
+	g_mapped += bytes;
+	if (g_mapped > g_peak)
+		g_peak = g_mapped;
+	pthread_mutex_unlock(&g_lock);
+	return p;
+}
+
+/**	Free a block.
+	The block is unmapped or freed according to how it was allocated, which does not depend on
+	the current settings.
+	@param p		pointer to the block
+	@param bytes	size of the block (the same as the allocation)
+*/
+void mmapDeallocate(void* p, size_t bytes) {
+	pthread_mutex_lock(&g_lock);
+	map<void*, size_t>::iterator it = g_Block.find(p);
+	bool mapped = (it != g_Block.end());
+	if (mapped) {
+		bytes = it->second;
+		g_Block.erase(it);
+		g_mapped -= bytes;
+	}
+	pthread_mutex_unlock(&g_lock);
+
+	if (mapped)
+		munmap(p, bytes);
+	else
+		free(p);
+}
+
+/**	Report the mapped storage, page faults and block I/O since setMmap().
+	@param logger	logger
+*/
+void reportMmap(Logger* logger) {
+	if (!g_mmap)
+		return;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	pthread_mutex_lock(&g_lock);
+	size_t n_file = g_n_file, mapped = g_mapped, peak = g_peak;
+	pthread_mutex_unlock(&g_lock);
+	logger->report("[Mapped storage]\n");
+	logger->report("  scratch directory = \t%s\n", g_mmap_dir.c_str());
+	logger->report("  mapped files = \t%lu\n", (unsigned long)n_file);
+	logger->report("  mapped bytes = \t%lu (peak %lu)\n", (unsigned long)mapped, (unsigned long)peak);
+	logger->report("  major page faults = \t%d\n", usage.ru_majflt - g_usage.ru_majflt);
+	logger->report("  minor page faults = \t%d\n", usage.ru_minflt - g_usage.ru_minflt);
+	logger->report("  blocks read = \t%d\n", usage.ru_inblock - g_usage.ru_inblock);
+	logger->report("  blocks written = \t%d\n\n", usage.ru_oublock - g_usage.ru_oublock);
+}
+
+} // namespace tricrf
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+#ifndef __MMAP_H__
+#define __MMAP_H__
+
+/// max headers
+#include "Utility.h"
+/// standard headers
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <new>
+#include <sys/mman.h>
+
+namespace tricrf {
+
+/// File-mapped storage ; blocks of at least min_bytes are mapped to unlinked files in the scratch directory
+void setMmap(const std::string& dir, size_t min_bytes = 1 << 20);
+bool isMmap();
+void* mmapAllocate(size_t bytes, int advice);
+void mmapDeallocate(void* p, size_t bytes);
+void reportMmap(Logger* logger);
+
+/** Allocator backed by file-mapped storage.
+	The kernel writes the pages back to the scratch files instead of the swap, so the weight,
+	gradient and count vectors (and the LBFGS history) can be larger than physical memory.
+	Small blocks, or all blocks while setMmap() is not called, come from the heap.
+	@class MmapAllocator
+*/
+template <class T, int Advice = MADV_NORMAL>
+class MmapAllocator {
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template <class U> struct rebind { typedef MmapAllocator<U, Advice> other; };
+
+	MmapAllocator() {}
+	MmapAllocator(const MmapAllocator&) {}
+	template <class U> MmapAllocator(const MmapAllocator<U, Advice>&) {}
+
+	pointer address(reference x) const { return &x; }
+	const_pointer address(const_reference x) const { return &x; }
+	size_type max_size() const { return size_t(-1) / sizeof(T); }
+
+	pointer allocate(size_type n, const void* = 0) {
+		if (n == 0)
+			return 0;
+		void* p = mmapAllocate(n * sizeof(T), Advice);
+		if (!p)
+			throw std::bad_alloc();
+		return static_cast<pointer>(p);
+	}
+	void deallocate(pointer p, size_type n) {
+		if (p)
+			mmapDeallocate(p, n * sizeof(T));
+	}
+
+	void construct(pointer p, const T& val) { new((void*)p) T(val); }
+	void destroy(pointer p) { p->~T(); }
+};
+
+template <class T1, class T2, int Advice>
+inline bool operator==(const MmapAllocator<T1, Advice>&, const MmapAllocator<T2, Advice>&) { return true; }
+template <class T1, class T2, int Advice>
+inline bool operator!=(const MmapAllocator<T1, Advice>&, const MmapAllocator<T2, Advice>&) { return false; }
+
+/// Weight, gradient and count vectors (random access by feature id)
+typedef std::vector<double, MmapAllocator<double, MADV_RANDOM> > WeightVector;
+/// LBFGS history (swept sequentially)
+typedef std::vector<double, MmapAllocator<double, MADV_SEQUENTIAL> > HistoryVector;
+
+} // namespace tricrf
+
+#endif
@@ -50,16 +50,16 @@ size_t Parameter::size() {
 */
 void Parameter::clear(bool state) {
 	if (!state) {
-		m_StateMap.clear();
-		m_StateVec.clear();
+		m_StateMap.reset();
+		m_StateVec.reset();
 	}
-	m_FeatureMap.clear();
-	m_FeatureVec.clear();
+	m_FeatureMap.reset();
+	m_FeatureVec.reset();
 	//m_StateID.clear();
-	m_Count.clear();
+	m_Count.reset();
 	m_Weight.clear();
 	m_Gradient.clear();
-	m_ParamIndex.clear();
+	m_ParamIndex.reset();
 	n_weight = 0;
 	m_StateIndex.clear();
 	m_SelectedStateList1.clear();
@@ -78,8 +78,9 @@ void Parameter::initialize() {
 /** Initialize the gradient vector.
 */
 void Parameter::initializeGradient() {
+	const WeightVector& count = *m_Count;
 	for (size_t i=0; i < n_weight; i++) {
-		m_Gradient[i] = -m_Count[i];
+		m_Gradient[i] = -count[i];
 	}
 }
 void Parameter::initializeGradient2() {
@@ -111,11 +112,11 @@ double* Parameter::getGradient() {
 /** Make and return the observation index
 	@todo	If the index vector is stored in training set, then the training speed can be (slightly) improved.
 */
-vector<ObsParam> Parameter::makeObsIndex(vector<pair<size_t, double> >& obs) {
+vector<ObsParam> Parameter::makeObsIndex(const vector<pair<size_t, double> >& obs) {
 	vector<ObsParam> obs_param;
-	vector<pair<size_t, double> >::iterator iter = obs.begin();
+	vector<pair<size_t, double> >::const_iterator iter = obs.begin();
 	for (; iter != obs.end(); iter++) {
-		vector<pair<size_t, size_t> >& param = m_ParamIndex[iter->first];
+		const vector<pair<size_t, size_t> >& param = (*m_ParamIndex)[iter->first];
 		for (size_t i = 0; i < param.size(); ++i) {
 			ObsParam element;
 			element.y = param[i].first;
@@ -128,11 +129,11 @@ vector<ObsParam> Parameter::makeObsIndex(vector<pair<size_t, double> >& obs) {
 }
 
 // sparse-FB, 2007-11-08
-vector<ObsParam> Parameter::makeObsIndex(vector<pair<size_t, double> >& obs, map<size_t, size_t>& beam) {
+vector<ObsParam> Parameter::makeObsIndex(const vector<pair<size_t, double> >& obs, map<size_t, size_t>& beam) {
 	vector<ObsParam> obs_param;
-	vector<pair<size_t, double> >::iterator iter = obs.begin();
+	vector<pair<size_t, double> >::const_iterator iter = obs.begin();
 	for (; iter != obs.end(); iter++) {
-		vector<pair<size_t, size_t> >& param = m_ParamIndex[iter->first];
+		const vector<pair<size_t, size_t> >& param = (*m_ParamIndex)[iter->first];
 		size_t index = 0;
 		for (size_t i = 0; i < param.size(); ++i) {
 			if (beam.find(param[i].first) == beam.end())
@@ -147,13 +148,13 @@ vector<ObsParam> Parameter::makeObsIndex(vector<pair<size_t, double> >& obs, map
 	return obs_param;
 }
 
-vector<ObsParam> Parameter::makeObsIndex(vector<pair<string, double> >& obs) {
+vector<ObsParam> Parameter::makeObsIndex(const vector<pair<string, double> >& obs) {
 	int pid;
 	vector<ObsParam> obs_param;
-	vector<pair<string, double> >::iterator iter = obs.begin();
+	vector<pair<string, double> >::const_iterator iter = obs.begin();
 	for (; iter != obs.end(); iter++) {
 		if ((pid = findObs(iter->first)) >= 0) {
-			vector<pair<size_t, size_t> >& param = m_ParamIndex[(size_t)pid];
+			const vector<pair<size_t, size_t> >& param = (*m_ParamIndex)[(size_t)pid];
 			for (size_t i = 0; i < param.size(); ++i) {
 				ObsParam element;
 				element.y = param[i].first;
@@ -166,22 +167,89 @@ vector<ObsParam> Parameter::makeObsIndex(vector<pair<string, double> >& obs) {
 	return obs_param;
 }
 
+/**	Look up the string observations once ; unknown observations are dropped.
+	@return observation ids and values
+*/
+vector<pair<size_t, double> > Parameter::indexObs(const vector<pair<string, double> >& obs) {
+	int pid;
+	vector<pair<size_t, double> > index;
+	vector<pair<string, double> >::const_iterator iter = obs.begin();
+	for (; iter != obs.end(); iter++) {
+		if ((pid = findObs(iter->first)) >= 0)
+			index.push_back(make_pair((size_t)pid, iter->second));
+	}
+	return index;
+}
+
+/**	Group the state index by the previous state (outgoing transitions) or the next state (incoming transitions).
+	The order of m_StateIndex is kept in each group.
+	@param outgoing	group by y1, otherwise by y2
+	@param n		# of groups
+*/
+vector<vector<StateParam> > Parameter::groupStateIndex(bool outgoing, size_t n) {
+	vector<vector<StateParam> > group(n);
+	vector<StateParam>::iterator iter = m_StateIndex.begin();
+	for (; iter != m_StateIndex.end(); ++iter) {
+		size_t y = (outgoing ? iter->y1 : iter->y2);
+		if (y >= group.size())
+			group.resize(y + 1);
+		group[y].push_back(*iter);
+	}
+	return group;
+}
+
 /**	Return the size of feature vector.
 */
 size_t Parameter::sizeFeatureVec() {
-	return m_FeatureVec.size();
+	return m_FeatureVec->size();
 }
 
 /**	Return the size of state vector.
 */
 size_t Parameter::sizeStateVec() {
-	return m_StateVec.size();
+	return m_StateVec->size();
 }
 
 /**	Return the state map and vector.
 */
 std::pair<Map, Vec> Parameter::getState() {
-	return make_pair(m_StateMap, m_StateVec);
+	return make_pair(*m_StateMap, *m_StateVec);
+}
+
+/**	Return the state map (borrowed).
+*/
+const Map& Parameter::getStateMap() {
+	return *m_StateMap;
+}
+
+/**	Return the state vector (borrowed).
+*/
+const Vec& Parameter::getStateVec() {
+	return *m_StateVec;
+}
+
+/**	Map the state ids to those of another parameter by the state names.
+	The last element maps the unknown state (sizeStateVec()) to that of the target, so the
+	mappings can be chained.
+	@param	target	parameter with the target state space
+	@return	state id in the target (target.sizeStateVec() if not found) for each state id
+*/
+vector<size_t> Parameter::mapStates(Parameter& target) {
+	const Map& target_map = target.getStateMap();
+	const Vec& state_vec = *m_StateVec;
+	vector<size_t> mapping(state_vec.size() + 1, target.sizeStateVec());
+	for (size_t i = 0; i < state_vec.size(); i++) {
+		Map::const_iterator it = target_map.find(state_vec[i]);
+		if (it != target_map.end())
+			mapping[i] = it->second;
+	}
+	return mapping;
+}
+
+/**	Return the feature map.
+*/
+const Map& Parameter::getFeatureMap() {
+	return *m_FeatureMap;
 }
 
 /**	Return the size of feature vector.
@@ -197,13 +265,14 @@ std::pair<Map, Vec> Parameter::getState() {
 */
 size_t Parameter::addNewState(const string& key) {
 	size_t oid;
-	if (m_StateMap.find(key) == m_StateMap.end()) {
-		oid = m_StateVec.size();
-		m_StateMap.insert(make_pair(key, oid));
-		m_StateVec.push_back(key);
+	Map::const_iterator it = m_StateMap->find(key);
+	if (it == m_StateMap->end()) {
+		oid = m_StateVec->size();
+		m_StateMap.edit().insert(make_pair(key, oid));
+		m_StateVec.edit().push_back(key);
 	} else {
-		oid = m_StateMap[key];
-		if (m_StateVec[oid] != key) {
+		oid = it->second;
+		if ((*m_StateVec)[oid] != key) {
 			cerr << "outcome id mismatch error" << endl;
 			exit(1);
 		}
@@ -216,8 +285,9 @@ size_t Parameter::addNewState(const string& key) {
 int Parameter::findState(const string& key) {
 	int oid = -1;
 
-	if (m_StateMap.find(key) != m_StateMap.end()) {
-		oid = m_StateMap[key];
+	Map::const_iterator it = m_StateMap->find(key);
+	if (it != m_StateMap->end()) {
+		oid = it->second;
 	}
 
 	return oid;
@@ -228,8 +298,9 @@ int Parameter::findState(const string& key) {
 int Parameter::findObs(const string& key) {
 	int pid = -1;
 
-	if (m_FeatureMap.find(key) != m_FeatureMap.end()) {
-		pid = m_FeatureMap[key];
+	Map::const_iterator it = m_FeatureMap->find(key);
+	if (it != m_FeatureMap->end()) {
+		pid = it->second;
 	}
 
 	return pid;
@@ -240,12 +311,13 @@ int Parameter::findObs(const string& key) {
 size_t Parameter::addNewObs(const string& key) {
 	size_t pid;
 
-	if (m_FeatureMap.find(key) != m_FeatureMap.end()) {
-		pid = m_FeatureMap[key];
+	Map::const_iterator it = m_FeatureMap->find(key);
+	if (it != m_FeatureMap->end()) {
+		pid = it->second;
 	} else {
-		pid = m_FeatureVec.size();
-		m_FeatureMap[key] = pid;
-		m_FeatureVec.push_back(key);
+		pid = m_FeatureVec->size();
+		m_FeatureMap.edit()[key] = pid;
+		m_FeatureVec.edit().push_back(key);
 	}
 	return pid;
 }
@@ -254,29 +326,31 @@ size_t Parameter::addNewObs(const string& key) {
 */
 size_t Parameter::updateParam(size_t oid, size_t pid, double fval) {
 	size_t fid;
-	assert(m_ParamIndex.size() >= pid);
-	if (m_ParamIndex.size() == pid) {	/// New feature
+	ParamIndex& index = m_ParamIndex.edit();
+	WeightVector& count = m_Count.edit();
+	assert(index.size() >= pid);
+	if (index.size() == pid) {	/// New feature
 		vector<pair<size_t, size_t> > param;
 		fid = n_weight;
 		n_weight++;
-		m_Count.push_back(fval);
+		count.push_back(fval);
 		m_Weight.push_back(0.0);
 		m_Gradient.push_back(0.0);
 		param.push_back(make_pair(oid, fid));
-		m_ParamIndex.push_back(param);
+		index.push_back(param);
 	} else {	 /// A parameter vector is exist
-		vector<pair<size_t, size_t> >& param = m_ParamIndex[pid];
+		vector<pair<size_t, size_t> >& param = index[pid];
 		size_t i;
 		for (i = 0; i < param.size(); i++) {
 			if (param[i].first == oid) {
-				m_Count[param[i].second] += fval;
+				count[param[i].second] += fval;
 				break;
 			}
 		}
 		if (i == param.size()) {
 			fid = n_weight;
 			n_weight++;
-			m_Count.push_back(fval);
+			count.push_back(fval);
 			m_Weight.push_back(0.0);
 			m_Gradient.push_back(0.0);
 			param.push_back(make_pair(oid, fid));
@@ -286,20 +360,34 @@ size_t Parameter::updateParam(size_t oid, size_t pid, double fval) {
 	return n_weight;
 }
 
+/**	Renumber the parameters in the order of m_ParamIndex.
+	The counts and the weights (of a loaded model, warm start) are permuted in place, so only
+	the permutation is allocated, from the mapped storage.
+*/
 void Parameter::endUpdate() {
-	vector<double> tmp_Count = m_Count;
-	fill(m_Count.begin(), m_Count.end(), 0.0);
-
+	vector<size_t, MmapAllocator<size_t, MADV_RANDOM> > dest(n_weight);	///< new fid of each old fid
+	ParamIndex& index = m_ParamIndex.edit();
+	WeightVector& count = m_Count.edit();
     size_t fid = 0;
-    for (size_t i = 0; i < m_ParamIndex.size(); ++i) {
-        vector<pair<size_t, size_t> >& param = m_ParamIndex[i];
+    for (size_t i = 0; i < index.size(); ++i) {
+        vector<pair<size_t, size_t> >& param = index[i];
         for (size_t j = 0; j < param.size(); ++j) {
-			m_Count[fid] = tmp_Count[param[j].second];
+			dest[param[j].second] = fid;
             param[j].second = fid;
             fid++;
         }
     }
 	assert(fid == n_weight);
+
+	/// following the cycles of the permutation
+	for (size_t i = 0; i < n_weight; i++) {
+		while (dest[i] != i) {
+			size_t j = dest[i];
+			swap(count[i], count[j]);
+			swap(m_Weight[i], m_Weight[j]);
+			swap(dest[i], dest[j]);
+		}
+	}
 }
 
 size_t Parameter::getDefaultState() {
@@ -326,6 +414,8 @@ void Parameter::makeStateIndex(bool makeIndex) {
     }*/
 	//m_default_oid = addNewState("|S|");
 
+	m_SelectedStateList1.clear();
+	m_SelectedStateList2.clear();
 	m_SelectedStateList1.resize(sizeStateVec());
 	m_SelectedStateList2.resize(sizeStateVec());
 
@@ -335,10 +425,9 @@ void Parameter::makeStateIndex(bool makeIndex) {
 		//int pid = findState(y1);
 		//if (pid < 0)
 		//	continue;
-		string fi = mEDGE + m_StateVec[y1];
-		if (m_FeatureMap.find(fi) != m_FeatureMap.end()) {
-			size_t pid = m_FeatureMap[fi];
-			vector<pair<size_t, size_t> >& param = m_ParamIndex[pid];
+		Map::const_iterator it = m_FeatureMap->find(mEDGE + (*m_StateVec)[y1]);
+		if (it != m_FeatureMap->end()) {
+			const vector<pair<size_t, size_t> >& param = (*m_ParamIndex)[it->second];
 			for (size_t i = 0; i < param.size(); i++) {
 				StateParam element;
 				element.y1 = y1;
@@ -382,10 +471,9 @@ void Parameter::makeActiveIndex(double eta) {
 
 vector<StateParam> Parameter::makeStateIndex(size_t y1) {
 	vector<StateParam> state_param;
-	string fi = mEDGE + m_StateVec[y1];
-	if (m_FeatureMap.find(fi) != m_FeatureMap.end()) {
-		size_t pid = m_FeatureMap[fi];
-		vector<pair<size_t, size_t> >& param = m_ParamIndex[pid];
+	Map::const_iterator it = m_FeatureMap->find(mEDGE + (*m_StateVec)[y1]);
+	if (it != m_FeatureMap->end()) {
+		const vector<pair<size_t, size_t> >& param = (*m_ParamIndex)[it->second];
 		for (size_t i = 0; i < param.size(); i++) {
 			StateParam element;
 			element.y1 = i;
@@ -398,6 +486,30 @@ vector<StateParam> Parameter::makeStateIndex(size_t y1) {
 	return state_param;
 }
 
+/** Clear the empirical feature counts.
+*/
+void Parameter::clearCount() {
+	size_t n = m_Count->size();
+	m_Count.reset().assign(n, 0.0);
+}
+
+/** Add to the empirical count of an existing parameter.
+	@param oid	outcome id
+	@param pid	observation id
+	@param fval	feature value
+*/
+void Parameter::addCount(size_t oid, size_t pid, double fval) {
+	if (pid >= m_ParamIndex->size())
+		return;
+	const vector<pair<size_t, size_t> >& param = (*m_ParamIndex)[pid];
+	for (size_t i = 0; i < param.size(); i++) {
+		if (param[i].first == oid) {
+			m_Count.edit()[param[i].second] += fval;
+			break;
+		}
+	}
+}
+
 /** Make the index for Tied Potential
 */
 void Parameter::makeTiedPotential(double K) {
@@ -422,18 +534,18 @@ void Parameter::makeTiedPotential(double K) {
 	m_SelectedStateList1.resize(sizeStateVec());
 	m_SelectedStateList2.resize(sizeStateVec());
 
+	WeightVector& count = m_Count.edit();	///< the counts are moved to the tied parameters
 	for (size_t y1=0; y1 < sizeStateVec(); y1++) {
-		string fi = mEDGE + m_StateVec[y1];
-		if (m_FeatureMap.find(fi) != m_FeatureMap.end()) {
-			size_t pid = m_FeatureMap[fi];
-			vector<pair<size_t, size_t> >& param = m_ParamIndex[pid];
+		Map::const_iterator it = m_FeatureMap->find(mEDGE + (*m_StateVec)[y1]);
+		if (it != m_FeatureMap->end()) {
+			const vector<pair<size_t, size_t> >& param = (*m_ParamIndex)[it->second];
 			for (size_t i = 0; i < param.size(); i++) {
 				StateParam element;
 				element.y1 = y1;
 				element.y2 = param[i].first;
 				element.fid = param[i].second;
 				element.fval = 1.0;
-				if (m_Count[element.fid] >= K) {
+				if (count[element.fid] >= K) {
 					m_SelectedStateIndex.push_back(element);
 
 					// make back pointer (t, t-1)
@@ -444,11 +556,11 @@ void Parameter::makeTiedPotential(double K) {
 
 				} else {
 					m_RemainStateIndex.push_back(element);
-					remain_count[element.y2] += m_Count[element.fid];
+					remain_count[element.y2] += count[element.fid];
 					//remain_fid[element.y2] = element.fid;
 					remain_size[element.y2] += 1.0;
-					m_Count[remain_fid[element.y2]] += m_Count[element.fid]; // empirical feature count is augmented
-					m_Count[element.fid] = 0.0;
+					count[remain_fid[element.y2]] += count[element.fid]; // empirical feature count is augmented
+					count[element.fid] = 0.0;
 				}
 			}	///< for
 		} ///< if else
@@ -463,41 +575,111 @@ void Parameter::makeTiedPotential(double K) {
 	}
 	vector<StateParam>::iterator iter = m_RemainStateIndex.begin();
 	for (; iter != m_RemainStateIndex.end(); ++iter) {
-		m_Count[iter->fid] = remain_count[iter->y2] / remain_size[iter->y2];
+		count[iter->fid] = remain_count[iter->y2] / remain_size[iter->y2];
 	}
 	*/
 
 	for (size_t i = 0; i < sizeStateVec(); i++) {
 		if (remain_size[i] > 0)
-			m_Count[remain_fid[i]] /= remain_size[i];
+			count[remain_fid[i]] /= remain_size[i];
 		else
-			m_Count[remain_fid[i]] = 0.0;
+			count[remain_fid[i]] = 0.0;
 	}
 }
 
+/** Collect the features which have a non-zero parameter.
+	@param	active	feature set to be appended
+*/
+void Parameter::getActiveFeatures(set<string>& active) {
+	const ParamIndex& index = *m_ParamIndex;
+	for (size_t i = 0; i < index.size(); ++i) {
+		const vector<pair<size_t, size_t> >& param = index[i];
+		for (size_t j = 0; j < param.size(); ++j) {
+			if (m_Weight[param[j].second] != 0.0) {
+				active.insert((*m_FeatureVec)[i]);
+				break;
+			}
+		}
+	}
+}
+
+/** Drop the zero-weight parameters and renumber the features and parameters.
+	The transition features (mEDGE) are kept as they are, since they define the state index.
+	The state index should be rebuilt after the compaction.
+	@param	keep	features kept in the dictionary even if all their parameters are dropped
+	@return	# of dropped parameters
+*/
+size_t Parameter::compact(const set<string>* keep) {
+	Map feature_map;
+	Vec feature_vec;
+	vector<vector<pair<size_t, size_t> > > param_index;
+	WeightVector weight, count;
+
+	const Vec& old_feature_vec = *m_FeatureVec;
+	const ParamIndex& old_param_index = *m_ParamIndex;
+	const WeightVector& old_count = *m_Count;
+	size_t fid = 0;
+	for (size_t i = 0; i < old_param_index.size(); ++i) {
+		bool edge = (old_feature_vec[i].compare(0, mEDGE.size(), mEDGE) == 0);
+		const vector<pair<size_t, size_t> >& param = old_param_index[i];
+		vector<pair<size_t, size_t> > new_param;
+		for (size_t j = 0; j < param.size(); ++j) {
+			if (!edge && m_Weight[param[j].second] == 0.0)
+				continue;
+			new_param.push_back(make_pair(param[j].first, fid++));
+			weight.push_back(m_Weight[param[j].second]);
+			count.push_back(old_count[param[j].second]);
+		}
+		if (new_param.empty() && !edge && (keep == NULL || keep->find(old_feature_vec[i]) == keep->end()))
+			continue;
+		feature_map[old_feature_vec[i]] = feature_vec.size();
+		feature_vec.push_back(old_feature_vec[i]);
+		param_index.push_back(new_param);
+	}
+
+	/// the shared dictionaries of the other copies are not touched
+	size_t dropped = n_weight - fid;
+	m_FeatureMap.reset().swap(feature_map);
+	m_FeatureVec.reset().swap(feature_vec);
+	m_ParamIndex.reset().swap(param_index);
+	m_Weight.swap(weight);
+	m_Count.reset().swap(count);
+	n_weight = fid;
+	m_Gradient.resize(n_weight);
+	fill(m_Gradient.begin(), m_Gradient.end(), 0.0);
+	m_StateIndex.clear();
+	m_SelectedStateList1.clear();
+	m_SelectedStateList2.clear();
+
+	return dropped;
+}
+
 /** Save the model.
 	@param	f	output file stream
 	@return	success or failure
 */
 bool Parameter::save(ofstream& f) {
 	/// Errors
-	if (m_ParamIndex.size() != m_FeatureVec.size())
+	const Vec& state_vec = *m_StateVec;
+	const Vec& feature_vec = *m_FeatureVec;
+	const ParamIndex& index = *m_ParamIndex;
+	if (index.size() != feature_vec.size())
 		return false;
 
 	/// state
-	f << "// State ; " << m_StateVec.size() << endl;
-    for (size_t i = 0; i < m_StateVec.size(); ++i)
-        f << m_StateVec[i] << endl;
+	f << "// State ; " << state_vec.size() << endl;
+    for (size_t i = 0; i < state_vec.size(); ++i)
+        f << state_vec[i] << endl;
 
 	/// feature
-    f << "// Feature ; " << m_FeatureVec.size() << endl;
-    for (size_t i = 0; i < m_FeatureVec.size(); ++i)
-        f << m_FeatureVec[i] << endl;
+    f << "// Feature ; " << feature_vec.size() << endl;
+    for (size_t i = 0; i < feature_vec.size(); ++i)
+        f << feature_vec[i] << endl;
 
 	/// parameter index
-    f << "// Parameter ; " << m_ParamIndex.size() << endl;
-    for (size_t i = 0; i < m_ParamIndex.size(); ++i) {
-        vector<pair<size_t, size_t> >& param = m_ParamIndex[i];
+    f << "// Parameter ; " << index.size() << endl;
+    for (size_t i = 0; i < index.size(); ++i) {
+        const vector<pair<size_t, size_t> >& param = index[i];
         f << param.size() << ' ';
         for (size_t j = 0; j < param.size(); ++j) {
             f << param[j].first << ' ';
@@ -522,6 +704,11 @@ bool Parameter::load(ifstream& f) {
 	clear();
     string line;
 	size_t count;
+	Map& state_map = m_StateMap.edit();
+	Vec& state_vec = m_StateVec.edit();
+	Map& feature_map = m_FeatureMap.edit();
+	Vec& feature_vec = m_FeatureVec.edit();
+	ParamIndex& index = m_ParamIndex.edit();
 
     /// state
 	getline(f, line);
@@ -533,8 +720,8 @@ bool Parameter::load(ifstream& f) {
 	count = atoi(tok[3].c_str());
     for (size_t i = 0; i < count; ++i) {
 		getline(f, line);
-		m_StateMap[line] = i;
-		m_StateVec.push_back(line);
+		state_map[line] = i;
+		state_vec.push_back(line);
     }
 
     /// feature
@@ -547,8 +734,8 @@ bool Parameter::load(ifstream& f) {
 	count = atoi(tok[3].c_str());
     for (size_t i = 0; i < count; ++i) {
         getline(f, line);
-        m_FeatureMap[line] = i;
-        m_FeatureVec.push_back(line);
+        feature_map[line] = i;
+        feature_vec.push_back(line);
     }
 
 	/// parameter index
@@ -570,7 +757,7 @@ bool Parameter::load(ifstream& f) {
             oid = atoi(it->c_str()); ++it;
             param.push_back(make_pair(oid,fid++));
         }
-        m_ParamIndex.push_back(param);
+        index.push_back(param);
     }
 
 	/// weight
@@ -589,8 +776,7 @@ bool Parameter::load(ifstream& f) {
 	assert(i == n_weight);
 
 	/// setting
-	m_Count.resize(n_weight);
-	fill(m_Count.begin(), m_Count.end(), 0.0);
+	m_Count.reset().assign(n_weight, 0.0);
 
 	return true;
 }
@@ -599,10 +785,21 @@ bool Parameter::load(ifstream& f) {
 */
 void Parameter::print(Logger *log) {
 	//log->report("[Parameters]\n");
-	log->report("  # of States = \t%d\n", m_StateVec.size());
-	log->report("  # of Features = \t%d\n", m_FeatureVec.size());
+	log->report("  # of States = \t%d\n", m_StateVec->size());
+	log->report("  # of Features = \t%d\n", m_FeatureVec->size());
 	log->report("  # of Parameters = \t%d\n\n", n_weight);
 }
 
+/**	Bytes held by the dictionaries, the indexes and the weight vectors.
+	@param usage	the items are added to it
+*/
+void Parameter::measureMemory(MemoryUsage& usage) {
+	usage.add("dictionaries", bytesOf(*m_FeatureMap) + bytesOf(*m_FeatureVec) + bytesOf(*m_StateMap) + bytesOf(*m_StateVec));
+	usage.add("parameter index", bytesOf(*m_ParamIndex) + bytesOf(m_StateIndex)
+		+ bytesOf(m_SelectedStateIndex) + bytesOf(m_RemainStateIndex) + bytesOf(remain_fid) + bytesOf(remain_count)
+		+ bytesOf(m_SelectedStateList1) + bytesOf(m_SelectedStateList2));
+	usage.add("weight, gradient, count", bytesOf(m_Weight) + bytesOf(m_Gradient) + bytesOf(*m_Count));
+}
+
 }	// namespace tricrf
 
@@ -10,10 +10,13 @@
 
 /// max headers
 #include "Utility.h"
+#include "Mmap.h"
+#include "Memory.h"
 /// standard headers
 #include <vector>
 #include <string>
 #include <map>
+#include <set>
 
 namespace tricrf {
 
@@ -39,23 +42,29 @@ typedef std::map<std::string, size_t> Map;
 */
 typedef std::vector<std::string> Vec;
 
+/** Typedef for the parameter index ; (outcome id, parameter id) of each observation.
+*/
+typedef std::vector<std::vector<std::pair<size_t, size_t> > > ParamIndex;
+
 
 /** Parameter class.
+	The dictionaries, the parameter index and the empirical counts are shared by the copies of
+	a parameter (see Shared) ; the weights, the gradient and the state index are their own.
 	@class Parameter
 */
 class Parameter {
 protected:
 	/// Weight
 	size_t n_weight;
-	std::vector<double> m_Weight;
-	std::vector<double> m_Gradient;
-	std::vector<double> m_Count;
+	WeightVector m_Weight;
+	WeightVector m_Gradient;
+	Shared<WeightVector> m_Count;
 
 	/// Dictionary
-	Map m_FeatureMap;
-	Vec m_FeatureVec;
-	Map m_StateMap;
-	Vec m_StateVec;
+	Shared<Map> m_FeatureMap;
+	Shared<Vec> m_FeatureVec;
+	Shared<Map> m_StateMap;
+	Shared<Vec> m_StateVec;
 
 
 	/// Options
@@ -70,7 +79,7 @@ public:
 	~Parameter();
 
 	/// Parameter index
-	std::vector<std::vector<std::pair<size_t, size_t> > > m_ParamIndex;
+	Shared<ParamIndex> m_ParamIndex;
 
 	/// weight vector
 	void initialize();
@@ -85,9 +94,11 @@ public:
 	void setWeight(double* theta);
 
 	std::vector<StateParam> m_StateIndex;
-	std::vector<ObsParam> makeObsIndex(std::vector<std::pair<size_t, double> >& obs);
-	std::vector<ObsParam> makeObsIndex(std::vector<std::pair<size_t, double> >& obs, std::map<size_t, size_t>& beam);
-	std::vector<ObsParam> makeObsIndex(std::vector<std::pair<std::string, double> >& obs);
+	std::vector<ObsParam> makeObsIndex(const std::vector<std::pair<size_t, double> >& obs);
+	std::vector<ObsParam> makeObsIndex(const std::vector<std::pair<size_t, double> >& obs, std::map<size_t, size_t>& beam);
+	std::vector<ObsParam> makeObsIndex(const std::vector<std::pair<std::string, double> >& obs);
+	std::vector<std::pair<size_t, double> > indexObs(const std::vector<std::pair<std::string, double> >& obs);
+	std::vector<std::vector<StateParam> > groupStateIndex(bool outgoing, size_t n);
 	int findObs(const std::string& key);
 	int findState(const std::string& key);
 	size_t getDefaultState();
@@ -96,6 +107,10 @@ public:
 	size_t sizeFeatureVec();
 	size_t sizeStateVec();
 	std::pair<Map, Vec> getState();
+	const Map& getStateMap();
+	const Vec& getStateVec();
+	std::vector<size_t> mapStates(Parameter& target);
+	const Map& getFeatureMap();
 	//int findState(size_t key);
 
 	/// Update and test the parameters
@@ -103,6 +118,8 @@ public:
 	size_t addNewObs(const std::string& key);
 	size_t updateParam(size_t oid, size_t pid,  double fval = 1.0);
 	void endUpdate();
+	void clearCount();	///< Empirical counts are recounted (cross-validation)
+	void addCount(size_t oid, size_t pid, double fval);
 	void makeStateIndex(bool makeIndex = true);
 	std::vector<StateParam> makeStateIndex(size_t y1);
 	void makeActiveIndex(double eta = 1E-02);
@@ -116,12 +133,17 @@ public:
 	std::vector<std::vector<size_t> > m_SelectedStateList1;
 	std::vector<std::vector<size_t> > m_SelectedStateList2;
 
+	/// Compaction (after L1 regularization)
+	void getActiveFeatures(std::set<std::string>& active);
+	size_t compact(const std::set<std::string>* keep = NULL);
+
 	/// save and load
 	bool save(std::ofstream& f);
 	bool load(std::ifstream& f);
 
 	/// Reporting
 	void print(Logger *log);
+	void measureMemory(MemoryUsage& usage);
 };
 
 } // namespace tricrf
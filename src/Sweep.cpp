@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+/// max headers
+#include "Sweep.h"
+/// standard headers
+#include <cstdio>
+#include <algorithm>
+#include <sys/time.h>
+
+using namespace std;
+
+namespace tricrf {
+
+/// Wall-clock time (sec) ; timer measures the CPU time of all threads
+static double wallTime() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1E-06;
+}
+
+/**	Constructor.
+	@param base			model with the training and dev sets
+	@param logger		logger
+	@param log_file		log file prefix of the settings
+	@param L1			L1 regularization
+	@param init_iter	# of iterations of the PL initialization (0 = none)
+	@param metric		index of the dev score for the selection
+*/
+Sweep::Sweep(MaxEnt* base, Logger* logger, const string& log_file, bool L1, size_t init_iter, size_t metric) {
+	m_Base = base;
+	m_Logger = logger;
+	m_LogFile = log_file;
+	m_L1 = L1;
+	m_init_iter = init_iter;
+	m_metric = metric;
+	m_Best = NULL;
+	m_best = 0;
+	m_next = 0;
+	pthread_mutex_init(&m_Lock, NULL);
+}
+
+Sweep::~Sweep() {
+	if (m_Best)
+		delete m_Best;
+	pthread_mutex_destroy(&m_Lock);
+}
+
+/**	Add a setting.
+*/
+void Sweep::add(double prior, size_t max_iter, double prune) {
+	SweepSetting setting;
+	setting.prior = prior;
+	setting.max_iter = max_iter;
+	setting.prune = prune;
+	setting.ok = false;
+	setting.time = 0.0;
+	setting.n_param = 0;
+	m_Setting.push_back(setting);
+}
+
+void* Sweep::runThread(void* arg) {
+	Sweep* sweep = (Sweep*)arg;
+	while (true) {
+		pthread_mutex_lock(&sweep->m_Lock);
+		size_t k = sweep->m_next++;
+		pthread_mutex_unlock(&sweep->m_Lock);
+		if (k >= sweep->m_Setting.size())
+			break;
+		sweep->train(k);
+	}
+	return NULL;
+}
+
+/**	Train a copy of the base model with the k-th setting.
+	The copy logs to its own file, since the settings are trained at the same time.
+*/
+void Sweep::train(size_t k) {
+	SweepSetting& setting = m_Setting[k];
+	char name[32];
+	sprintf(name, ".%d", (int)k);
+	Logger* logger = new Logger(m_LogFile + name, 1);
+	MaxEnt* model = m_Base->clone();
+	model->setLogger(logger);
+	model->setPrune(setting.prune);
+
+	double start = wallTime();
+	if (m_init_iter > 0)
+		model->pretrain(m_init_iter, setting.prior, true);	///< errors of the PL training are ignored
+	setting.ok = model->train(setting.max_iter, setting.prior, m_L1);
+	if (setting.ok && m_L1)
+		model->compact();
+	setting.time = wallTime() - start;
+	setting.score = model->getDevScore();
+	setting.n_param = model->sizeParam();
+	model->setLogger(m_Logger);
+	delete logger;
+
+	/// only the best model is kept ; a tie goes to the lower setting, whichever finishes first
+	pthread_mutex_lock(&m_Lock);
+	bool best = (setting.ok && setting.score.size() > m_metric);
+	if (best && m_Best) {
+		double score = setting.score[m_metric];
+		double best_score = m_Setting[m_best].score[m_metric];
+		best = (score > best_score || (score == best_score && k < m_best));
+	}
+	if (best) {
+		if (m_Best)
+			delete m_Best;
+		m_Best = model;
+		m_best = k;
+	}
+	pthread_mutex_unlock(&m_Lock);
+	if (!best)
+		delete model;
+}
+
+/**	Train all the settings.
+	@param n_thread	# of settings trained at the same time
+	@return true if any setting is trained
+*/
+bool Sweep::run(size_t n_thread) {
+	if (n_thread == 0)
+		n_thread = 1;
+	if (n_thread > m_Setting.size())
+		n_thread = m_Setting.size();
+	m_next = 0;
+
+	vector<pthread_t> threads(n_thread);
+	for (size_t t = 0; t < n_thread; t++)
+		pthread_create(&threads[t], NULL, Sweep::runThread, this);
+	for (size_t t = 0; t < n_thread; t++)
+		pthread_join(threads[t], NULL);
+
+	return (m_Best != NULL);
+}
+
+/**	Report the dev scores, times and model sizes of the settings.
+*/
+void Sweep::report() {
+	bool topic = false;
+	for (size_t k = 0; k < m_Setting.size(); k++)
+		topic = topic || (m_Setting[k].score.size() > 3);
+
+	m_Logger->report("[Sweep results]\n");
+	m_Logger->report("  %3s %10s %6s %10s %8s %8s %8s", "", "prior", "iter", "prune", "acc", "micro-f1", "macro-f1");
+	if (topic)
+		m_Logger->report(" %8s", "topic");
+	m_Logger->report(" %10s %10s\n", "sec", "# of param");
+	for (size_t k = 0; k < m_Setting.size(); k++) {
+		SweepSetting& setting = m_Setting[k];
+		vector<double> score = setting.score;
+		score.resize(4, 0.0);
+		m_Logger->report("%s %3d %10g %6d %10g %8.3f %8.3f %8.3f", (m_Best && k == m_best ? "*" : " "), k,
+			setting.prior, setting.max_iter, setting.prune, score[0], score[1], score[2]);
+		if (topic)
+			m_Logger->report(" %8.3f", score[3]);
+		m_Logger->report(" %10.3f %10d%s\n", setting.time, setting.n_param, (setting.ok ? "" : "  (failed)"));
+	}
+	m_Logger->report("\n");
+}
+
+MaxEnt* Sweep::getBest() {
+	return m_Best;
+}
+
+/**	Constructor.
+	@param base			model with the training set
+	@param logger		logger
+	@param log_file		log file prefix of the folds
+	@param n_fold		# of folds
+	@param prior		l1_prior or l2_prior
+	@param max_iter		# of iterations
+	@param L1			L1 regularization
+	@param init_iter	# of iterations of the PL initialization (0 = none)
+*/
+CrossValidation::CrossValidation(MaxEnt* base, Logger* logger, const string& log_file, size_t n_fold,
+		double prior, size_t max_iter, bool L1, size_t init_iter) {
+	m_Base = base;
+	m_Logger = logger;
+	m_LogFile = log_file;
+	m_n_fold = n_fold;
+	m_prior = prior;
+	m_max_iter = max_iter;
+	m_L1 = L1;
+	m_init_iter = init_iter;
+	FoldResult fold;
+	fold.ok = false;
+	fold.time = 0.0;
+	m_Fold.resize(n_fold, fold);
+	m_next = 0;
+	pthread_mutex_init(&m_Lock, NULL);
+}
+
+CrossValidation::~CrossValidation() {
+	pthread_mutex_destroy(&m_Lock);
+}
+
+void* CrossValidation::runThread(void* arg) {
+	CrossValidation* cv = (CrossValidation*)arg;
+	while (true) {
+		pthread_mutex_lock(&cv->m_Lock);
+		size_t k = cv->m_next++;
+		pthread_mutex_unlock(&cv->m_Lock);
+		if (k >= cv->m_n_fold)
+			break;
+		cv->train(k);
+	}
+	return NULL;
+}
+
+/**	Train the k-th fold ; the held-out fold is evaluated as the dev set at each iteration.
+*/
+void CrossValidation::train(size_t k) {
+	FoldResult& fold = m_Fold[k];
+	char name[32];
+	sprintf(name, ".%d", (int)k);
+	Logger* logger = new Logger(m_LogFile + name, 1);
+	MaxEnt* model = m_Base->fold(k, m_n_fold);
+	model->setLogger(logger);
+
+	double start = wallTime();
+	if (m_init_iter > 0)
+		model->pretrain(m_init_iter, m_prior, true);	///< errors of the PL training are ignored
+	fold.ok = model->train(m_max_iter, m_prior, m_L1);
+	fold.time = wallTime() - start;
+	fold.score = model->getDevScore();
+	if (fold.score.empty())	///< empty fold
+		fold.ok = false;
+
+	delete model;
+	delete logger;
+}
+
+/**	Train all the folds.
+	@param n_thread	# of folds trained at the same time
+	@return true if all the folds are trained
+*/
+bool CrossValidation::run(size_t n_thread) {
+	if (n_thread == 0)
+		n_thread = 1;
+	if (n_thread > m_n_fold)
+		n_thread = m_n_fold;
+	m_next = 0;
+
+	vector<pthread_t> threads(n_thread);
+	for (size_t t = 0; t < n_thread; t++)
+		pthread_create(&threads[t], NULL, CrossValidation::runThread, this);
+	for (size_t t = 0; t < n_thread; t++)
+		pthread_join(threads[t], NULL);
+
+	for (size_t k = 0; k < m_n_fold; k++)
+		if (!m_Fold[k].ok)
+			return false;
+	return true;
+}
+
+/**	Report the scores of the folds and their mean and (sample) variance.
+*/
+void CrossValidation::report() {
+	size_t n_score = 3;
+	for (size_t k = 0; k < m_n_fold; k++)
+		if (m_Fold[k].score.size() > n_score)
+			n_score = m_Fold[k].score.size();
+
+	m_Logger->report("[Cross-validation results]\n");
+	m_Logger->report("  %8s %8s %8s %8s", "fold", "acc", "micro-f1", "macro-f1");
+	if (n_score > 3)
+		m_Logger->report(" %8s", "topic");
+	m_Logger->report(" %10s\n", "sec");
+
+	vector<double> sum(n_score, 0.0), sum2(n_score, 0.0);
+	size_t n = 0;
+	for (size_t k = 0; k < m_n_fold; k++) {
+		vector<double> score = m_Fold[k].score;
+		score.resize(n_score, 0.0);
+		m_Logger->report("  %8d", k);
+		for (size_t i = 0; i < n_score; i++)
+			m_Logger->report(" %8.3f", score[i]);
+		m_Logger->report(" %10.3f%s\n", m_Fold[k].time, (m_Fold[k].ok ? "" : "  (failed)"));
+		if (!m_Fold[k].ok)
+			continue;
+		for (size_t i = 0; i < n_score; i++) {
+			sum[i] += score[i];
+			sum2[i] += score[i] * score[i];
+		}
+		n++;
+	}
+	if (n == 0) {
+		m_Logger->report("\n");
+		return;
+	}
+
+	m_Logger->report("  %8s", "mean");
+	for (size_t i = 0; i < n_score; i++)
+		m_Logger->report(" %8.3f", sum[i] / n);
+	m_Logger->report("\n  %8s", "variance");
+	for (size_t i = 0; i < n_score; i++)
+		m_Logger->report(" %8.3f", (n > 1 ? max(0.0, sum2[i] - sum[i] * sum[i] / n) / (n - 1) : 0.0));
+	m_Logger->report("\n\n");
+}
+
+} // namespace tricrf
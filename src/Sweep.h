@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2010 Minwoo Jeong (minwoo.j@gmail.com).
+ * This file is part of the "TriCRF" distribution.
+ * http://github.com/minwoo/TriCRF/
+ * This software is provided under the terms of Modified BSD license: see LICENSE for the detail.
+ */
+
+#ifndef __SWEEP_H__
+#define __SWEEP_H__
+
+/// max headers
+#include "MaxEnt.h"
+#include "Utility.h"
+/// standard headers
+#include <vector>
+#include <string>
+#include <pthread.h>
+
+namespace tricrf {
+
+/** Setting of a training run in the hyperparameter sweep.
+	@class SweepSetting
+*/
+struct SweepSetting {
+	double prior;	///< l1_prior or l2_prior
+	size_t max_iter;	///< # of iterations
+	double prune;	///< pruning threshold
+
+	/// results
+	bool ok;	///< training succeeded
+	std::vector<double> score;	///< dev scores (see MaxEnt::getDevScore())
+	double time;	///< wall-clock training time (sec)
+	size_t n_param;	///< # of parameters
+};
+
+/** Hyperparameter sweep.
+	The data sets are read and indexed once into the base model. Each setting trains a copy of
+	the base model, which shares its data sets and dictionaries and has its own weights, up to
+	n_thread settings at the same time. Only the best model on the dev set is kept, and a tie
+	goes to the first setting.
+	@class Sweep
+*/
+class Sweep {
+private:
+	MaxEnt* m_Base;	///< model with the data sets
+	Logger* m_Logger;
+	std::string m_LogFile;	///< log of the k-th setting = m_LogFile.k
+	bool m_L1;
+	size_t m_init_iter;	///< # of iterations of the PL initialization (0 = none)
+	size_t m_metric;	///< index of the dev score for the selection
+
+	std::vector<SweepSetting> m_Setting;
+	MaxEnt* m_Best;	///< best model so far
+	size_t m_best;	///< its setting
+	size_t m_next;	///< next setting to be trained
+	pthread_mutex_t m_Lock;
+
+	static void* runThread(void* arg);
+	void train(size_t k);
+
+public:
+	Sweep(MaxEnt* base, Logger* logger, const std::string& log_file, bool L1, size_t init_iter, size_t metric);
+	~Sweep();
+
+	void add(double prior, size_t max_iter, double prune);
+	bool run(size_t n_thread);
+	void report();
+	MaxEnt* getBest();	///< NULL if no setting is trained
+};
+
+/** Result of a fold in the cross-validation.
+	@class FoldResult
+*/
+struct FoldResult {
+	bool ok;	///< training succeeded
+	std::vector<double> score;	///< dev scores on the held-out fold (see MaxEnt::getDevScore())
+	double time;	///< wall-clock training time (sec)
+};
+
+/** k-fold cross-validation.
+	The dictionaries are built once over the whole training set, which is split into the folds
+	by sequence. Each fold trains a copy of the base model on the other folds and evaluates
+	the held-out fold as its dev set, up to n_thread folds at the same time ; the copies share
+	the training set and differ only in its counts (see MaxEnt::fold()).
+	@class CrossValidation
+*/
+class CrossValidation {
+private:
+	MaxEnt* m_Base;	///< model with the training set
+	Logger* m_Logger;
+	std::string m_LogFile;	///< log of the k-th fold = m_LogFile.k
+	size_t m_n_fold;
+	double m_prior;
+	size_t m_max_iter;
+	bool m_L1;
+	size_t m_init_iter;	///< # of iterations of the PL initialization (0 = none)
+
+	std::vector<FoldResult> m_Fold;
+	size_t m_next;	///< next fold to be trained
+	pthread_mutex_t m_Lock;
+
+	static void* runThread(void* arg);
+	void train(size_t k);
+
+public:
+	CrossValidation(MaxEnt* base, Logger* logger, const std::string& log_file, size_t n_fold,
+		double prior, size_t max_iter, bool L1, size_t init_iter);
+	~CrossValidation();
+
+	bool run(size_t n_thread);
+	void report();
+};
+
+} // namespace tricrf
+
+#endif
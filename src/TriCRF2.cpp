@@ -10,6 +10,7 @@
 #include "Evaluator.h"
 #include "Utility.h"
 #include "LBFGS.h"
+#include "Decoder.h"
 /// standard headers
 #include <cassert>
 #include <cfloat>
@@ -159,13 +160,34 @@ bool TriCRF2::loadModel(const std::string& filename) {
 	return true;
 }
 
+/**	Drop the zero-weight parameters of the model.
+	@return	# of dropped parameters
+*/
+size_t TriCRF2::compact() {
+	timer stop_watch;
+	logger->report("[Model compaction]\n");
+
+	size_t n_param = m_ParamTopic.size() + m_ParamSeq.size();
+	size_t dropped = m_ParamTopic.compact();
+	dropped += m_ParamSeq.compact();
+	logger->report("  # of Parameters = \t%d -> %d\n", n_param, m_ParamTopic.size() + m_ParamSeq.size());
+	logger->report("  compaction time = \t%.3f\n\n", stop_watch.elapsed());
+
+	/// to be used in inference
+	m_ParamTopic.makeStateIndex(false);
+	m_ParamSeq.makeStateIndex();
+	createIndex();
+
+	return dropped;
+}
+
 /**	Read the data from file
 */
 void TriCRF2::readTrainData(const string& filename) {
 
 	/// File stream
 	string line;
-	ifstream f(filename.c_str());
+	InputStream f(filename);
 	if (!f)
 		throw runtime_error("cannot open data file");
 
@@ -176,23 +198,24 @@ void TriCRF2::readTrainData(const string& filename) {
 	string topic;
 	timer stop_watch;
 	logger->report("[Training data file loading]\n");
-	m_TrainSet.clear();
-	m_TrainSetCount.clear();
+	Data<TriSequence>& train_set = m_TrainSet.reset();
+	vector<double>& train_count = m_TrainSetCount.reset();
 
 	/// To reduce the storage and computation
 	map<vector<vector<string> >, size_t> train_data_map;
 	vector<vector<string> > token_list;
 
 	size_t seq_count = 0;
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty() || tokens.size() <= 0) {	 ///< sequence break
+	DataReader reader(f, &m_Template, true);
+	vector<string> tokens;
+	while (reader.next(tokens)) {
+		if (tokens.size() <= 0) {	 ///< sequence break
 			if (train_data_map.find(token_list) == train_data_map.end()) {
-				m_TrainSet.append(triseq);
-				train_data_map.insert(make_pair(token_list, m_TrainSetCount.size()));
-				m_TrainSetCount.push_back(1.0);
+				train_set.append(triseq);
+				train_data_map.insert(make_pair(token_list, train_count.size()));
+				train_count.push_back(1.0);
 			} else {
-				m_TrainSetCount[train_data_map[token_list]] += 1.0;
+				train_count[train_data_map[token_list]] += 1.0;
 			}
 			triseq.seq.clear();
 			token_list.clear();
@@ -228,6 +251,7 @@ void TriCRF2::readTrainData(const string& filename) {
 	m_ParamTopic.endUpdate();
 	m_ParamSeq.endUpdate();
 
+	m_dedup_bytes = max(m_dedup_bytes, bytesOf(train_data_map));
 	logger->report("  # of data = \t\t%d\n", count);
 	logger->report("  loading time = \t%.3f\n\n", stop_watch.elapsed());
 
@@ -243,7 +267,7 @@ void TriCRF2::readDevData(const string& filename) {
 
 	/// File stream
 	string line;
-	ifstream f(filename.c_str());
+	InputStream f(filename);
 	if (!f)
 		throw runtime_error("cannot open data file");
 
@@ -254,23 +278,24 @@ void TriCRF2::readDevData(const string& filename) {
 	string topic;
 	timer stop_watch;
 	logger->report("[Dev data file loading]\n");
-	m_DevSet.clear();
-	m_DevSetCount.clear();
+	Data<TriSequence>& dev_set = m_DevSet.reset();
+	vector<double>& dev_count = m_DevSetCount.reset();
 
 	/// To reduce the storage and computation
 	map<vector<vector<string> >, size_t> dev_data_map;
 	vector<vector<string> > token_list;
 
 	size_t seq_count = 0;
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty() || tokens.size() <= 0) {	 ///< sequence break
+	DataReader reader(f, &m_Template, true);
+	vector<string> tokens;
+	while (reader.next(tokens)) {
+		if (tokens.size() <= 0) {	 ///< sequence break
 			if (dev_data_map.find(token_list) == dev_data_map.end()) {
-				m_DevSet.append(triseq);
-				dev_data_map.insert(make_pair(token_list, m_DevSetCount.size()));
-				m_DevSetCount.push_back(1.0);
+				dev_set.append(triseq);
+				dev_data_map.insert(make_pair(token_list, dev_count.size()));
+				dev_count.push_back(1.0);
 			} else {
-				m_DevSetCount[dev_data_map[token_list]] += 1.0;
+				dev_count[dev_data_map[token_list]] += 1.0;
 			}
 			triseq.seq.clear();
 			token_list.clear();
@@ -293,13 +318,19 @@ void TriCRF2::readDevData(const string& filename) {
 
 	}	// while
 
+	m_dedup_bytes = max(m_dedup_bytes, bytesOf(dev_data_map));
 	logger->report("  # of data = \t\t%d\n", count);
 	logger->report("  loading time = \t%.3f\n\n", stop_watch.elapsed());
 
 }
 
+/**	Calculate the transition and topic factors, and gather them for each topic.
+	m_zy_M[z] is the dense transition matrix over the labels of the topic z (m_yz_index[z]), with the
+	topic factor of the next label folded in ; the recursions run on the local labels.
+*/
 void TriCRF2::calculateEdge() {
 	double* theta_seq = m_ParamSeq.getWeight();
+	double* theta_topic = m_ParamTopic.getWeight();
 	m_M.resize(m_state_size * m_state_size);
 	fill(m_M.begin(), m_M.end(), 1.0);
 
@@ -307,14 +338,37 @@ void TriCRF2::calculateEdge() {
 	for (; iter != m_ParamSeq.m_StateIndex.end(); ++iter) {
 		m_M[MAT2(iter->y1,iter->y2)] *= exp(theta_seq[iter->fid] * iter->fval);
 	}
-}
 
+	/// Topic factor ; it does not depend on the sequence
+	m_Z.resize(m_topic_size * m_state_size);
+	fill(m_Z.begin(), m_Z.end(), 1.0);
+	for (iter = m_ParamTopic.m_StateIndex.begin(); iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
+		m_Z[MAT2(iter->y1, iter->y2)] *= exp(theta_topic[iter->fid] * iter->fval);
+	}
+
+	/// Gathered transitions
+	m_zy_start.resize(m_topic_size);
+	m_zy_M.resize(m_topic_size);
+	for (size_t z = 0; z < m_topic_size; z++) {
+		size_t n = m_zy_size[z];
+		const vector<size_t>& label = m_yz_index[z];
+		m_zy_start[z].resize(n);
+		m_zy_M[z].resize(n * n);
+		for (size_t j = 0; j < n; j++)
+			m_zy_start[z][j] = m_M[MAT2(m_default_oid, label[j])] * m_Z[MAT2(z, label[j])];
+		for (size_t k = 0; k < n; k++) {
+			double* row = &m_zy_M[z][n * k];
+			for (size_t j = 0; j < n; j++)
+				row[j] = m_M[MAT2(label[k], label[j])] * m_Z[MAT2(z, label[j])];
+		}
+	}
+}
 
 /**	Calculate the factors.
 	References
 		Jeong and Lee, Triangular-chain Conditional Random Fields, (Submitted), IEEE TASLP.
 */
-void TriCRF2::calculateFactors(TriSequence &triseq) {
+void TriCRF2::calculateFactors(const TriSequence &triseq) {
 	/// Initialization
 	m_seq_size = triseq.seq.size() + 1;	///< sequence length
 	double* theta_seq = m_ParamSeq.getWeight();
@@ -322,9 +376,7 @@ void TriCRF2::calculateFactors(TriSequence &triseq) {
 
 	/// Factor matrix initialization
 	m_R.resize(m_seq_size * m_state_size);
-	m_Z.resize(m_topic_size * m_state_size);
 	fill(m_R.begin(), m_R.end(), 1.0);
-	fill(m_Z.begin(), m_Z.end(), 1.0);
 
 	/// Calculation
 	for (size_t i = 0; i < m_seq_size-1; i++) {
@@ -345,12 +397,6 @@ void TriCRF2::calculateFactors(TriSequence &triseq) {
 
 	}	///< for
 
-	/// Topic factor
-	vector<StateParam>::iterator iter = m_ParamTopic.m_StateIndex.begin();
-	for (; iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
-		m_Z[MAT2(iter->y1, iter->y2)] *= exp(theta_topic[iter->fid] * iter->fval);
-	}
-
 	/// Gamma
 	m_Gamma.resize(m_topic_size, 1.0);
 	fill(m_Gamma.begin(), m_Gamma.end(), 1.0);
@@ -366,7 +412,7 @@ void TriCRF2::calculateFactors(TriSequence &triseq) {
 	References
 		Jeong and Lee, Triangular-chain Conditional Random Fields, (Submitted), IEEE TASLP.
 */
-void TriCRF2::calculateFactors(TriStringSequence &triseq) {
+void TriCRF2::calculateFactors(const TriStringSequence &triseq) {
 	/// Initialization
 	m_seq_size = triseq.seq.size() + 1;	///< sequence length
 	double* theta_seq = m_ParamSeq.getWeight();
@@ -374,9 +420,7 @@ void TriCRF2::calculateFactors(TriStringSequence &triseq) {
 
 	/// Factor matrix initialization
 	m_R.resize(m_seq_size * m_state_size);
-	m_Z.resize(m_topic_size * m_state_size);
 	fill(m_R.begin(), m_R.end(), 1.0);
-	fill(m_Z.begin(), m_Z.end(), 1.0);
 
 	/// Calculation
 	for (size_t i = 0; i < m_seq_size-1; i++) {
@@ -397,12 +441,6 @@ void TriCRF2::calculateFactors(TriStringSequence &triseq) {
 
 	}	///< for
 
-	/// Topic factor
-	vector<StateParam>::iterator iter = m_ParamTopic.m_StateIndex.begin();
-	for (; iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
-		m_Z[MAT2(iter->y1, iter->y2)] *= exp(theta_topic[iter->fid] * iter->fval);
-	}
-
 	/// Gamma
 	m_Gamma.resize(m_topic_size, 1.0);
 	fill(m_Gamma.begin(), m_Gamma.end(), 1.0);
@@ -418,49 +456,69 @@ void TriCRF2::calculateFactors(TriStringSequence &triseq) {
 	Computing and storing the alpha value.
 */
 void TriCRF2::forward() {
-	//m_Alpha.resize(m_topic_size* m_seq_size * m_state_size);
-	//fill(m_Alpha.begin(), m_Alpha.end(), 0.0);
 	m_Alpha.resize(m_topic_size);
 	for (size_t z = 0; z < m_topic_size; z++) {
 		m_Alpha[z].resize(m_seq_size * m_zy_size[z]);
 		fill(m_Alpha[z].begin(), m_Alpha[z].end(), 0.0);
 	}
 
+	scale.resize(m_seq_size);
+	fill(scale.begin(), scale.end(), 1.0);
+
 	for (size_t z = 0; z < m_topic_size; z++) {
-		//for (size_t j = 0; j < m_state_size; j++) {
-		for (vector<StateParam>::iterator iter = m_y_state[z].begin(); iter != m_y_state[z].end(); ++iter) {
-			size_t j = iter->y2;
-			long double prob = m_R[MAT2(0, j)] * m_M[MAT2(m_default_oid, j)];
-			m_Alpha[z][TCRF2_MAT2(m_zy_size[z], 0, iter->y1)] += prob * m_Z[MAT2(z, j)];
-		}
+		const vector<size_t>& label = m_yz_index[z];
+		for (size_t j = 0; j < m_zy_size[z]; j++)
+			m_Alpha[z][j] = m_R[MAT2(0, label[j])] * m_zy_start[z][j];
 	}
+	scaleAlpha(0);
+
+	for (size_t i = 1; i < m_seq_size; i++) {
+		for (size_t z = 0; z < m_topic_size; z++) {
+			size_t n = m_zy_size[z];
+			const vector<size_t>& label = m_yz_index[z];
+			const double* prev = &m_Alpha[z][TCRF2_MAT2(n, i-1, 0)];
+			double* alpha = &m_Alpha[z][TCRF2_MAT2(n, i, 0)];
+			/// alpha_i = (alpha_{i-1} * M_z) .* R_i
+			for (size_t k = 0; k < n; k++) {
+				double a = prev[k];
+				if (a == 0.0)
+					continue;
+				const double* row = &m_zy_M[z][n * k];
+				for (size_t j = 0; j < n; j++)
+					alpha[j] += a * row[j];
+			} ///< for k
+			for (size_t j = 0; j < n; j++)
+				alpha[j] *= m_R[MAT2(i, label[j])];
+		}  ///< for z
+		scaleAlpha(i);
+	}  ///< for i
 
-	for (size_t z = 0; z < m_topic_size; z++) {
-		for (size_t i = 1; i < m_seq_size; i++) {
-			//for (size_t j = 0; j < m_state_size; j++) {
-			for (vector<StateParam>::iterator iter = m_y_state[z].begin(); iter != m_y_state[z].end(); ++iter) {
-				size_t j = iter->y2;
-				long double prob = m_R[MAT2(i, j)] * m_Z[MAT2(z, j)];
-				if (prob > 0) {
-					//for (size_t k = 0; k < m_state_size; k++) {
-					for (vector<StateParam>::iterator iter2 = m_y_state[z].begin(); iter2 != m_y_state[z].end(); ++iter2) {
-						size_t k = iter2->y2;
-						m_Alpha[z][TCRF2_MAT2(m_zy_size[z],i, iter->y1)] +=
-										m_Alpha[z][TCRF2_MAT2(m_zy_size[z], i-1, iter2->y1)] * m_M[MAT2(k, j)] * prob;
-					} ///< for k
-				} // if prob > 0
-			} ///< for j
-		}  ///< for i
-	}  ///< for z
+}
 
+/**	Scale the alpha values of all the topics at a position.
+	All the topics share the scale, so the ratios between the topics are kept ; the unscaled
+	alpha at i is the scaled one times scale[0] * ... * scale[i].
+	@param i	position
+*/
+void TriCRF2::scaleAlpha(size_t i) {
+	double sum = 0.0;
+	for (size_t z = 0; z < m_topic_size; z++) {
+		for (size_t y = 0; y < m_zy_size[z]; y++)
+			sum += m_Alpha[z][TCRF2_MAT2(m_zy_size[z], i, y)];
+	}
+	if (sum <= 0.0)
+		return;
+	for (size_t z = 0; z < m_topic_size; z++) {
+		for (size_t y = 0; y < m_zy_size[z]; y++)
+			m_Alpha[z][TCRF2_MAT2(m_zy_size[z], i, y)] /= sum;
+	}
+	scale[i] = sum;
 }
 
 /**	Backward Recursion.
 	Computing and storing the beta value.
 */
 void TriCRF2::backward() {
-	//m_Beta.resize(m_topic_size * m_seq_size * m_state_size);
-	//fill(m_Beta.begin(), m_Beta.end(), 0.0);
 	m_Beta.resize(m_topic_size);
 	for (size_t z = 0; z < m_topic_size; z++) {
 		m_Beta[z].resize(m_seq_size * m_zy_size[z]);
@@ -471,26 +529,29 @@ void TriCRF2::backward() {
 		m_Beta[z][TCRF2_MAT2(m_zy_size[z], m_seq_size-1, m_y_state[z][0].y1)] = 1.0;
 	}
 
+	vector<double> next;
 	//for (size_t z = 0; z < m_topic_size; z++) { // original
 	for (size_t prune = 0; prune < m_prune.size(); prune++) {
 		size_t z = m_prune[prune].second;
+		size_t n = m_zy_size[z];
+		const vector<size_t>& label = m_yz_index[z];
+		next.resize(n);
 
 		for (size_t i = m_seq_size-1; i >= 1; i--) {
-			//for (size_t k = 0; k < m_state_size; k++) {
-			for (vector<StateParam>::iterator iter = m_y_state[z].begin(); iter != m_y_state[z].end(); ++iter) {
-				size_t k = iter->y2;
-				long double prob = m_R[MAT2(i, k)] * m_Z[MAT2(z, k)];
-				if (prob > 0) {
-					//for (size_t j = 0; j < m_state_size; j++) {
-					for (vector<StateParam>::iterator iter2 = m_y_state[z].begin(); iter2 != m_y_state[z].end(); ++iter2) {
-						size_t j = iter2->y2;
-						m_Beta[z][TCRF2_MAT2(m_zy_size[z], i-1, iter2->y1)] +=
-										m_Beta[z][TCRF2_MAT2(m_zy_size[z], i, iter->y1)] * m_M[MAT2(j, k)] * prob;
-					} ///< for j
-				} ///< if prob > 0
-            } ///< for k
-        } ///< for i
-    } ///< for z
+			/// beta_{i-1} = M_z * (beta_i .* R_i), scaled with the alpha
+			const double* beta = &m_Beta[z][TCRF2_MAT2(n, i, 0)];
+			for (size_t k = 0; k < n; k++)
+				next[k] = beta[k] * m_R[MAT2(i, label[k])] / scale[i];
+			double* prev = &m_Beta[z][TCRF2_MAT2(n, i-1, 0)];
+			for (size_t j = 0; j < n; j++) {
+				const double* row = &m_zy_M[z][n * j];
+				double sum = 0.0;
+				for (size_t k = 0; k < n; k++)
+					sum += row[k] * next[k];
+				prev[j] = sum;
+			} ///< for j
+		} ///< for i
+	} ///< for z
 
 }
 
@@ -519,7 +580,7 @@ long double TriCRF2::getPartitionZ() {
 	@param seq			given data (y, x)
 	@return probability
 */
-long double TriCRF2::calculateProb(TriSequence& triseq) {
+long double TriCRF2::calculateProb(const TriSequence& triseq) {
 	long double z = getPartitionZ();
 
     long double seq_prob = 1.0;
@@ -531,7 +592,7 @@ long double TriCRF2::calculateProb(TriSequence& triseq) {
         } else {
             y = m_y_state[triseq.topic.label][0].y2;
         }
-        seq_prob *= m_R[MAT2(i,y)] * m_M[MAT2(prev_y,y)] * m_Z[MAT2(triseq.topic.label, y)];
+        seq_prob *= m_R[MAT2(i,y)] * m_M[MAT2(prev_y,y)] * m_Z[MAT2(triseq.topic.label, y)] / scale[i];
         prev_y = y;
 
     }
@@ -549,52 +610,53 @@ long double TriCRF2::calculateProb(TriSequence& triseq) {
 */
 vector<size_t> TriCRF2::viterbiSearch(size_t& max_z, long double& prob) {
 	/// Initialization
-	long double max_prob = -10000.0;
+	long double max_prob = -10000.0;	///< log-score of the best path
 	max_z = m_default_oid;
 	vector<size_t> max_y;
 
-	vector<size_t> psi_x(m_state_size) ;
-	vector<long double> delta_x(m_state_size);
-	fill(psi_x.begin(), psi_x.end(), m_state_size);
-	fill(delta_x.begin(), delta_x.begin(), 0.0);
-
 	/// Search
 	///for (size_t z = 0; z < m_topic_size; z++) {
 	for (size_t prune = 0; prune < m_prune.size(); prune++) {
 		size_t z = m_prune[prune].second;
+		size_t n = m_zy_size[z];
+		const vector<size_t>& label = m_yz_index[z];
 
+		/// on the local labels of the topic
 		vector<vector<size_t> > psi;
-		vector<vector<long double> > delta;
+		vector<vector<double> > delta;
+		long double log_scale = 0.0;	///< log of the scales of delta
 
 		for (size_t i=0; i < m_seq_size; i++) {
-			vector<size_t> psi_i= psi_x;
-			vector<long double> delta_i = delta_x;
-
-			//for (size_t j=0; j < m_state_size; j++) {
-			for (vector<StateParam>::iterator iter = m_y_state[z].begin(); iter != m_y_state[z].end(); ++iter) {
-				size_t j = iter->y2;
-				long double max = -10000.0;
-				size_t max_k = m_y_state[z][0].y2;
-				if (i == 0) {
-					max = m_R[MAT2(i, j)] * m_M[MAT2(m_default_oid, j)] * m_Z[MAT2(z, j)];
-					max_k = m_default_oid;
-				} else {
-					long double p = m_R[MAT2(i,j)] * m_Z[MAT2(z, j)];
-					//for (size_t k=0; k < m_state_size; k++) {
-					for (vector<StateParam>::iterator iter2 = m_y_state[z].begin(); iter2 != m_y_state[z].end(); ++iter2) {
-						size_t k = iter2->y2;
-						double val = delta[i-1][k] *  m_M[MAT2(k,j)] * p;
-						if (val > max) {
-							max = val;
-							max_k = k;
+			vector<size_t> psi_i(n, 0);
+			vector<double> delta_i(n, -10000.0);
+
+			if (i == 0) {
+				for (size_t j=0; j < n; j++)
+					delta_i[j] = m_R[MAT2(i, label[j])] * m_zy_start[z][j];
+			} else {
+				for (size_t k=0; k < n; k++) {
+					double d = delta[i-1][k];
+					const double* row = &m_zy_M[z][n * k];
+					for (size_t j=0; j < n; j++) {
+						double val = d * row[j];
+						if (val > delta_i[j]) {
+							delta_i[j] = val;
+							psi_i[j] = k;
 						}
 					}
 				}
+				for (size_t j=0; j < n; j++)
+					delta_i[j] *= m_R[MAT2(i, label[j])];
+			}
 
-				delta_i[j] = max;
-				psi_i[j] = max_k;
-				//delta_i.push_back(max);
-				//psi_i.push_back(max_k);
+			/// scaling ; the best path does not change
+			double max_delta = 0.0;
+			for (size_t j=0; j < n; j++)
+				max_delta = (delta_i[j] > max_delta ? delta_i[j] : max_delta);
+			if (max_delta > 0.0) {
+				for (size_t j=0; j < n; j++)
+					delta_i[j] /= max_delta;
+				log_scale += log(max_delta);
 			}
 			delta.push_back(delta_i);
 			psi.push_back(psi_i);
@@ -602,24 +664,23 @@ vector<size_t> TriCRF2::viterbiSearch(size_t& max_z, long double& prob) {
 
 		/// Back-tracking
 		vector<size_t> y_seq;
-		size_t prev_y = m_y_state[z][0].y2;
+		size_t prev_y = m_y_state[z][0].y1;
 		for (size_t i = m_seq_size-1; i >= 1; i--) {
-			//cout << prev_y << " " << psi[i][prev_y] << endl;
 			size_t y = psi[i][prev_y];
-			y_seq.push_back(y);
+			y_seq.push_back(label[y]);
 			prev_y = y;
 		}
 		reverse(y_seq.begin(), y_seq.end());
-		double tmp_prob = delta[m_seq_size-1][m_y_state[z][0].y2] * m_Gamma[z];
+		long double tmp_prob = log((long double)delta[m_seq_size-1][m_y_state[z][0].y1] * m_Gamma[z]) + log_scale;
 
-		if (tmp_prob > max_prob) {
+		if (prune == 0 || tmp_prob > max_prob) {
 			max_prob = tmp_prob;
 			max_z = z;
 			max_y = y_seq;
 		}
 
 	} ///< for each z
-	prob = max_prob;
+	prob = expl(max_prob);
 	return max_y;
 
 }
@@ -629,6 +690,7 @@ void TriCRF2::createIndex() {
 	/// todo: remove the makeStateIndex(z)
 	m_y_state.clear();
 	m_zy_index.clear();
+	m_yz_index.clear();
 	m_zy_size.clear();
 	m_zy_index.resize(m_topic_size);
 	m_yz_index.resize(m_topic_size);
@@ -636,7 +698,7 @@ void TriCRF2::createIndex() {
 		vector<StateParam> y_state = m_ParamTopic.makeStateIndex(z);
 		m_zy_size.push_back(y_state.size());
 		m_zy_index[z].resize(m_state_size);
-		m_yz_index[z].resize(m_state_size);
+		m_yz_index[z].resize(y_state.size());
 		fill(m_zy_index[z].begin(), m_zy_index[z].end(), m_state_size);
 		for (vector<StateParam>::iterator iter = y_state.begin(); iter != y_state.end(); ++iter) {
 			m_zy_index[z][iter->y2] = iter->y1;
@@ -655,7 +717,8 @@ bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 
 	/// Parameter weight setting
 	size_t n_theta = m_ParamTopic.size() + m_ParamSeq.size();
-	double* theta = new double[n_theta];
+	WeightVector theta_vec(n_theta);	///< concatenated weights (mapped with mmap_dir)
+	double* theta = &theta_vec[0];
 
 	double* theta_topic = m_ParamTopic.getWeight();
 	double* theta_seq = m_ParamSeq.getWeight();
@@ -665,7 +728,8 @@ bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 	for (size_t i = 0; i < m_ParamSeq.size(); ++i, ++tmp_i)
 		theta[tmp_i] = theta_seq[i];
 
-	double* gradient = new double[n_theta]; //m_Param.getGradient();
+	WeightVector gradient_vec(n_theta);	///< concatenated gradients (mapped with mmap_dir)
+	double* gradient = &gradient_vec[0];
 	double* gradient_topic = m_ParamTopic.getGradient();
 	double* gradient_seq = m_ParamSeq.getGradient();
 
@@ -696,13 +760,29 @@ bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 
 	createIndex();
 
+	/// Distributed training ; a worker runs until the coordinator stops
+	bool worker = isWorker();
+	size_t shard_begin, shard_end;
+	getShard(m_TrainSet->size(), shard_begin, shard_end);
+
 	/// Training iteration
-    for (size_t niter = 0 ;niter < (int)max_iter; ++niter) {
+    for (size_t niter = 0 ; worker || niter < (int)max_iter; ++niter) {
+		if (!syncTheta(theta, n_theta))
+			break;
+		if (worker) {
+			m_ParamTopic.setWeight(theta);
+			m_ParamSeq.setWeight(&theta[m_ParamTopic.size()]);
+		}
 
 		/// Initializing local variables
         timer t2;	///< elapsed time for one iteration
-		m_ParamTopic.initializeGradient();	///< gradient vector initialization
-		m_ParamSeq.initializeGradient();
+		if (worker) {	///< the empirical counts are added by the coordinator
+			m_ParamTopic.initializeGradient2();
+			m_ParamSeq.initializeGradient2();
+		} else {
+			m_ParamTopic.initializeGradient();	///< gradient vector initialization
+			m_ParamSeq.initializeGradient();
+		}
 
 		eval1.initialize();	///< evaluator intialization
 		eval2.initialize();
@@ -710,10 +790,12 @@ bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 		calculateEdge();
 
 		/// for each training set
-        vector<TriSequence>::iterator it = m_TrainSet.begin();
-		vector<double>::iterator count_it = m_TrainSetCount.begin();
-        for (; it != m_TrainSet.end(); ++it, ++count_it) {
+        vector<TriSequence>::const_iterator it = m_TrainSet->begin() + shard_begin;
+		vector<double>::const_iterator count_it = m_TrainSetCount->begin() + shard_begin;
+        for (; it != m_TrainSet->begin() + shard_end; ++it, ++count_it) {
 			double count = *count_it;
+			if (count == 0.0)	///< out of the fold (see fold())
+				continue;
 			/// Forward-Backward
 			timer stop_watch;
 			calculateFactors(*it);
@@ -804,7 +886,7 @@ bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 									a_y = m_Alpha[z][TCRF2_MAT2(m_zy_size[z], i-1, new_y1)];
 								}
 								long double b_y = m_Beta[z][TCRF2_MAT2(m_zy_size[z], i, new_y2)];
-								long double m_yy = m_R[MAT2(i,iter->y2)] * m_M[MAT2(iter->y1,iter->y2)] * m_Z[MAT2(z, iter->y2)];
+								long double m_yy = m_R[MAT2(i,iter->y2)] * m_M[MAT2(iter->y1,iter->y2)] * m_Z[MAT2(z, iter->y2)] / scale[i];
 								long double prob = a_y * b_y * m_yy * m_Gamma[z] / zval;
 								prob_sum += prob;
 							} ///< if
@@ -857,10 +939,12 @@ bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 		timer stop_watch;
 		double time_for_dev = 0.0;
 		/// for each dev data
-        it = m_DevSet.begin();
-		count_it = m_DevSetCount.begin();
-        for (; it != m_DevSet.end(); ++it, ++count_it) {
+        it = m_DevSet->begin();
+		count_it = m_DevSetCount->begin();
+        for (; it != m_DevSet->end(); ++it, ++count_it) {
 			double count = *count_it;
+			if (count == 0.0)	///< out of the fold (see fold())
+				continue;
 			calculateFactors(*it);
   			forward();
 			long double zval = getPartitionZ();
@@ -896,6 +980,10 @@ bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 			gradient[tmp_i] = gradient_seq[i];
 		}
 
+		/// summing up the shards
+		if (!syncGradient(gradient, n_theta, eval1, &eval2))
+			continue;
+
 		/// applying regularization
 		size_t n_nonzero = 0;
 		if (sigma) {
@@ -937,9 +1025,12 @@ bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 		/// Reporting the result
 		eval1.calculateF1();
 		eval2.calculateF1();
-		if (m_DevSet.size() > 0) {
+		bool stop = false;
+		if (m_DevSet->size() > 0) {
 			dev_eval1.calculateF1();
 			dev_eval2.calculateF1();
+			setDevScore(dev_eval2, &dev_eval1);
+			stop = checkEarlyStop(niter);	///< the parameter vectors are not updated yet
 			logger->report("%4d %15E %8.3f %8.3f %8.3f %8.3f  |  %8.3f %8.3f %8.3f\n",
 				niter, eval1.getLoglikelihood(),
 				eval1.getAccuracy(), eval1.getMicroF1()[2], eval1.getMacroF1()[2], t2.elapsed(),
@@ -958,14 +1049,156 @@ bool TriCRF2::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 		/// Updating the parameter vectors
 		m_ParamTopic.setWeight(theta);
 		m_ParamSeq.setWeight(&theta[m_ParamTopic.size()]);
+		if (stop)
+			break;
 
 	} ///< for iter
 
-	delete theta;
-	delete gradient;
+	return !clusterFailed();
 
-	return true;
+}
+
+/**	Accumulate the PL gradients and evaluations of the sequences in a shard.
+	The transitions are read from m_OutState and m_InTopic.
+*/
+void TriCRF2::estimateShard(TrainShard& shard) {
+	double* theta_topic = m_ParamTopic.getWeight();
+	double* theta_seq = m_ParamSeq.getWeight();
+	double* gradient_topic = shard.gradient[0];
+	double* gradient_seq = shard.gradient[1];
+	Evaluator& eval1 = *shard.eval[0];
+	Evaluator& eval2 = *shard.eval[1];
+	vector<double>& prob_topic = shard.prob1;
+	vector<double>& prob_seq = shard.prob2;
+	vector<size_t>& reference1 = shard.reference1;
+	vector<size_t>& hypothesis1 = shard.hypothesis1;
+	vector<size_t>& reference2 = shard.reference2;
+	vector<size_t>& hypothesis2 = shard.hypothesis2;
+	prob_topic.resize(m_topic_size);
+	prob_seq.resize(m_state_size);
+
+	for (size_t s = shard.begin; s < shard.end; s++) {
+		const TriSequence* it = &(*m_TrainSet)[s];
+		double count = (*m_TrainSetCount)[s];
+		if (count == 0.0)	///< out of the fold (see fold())
+			continue;
+
+		/////////////////////////////////////////////////////////////////////
+		/// PL for topic
+		/////////////////////////////////////////////////////////////////////
+		reference1.clear();
+		hypothesis1.clear();
+		size_t max_z = 0;
+		fill(prob_topic.begin(), prob_topic.end(), 0.0);
+
+		/// Inference
+		vector<pair<size_t, double> >::const_iterator obs = it->topic.obs.begin();
+		for (; obs != it->topic.obs.end(); ++obs) {
+			const vector<pair<size_t, size_t> >& param = (*m_ParamTopic.m_ParamIndex)[obs->first];
+			for (size_t j = 0; j < param.size(); ++j)
+				prob_topic[param[j].first] += theta_topic[param[j].second] * obs->second;
+		}
+		for (size_t i = 0; i < it->seq.size(); ++i) {	 /// f(y,z)
+			vector<StateParam>& trans = m_InTopic[it->seq[i].label];
+			for (vector<StateParam>::iterator iter = trans.begin(); iter != trans.end(); ++iter)
+				prob_topic[iter->y1] += theta_topic[iter->fid] * iter->fval;
+		}
+
+		/// normalize
+		double sum = 0.0;
+		double max = 0.0;
+		for (size_t j=0; j < m_topic_size; j++) {
+			prob_topic[j] = exp(prob_topic[j]); // * y_prob[j];
+			sum += prob_topic[j];
+			if (prob_topic[j] > max) {
+				max = prob_topic[j];
+				max_z = j;
+			}
+		}
+		for (size_t j=0; j < m_topic_size; j++) {
+			prob_topic[j] /= sum;
+		}
+
+		/// evaluating
+		reference1.push_back(it->topic.label);
+		hypothesis1.push_back(max_z);
+
+		/// calculate the expectation
+		/// E[p] - E[~p]
+		for (obs = it->topic.obs.begin(); obs != it->topic.obs.end(); ++obs) {
+			const vector<pair<size_t, size_t> >& param = (*m_ParamTopic.m_ParamIndex)[obs->first];
+			for (size_t j = 0; j < param.size(); ++j)
+				gradient_topic[param[j].second] += prob_topic[param[j].first] * obs->second * count;
+		}
+		for (size_t i = 0; i < it->seq.size(); ++i) { /// f(y,z)
+			vector<StateParam>& trans = m_InTopic[it->seq[i].label];
+			for (vector<StateParam>::iterator iter = trans.begin(); iter != trans.end(); ++iter)
+				gradient_topic[iter->fid] += prob_topic[iter->y1] * iter->fval * count;
+		}
+
+		/////////////////////////////////////////////////////////////////////
+		/// PL for sequence
+		/////////////////////////////////////////////////////////////////////
+		size_t prev_label = m_default_oid;
+		reference2.clear();
+		hypothesis2.clear();
+		for (size_t i = 0; i < it->seq.size(); ++i) {
+
+			size_t max_y = m_default_oid;
+			fill(prob_seq.begin(), prob_seq.end(), 0.0);
+
+			/// w * f (for all classes)
+			for (obs = it->seq[i].obs.begin(); obs != it->seq[i].obs.end(); ++obs) {
+				const vector<pair<size_t, size_t> >& param = (*m_ParamSeq.m_ParamIndex)[obs->first];
+				for (size_t j = 0; j < param.size(); ++j)
+					prob_seq[param[j].first] += theta_seq[param[j].second] * obs->second;
+			}
+			vector<StateParam>& trans = m_OutState[prev_label];
+			for (vector<StateParam>::iterator iter = trans.begin(); iter != trans.end(); ++iter)
+				prob_seq[iter->y2] += theta_seq[iter->fid] * iter->fval;
+
+			/// normalize
+			double sum = 0.0;
+			double max = 0.0;
+			for (size_t j=0; j < m_state_size; j++) {
+				prob_seq[j] = exp(prob_seq[j]); // * y_prob[j];
+				sum += prob_seq[j];
+				if (prob_seq[j] > max) {
+					max = prob_seq[j];
+					max_y = j;
+				}
+			}
+			for (size_t j=0; j < m_state_size; j++) {
+				prob_seq[j] /= sum;
+			}
+
+			reference2.push_back(it->seq[i].label);
+			hypothesis2.push_back(max_y);
+
+			for (obs = it->seq[i].obs.begin(); obs != it->seq[i].obs.end(); ++obs) {
+				const vector<pair<size_t, size_t> >& param = (*m_ParamSeq.m_ParamIndex)[obs->first];
+				for (size_t j = 0; j < param.size(); ++j)
+					gradient_seq[param[j].second] += prob_seq[param[j].first] * obs->second * count;
+			}
+			for (vector<StateParam>::iterator iter = trans.begin(); iter != trans.end(); ++iter)
+				shard.assign(1, iter->fid, prob_seq[iter->y2] * iter->fval * count);
 
+			/// evaluation (accuracy and f1 score)
+			for (size_t c = 0; c < count; c++) {
+				eval2.addLikelihood(prob_seq[it->seq[i].label]);
+			}
+
+			prev_label = it->seq[i].label;
+		}
+
+		/// evaluation
+		for (size_t c = 0; c < count; c++) {
+			eval1.addLikelihood(prob_topic[it->topic.label]);
+			eval1.append(reference1, hypothesis1);
+			eval2.append(reference2, hypothesis2);
+		}
+
+	} ///< for shard
 }
 
 /** Training with Psuedo-likelihood.
@@ -981,6 +1214,9 @@ bool TriCRF2::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 	double* gradient_seq = m_ParamSeq.getGradient();
 	Evaluator eval1(m_ParamTopic, false);		///< Evaluator (topic)
 	Evaluator eval2(m_ParamSeq);		///< Evaluator (sequence)
+	vector<Evaluator*> evals;
+	evals.push_back(&eval1);
+	evals.push_back(&eval2);
 	timer t;		///< timer
 
 	/// Reporting
@@ -1002,6 +1238,9 @@ bool TriCRF2::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 	double time_for_topic = 0.0;
 
 	createIndex();
+	/// transitions grouped by the previous label and the topic features by the label, instead of scanning the state indexes
+	m_OutState = m_ParamSeq.groupStateIndex(true, m_state_size);
+	m_InTopic = m_ParamTopic.groupStateIndex(false, m_state_size);
 
 	/// Training iteration
     for (size_t niter = 0 ;niter < (int)max_iter; ++niter) {
@@ -1014,129 +1253,9 @@ bool TriCRF2::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 		eval1.initialize();	///< evaluator intialization
 		eval2.initialize();
 
-		/// for each training example
+		/// for each training example (in shards)
 		timer stop_watch;
-        vector<TriSequence>::iterator it = m_TrainSet.begin();
-		vector<double>::iterator count_it = m_TrainSetCount.begin();
-        for (; it != m_TrainSet.end(); ++it, ++count_it) {
-			double count = *count_it;
-
-
-			/////////////////////////////////////////////////////////////////////
-			/// PL for topic
-			/////////////////////////////////////////////////////////////////////
-			vector<size_t> reference1, hypothesis1;
-			size_t max_z = 0;
-			vector<double> prob_topic(m_topic_size);
-			fill(prob_topic.begin(), prob_topic.end(), 0.0);
-
-			/// Inference
-			vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(it->topic.obs);
-			for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-				prob_topic[iter->y] += theta_topic[iter->fid] * iter->fval;
-			}
-			for (size_t i = 0; i < it->seq.size(); ++i) {	 /// f(y,z)
-				for (vector<StateParam>::iterator iter = m_ParamTopic.m_StateIndex.begin(); iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
-					if (iter->y2 == it->seq[i].label)
-						prob_topic[iter->y1] += theta_topic[iter->fid] * iter->fval;
-				}
-			}
-
-			/// normalize
-			double sum = 0.0;
-			double max = 0.0;
-			for (size_t j=0; j < m_topic_size; j++) {
-				prob_topic[j] = exp(prob_topic[j]); // * y_prob[j];
-				sum += prob_topic[j];
-				if (prob_topic[j] > max) {
-					max = prob_topic[j];
-					max_z = j;
-				}
-			}
-			for (size_t j=0; j < m_topic_size; j++) {
-				prob_topic[j] /= sum;
-			}
-
-			/// evaluating
-			reference1.push_back(it->topic.label);
-			hypothesis1.push_back(max_z);
-
-			/// calculate the expectation
-			/// E[p] - E[~p]
-			for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-				gradient_topic[iter->fid] += prob_topic[iter->y] * iter->fval * count;
-			}
-			for (size_t i = 0; i < it->seq.size(); ++i) { /// f(y,z)
-				for (vector<StateParam>::iterator iter = m_ParamTopic.m_StateIndex.begin(); iter != m_ParamTopic.m_StateIndex.end(); ++iter) {
-					if (iter->y2 == it->seq[i].label)
-						gradient_topic[iter->fid] += prob_topic[iter->y1] * iter->fval * count;
-				}
-			}
-
-			/////////////////////////////////////////////////////////////////////
-			/// PL for sequence
-			/////////////////////////////////////////////////////////////////////
-			size_t prev_label = m_default_oid;
-			size_t next_label = m_default_oid;
-			vector<size_t> reference2, hypothesis2;
-			for (size_t i = 0; i < it->seq.size(); ++i) {
-
-				size_t max_y = m_default_oid;
-				vector<double> prob_seq(m_state_size);
-				fill(prob_seq.begin(), prob_seq.end(), 0.0);
-
-				/// w * f (for all classes)
-				vector<ObsParam> obs_param = m_ParamSeq.makeObsIndex(it->seq[i].obs);
-				for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-					prob_seq[iter->y] += theta_seq[iter->fid] * iter->fval;
-				}
-				for (vector<StateParam>::iterator iter = m_ParamSeq.m_StateIndex.begin(); iter != m_ParamSeq.m_StateIndex.end(); ++iter) {
-					if (iter->y1 == prev_label)
-						prob_seq[iter->y2] += theta_seq[iter->fid] * iter->fval;
-				}
-
-				/// normalize
-				double sum = 0.0;
-				double max = 0.0;
-				for (size_t j=0; j < m_state_size; j++) {
-					prob_seq[j] = exp(prob_seq[j]); // * y_prob[j];
-					sum += prob_seq[j];
-					if (prob_seq[j] > max) {
-						max = prob_seq[j];
-						max_y = j;
-					}
-				}
-				for (size_t j=0; j < m_state_size; j++) {
-					prob_seq[j] /= sum;
-				}
-
-				reference2.push_back(it->seq[i].label);
-				hypothesis2.push_back(max_y);
-
-				for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-					gradient_seq[iter->fid] += prob_seq[iter->y] * iter->fval * count;
-				}
-				for (vector<StateParam>::iterator iter = m_ParamSeq.m_StateIndex.begin(); iter != m_ParamSeq.m_StateIndex.end(); ++iter) {
-					if (iter->y1 == prev_label)
-						gradient_seq[iter->fid] = prob_seq[iter->y2] * iter->fval * count;
-				}
-
-				/// evaluation (accuracy and f1 score)
-				for (size_t c = 0; c < count; c++) {
-					eval2.addLikelihood(prob_seq[it->seq[i].label]);
-				}
-
-				prev_label = it->seq[i].label;
-			}
-
-			/// evaluation
-			for (size_t c = 0; c < count; c++) {
-				eval1.addLikelihood(prob_topic[it->topic.label]);
-				eval1.append(reference1, hypothesis1);
-				eval2.append(reference2, hypothesis2);
-			}
-
-		} ///< for m_TrainSet
+		accumulateShards(0, m_TrainSet->size(), evals);
 		time_for_topic += stop_watch.elapsed();
 
 		/////////////////////////////////////////////////////////////////////////////////
@@ -1148,11 +1267,16 @@ bool TriCRF2::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 		dev_eval2.initialize();
 		stop_watch.restart();
 		double time_for_dev = 0.0;
+		/// the transition factors are not computed by the PL training
+		if (m_DevSet->size() > 0)
+			calculateEdge();
 		/// for each dev data
-        it = m_DevSet.begin();
-		count_it = m_DevSetCount.begin();
-        for (; it != m_DevSet.end(); ++it, ++count_it) {
+        vector<TriSequence>::const_iterator it = m_DevSet->begin();
+		vector<double>::const_iterator count_it = m_DevSetCount->begin();
+        for (; it != m_DevSet->end(); ++it, ++count_it) {
 			double count = *count_it;
+			if (count == 0.0)	///< out of the fold (see fold())
+				continue;
 			calculateFactors(*it);
   			forward();
 			long double zval = getPartitionZ();
@@ -1254,9 +1378,10 @@ bool TriCRF2::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 		/// Reporting the result
 		eval1.calculateF1();
 		eval2.calculateF1();
-		if (m_DevSet.size() > 0) {
+		if (m_DevSet->size() > 0) {
 			dev_eval1.calculateF1();
 			dev_eval2.calculateF1();
+			setDevScore(dev_eval2, &dev_eval1);
 			logger->report("%4d %15E %8.3f %8.3f %8.3f %8.3f  |  %8.3f %8.3f %8.3f\n",
 				niter, eval1.getLoglikelihood(),
 				eval1.getAccuracy(), eval1.getMicroF1()[2], eval1.getMacroF1()[2], t2.elapsed(),
@@ -1290,135 +1415,87 @@ bool TriCRF2::pretrain(size_t max_iter, double sigma, bool L1) {
 }
 
 bool TriCRF2::train(size_t max_iter, double sigma, bool L1) {
-		return estimateWithLBFGS(max_iter, sigma, L1);
+	beginEarlyStop();
+	bool ok = estimateWithLBFGS(max_iter, sigma, L1);
+	endEarlyStop();
+	return ok;
 }
 
-bool TriCRF2::test(const std::string& filename, const std::string& outputfile, bool confidence) {
-	/// File stream
-	string line;
-	ifstream f(filename.c_str());
-	if (!f)
-		throw runtime_error("cannot open data file");
-
-	/// output
-	ofstream out;
-	vector<string> state_vec, seq_state_vec;
-	if (outputfile != "") {
-		out.open(outputfile.c_str());
-		out.precision(20);
-		state_vec = m_ParamTopic.getState().second;
-		seq_state_vec = m_ParamSeq.getState().second;
+/**	Evaluation of the compiled decoding in TriCRF2::test().
+	@class TriCRF2Evaluator
+*/
+class TriCRF2Evaluator : public DecodeEvaluator {
+public:
+	Evaluator topic_eval;	///< topic classification
+	Evaluator seq_eval;		///< sequential labeling
+	const Map* topic_map;	///< topic -> id
+	const Map* seq_map;		///< label -> id
+	size_t n_topic;			///< id of the unknown topics (out of class)
+	size_t default_oid;		///< id of the unknown labels
+	vector<size_t> reference;
+
+	TriCRF2Evaluator(Parameter& param_topic, Parameter& param_seq, size_t oid)
+		: topic_eval(param_topic, false), seq_eval(param_seq), default_oid(oid) {
+		topic_eval.initialize();
+		seq_eval.initialize();
+		topic_map = &param_topic.getStateMap();
+		seq_map = &param_seq.getStateMap();
+		n_topic = param_topic.sizeStateVec();
 	}
 
-	/// initializing
-	size_t count = 0;
-	TriStringSequence triseq;
-	logger->report("[Testing begins ...]\n");
-	timer stop_watch;
-	Evaluator test_eval1(m_ParamTopic, false);		///< Evaluator (topic)
-	Evaluator test_eval2(m_ParamSeq);		///< Evaluator (sequence)
-	test_eval1.initialize();	///< evaluator intialization
-	test_eval2.initialize();
-	size_t seq_count = 0;
-
-	calculateEdge();
-
-	/// reading the text
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty()) {
-			/// test
-			calculateFactors(triseq);
-  			forward();
-			long double zval = getPartitionZ();
-            long double dummy_prob;
-
-			////////////////////////////////////////////////////////////////////
-			/// pruning
-			////////////////////////////////////////////////////////////////////
-			long double threshold = m_prune[0].first / m_prune_threshold;
-			vector<pair<long double, size_t> >::iterator pit = m_prune.begin();
-			for (; pit != m_prune.end(); pit++) {
-				if (pit->first < threshold) {
-					m_prune.erase(pit, m_prune.end());
-					break;
-				}
-			}
-
-			size_t max_z;
-			vector<size_t> y_seq = viterbiSearch(max_z, dummy_prob);
-			assert(y_seq.size() == triseq.size());
-
-			vector<size_t> reference1, hypothesis1;
-			reference1.push_back(triseq.topic.label);
-			hypothesis1.push_back(max_z);
-			test_eval1.append(reference1, hypothesis1);
-			if (outputfile != "") {
-				out << state_vec[max_z];
-				/*
-				if (confidence) {
-					double prob = m_Alpha[max_z][TCRF2_MAT2(m_zy_size[max_z], m_seq_size-1, m_y_state[max_z][0].y1)] * m_Gamma[max_z] / zval;
-					out << " " << prob;
-				}
-				*/
-				out << endl;
-			}
-
-			size_t prev_y = m_default_oid;
-			vector<string> reference, hypothesis;
-			StringSequence::iterator it = triseq.seq.begin();
-			for (size_t i = 0; it != triseq.seq.end(); ++i, ++it) {	 /// for each node in sequence
-				size_t outcome = triseq.seq[i].label;
-				string outcome_s;
-				if (m_ParamSeq.sizeStateVec() <= outcome)
-					outcome_s = m_ParamSeq.getState().second[m_default_oid];
-				else
-					outcome_s = m_ParamSeq.getState().second[outcome];
-				string y_seq_s = m_ParamSeq.getState().second[y_seq[i]];
-
-				reference.push_back(outcome_s);
-				hypothesis.push_back(y_seq_s);
-
-				if (outputfile != "") {
-					out << y_seq_s;
-					/*
-					if (confidence) {
-						double norm = 0.0;
-						for (size_t j = 0; j < m_y_state.size(); j++)
-							norm += m_R[MAT2(i, j)] * m_M[MAT2(prev_y, j)] * m_Z[MAT2(max_z, j)];
-						double prob = m_R[MAT2(i, y_seq[i])] * m_M[MAT2( prev_y, y_seq[i])] * m_Z[MAT2(max_z, y_seq[i])] / norm;
-						out << " " << prob;
-						prev_y = y_seq[i];
-					}
-					*/
-					out << endl;
-				}
-			}
-			if (outputfile != "")
-				out << endl;
-
-			test_eval2.append(m_ParamSeq, reference, hypothesis);
-
-			triseq.seq.clear();
-			seq_count = 0;
-			++count;
-		} else {
-			++seq_count;
-			if (seq_count == 1) { ///< this is a topic
-				triseq.topic = packEvent(tokens, &m_ParamTopic, true);	///< wanrning: There are no common element in topic classes and sequence classes.
-			} else {
-				StringEvent ev = packStringEvent(tokens, &m_ParamSeq, true);	///< observation features
-				triseq.seq.push_back(ev);	///< append
-			}
+	DecodeEvaluator* clone() const {
+		TriCRF2Evaluator* copy = new TriCRF2Evaluator(*this);
+		copy->clear();
+		return copy;
+	}
 
-		}	///< else
+	void clear() {
+		topic_eval.initialize();
+		seq_eval.initialize();
+	}
 
+	void append(const vector<string>& lines, const DecodeResult& result) {
+		if (lines.empty() || result.label_ids.size() != lines.size() - 1)
+			return;	///< not decoded
+		Map::const_iterator it = topic_map->find(referenceLabel(lines[0]));
+		size_t topic = (it != topic_map->end() ? it->second : n_topic);
+		topic_eval.append(&topic, &result.topic_id, 1);
+
+		reference.clear();
+		for (size_t i = 1; i < lines.size(); i++) {
+			it = seq_map->find(referenceLabel(lines[i]));
+			reference.push_back(it != seq_map->end() ? it->second : default_oid);
+		}
+		if (!reference.empty())
+			seq_eval.append(&reference[0], &result.label_ids[0], reference.size());
+	}
 
-	}	///< while
+	void merge(const DecodeEvaluator& other) {
+		topic_eval.merge(((const TriCRF2Evaluator&)other).topic_eval);
+		seq_eval.merge(((const TriCRF2Evaluator&)other).seq_eval);
+	}
+};
+
+/**	Test the model on a data file.
+	The file is decoded by the compiled model (see decodeFile()) in batches of m_decode_batch,
+	over m_decode_thread decoder threads, and the results are evaluated in the order of the input.
+	@param filename		data file
+	@param outputfile	output file (topic, and labels)
+	@param confidence	not used ; the probabilities are not written
+	@return true if succeeded
+*/
+bool TriCRF2::test(const std::string& filename, const std::string& outputfile, bool confidence) {
+	logger->report("[Testing begins ...]\n");
+	timer stop_watch;
+	TriCRF2Evaluator evaluator(m_ParamTopic, m_ParamSeq, m_default_oid);
+	CompiledModel* compiled = compile();
+	decodeFile(*compiled, filename, outputfile, CONFIDENCE_NONE, m_decode_batch, logger, m_decode_thread, &evaluator);
+	delete compiled;
 
+	Evaluator& test_eval1 = evaluator.topic_eval;
+	Evaluator& test_eval2 = evaluator.seq_eval;
 	test_eval1.calculateF1();
 	test_eval2.calculateF1();
-	logger->report("  # of data = \t\t%d\n", count);
 	logger->report("  testing time = \t%.3f\n\n", stop_watch.elapsed());
 	logger->report("  Topic Classification \n");
 	logger->report("  Acc = \t\t%8.3f\n", test_eval1.getAccuracy());
@@ -1428,6 +1505,128 @@ bool TriCRF2::test(const std::string& filename, const std::string& outputfile, b
 	logger->report("  Acc = \t\t%8.3f\n", test_eval2.getAccuracy());
 	logger->report("  MicroF1 = \t\t%8.3f\n", test_eval2.getMicroF1()[2]);
 	logger->report("  MacroF1 = \t\t%8.3f\n", test_eval2.getMacroF1()[2]);
+	return true;
+}
+
+/**	Compile the model for the decoder sessions.
+	The label set of each topic is the reduced search space (m_y_state), and the topic factor (m_Z)
+	becomes a static node factor of the labels.
+	@return compiled model (owned by the caller)
+*/
+CompiledModel* TriCRF2::compile() {
+	CompiledModel* model = new CompiledModel();
+	model->setFeatures(m_ParamSeq);
+	model->setTopicFeatures(m_ParamTopic);
+
+	calculateEdge();	///< with the topic factor
+
+	vector<string> topics = m_ParamTopic.getStateVec();
+	vector<string> seq_states = m_ParamSeq.getStateVec();
+	for (size_t z = 0; z < m_topic_size; z++) {
+		size_t size = m_y_state[z].size();
+		vector<string> states(size);
+		vector<size_t> l2g(size);
+		for (size_t y = 0; y < size; y++) {
+			l2g[y] = m_y_state[z][y].y2;
+			states[y] = seq_states[l2g[y]];
+		}
+		model->addTopic(topics[z], states, l2g);
+
+		size_t y_end = m_y_state[z][0].y2;
+		vector<double> start(size), end(size), node(size);
+		vector<double> trans(size * size);
+		for (size_t k = 0; k < size; k++) {
+			start[k] = m_M[MAT2(m_default_oid, l2g[k])];
+			end[k] = m_M[MAT2(l2g[k], y_end)] * m_Z[MAT2(z, y_end)];
+			node[k] = m_Z[MAT2(z, l2g[k])];
+			for (size_t j = 0; j < size; j++)
+				trans[size * k + j] = m_M[MAT2(l2g[k], l2g[j])];
+		}
+		model->setEdge(z, start, trans, end, node);
+	}
+	model->setPrune(m_prune_threshold);
+	model->setViterbiBound(m_viterbi_bound);
+	model->setTemplate(m_Template);
+
+	return model;
+}
+
+MaxEnt* TriCRF2::clone() {
+	return new TriCRF2(*this);
+}
+
+vector<Parameter*> TriCRF2::getParams() {
+	vector<Parameter*> params;
+	params.push_back(&m_ParamTopic);
+	params.push_back(&m_ParamSeq);
+	return params;
+}
+
+MaxEnt* TriCRF2::fold(size_t k, size_t n_fold) {
+	TriCRF2* model = new TriCRF2(*this);
+	model->m_DevSet = m_TrainSet;
+	splitFold(*m_TrainSetCount, k, n_fold, model->m_TrainSetCount.reset(), model->m_DevSetCount.reset());
+	model->countFeatures();
+	return model;
+}
+
+void TriCRF2::countFeatures() {
+	m_ParamSeq.clearCount();
+	m_ParamTopic.clearCount();
+	const Vec& state_vec = m_ParamSeq.getStateVec();
+	const Vec& topic_vec = m_ParamTopic.getStateVec();
+	for (size_t i = 0; i < m_TrainSet->size(); i++) {
+		const TriSequence& triseq = (*m_TrainSet)[i];
+		double count = (*m_TrainSetCount)[i];
+		const Event& topic = triseq.topic;
+		for (size_t k = 0; k < topic.obs.size(); k++)
+			m_ParamTopic.addCount(topic.label, topic.obs[k].first, count * topic.fval);
+
+		int topic_pid = m_ParamTopic.findObs("@" + topic_vec[topic.label]);
+		for (size_t j = 0; j < triseq.seq.size(); j++) {
+			const Event& ev = triseq.seq[j];
+			for (size_t k = 0; k < ev.obs.size(); k++)
+				m_ParamSeq.addCount(ev.label, ev.obs[k].first, count * ev.fval);
+			/// state transition features
+			if (j > 0) {
+				int pid = m_ParamSeq.findObs("@" + state_vec[triseq.seq[j-1].label]);
+				if (pid >= 0)
+					m_ParamSeq.addCount(ev.label, pid, count * ev.fval);
+			}
+			/// topic-sequence state features
+			if (topic_pid >= 0)
+				m_ParamTopic.addCount(ev.label, topic_pid, count * ev.fval);
+		}
+	}
+}
+
+size_t TriCRF2::sizeParam() {
+	return m_ParamSeq.size() + m_ParamTopic.size();
+}
+
+/**	Bytes held by the structures of the model ; the tables of each topic are sized to its labels.
+*/
+void TriCRF2::measureMemory(MemoryUsage& usage) {
+	CRF::measureMemory(usage);
+	usage.add("training set", bytesOf(*m_TrainSet));
+	usage.add("dev set", bytesOf(*m_DevSet));
+	usage.add("DP tables", bytesOf(m_Z) + bytesOf(m_Gamma));
+	usage.add("DP tables (per topic)", bytesOf(m_Alpha) + bytesOf(m_Beta) + bytesOf(m_zy_M) + bytesOf(m_zy_start));
+	usage.add("label index", bytesOf(m_zy_index) + bytesOf(m_yz_index) + bytesOf(m_zy_size) + bytesOf(m_y_state));
+	usage.add("PL index", bytesOf(m_InTopic));
+}
+
+/**	Bytes predicted from the statistics of the training file ; every label is assumed to appear
+	with every topic, which bounds the per-topic tables.
+*/
+void TriCRF2::estimateMemory(const CorpusStats& stats, MemoryUsage& usage) {
+	CRF::estimateMemory(stats, usage);
+	size_t L = stats.n_label;
+	size_t heap = (stats.n_obs > 0 ? stats.obs_heap / stats.n_obs : 0);
+	estimateParam(usage, stats.n_topic_param, stats.n_topic_param, heap);
+	usage.add("training set", stats.n_seq * sizeof(Event) + stats.n_topic_obs * sizeof(pair<size_t, double>));
+	usage.add("DP tables", 2 * stats.n_topic * sizeof(double));
+	usage.add("DP tables (per topic)", stats.n_topic * (2 * stats.max_len * L + L * L + L) * sizeof(double));
 }
 
 }	///< namespace tricrf
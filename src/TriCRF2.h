@@ -23,19 +23,22 @@ namespace tricrf {
 class TriCRF2 : public CRF {
 protected:
 	/// Data sets
-	Data<TriSequence> m_TrainSet;	 ///< Train data
-	Data<TriSequence> m_DevSet;	///< Development data (held-out data)
+	Shared<Data<TriSequence> > m_TrainSet;	 ///< Train data (shared by the copies of the model)
+	Shared<Data<TriSequence> > m_DevSet;	///< Development data (held-out data)
 
-	std::vector<long double> m_Z;			///< Z matrix ; topic prior
-	std::vector<std::vector<long double> > m_Alpha;	///< Alpha matrix
-	std::vector<std::vector<long double> > m_Beta;		///< Beta matrix
-	std::vector<long double> m_Gamma;			///< Gamma matrix ; topic prior
+	/// The tables are in double ; alpha and beta of all the topics share the scale at each position (see CRF::scale)
+	std::vector<double> m_Z;			///< Z matrix ; topic prior
+	std::vector<std::vector<double> > m_Alpha;	///< Alpha matrix
+	std::vector<std::vector<double> > m_Beta;		///< Beta matrix
+	std::vector<double> m_Gamma;			///< Gamma matrix ; topic prior
 
 	/// for improving the speed
 	std::vector<std::vector<size_t> > m_zy_index;
-	std::vector<std::vector<size_t> > m_yz_index;
+	std::vector<std::vector<size_t> > m_yz_index;	///< local-to-global labels of each topic
 	std::vector<size_t> m_zy_size;
 	std::vector<std::vector<StateParam> > m_y_state;
+	std::vector<std::vector<double> > m_zy_M;	///< transitions between the local labels, with the topic factor (see calculateEdge())
+	std::vector<std::vector<double> > m_zy_start;	///< transitions from the start, with the topic factor
 	void createIndex();
 
 	/// Parameters
@@ -46,18 +49,29 @@ protected:
 	size_t m_topic_size;
 
 	/// Inference
-	void calculateFactors(TriSequence &seq);	///< Calculating the factors
-	void calculateFactors(TriStringSequence &seq);	///< Calculating the factors
+	void calculateFactors(const TriSequence &seq);	///< Calculating the factors
+	void calculateFactors(const TriStringSequence &seq);	///< Calculating the factors
 	void calculateEdge();
 	void forward();	 ///< Forward recursion
+	void scaleAlpha(size_t i);	///< shared scale of the topics at a position
 	void backward();	///< Backward recursion
 	long double getPartitionZ();	///< Z
-	long double calculateProb(TriSequence& seq);	///< Prob(y|x)
+	long double calculateProb(const TriSequence& seq);	///< Prob(y|x)
 	std::vector<size_t> viterbiSearch(size_t& max_z, long double& prob);	///< Find the best path
 
 	/// Parameter Estimation
 	bool estimateWithLBFGS(size_t max_iter, double sigma, bool L1 = false, double eta = 1E-05);
 	bool estimateWithPL(size_t max_iter, double sigma, bool L1 = false, double eta = 1E-05);
+	void countFeatures();
+	std::vector<Parameter*> getParams();
+
+	/// PL training ; the transitions of m_ParamSeq are in m_OutState
+	std::vector<std::vector<StateParam> > m_InTopic;	///< topic features f(y,z) of each label y
+	void estimateShard(TrainShard& shard);
+
+	/// Memory accounting
+	void measureMemory(MemoryUsage& usage);
+	void estimateMemory(const CorpusStats& stats, MemoryUsage& usage);
 
 public:
 	TriCRF2();
@@ -70,6 +84,7 @@ public:
 	/// Model
 	bool loadModel(const std::string& filename);
 	bool saveModel(const std::string& filename);
+	size_t compact();
 
 	/// Training
 	void clear();
@@ -79,6 +94,10 @@ public:
 
 	/// Testing
 	bool test(const std::string& filename, const std::string& outputfile = "", bool confidence = false);
+	CompiledModel* compile();
+	MaxEnt* clone();
+	MaxEnt* fold(size_t k, size_t n_fold);
+	size_t sizeParam();
 
 };	///< TriCRF2
 
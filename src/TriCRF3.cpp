@@ -10,6 +10,7 @@
 #include "Evaluator.h"
 #include "Utility.h"
 #include "LBFGS.h"
+#include "Decoder.h"
 /// standard headers
 #include <cassert>
 #include <cfloat>
@@ -20,6 +21,9 @@
 #include <iostream>
 #include <fstream>
 
+/// margin of the Viterbi bound against the rounding errors (log-score)
+#define VITERBI_BOUND_SLACK	1E-06
+
 /// for fast accessing the element of matrixes
 #define MAT3(I, X, Y)			((m_state_size * m_state_size * (I)) + (m_state_size * (X)) + Y)
 #define MAT2(I, X)				((m_state_size * (I)) + X)
@@ -47,6 +51,8 @@ namespace tricrf {
 TriCRF3::TriCRF3() {
 	m_default_oid = 0;
 	m_topic_size = 0;
+	m_n_viterbi_topic = 0;
+	m_n_viterbi_search = 0;
 }
 
 /** Constructor with logger.
@@ -57,6 +63,8 @@ TriCRF3::TriCRF3(Logger *logger) {
 	logger->report(2, ">> Triangular-chain Conditional Random Fields (Model1) << \n\n");
 	m_default_oid = 0;
 	m_topic_size = 0;
+	m_n_viterbi_topic = 0;
+	m_n_viterbi_search = 0;
 }
 
 void TriCRF3::clear() {
@@ -66,6 +74,8 @@ void TriCRF3::clear() {
 	m_ParamTopic.clear();
 	m_Param.clear();
 	m_state_size.clear();
+	m_Mapping.clear();
+	m_RMapping.clear();
 }
 
 void TriCRF3::initializeModel() {
@@ -197,16 +207,45 @@ bool TriCRF3::loadModel(const std::string& filename) {
 	return true;
 }
 
+/**	Drop the zero-weight parameters of the model.
+	The test features are filtered by the dictionary of the common parameters,
+	so a feature is kept there while any plane still has a parameter for it.
+	@return	# of dropped parameters
+*/
+size_t TriCRF3::compact() {
+	timer stop_watch;
+	logger->report("[Model compaction]\n");
+
+	set<string> active;
+	size_t n_param = m_ParamTopic.size() + m_Param.size();
+	m_Param.getActiveFeatures(active);
+	for (size_t i = 0; i < m_ParamSeq.size(); i++) {
+		n_param += m_ParamSeq[i].size();
+		m_ParamSeq[i].getActiveFeatures(active);
+	}
+
+	size_t dropped = m_ParamTopic.compact();
+	for (size_t i = 0; i < m_ParamSeq.size(); i++)
+		dropped += m_ParamSeq[i].compact();
+	dropped += m_Param.compact(&active);
+	logger->report("  # of Parameters = \t%d -> %d\n", n_param, n_param - dropped);
+	logger->report("  compaction time = \t%.3f\n\n", stop_watch.elapsed());
+
+	/// to be used in inference
+	for (size_t i = 0; i < m_ParamSeq.size(); i++)
+		m_ParamSeq[i].makeStateIndex();
+	m_Param.makeStateIndex();
+
+	return dropped;
+}
+
 /**	Read the data from file
 */
 void TriCRF3::readTrainData(const string& filename) {
 
-	m_Mapping.clear();
-	m_RMapping.clear();
-
 	/// File stream
 	string line;
-	ifstream f(filename.c_str());
+	InputStream f(filename, true);
 	if (!f)
 		throw runtime_error("cannot open data file");
 
@@ -260,17 +299,18 @@ void TriCRF3::readTrainData(const string& filename) {
 	//string topic;
 	timer stop_watch;
 	logger->report("[Training data file loading]\n");
-	m_TrainSet.clear();
-	m_TrainSetCount.clear();
+	Data<TriStringSequence>& train_set = m_TrainSet.reset();
+	vector<double>& train_count = m_TrainSetCount.reset();
 
 	/// To reduce the storage and computation
 	map<vector<vector<string> >, size_t> train_data_map;
 	vector<vector<string> > token_list;
 
 	seq_count = 0;
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty() || tokens.size() <= 0) {	 ///< sequence break
+	DataReader reader(f, &m_Template, true);
+	vector<string> tokens;
+	while (reader.next(tokens)) {
+		if (tokens.size() <= 0) {	 ///< sequence break
 			/*
 			TriSequence tt;
 			tt.topic.label = triseq.topic.label;
@@ -283,15 +323,15 @@ void TriCRF3::readTrainData(const string& filename) {
 			}
 			*/
 			if (train_data_map.find(token_list) == train_data_map.end()) {
-				m_TrainSet.append(triseq);
-				train_data_map.insert(make_pair(token_list, m_TrainSetCount.size()));
-				m_TrainSetCount.push_back(1.0);
+				train_set.append(triseq);
+				train_data_map.insert(make_pair(token_list, train_count.size()));
+				train_count.push_back(1.0);
 
 				//vector<TriSequence> temp;
 				//temp.push_back(tt);
 				//m_TrainLabelSet.push_back(temp);
 			} else {
-				m_TrainSetCount[train_data_map[token_list]] += 1.0;
+				train_count[train_data_map[token_list]] += 1.0;
 
 				//m_TrainLabelSet[train_data_map[token_list]].push_back(tt);
 			}
@@ -366,9 +406,11 @@ void TriCRF3::readTrainData(const string& filename) {
 	//m_Param.clear(true);
 	m_Param.endUpdate();
 
+	m_dedup_bytes = max(m_dedup_bytes, bytesOf(train_data_map));
 	logger->report("  # of data = \t\t%d\n", count);
 	logger->report("  loading time = \t%.3f\n\n", stop_watch.elapsed());
 
+	m_state_size.clear();
 	for (size_t i = 0; i < m_ParamTopic.sizeStateVec(); i++) {
 		m_ParamSeq[i].makeStateIndex();
 		m_state_size.push_back(m_ParamSeq[i].sizeStateVec());
@@ -385,7 +427,7 @@ void TriCRF3::readDevData(const string& filename) {
 
 	/// File stream
 	string line;
-	ifstream f(filename.c_str());
+	InputStream f(filename);
 	if (!f)
 		throw runtime_error("cannot open data file");
 
@@ -396,23 +438,24 @@ void TriCRF3::readDevData(const string& filename) {
 	string topic;
 	timer stop_watch;
 	logger->report("[Dev data file loading]\n");
-	m_DevSet.clear();
-	m_DevSetCount.clear();
+	Data<TriStringSequence>& dev_set = m_DevSet.reset();
+	vector<double>& dev_count = m_DevSetCount.reset();
 
 	/// To reduce the storage and computation
 	map<vector<vector<string> >, size_t> dev_data_map;
 	vector<vector<string> > token_list;
 
 	size_t seq_count = 0;
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty() || tokens.size() <= 0) {	 ///< sequence break
+	DataReader reader(f, &m_Template, true);
+	vector<string> tokens;
+	while (reader.next(tokens)) {
+		if (tokens.size() <= 0) {	 ///< sequence break
 			if (dev_data_map.find(token_list) == dev_data_map.end()) {
-				m_DevSet.append(triseq);
-				dev_data_map.insert(make_pair(token_list, m_DevSetCount.size()));
-				m_DevSetCount.push_back(1.0);
+				dev_set.append(triseq);
+				dev_data_map.insert(make_pair(token_list, dev_count.size()));
+				dev_count.push_back(1.0);
 			} else {
-				m_DevSetCount[dev_data_map[token_list]] += 1.0;
+				dev_count[dev_data_map[token_list]] += 1.0;
 			}
 			triseq.seq.clear();
 			token_list.clear();
@@ -436,6 +479,7 @@ void TriCRF3::readDevData(const string& filename) {
 
 	}	// while
 
+	m_dedup_bytes = max(m_dedup_bytes, bytesOf(dev_data_map));
 	logger->report("  # of data = \t\t%d\n", count);
 	logger->report("  loading time = \t%.3f\n\n", stop_watch.elapsed());
 
@@ -464,29 +508,70 @@ void TriCRF3::calculateEdge() {
 
 	} ///< for each z
 
+	/// Shared transitions ; they do not depend on the topic, so they are computed once and projected
+	/// to the local labels of each topic
 	double* theta_share = m_Param.getWeight();
-	// state transition is independent of time t and training set
+	mapShared();
+	vector<double> share(m_Param.m_StateIndex.size());
+	for (size_t k = 0; k < share.size(); k++)
+		share[k] = exp(theta_share[m_Param.m_StateIndex[k].fid] * m_Param.m_StateIndex[k].fval);
 	for (size_t z = 0; z < m_topic_size; z++) {
-		vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin();
-		for (; iter != m_Param.m_StateIndex.end(); ++iter) {
-			pair<size_t, size_t> key1 = make_pair(z, iter->y1);
-			pair<size_t, size_t> key2 = make_pair(z, iter->y2);
+		const vector<size_t>& to_local = m_ToLocal[z];
+		for (size_t k = 0; k < share.size(); k++) {
+			size_t y1 = to_local[m_Param.m_StateIndex[k].y1];
+			size_t y2 = to_local[m_Param.m_StateIndex[k].y2];
+			if (y1 < m_state_size[z] && y2 < m_state_size[z])
+				m_M[z][ZMAT2(z, y1, y2)] *= share[k];
+		}
+	}
 
-			if (m_Mapping.find(key1) == m_Mapping.end() || m_Mapping.find(key2) == m_Mapping.end())
-				continue;
-			size_t y1 = m_Mapping[key1];
-			size_t y2 = m_Mapping[key2];
-			m_M[z][ZMAT2(z, y1, y2)] *= exp(theta_share[iter->fid] * iter->fval);
+	/// Largest transition into each label, for the bound of the Viterbi search
+	m_MaxIn.resize(m_topic_size);
+	for (size_t z = 0; z < m_topic_size; z++) {
+		m_MaxIn[z].assign(m_state_size[z], 0.0);
+		for (size_t k = 0; k < m_state_size[z]; k++) {
+			for (size_t j = 0; j < m_state_size[z]; j++)
+				m_MaxIn[z][j] = max(m_MaxIn[z][j], m_M[z][ZMAT2(z, k, j)]);
 		}
 	}
 
 }
 
+/**	Map the label ids between the state spaces of each topic and the global one.
+	Unknown labels are mapped to the size of the target state space.
+	@param	to_global	global label id of each local label (per topic)
+	@param	to_local	local label id of each global label (per topic)
+*/
+void TriCRF3::mapLabels(vector<vector<size_t> >& to_global, vector<vector<size_t> >& to_local) {
+	to_global.resize(m_topic_size);
+	to_local.resize(m_topic_size);
+	for (size_t z = 0; z < m_topic_size; z++) {
+		to_global[z] = m_ParamSeq[z].mapStates(m_Param);
+		to_local[z] = m_Param.mapStates(m_ParamSeq[z]);
+	}
+}
+
+/**	Map the global labels to the local labels of each topic by m_Mapping (m_ToLocal).
+	Unknown labels are mapped to the size of the local state space.
+*/
+void TriCRF3::mapShared() {
+	m_ToLocal.resize(m_topic_size);
+	for (size_t z = 0; z < m_topic_size; z++)
+		m_ToLocal[z].assign(m_Param.sizeStateVec(), m_state_size[z]);
+	map<pair<size_t, size_t>, size_t>::iterator map_it = m_Mapping.begin();
+	for (; map_it != m_Mapping.end(); ++map_it) {
+		size_t z = map_it->first.first;
+		size_t y = map_it->first.second;
+		if (z < m_topic_size && y < m_ToLocal[z].size())
+			m_ToLocal[z][y] = map_it->second;
+	}
+}
+
 /**	Calculate the factors.
 	References
 		Jeong and Lee, Triangular-chain Conditional Random Fields, IEEE TASLP.
 */
-void TriCRF3::calculateFactors(TriStringSequence &triseq) {
+void TriCRF3::calculateFactors(const TriStringSequence &triseq) {
 	/// Initialization
 	m_seq_size = triseq.seq.size() + 1;	///< sequence length
 	vector<double*> theta_seq;
@@ -502,30 +587,31 @@ void TriCRF3::calculateFactors(TriStringSequence &triseq) {
 	}
 
 	/// Calculation
-	for (size_t z = 0; z < m_topic_size; z++) {
-		for (size_t i = 0; i < m_seq_size-1; i++) {
+	vector<pair<size_t, double> > share;	///< shared observation factors of a position (global labels)
+	for (size_t i = 0; i < m_seq_size-1; i++) {
+		/// Shared observation factor ; it does not depend on the topic
+		share.clear();
+		vector<ObsParam> obs_param = m_Param.makeObsIndex(triseq.seq[i].obs);
+		vector<ObsParam>::iterator iter = obs_param.begin();
+		for(; iter != obs_param.end(); ++iter) {
+			share.push_back(make_pair(iter->y, exp(theta_share[iter->fid] * iter->fval)));
+		}
+
+		for (size_t z = 0; z < m_topic_size; z++) {
 			/// Observation factor
-			vector<ObsParam> obs_param = m_ParamSeq[z].makeObsIndex(triseq.seq[i].obs);
-			vector<ObsParam>::iterator iter = obs_param.begin();
-			for(; iter != obs_param.end(); ++iter) {
+			obs_param = m_ParamSeq[z].makeObsIndex(triseq.seq[i].obs);
+			for(iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
 				m_R[z][ZMAT2(z, i, iter->y)] *= exp(theta_seq[z][iter->fid] * iter->fval);
 			}
 
-
-			obs_param = m_Param.makeObsIndex(triseq.seq[i].obs);
-			iter = obs_param.begin();
-			for(; iter != obs_param.end(); ++iter) {
-				pair<size_t, size_t> key = make_pair(z, iter->y);
-				if (m_Mapping.find(key) == m_Mapping.end())
-					continue;
-				size_t y = m_Mapping[key];
-				m_R[z][ZMAT2(z, i, y)] *= exp(theta_share[iter->fid] * iter->fval);
+			const vector<size_t>& to_local = m_ToLocal[z];
+			for (size_t k = 0; k < share.size(); k++) {
+				size_t y = to_local[share[k].first];
+				if (y < m_state_size[z])
+					m_R[z][ZMAT2(z, i, y)] *= share[k].second;
 			}
-
-
-
-		}	///< for
-	} ///< for each z
+		} ///< for each z
+	}	///< for
 
 	/// Gamma
 	m_Gamma.resize(m_topic_size, 1.0);
@@ -542,22 +628,39 @@ void TriCRF3::calculateFactors(TriStringSequence &triseq) {
 	Computing and storing the alpha value.
 */
 void TriCRF3::forward() {
+	vector<size_t> topics(m_topic_size);
+	for (size_t z = 0; z < m_topic_size; z++)
+		topics[z] = z;
+	forward(topics);
+}
+
+/**	Forward Recursion over the given topics only.
+	The alpha values of the other topics are left zero, i.e. they are pruned.
+	@param topics	topic list to be computed
+*/
+void TriCRF3::forward(const vector<size_t>& topics) {
 	m_Alpha.resize(m_topic_size);
 	for (size_t z = 0; z < m_topic_size; z++) {
 		m_Alpha[z].resize(m_seq_size * m_state_size[z]);
 		fill(m_Alpha[z].begin(), m_Alpha[z].end(), 0.0);
 	}
 
-	for (size_t z = 0; z < m_topic_size; z++) {
+	scale.resize(m_seq_size);
+	fill(scale.begin(), scale.end(), 1.0);
+
+	for (size_t t = 0; t < topics.size(); t++) {
+		size_t z = topics[t];
 		for (size_t j = 0; j < m_state_size[z]; j++) {
 				m_Alpha[z][ZMAT2(z, 0, j)] += m_R[z][ZMAT2(z, 0, j)] * m_M[z][ZMAT2(z, m_default_oid, j)];
 		}
 	}
+	scaleAlpha(topics, 0);
 
-	for (size_t z = 0; z < m_topic_size; z++) {
-		for (size_t i = 1; i < m_seq_size; i++) {
+	for (size_t i = 1; i < m_seq_size; i++) {
+		for (size_t t = 0; t < topics.size(); t++) {
+			size_t z = topics[t];
 			for (size_t j = 0; j < m_state_size[z]; j++) {
-				long double prob = m_R[z][ZMAT2(z, i, j)];
+				double prob = m_R[z][ZMAT2(z, i, j)];
 
 				if (prob > 0) {
 					for (size_t k = 0; k < m_state_size[z]; k++) {
@@ -566,6 +669,66 @@ void TriCRF3::forward() {
 				}
 			}
 		}
+		scaleAlpha(topics, i);
+	}
+}
+
+/**	Scale the alpha values of the topics at a position.
+	All the topics share the scale, so the ratios between the topics are kept ; the unscaled
+	alpha at i is the scaled one times scale[0] * ... * scale[i].
+	@param topics	topic list to be computed
+	@param i		position
+*/
+void TriCRF3::scaleAlpha(const vector<size_t>& topics, size_t i) {
+	double sum = 0.0;
+	for (size_t t = 0; t < topics.size(); t++) {
+		size_t z = topics[t];
+		for (size_t j = 0; j < m_state_size[z]; j++)
+			sum += m_Alpha[z][ZMAT2(z, i, j)];
+	}
+	if (sum <= 0.0)
+		return;
+	for (size_t t = 0; t < topics.size(); t++) {
+		size_t z = topics[t];
+		for (size_t j = 0; j < m_state_size[z]; j++)
+			m_Alpha[z][ZMAT2(z, i, j)] /= sum;
+	}
+	scale[i] = sum;
+}
+
+/**	Restrict the alpha values of a full forward pass to the given topics.
+	The recursions of the topics are independent except for the shared scale, so rescaling
+	the kept topics at each position gives the same tables as forward(topics).
+	@param topics	topic list to be kept
+*/
+void TriCRF3::restrictAlpha(const vector<size_t>& topics) {
+	vector<char> keep(m_topic_size, 0);
+	for (size_t t = 0; t < topics.size(); t++)
+		keep[topics[t]] = 1;
+	for (size_t z = 0; z < m_topic_size; z++) {
+		if (!keep[z])
+			fill(m_Alpha[z].begin(), m_Alpha[z].end(), 0.0);
+	}
+
+	double prev = 1.0;	///< share of the kept topics at the previous position
+	for (size_t i = 0; i < m_seq_size; i++) {
+		double sum = 0.0;
+		for (size_t t = 0; t < topics.size(); t++) {
+			size_t z = topics[t];
+			for (size_t j = 0; j < m_state_size[z]; j++)
+				sum += m_Alpha[z][ZMAT2(z, i, j)];
+		}
+		if (sum <= 0.0) {
+			scale[i] = 1.0;
+			continue;
+		}
+		for (size_t t = 0; t < topics.size(); t++) {
+			size_t z = topics[t];
+			for (size_t j = 0; j < m_state_size[z]; j++)
+				m_Alpha[z][ZMAT2(z, i, j)] /= sum;
+		}
+		scale[i] *= sum / prev;
+		prev = sum;
 	}
 }
 
@@ -590,7 +753,7 @@ void TriCRF3::backward() {
 
 	    for (size_t i = m_seq_size-1; i >= 1; i--) {
 		    for (size_t k = 0; k < m_state_size[z]; k++) {
-				long double prob = m_R[z][ZMAT2(z, i, k)];
+				double prob = m_R[z][ZMAT2(z, i, k)] / scale[i];	///< scaled with the alpha
 				if (prob > 0) {
 					for (size_t j = 0; j < m_state_size[z]; j++) {
 							m_Beta[z][ZMAT2(z, i-1, j)] += m_Beta[z][ZMAT2(z, i, k)] * m_M[z][ZMAT2(z, j, k)] * prob;
@@ -622,11 +785,25 @@ long double TriCRF3::getPartitionZ() {
 	return zval;
 }
 
+/**	Prune the topics.
+	The topics less probable than (the best one / m_prune_threshold) are removed from m_prune.
+*/
+void TriCRF3::pruneTopics() {
+	long double threshold = m_prune[0].first / m_prune_threshold;
+	vector<pair<long double, size_t> >::iterator pit = m_prune.begin();
+	for (; pit != m_prune.end(); pit++) {
+		if (pit->first < threshold) {
+			m_prune.erase(pit, m_prune.end());
+			break;
+		}
+	}
+}
+
 /** Calculate prob. of y* sequence.
 	@param seq			given data (y, x)
 	@return probability
 */
-long double TriCRF3::calculateProb(TriStringSequence& triseq) {
+long double TriCRF3::calculateProb(const TriStringSequence& triseq) {
 	long double zval = getPartitionZ();
 
     long double seq_prob = 1.0;
@@ -639,7 +816,7 @@ long double TriCRF3::calculateProb(TriStringSequence& triseq) {
         } else {
             y = m_default_oid;
         }
-        seq_prob *= m_R[z][ZMAT2(z, i,y)] * m_M[z][ZMAT2(z, prev_y, y)];
+        seq_prob *= m_R[z][ZMAT2(z, i,y)] * m_M[z][ZMAT2(z, prev_y, y)] / scale[i];
         prev_y = y;
 
     }
@@ -650,31 +827,71 @@ long double TriCRF3::calculateProb(TriStringSequence& triseq) {
     return seq_prob * m_Gamma[z] / zval;
 }
 
+/**	Upper bound of the log-score of the best path of a topic.
+	Each position contributes its best label with the largest transition into it (m_MaxIn).
+	@param z	topic
+	@return log-score bound, including the topic factor
+*/
+long double TriCRF3::boundPath(size_t z) {
+	long double bound = log((long double)m_Gamma[z]);
+	for (size_t i = 0; i < m_seq_size; i++) {
+		double max_node = 0.0;
+		for (size_t j = 0; j < m_state_size[z]; j++)
+			max_node = max(max_node, m_R[z][ZMAT2(z, i, j)] * m_MaxIn[z][j]);
+		bound += log((long double)max_node);
+	}
+	return bound;
+}
+
 /** Viterbi search to find the best probable output sequence.
   Viterbi algorithm.
+  With the bound (m_viterbi_bound), a topic is searched only if the bound of its best path beats
+  the best path so far, and the search stops when no remaining topic can ; the result is the same.
  @param prob		dummy probability vector
  @return outcome sequence
 */
 vector<size_t> TriCRF3::viterbiSearch(size_t& max_z, long double& prob) {
 	/// Initialization
-	long double max_prob = -10000.0;
+	long double max_prob = -10000.0;	///< log-score of the best path
 	max_z = m_default_oid;
 	vector<size_t> max_y;
 	vector<vector<size_t> > psi;
-    vector<vector<long double> > delta;
+    vector<vector<double> > delta;
+
+	/// Bounds of the topics, and their maximum over the remaining topics
+	bool bound = (m_viterbi_bound && m_MaxIn.size() == m_topic_size);
+	vector<long double> path_bound, rest_bound;
+	if (bound) {
+		path_bound.resize(m_prune.size());
+		rest_bound.resize(m_prune.size() + 1);
+		rest_bound[m_prune.size()] = -HUGE_VAL;
+		for (size_t prune = m_prune.size(); prune > 0; prune--) {
+			path_bound[prune-1] = boundPath(m_prune[prune-1].second) + VITERBI_BOUND_SLACK;
+			rest_bound[prune-1] = max(rest_bound[prune], path_bound[prune-1]);
+		}
+	}
+	m_n_viterbi_topic += m_prune.size();
 
 	/// Search
 	///for (size_t z = 0; z < m_topic_size; z++) {
 	for (size_t prune = 0; prune < m_prune.size(); prune++) {
 		size_t z = m_prune[prune].second;
+		if (bound && prune > 0) {
+			if (rest_bound[prune] <= max_prob)
+				break;
+			if (path_bound[prune] <= max_prob)
+				continue;
+		}
+		m_n_viterbi_search++;
 
 		delta.clear();
 		psi.clear();
+		long double log_scale = 0.0;	///< log of the scales of delta
 		for (size_t i=0; i < m_seq_size; i++) {
 			vector<size_t> psi_i;
-			vector<long double> delta_i;
+			vector<double> delta_i;
 			for (size_t j=0; j < m_state_size[z]; j++) {
-				long double max = -10000.0;
+				double max = -10000.0;
 				size_t max_k = 0;
 				if (i == 0) {
 					max = m_R[z][ZMAT2(z, i, j)] * m_M[z][ZMAT2(z, m_default_oid, j)];
@@ -692,6 +909,15 @@ vector<size_t> TriCRF3::viterbiSearch(size_t& max_z, long double& prob) {
 				delta_i.push_back(max);
 				psi_i.push_back(max_k);
 			}
+			/// scaling ; the best path does not change
+			double max_delta = 0.0;
+			for (size_t j=0; j < delta_i.size(); j++)
+				max_delta = (delta_i[j] > max_delta ? delta_i[j] : max_delta);
+			if (max_delta > 0.0) {
+				for (size_t j=0; j < delta_i.size(); j++)
+					delta_i[j] /= max_delta;
+				log_scale += log(max_delta);
+			}
 			delta.push_back(delta_i);
 			psi.push_back(psi_i);
 
@@ -706,16 +932,16 @@ vector<size_t> TriCRF3::viterbiSearch(size_t& max_z, long double& prob) {
 			prev_y = y;
 		}
 		reverse(y_seq.begin(), y_seq.end());
-		double tmp_prob = delta[m_seq_size-1][m_default_oid] * m_Gamma[z];
+		long double tmp_prob = log((long double)delta[m_seq_size-1][m_default_oid] * m_Gamma[z]) + log_scale;
 
-		if (tmp_prob > max_prob) {
+		if (prune == 0 || tmp_prob > max_prob) {
 			max_prob = tmp_prob;
 			max_z = z;
 			max_y = y_seq;
 		}
 	} ///< for each z
 
-	prob = max_prob;
+	prob = expl(max_prob);
 	return max_y;
 
 }
@@ -740,7 +966,8 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 	n_theta += m_Param.size();
 
 
-	double* theta = new double[n_theta];
+	WeightVector theta_vec(n_theta);	///< concatenated weights (mapped with mmap_dir)
+	double* theta = &theta_vec[0];
 	size_t tmp_i = 0;
 	for (; tmp_i < m_ParamTopic.size(); ++tmp_i)
 		theta[tmp_i] = theta_topic[tmp_i];
@@ -753,7 +980,8 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 
 	assert(tmp_i == n_theta);
 
-	double* gradient = new double[n_theta]; //m_Param.getGradient();
+	WeightVector gradient_vec(n_theta);	///< concatenated gradients (mapped with mmap_dir)
+	double* gradient = &gradient_vec[0];
 	double* gradient_topic = m_ParamTopic.getGradient();
 	vector<double*> gradient_seq;
 	for (size_t z = 0; z < m_topic_size; z++)
@@ -763,6 +991,8 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 
 	Evaluator eval1(m_ParamTopic, false);		///< Evaluator (topic)
 	Evaluator eval2(m_Param);					///< Evaluator (sequence)
+	vector<vector<size_t> > to_global, to_local;
+	mapLabels(to_global, to_local);
 																///< todo; replace with a general evaluator for seq
 	timer t;		///< timer
 
@@ -791,53 +1021,100 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 	double time_for_evaluation = 0.0;
 	double time_for_estimating = 0.0;
 
+	/// Topic pruning cache ; the surviving topics of each training sequence
+	m_TopicCache.clear();
+	m_TopicCache.resize(m_TrainSet->size());
+
+	/// Distributed training ; a worker runs until the coordinator stops
+	bool worker = isWorker();
+	size_t shard_begin, shard_end;
+	getShard(m_TrainSet->size(), shard_begin, shard_end);
+
 	/// Training iteration
-    for (size_t niter = 0 ;niter < (int)max_iter; ++niter) {
+    for (size_t niter = 0 ; worker || niter < (int)max_iter; ++niter) {
+		if (!syncTheta(theta, n_theta))
+			break;
+		if (worker) {
+			m_ParamTopic.setWeight(theta);
+			size_t tmp_z = m_ParamTopic.size();
+			for (size_t z = 0; z < m_topic_size; z++) {
+				m_ParamSeq[z].setWeight(&theta[tmp_z]);
+				tmp_z += m_ParamSeq[z].size();
+			}
+			m_Param.setWeight(&theta[tmp_z]);
+		}
 
 		////////////////////////////////////////////////////////////////////////////
 		/// Initializing local variables
 		////////////////////////////////////////////////////////////////////////////
         timer t2;	///< elapsed time for one iteration
-		m_ParamTopic.initializeGradient();	///< gradient vector initialization
-		for (size_t z = 0; z < m_topic_size; z++)
-			m_ParamSeq[z].initializeGradient();
-		m_Param.initializeGradient();
+		if (worker) {	///< the empirical counts are added by the coordinator
+			m_ParamTopic.initializeGradient2();
+			for (size_t z = 0; z < m_topic_size; z++)
+				m_ParamSeq[z].initializeGradient2();
+			m_Param.initializeGradient2();
+		} else {
+			m_ParamTopic.initializeGradient();	///< gradient vector initialization
+			for (size_t z = 0; z < m_topic_size; z++)
+				m_ParamSeq[z].initializeGradient();
+			m_Param.initializeGradient();
+		}
 
 		eval1.initialize();	///< evaluator intialization
 		eval2.initialize();
 		double time_for_inference = 0.0;
 
+		/// the topics are cached at a full refresh and used until the next one
+		bool use_cache = (m_prune_refresh > 0 && niter > 0);
+		bool refresh = (use_cache && (niter - 1) % m_prune_refresh == 0);
+		size_t n_skipped = 0;
+
 		calculateEdge();
 
 		////////////////////////////////////////////////////////////////////////////
 		/// for each training set
 		////////////////////////////////////////////////////////////////////////////
-        vector<TriStringSequence>::iterator it = m_TrainSet.begin();
-		vector<double>::iterator count_it = m_TrainSetCount.begin();
-        for (; it != m_TrainSet.end(); ++it, ++count_it) {
+        vector<TriStringSequence>::const_iterator it = m_TrainSet->begin() + shard_begin;
+		vector<double>::const_iterator count_it = m_TrainSetCount->begin() + shard_begin;
+        for (; it != m_TrainSet->begin() + shard_end; ++it, ++count_it) {
 			double count = *count_it;
+			if (count == 0.0)	///< out of the fold (see fold())
+				continue;
 			/// Forward-Backward
 			timer stop_watch;
 			calculateFactors(*it);
 			time_for_factor += stop_watch.elapsed();
 			stop_watch.restart();
-  			forward();
+			vector<size_t>& topic_cache = m_TopicCache[it - m_TrainSet->begin()];
+			if (use_cache && !refresh) {
+				forward(topic_cache);
+				n_skipped += m_topic_size - topic_cache.size();
+			} else
+				forward();
+			if (refresh) {
+				/// caching the topics surviving the full pass (the true topic is always kept) ;
+				/// the alpha values are then restricted to them, as forward(topic_cache) would compute
+				getPartitionZ();
+				pruneTopics();
+				bool has_topic = false;
+				topic_cache.clear();
+				for (size_t prune = 0; prune < m_prune.size(); prune++) {
+					topic_cache.push_back(m_prune[prune].second);
+					if (m_prune[prune].second == it->topic.label)
+						has_topic = true;
+				}
+				if (!has_topic)
+					topic_cache.push_back(it->topic.label);
+				restrictAlpha(topic_cache);
+			}
 			time_for_forward += stop_watch.elapsed();
 			long double zval = getPartitionZ();
 
 			////////////////////////////////////////////////////////////////////
 			/// pruning
 			////////////////////////////////////////////////////////////////////
-			long double threshold = m_prune[0].first / m_prune_threshold;
-			if (niter > 0) {
-				vector<pair<long double, size_t> >::iterator pit = m_prune.begin();
-				for (; pit != m_prune.end(); pit++) {
-					if (pit->first < threshold) {
-						m_prune.erase(pit, m_prune.end());
-						break;
-					}
-				}
-			}
+			if (niter > 0)
+				pruneTopics();
 
 			stop_watch.restart();
 			backward();
@@ -858,15 +1135,13 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 
 			stop_watch.restart();
 			size_t prev_outcome = m_default_oid;
-			vector<string> reference, hypothesis;
+			vector<size_t> reference, hypothesis;
 			double fval = it->topic.fval;
 			for (size_t i = 0; i < it->seq.size(); ++i) {	 /// for each node in sequence
 
 				size_t outcome = it->seq[i].label;
-				string outcome_s = m_ParamSeq[it->topic.label].getState().second[outcome];
-				string y_seq_s = m_ParamSeq[max_z].getState().second[y_seq[i]];
-				reference.push_back(outcome_s);
-				hypothesis.push_back(y_seq_s);
+				reference.push_back(to_global[it->topic.label][outcome]);
+				hypothesis.push_back(to_global[max_z][y_seq[i]]);
 
 				/// calculate the expectation
 				/// E[p] - E[~p]
@@ -884,10 +1159,9 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 
 					obs_param = m_Param.makeObsIndex(it->seq[i].obs);
 					for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-							pair<size_t, size_t> key = make_pair(z, iter->y);
-							if (m_Mapping.find(key) == m_Mapping.end())
+							size_t y = m_ToLocal[z][iter->y];
+							if (y >= m_state_size[z])
 								continue;
-							size_t y = m_Mapping[key];
 							long double prob = m_Alpha[z][ZMAT2(z, i, y)] * m_Beta[z][ZMAT2(z, i, y)] * m_Gamma[z] / zval;
 							gradient_share[iter->fid] += prob * iter->fval * count;
 					}
@@ -910,7 +1184,7 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 								a_y = m_Alpha[z][ZMAT2(z, i-1, iter->y1)];
 							}
 							long double b_y = m_Beta[z][ZMAT2(z, i, iter->y2)];
-							long double m_yy = m_R[z][ZMAT2(z, i, iter->y2)] * m_M[z][ZMAT2(z, iter->y1,iter->y2)];
+							long double m_yy = m_R[z][ZMAT2(z, i, iter->y2)] * m_M[z][ZMAT2(z, iter->y1,iter->y2)] / scale[i];
 							long double prob = a_y * b_y * m_yy * m_Gamma[z] / zval;
 							gradient_seq[z][iter->fid] += prob * iter->fval * count;
 						} ///< for each edge
@@ -918,13 +1192,10 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 
 						iter = m_Param.m_StateIndex.begin();
 						for (; iter != m_Param.m_StateIndex.end(); ++iter) {
-							pair<size_t, size_t> key1 = make_pair(z, iter->y1);
-							pair<size_t, size_t> key2 = make_pair(z, iter->y2);
-
-							if (m_Mapping.find(key1) == m_Mapping.end() || m_Mapping.find(key2) == m_Mapping.end())
+							size_t y1 = m_ToLocal[z][iter->y1];
+							size_t y2 = m_ToLocal[z][iter->y2];
+							if (y1 >= m_state_size[z] || y2 >= m_state_size[z])
 								continue;
-							size_t y1 = m_Mapping[key1];
-							size_t y2 = m_Mapping[key2];
 
 							long double a_y;
 							long double prob_sum = 0.0;
@@ -935,7 +1206,7 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 								a_y = m_Alpha[z][ZMAT2(z, i-1, y1)];
 							}
 							long double b_y = m_Beta[z][ZMAT2(z, i, y2)];
-							long double m_yy = m_R[z][ZMAT2(z, i, y2)] * m_M[z][ZMAT2(z, y1, y2)];
+							long double m_yy = m_R[z][ZMAT2(z, i, y2)] * m_M[z][ZMAT2(z, y1, y2)] / scale[i];
 							long double prob = a_y * b_y * m_yy * m_Gamma[z] / zval;
 							gradient_share[iter->fid] += prob * iter->fval * count;
 						} ///< for each edge
@@ -956,7 +1227,7 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 
 			for (size_t c = 0; c < count; c++) {
 				eval2.addLikelihood(y_seq_prob);	/// loglikelihood
-				eval2.append(m_Param, reference, hypothesis);	/// evaluation (accuracy and f1 score)
+				eval2.append(reference, hypothesis);	/// evaluation (accuracy and f1 score)
 				vector<size_t> reference1, hypothesis1;
 				reference1.push_back(it->topic.label);
 				hypothesis1.push_back(max_z);
@@ -967,6 +1238,61 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 
 		} ///< for m_TrainSet
 
+		/////////////////////////////////////////////////////////////////////////////////
+		/// Evaluation for dev set
+		////////////////////////////////////////////////////////////////////////////////
+		Evaluator dev_eval1(m_ParamTopic, false);		///< Evaluator (topic)
+		Evaluator dev_eval2(m_Param);						///< Evaluator (sequence)
+		dev_eval1.initialize();										///< Evaluator intialization
+		dev_eval2.initialize();
+
+		/// for each dev data
+		it = m_DevSet->begin();
+		count_it = m_DevSetCount->begin();
+		for (; it != m_DevSet->end(); ++it, ++count_it) {
+			double count = *count_it;
+			if (count == 0.0)	///< out of the fold (see fold())
+				continue;
+			calculateFactors(*it);
+			forward();
+			getPartitionZ();
+			long double dummy_prob;
+
+			/// pruning
+			long double threshold = m_prune[0].first / m_prune_threshold;
+			vector<pair<long double, size_t> >::iterator pit = m_prune.begin();
+			for (; pit != m_prune.end(); pit++) {
+				if (pit->first < threshold) {
+					m_prune.erase(pit, m_prune.end());
+					break;
+				}
+			}
+
+			size_t max_z;
+			vector<size_t> y_seq = viterbiSearch(max_z, dummy_prob);
+			assert(y_seq.size() == it->seq.size());
+
+			vector<size_t> reference, hypothesis;
+			for (size_t i = 0; i < it->seq.size(); ++i) {	 /// for each node in sequence
+				size_t outcome = it->seq[i].label;
+
+				/// If there are non-attested labels in dev, test sets, then ...
+				if (m_ParamTopic.sizeStateVec() <= it->topic.label || m_ParamSeq[it->topic.label].sizeStateVec() <= outcome)
+					reference.push_back(m_default_oid);
+				else
+					reference.push_back(to_global[it->topic.label][outcome]);
+				hypothesis.push_back(to_global[max_z][y_seq[i]]);
+			}
+
+			for (size_t c = 0; c < count; c++) {
+				dev_eval2.append(reference, hypothesis);
+				vector<size_t> reference1, hypothesis1;
+				reference1.push_back(it->topic.label);
+				hypothesis1.push_back(max_z);
+				dev_eval1.append(reference1, hypothesis1);
+			}
+		} ///< for each dev
+
 		////////////////////////////////////////////////////////////////////////////
 		/// Parameter Merging
 		////////////////////////////////////////////////////////////////////////////
@@ -985,6 +1311,10 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 
 		assert(n_theta == tmp_i);
 
+		/// summing up the shards
+		if (!syncGradient(gradient, n_theta, eval1, &eval2))
+			continue;
+
 		////////////////////////////////////////////////////////////////////////////
 		/// Applying regularization
 		////////////////////////////////////////////////////////////////////////////
@@ -1023,6 +1353,9 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 		////////////////////////////////////////////////////////////////////////////
 		/// LBFGS optimizer
 		////////////////////////////////////////////////////////////////////////////
+		/// the objective changes with the cached topics, so the curvature pairs are dropped
+		if (refresh)
+			lbfgs.clear();
 		int ret = lbfgs.optimize(n_theta, theta, eval2.getObjFunc(), gradient, L1, sigma);
 		if (ret < 0)
 			return false;
@@ -1034,10 +1367,29 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 		////////////////////////////////////////////////////////////////////////////
 		eval1.calculateF1();
 		eval2.calculateF1();
+		bool stop = false;
+		if (m_DevSet->size() > 0) {
+			dev_eval1.calculateF1();
+			dev_eval2.calculateF1();
+			setDevScore(dev_eval2, &dev_eval1);
+			stop = checkEarlyStop(niter);	///< the parameter vectors are not updated yet
+			logger->report("%4d %15E %8.3f %8.3f %8.3f %8.3f  |  %8.3f %8.3f %8.3f\n",
+				niter, eval1.getLoglikelihood(),
+				eval1.getAccuracy(), eval1.getMicroF1()[2], eval1.getMacroF1()[2], t2.elapsed(),
+				dev_eval1.getAccuracy(), dev_eval1.getMicroF1()[2], dev_eval1.getMacroF1()[2]);
+			logger->report("%4s %15s %8.3f %8.3f %8.3f %8.3f  |  %8.3f %8.3f %8.3f\n",
+				"", "",
+				eval2.getAccuracy(), eval2.getMicroF1()[2], eval2.getMacroF1()[2], t2.elapsed(),
+				dev_eval2.getAccuracy(), dev_eval2.getMicroF1()[2], dev_eval2.getMacroF1()[2]);
+		} else {
 			logger->report("%4d %15E %8.3f %8.3f %8.3f %8.3f\n", niter, eval1.getLoglikelihood(),
 				eval1.getAccuracy(), eval1.getMicroF1()[2], eval1.getMacroF1()[2], t2.elapsed());
 			logger->report("%4s %15s %8.3f %8.3f %8.3f %8.3f\n", "", "",
 				eval2.getAccuracy(), eval2.getMicroF1()[2], eval2.getMacroF1()[2], t2.elapsed());
+		}
+
+		if (m_prune_refresh > 0)
+			logger->report("%4s %15s skipped topic-passes = %d / %d\n", "", "", n_skipped, (shard_end - shard_begin) * m_topic_size);
 
 		////////////////////////////////////////////////////////////////////////////
 		/// Update the parameter vectors
@@ -1049,13 +1401,217 @@ bool TriCRF3::estimateWithLBFGS(size_t max_iter, double sigma, bool L1, double e
 			tmp_z += m_ParamSeq[z].size();
 		}
 		m_Param.setWeight(&theta[tmp_z]);
+		if (stop)
+			break;
 
 	} ///< for iter
 
-	delete theta;
-	delete gradient;
+	return !clusterFailed();
+}
 
-	return true;
+/**	Make the indexes of the PL training.
+	The observations are looked up in the dictionaries once, and the transitions of m_ParamSeq[z]
+	and m_Param are grouped by the previous label in the local state space of each topic.
+*/
+void TriCRF3::makePLIndex() {
+	vector<vector<size_t> > to_local;
+	mapLabels(m_ToGlobal, to_local);
+
+	mapShared();
+
+	/// transitions
+	m_OutSeq.resize(m_topic_size);
+	m_OutShare.resize(m_topic_size);
+	for (size_t z = 0; z < m_topic_size; z++) {
+		m_OutSeq[z] = m_ParamSeq[z].groupStateIndex(true, m_state_size[z]);
+		m_OutShare[z].assign(m_state_size[z], vector<StateParam>());
+		vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin();
+		for (; iter != m_Param.m_StateIndex.end(); ++iter) {
+			StateParam element = *iter;
+			element.y1 = m_ToLocal[z][iter->y1];
+			element.y2 = m_ToLocal[z][iter->y2];
+			if (element.y1 < m_state_size[z] && element.y2 < m_state_size[z])
+				m_OutShare[z][element.y1].push_back(element);
+		}
+	}
+
+	/// observations
+	m_PLSeqSet.resize(m_TrainSet->size());
+	m_PLShareSet.resize(m_TrainSet->size());
+	for (size_t s = 0; s < m_TrainSet->size(); s++) {
+		const TriStringSequence& triseq = (*m_TrainSet)[s];
+		Parameter& param = m_ParamSeq[triseq.topic.label];
+		m_PLSeqSet[s].resize(triseq.seq.size());
+		m_PLShareSet[s].resize(triseq.seq.size());
+		for (size_t i = 0; i < triseq.seq.size(); i++) {
+			m_PLSeqSet[s][i].label = m_PLShareSet[s][i].label = triseq.seq[i].label;
+			m_PLSeqSet[s][i].fval = m_PLShareSet[s][i].fval = triseq.seq[i].fval;
+			m_PLSeqSet[s][i].obs = param.indexObs(triseq.seq[i].obs);
+			m_PLShareSet[s][i].obs = m_Param.indexObs(triseq.seq[i].obs);
+		}
+	}
+}
+
+/**	Accumulate the PL gradients and evaluations of the sequences in a shard.
+*/
+void TriCRF3::estimateShard(TrainShard& shard) {
+	double* theta_topic = m_ParamTopic.getWeight();
+	double* theta_share = m_Param.getWeight();
+	double* gradient_topic = shard.gradient[0];
+	double* gradient_share = shard.gradient[m_topic_size + 1];
+	Evaluator& eval1 = *shard.eval[0];
+	Evaluator& eval2 = *shard.eval[1];
+	vector<double>& prob_topic = shard.prob1;
+	vector<double>& prob_seq = shard.prob2;
+	vector<size_t>& reference1 = shard.reference1;
+	vector<size_t>& hypothesis1 = shard.hypothesis1;
+	vector<size_t>& reference2 = shard.reference2;
+	vector<size_t>& hypothesis2 = shard.hypothesis2;
+	prob_topic.resize(m_topic_size);
+
+	for (size_t s = shard.begin; s < shard.end; s++) {
+		const TriStringSequence* it = &(*m_TrainSet)[s];
+		double count = (*m_TrainSetCount)[s];
+		if (count == 0.0)	///< out of the fold (see fold())
+			continue;
+		size_t z = it->topic.label;
+		double* theta_seq = m_ParamSeq[z].getWeight();
+		double* gradient_seq = shard.gradient[z + 1];
+		vector<size_t>& to_local = m_ToLocal[z];
+		vector<size_t>& to_global = m_ToGlobal[z];
+
+		/////////////////////////////////////////////////////////////////////
+		/// PL for topic
+		/////////////////////////////////////////////////////////////////////
+		reference1.clear();
+		hypothesis1.clear();
+		size_t max_z = 0;
+		fill(prob_topic.begin(), prob_topic.end(), 0.0);
+
+		/// Inference
+		vector<pair<size_t, double> >::const_iterator obs = it->topic.obs.begin();
+		for (; obs != it->topic.obs.end(); ++obs) {
+			const vector<pair<size_t, size_t> >& param = (*m_ParamTopic.m_ParamIndex)[obs->first];
+			for (size_t j = 0; j < param.size(); ++j)
+				prob_topic[param[j].first] += theta_topic[param[j].second] * obs->second;
+		}
+
+		/// normalize
+		double sum = 0.0;
+		double max = 0.0;
+		for (size_t j=0; j < m_topic_size; j++) {
+			prob_topic[j] = exp(prob_topic[j]); // * y_prob[j];
+			sum += prob_topic[j];
+			if (prob_topic[j] > max) {
+				max = prob_topic[j];
+				max_z = j;
+			}
+		}
+		for (size_t j=0; j < m_topic_size; j++) {
+			prob_topic[j] /= sum;
+		}
+
+		/// evaluating
+		reference1.push_back(it->topic.label);
+		hypothesis1.push_back(max_z);
+
+		/// calculate the expectation
+		/// E[p] - E[~p]
+		for (obs = it->topic.obs.begin(); obs != it->topic.obs.end(); ++obs) {
+			const vector<pair<size_t, size_t> >& param = (*m_ParamTopic.m_ParamIndex)[obs->first];
+			for (size_t j = 0; j < param.size(); ++j)
+				gradient_topic[param[j].second] += prob_topic[param[j].first] * obs->second * count;
+		}
+
+		/////////////////////////////////////////////////////////////////////
+		/// PL for sequence
+		/////////////////////////////////////////////////////////////////////
+		size_t prev_label = m_default_oid;
+		reference2.clear();
+		hypothesis2.clear();
+		prob_seq.resize(m_state_size[z]);
+		for (size_t i = 0; i < it->seq.size(); ++i) {
+			Event& seq_obs = m_PLSeqSet[s][i];
+			Event& share_obs = m_PLShareSet[s][i];
+
+			size_t max_y = m_default_oid;
+			fill(prob_seq.begin(), prob_seq.end(), 0.0);
+
+			/// w * f (for all classes)
+			for (obs = seq_obs.obs.begin(); obs != seq_obs.obs.end(); ++obs) {
+				const vector<pair<size_t, size_t> >& param = (*m_ParamSeq[z].m_ParamIndex)[obs->first];
+				for (size_t j = 0; j < param.size(); ++j)
+					prob_seq[param[j].first] += theta_seq[param[j].second] * obs->second;
+			}
+			for (obs = share_obs.obs.begin(); obs != share_obs.obs.end(); ++obs) {
+				const vector<pair<size_t, size_t> >& param = (*m_Param.m_ParamIndex)[obs->first];
+				for (size_t j = 0; j < param.size(); ++j) {
+					size_t y = to_local[param[j].first];
+					if (y < m_state_size[z])
+						prob_seq[y] += theta_share[param[j].second] * obs->second;
+				}
+			}
+
+			vector<StateParam>& trans_seq = m_OutSeq[z][prev_label];
+			for (vector<StateParam>::iterator iter = trans_seq.begin(); iter != trans_seq.end(); ++iter)
+				prob_seq[iter->y2] += theta_seq[iter->fid] * iter->fval;
+			vector<StateParam>& trans_share = m_OutShare[z][prev_label];
+			for (vector<StateParam>::iterator iter = trans_share.begin(); iter != trans_share.end(); ++iter)
+				prob_seq[iter->y2] += theta_share[iter->fid] * iter->fval;
+
+			/// normalize
+			double sum = 0.0;
+			double max = 0.0;
+			for (size_t j=0; j < m_state_size[z]; j++) {
+				prob_seq[j] = exp(prob_seq[j]); // * y_prob[j];
+				sum += prob_seq[j];
+				if (prob_seq[j] > max) {
+					max = prob_seq[j];
+					max_y = j;
+				}
+			}
+			for (size_t j=0; j < m_state_size[z]; j++) {
+				prob_seq[j] /= sum;
+			}
+
+			reference2.push_back(to_global[it->seq[i].label]);
+			hypothesis2.push_back(to_global[max_y]);
+
+			for (obs = share_obs.obs.begin(); obs != share_obs.obs.end(); ++obs) {
+				const vector<pair<size_t, size_t> >& param = (*m_Param.m_ParamIndex)[obs->first];
+				for (size_t j = 0; j < param.size(); ++j) {
+					size_t y = to_local[param[j].first];
+					if (y < m_state_size[z])
+						gradient_share[param[j].second] += prob_seq[y] * obs->second * count;
+				}
+			}
+			for (obs = seq_obs.obs.begin(); obs != seq_obs.obs.end(); ++obs) {
+				const vector<pair<size_t, size_t> >& param = (*m_ParamSeq[z].m_ParamIndex)[obs->first];
+				for (size_t j = 0; j < param.size(); ++j)
+					gradient_seq[param[j].second] += prob_seq[param[j].first] * obs->second * count;
+			}
+
+			for (vector<StateParam>::iterator iter = trans_seq.begin(); iter != trans_seq.end(); ++iter)
+				shard.assign(z + 1, iter->fid, prob_seq[iter->y2] * iter->fval * count);
+			for (vector<StateParam>::iterator iter = trans_share.begin(); iter != trans_share.end(); ++iter)
+				shard.assign(m_topic_size + 1, iter->fid, prob_seq[iter->y2] * iter->fval * count);
+
+			/// evaluation (accuracy and f1 score)
+			for (size_t c = 0; c < count; c++) {
+				eval2.addLikelihood(prob_seq[it->seq[i].label]);
+			}
+
+			prev_label = it->seq[i].label;
+		}
+
+		/// evaluation
+		for (size_t c = 0; c < count; c++) {
+			eval1.addLikelihood(prob_topic[it->topic.label]);
+			eval1.append(reference1, hypothesis1);
+			eval2.append(reference2, hypothesis2);
+		}
+
+	} ///< for shard
 }
 
 /** Training with Psuedo-likelihood.
@@ -1076,7 +1632,8 @@ bool TriCRF3::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 	double* theta_share = m_Param.getWeight();
 	n_theta += m_Param.size();
 
-	double* theta = new double[n_theta];
+	WeightVector theta_vec(n_theta);	///< concatenated weights (mapped with mmap_dir)
+	double* theta = &theta_vec[0];
 	size_t tmp_i = 0;
 	for (size_t z = 0; z < m_topic_size; z++) {
 		for (size_t i = 0; i < m_ParamSeq[z].size(); ++i, ++tmp_i)
@@ -1087,7 +1644,8 @@ bool TriCRF3::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 
 	assert(tmp_i == n_theta);
 
-	double* gradient = new double[n_theta]; //m_Param.getGradient();
+	WeightVector gradient_vec(n_theta);	///< concatenated gradients (mapped with mmap_dir)
+	double* gradient = &gradient_vec[0];
 	double* gradient_topic = m_ParamTopic.getGradient();
 	vector<double*> gradient_seq;
 	for (size_t z = 0; z < m_topic_size; z++)
@@ -1096,6 +1654,11 @@ bool TriCRF3::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 
 	Evaluator eval1(m_ParamTopic, false);		///< Evaluator (topic)
 	Evaluator eval2(m_Param);					///< Evaluator (sequence)
+	vector<Evaluator*> evals;
+	evals.push_back(&eval1);
+	evals.push_back(&eval2);
+	vector<vector<size_t> > to_global, to_local;
+	mapLabels(to_global, to_local);
 																///< todo; replace with a general evaluator for seq
 	timer t;		///< timer
 
@@ -1124,6 +1687,8 @@ bool TriCRF3::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 	double time_for_evaluation = 0.0;
 	double time_for_estimating = 0.0;
 
+	makePLIndex();
+
 	/// Training iteration
     for (size_t niter = 0 ;niter < (int)max_iter; ++niter) {
 
@@ -1141,163 +1706,9 @@ bool TriCRF3::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 		double time_for_inference = 0.0;
 
 		////////////////////////////////////////////////////////////////////////////
-		/// for each training set
+		/// for each training set (in shards)
 		////////////////////////////////////////////////////////////////////////////
-        vector<TriStringSequence>::iterator it = m_TrainSet.begin();
-		vector<double>::iterator count_it = m_TrainSetCount.begin();
-        for (; it != m_TrainSet.end(); ++it, ++count_it) {
-			double count = *count_it;
-
-			/////////////////////////////////////////////////////////////////////
-			/// PL for topic
-			/////////////////////////////////////////////////////////////////////
-			vector<size_t> reference1, hypothesis1;
-			size_t max_z = 0;
-			vector<double> prob_topic(m_topic_size);
-			fill(prob_topic.begin(), prob_topic.end(), 0.0);
-
-			/// Inference
-			vector<ObsParam> obs_param = m_ParamTopic.makeObsIndex(it->topic.obs);
-			for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-				prob_topic[iter->y] += theta_topic[iter->fid] * iter->fval;
-			}
-
-			/// normalize
-			double sum = 0.0;
-			double max = 0.0;
-			for (size_t j=0; j < m_topic_size; j++) {
-				prob_topic[j] = exp(prob_topic[j]); // * y_prob[j];
-				sum += prob_topic[j];
-				if (prob_topic[j] > max) {
-					max = prob_topic[j];
-					max_z = j;
-				}
-			}
-			for (size_t j=0; j < m_topic_size; j++) {
-				prob_topic[j] /= sum;
-			}
-
-			/// evaluating
-			reference1.push_back(it->topic.label);
-			hypothesis1.push_back(max_z);
-
-			/// calculate the expectation
-			/// E[p] - E[~p]
-			for(vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-				gradient_topic[iter->fid] += prob_topic[iter->y] * iter->fval * count;
-			}
-
-			/////////////////////////////////////////////////////////////////////
-			/// PL for sequence
-			/////////////////////////////////////////////////////////////////////
-			size_t prev_label = m_default_oid;
-			size_t next_label = m_default_oid;
-			vector<string> reference2, hypothesis2;
-			for (size_t i = 0; i < it->seq.size(); ++i) {
-
-				size_t max_y = m_default_oid;
-				vector<double> prob_seq(m_state_size[it->topic.label]);
-				fill(prob_seq.begin(), prob_seq.end(), 0.0);
-
-				/// w * f (for all classes)
-				vector<ObsParam> obs_param = m_ParamSeq[it->topic.label].makeObsIndex(it->seq[i].obs);
-				for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-					prob_seq[iter->y] += theta_seq[it->topic.label][iter->fid] * iter->fval;
-				}
-				obs_param = m_Param.makeObsIndex(it->seq[i].obs);
-				for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-					pair<size_t, size_t> key = make_pair(it->topic.label, iter->y);
-					if (m_Mapping.find(key) == m_Mapping.end())
-						continue;
-					prob_seq[m_Mapping[key]] += theta_share[iter->fid] * iter->fval;
-				}
-
-				for (vector<StateParam>::iterator iter = m_ParamSeq[it->topic.label].m_StateIndex.begin(); iter != m_ParamSeq[it->topic.label].m_StateIndex.end(); ++iter) {
-					if (iter->y1 == prev_label)
-						prob_seq[iter->y2] += theta_seq[it->topic.label][iter->fid] * iter->fval;
-				}
-
-				for (vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin(); iter != m_Param.m_StateIndex.end(); ++iter) {
-					pair<size_t, size_t> key1 = make_pair(it->topic.label, iter->y1);
-					pair<size_t, size_t> key2 = make_pair(it->topic.label, iter->y2);
-
-					if (m_Mapping.find(key1) == m_Mapping.end() || m_Mapping.find(key2) == m_Mapping.end())
-						continue;
-					size_t y1 = m_Mapping[key1];
-					size_t y2 = m_Mapping[key2];
-
-					if (y1 == prev_label)
-						prob_seq[y2] += theta_share[iter->fid] * iter->fval;
-				}
-
-
-				/// normalize
-				double sum = 0.0;
-				double max = 0.0;
-				for (size_t j=0; j < m_state_size[it->topic.label]; j++) {
-					prob_seq[j] = exp(prob_seq[j]); // * y_prob[j];
-					sum += prob_seq[j];
-					if (prob_seq[j] > max) {
-						max = prob_seq[j];
-						max_y = j;
-					}
-				}
-				for (size_t j=0; j < m_state_size[it->topic.label]; j++) {
-					prob_seq[j] /= sum;
-				}
-
-				string outcome_s = m_ParamSeq[it->topic.label].getState().second[it->seq[i].label];
-				string y_seq_s = m_ParamSeq[it->topic.label].getState().second[max_y];
-				reference2.push_back(outcome_s);
-				hypothesis2.push_back(y_seq_s);
-
-				for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-					pair<size_t, size_t> key = make_pair(it->topic.label, iter->y);
-					if (m_Mapping.find(key) == m_Mapping.end())
-						continue;
-					gradient_share[iter->fid] += prob_seq[m_Mapping[key]] * iter->fval * count;
-				}
-
-				obs_param = m_ParamSeq[it->topic.label].makeObsIndex(it->seq[i].obs);
-				for (vector<ObsParam>::iterator iter = obs_param.begin(); iter != obs_param.end(); ++iter) {
-					gradient_seq[it->topic.label][iter->fid] += prob_seq[iter->y] * iter->fval * count;
-				}
-
-				for (vector<StateParam>::iterator iter = m_ParamSeq[it->topic.label].m_StateIndex.begin(); iter != m_ParamSeq[it->topic.label].m_StateIndex.end(); ++iter) {
-					if (iter->y1 == prev_label)
-						gradient_seq[it->topic.label][iter->fid] = prob_seq[iter->y2] * iter->fval * count;
-				}
-
-				for (vector<StateParam>::iterator iter = m_Param.m_StateIndex.begin(); iter != m_Param.m_StateIndex.end(); ++iter) {
-					pair<size_t, size_t> key1 = make_pair(it->topic.label, iter->y1);
-					pair<size_t, size_t> key2 = make_pair(it->topic.label, iter->y2);
-
-					if (m_Mapping.find(key1) == m_Mapping.end() || m_Mapping.find(key2) == m_Mapping.end())
-						continue;
-					size_t y1 = m_Mapping[key1];
-					size_t y2 = m_Mapping[key2];
-
-					if (y1 == prev_label)
-						gradient_share[iter->fid] = prob_seq[y2] * iter->fval * count;
-				}
-
-
-				/// evaluation (accuracy and f1 score)
-				for (size_t c = 0; c < count; c++) {
-					eval2.addLikelihood(prob_seq[it->seq[i].label]);
-				}
-
-				prev_label = it->seq[i].label;
-			}
-
-			/// evaluation
-			for (size_t c = 0; c < count; c++) {
-				eval1.addLikelihood(prob_topic[it->topic.label]);
-				eval1.append(reference1, hypothesis1);
-				eval2.append(m_Param, reference2, hypothesis2);
-			}
-
-		} ///< for m_TrainSet
+		accumulateShards(0, m_TrainSet->size(), evals);
 
 
 		////////////////////////////////////////////////////////////////////////////
@@ -1403,176 +1814,131 @@ bool TriCRF3::estimateWithPL(size_t max_iter, double sigma, bool L1, double eta)
 
 	} ///< for iter
 
-	delete theta;
-	delete gradient;
-
 	return true;
 }
 
 bool TriCRF3::pretrain(size_t max_iter, double sigma, bool L1) {
-	return estimateWithPL(max_iter, sigma, L1);
+	bool ok = estimateWithPL(max_iter, sigma, L1);
+	/// the observation ids are as large as the training set
+	vector<Sequence>().swap(m_PLSeqSet);
+	vector<Sequence>().swap(m_PLShareSet);
+	return ok;
 }
 
 bool TriCRF3::train(size_t max_iter, double sigma, bool L1) {
-	return estimateWithLBFGS(max_iter, sigma, L1);
+	beginEarlyStop();
+	bool ok = estimateWithLBFGS(max_iter, sigma, L1);
+	endEarlyStop();
+	return ok;
 }
 
-bool TriCRF3::test(const std::string& filename, const std::string& outputfile, bool confidence) {
-	/// File stream
-	string line;
-	ifstream f(filename.c_str());
-	if (!f)
-		throw runtime_error("cannot open data file");
-
-	/// output
-	ofstream out;
-	//vector<string> state_vec;
-	if (outputfile != "") {
-		out.open(outputfile.c_str());
-		out.precision(20);
-		//state_vec = m_ParamTopic.getState().second;
-	}
-	/*
-	ofstream out, outs[m_ParamTopic.sizeStateVec()];
-	if (outputfile != "") {
-		string name = outputfile + ".TOPIC";
-		out.open(name.c_str());
-		out.precision(20);
-		for (size_t i = 0; i < m_ParamTopic.sizeStateVec(); i++) {
-			string name = outputfile + "." + m_ParamTopic.getState().second[i];
-			outs[i].open(name.c_str());
-			outs[i].precision(20);
-		}
+/**	Evaluation of the compiled decoding in TriCRF3::test().
+	@class TriCRF3Evaluator
+*/
+class TriCRF3Evaluator : public DecodeEvaluator {
+public:
+	Evaluator topic_eval;		///< topic classification
+	Evaluator seq_eval;			///< sequential labeling (global labels)
+	vector<Evaluator> evals;	///< sequential labeling of each topic (local labels)
+	const Map* topic_map;		///< topic -> id
+	const Map* seq_map;			///< global label -> id
+	size_t n_topic;
+	size_t n_state;
+	vector<vector<size_t> > to_local;	///< global -> local label of each topic
+	vector<size_t> reference, hypothesis, reference_z, hypothesis_z;
+
+	TriCRF3Evaluator(Parameter& param_topic, Parameter& param, vector<Parameter>& param_seq, const vector<vector<size_t> >& to_local)
+		: topic_eval(param_topic, false), seq_eval(param), evals(param_topic.sizeStateVec()), to_local(to_local) {
+		topic_map = &param_topic.getStateMap();
+		seq_map = &param.getStateMap();
+		n_topic = param_topic.sizeStateVec();
+		n_state = param.sizeStateVec();
+		for (size_t i = 0; i < n_topic; i++)
+			evals[i].encode(param_seq[i]);
+		clear();
 	}
-	*/
-
-	/// initializing
-	size_t count = 0;
-	TriStringSequence triseq;
-	logger->report("[Testing begins ...]\n");
-	timer stop_watch;
-	Evaluator test_eval1(m_ParamTopic, false);		///< Evaluator (topic)
-	Evaluator test_eval2(m_Param);		///< Evaluator (sequence)
-	test_eval1.initialize();	///< evaluator intialization
-	test_eval2.initialize();
 
-	/////// for MULTI-DOMAIN SLU evaluation 2008. 4. 30
-	Evaluator *evals = new Evaluator[m_ParamTopic.sizeStateVec()];
-	for (size_t i = 0; i < m_ParamTopic.sizeStateVec(); i++) {
-		evals[i].encode(m_ParamSeq[i]);
-		evals[i].initialize();
+	DecodeEvaluator* clone() const {
+		TriCRF3Evaluator* copy = new TriCRF3Evaluator(*this);
+		copy->clear();
+		return copy;
 	}
 
-	size_t seq_count = 0;
-
-	calculateEdge();
-
-	/// reading the text
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty()) {
-			/// test
-			calculateFactors(triseq);
-  			forward();
-			long double zval = getPartitionZ();
-            long double dummy_prob;
-
-			////////////////////////////////////////////////////////////////////
-			/// pruning
-			////////////////////////////////////////////////////////////////////
-			long double threshold = m_prune[0].first / m_prune_threshold;
-			vector<pair<long double, size_t> >::iterator pit = m_prune.begin();
-			for (; pit != m_prune.end(); pit++) {
-				if (pit->first < threshold) {
-					m_prune.erase(pit, m_prune.end());
-					break;
-				}
-			}
-
-			size_t max_z;
-			vector<size_t> y_seq = viterbiSearch(max_z, dummy_prob);
-			assert(y_seq.size() == triseq.seq.size());
-
-			vector<size_t> reference1, hypothesis1;
-			reference1.push_back(triseq.topic.label);
-			hypothesis1.push_back(max_z);
-			test_eval1.append(reference1, hypothesis1);
-			if (outputfile != "") {
-				string outcome_s = m_ParamTopic.getState().second[max_z];
-				out << outcome_s;
-				/*
-				if (confidence) {
-					double prob = m_Alpha[max_z][ZMAT2(max_z, m_seq_size-1, m_default_oid)] * m_Gamma[max_z] / zval;
-					out << " " << prob;
-				}
-				*/
-				out << endl;
-			}
-
-			size_t prev_y = m_default_oid;
-			vector<string> reference, hypothesis;
-			StringSequence::iterator it = triseq.seq.begin();
-			for (size_t i = 0; it != triseq.seq.end(); ++i, ++it) {	 /// for each node in sequence
-				size_t outcome = triseq.seq[i].label;
-				string outcome_s;
-
-				if (m_ParamTopic.sizeStateVec() <= triseq.topic.label) {
-					std::cout << "ERROR: unknown intent" << triseq.topic.label << std::endl;
-					exit(1);
-				}
-				if (m_Param.sizeStateVec() <= outcome) {
-					std::cout << "ERROR: unknown slot" << outcome << std::endl;
-					exit(1);
-				}
-				outcome_s = m_Param.getState().second[outcome];
-				string y_seq_s = m_ParamSeq[max_z].getState().second[y_seq[i]];
-
-				reference.push_back(outcome_s);
-				hypothesis.push_back(y_seq_s);
-
-				if (outputfile != "") {
-					out << y_seq_s << endl;
-					/*
-					if (confidence) {
-						double norm = 0.0;
-						for (size_t j = 0; j < m_state_size[max_z]; j++)
-							norm += m_R[max_z][ZMAT2(max_z, i, j)] * m_M[max_z][ZMAT2(max_z, prev_y,j)];
-						double prob = m_R[max_z][ZMAT2(max_z, i, y_seq[i])] * m_M[max_z][ZMAT2(max_z, prev_y,y_seq[i])] / norm;
-						out << " " << prob;
-						prev_y = y_seq[i];
-					}
-					*/
-					//outs[triseq.topic.label] << endl;
-				}
-			}
-			if (outputfile != "")
-				out << endl;
-
-			test_eval2.append(m_Param, reference, hypothesis);
-			evals[triseq.topic.label].append(m_ParamSeq[triseq.topic.label], reference, hypothesis);
+	void clear() {
+		topic_eval.initialize();
+		seq_eval.initialize();
+		for (size_t i = 0; i < evals.size(); i++)
+			evals[i].initialize();
+	}
 
-			triseq.seq.clear();
-			seq_count = 0;
-			++count;
-		} else {
-			++seq_count;
-			if (seq_count == 1) { ///< this is a topic
-				triseq.topic = packEvent(tokens, &m_ParamTopic, true);	///< wanrning: There are no common element in topic classes and sequence classes.
-			} else {
-				size_t z = (triseq.topic.label < m_ParamTopic.sizeStateVec() ? triseq.topic.label : m_default_oid);
-				StringEvent ev = packStringEvent(tokens, &m_Param, true);	///< observation features
-				triseq.seq.push_back(ev);	///< append
+	void append(const vector<string>& lines, const DecodeResult& result) {
+		if (lines.empty() || result.label_ids.size() != lines.size() - 1)
+			return;	///< not decoded
+		Map::const_iterator it = topic_map->find(referenceLabel(lines[0]));
+		size_t topic = (it != topic_map->end() ? it->second : n_topic);
+		topic_eval.append(&topic, &result.topic_id, 1);
+		if (lines.size() == 1)
+			return;
+
+		if (topic >= n_topic) {
+			std::cout << "ERROR: unknown intent" << referenceLabel(lines[0]) << std::endl;
+			exit(1);
+		}
+		const vector<size_t>& to_topic = to_local[topic];
+		reference.clear();
+		hypothesis.clear();
+		reference_z.clear();
+		hypothesis_z.clear();
+		for (size_t i = 1; i < lines.size(); i++) {
+			it = seq_map->find(referenceLabel(lines[i]));
+			if (it == seq_map->end()) {
+				std::cout << "ERROR: unknown slot" << referenceLabel(lines[i]) << std::endl;
+				exit(1);
 			}
+			size_t y = result.label_ids[i - 1];
+			reference.push_back(it->second);
+			hypothesis.push_back(y);
+			reference_z.push_back(to_topic[it->second]);
+			hypothesis_z.push_back(to_topic[y]);
+		}
+		seq_eval.append(reference, hypothesis);
+		evals[topic].append(reference_z, hypothesis_z);
+	}
 
-		}	///< else
-	}	///< while
-
+	void merge(const DecodeEvaluator& other) {
+		const TriCRF3Evaluator& e = (const TriCRF3Evaluator&)other;
+		topic_eval.merge(e.topic_eval);
+		seq_eval.merge(e.seq_eval);
+		for (size_t i = 0; i < evals.size(); i++)
+			evals[i].merge(e.evals[i]);
+	}
+};
+
+/**	Test the model on a data file.
+	The file is decoded by the compiled model (see decodeFile()) in batches of m_decode_batch,
+	over m_decode_thread decoder threads, and the results are evaluated in the order of the input.
+	@param filename		data file
+	@param outputfile	output file (topic, and labels)
+	@param confidence	not used ; the probabilities are not written
+	@return true if succeeded
+*/
+bool TriCRF3::test(const std::string& filename, const std::string& outputfile, bool confidence) {
+	logger->report("[Testing begins ...]\n");
+	timer stop_watch;
+	vector<vector<size_t> > to_global, to_local;
+	mapLabels(to_global, to_local);
+	TriCRF3Evaluator evaluator(m_ParamTopic, m_Param, m_ParamSeq, to_local);
+	CompiledModel* compiled = compile();
+	decodeFile(*compiled, filename, outputfile, CONFIDENCE_NONE, m_decode_batch, logger, m_decode_thread, &evaluator);
+	delete compiled;
+
+	Evaluator& test_eval1 = evaluator.topic_eval;
+	Evaluator& test_eval2 = evaluator.seq_eval;
 	test_eval1.calculateF1();
 	test_eval2.calculateF1();
 	for (size_t i = 0; i < m_ParamTopic.sizeStateVec(); i++)
-		evals[i].calculateF1();
+		evaluator.evals[i].calculateF1();
 
-	logger->report("  # of data = \t\t%d\n", count);
 	logger->report("  testing time = \t%.3f\n\n", stop_watch.elapsed());
 	logger->report("[Topic Classification]\n");
 	test_eval1.Print(logger);
@@ -1581,16 +1947,16 @@ bool TriCRF3::test(const std::string& filename, const std::string& outputfile, b
 	test_eval2.Print(logger);
 	logger->report("\n-------------PER TOPIC CLASS-------------------------------------------\n");
 	for (size_t i = 0; i < m_ParamTopic.sizeStateVec(); i++) {
-		logger->report("- Domain = %s ----------------------------------------------------\n", m_ParamTopic.getState().second[i].c_str());
-		evals[i].Print(logger);
+		logger->report("- Domain = %s ----------------------------------------------------\n", m_ParamTopic.getStateVec()[i].c_str());
+		evaluator.evals[i].Print(logger);
 	}
-
+	return true;
 }
 
 bool TriCRF3::infer(const std::string& filename, const std::string& outputfile, bool confidence) {
 	/// File stream
 	string line;
-	ifstream f(filename.c_str());
+	InputStream f(filename);
 	if (!f)
 		throw runtime_error("cannot open data file");
 
@@ -1600,7 +1966,7 @@ bool TriCRF3::infer(const std::string& filename, const std::string& outputfile,
 	if (outputfile != "") {
 		out.open(outputfile.c_str());
 		out.precision(20);
-		//state_vec = m_ParamTopic.getState().second;
+		//state_vec = m_ParamTopic.getStateVec();
 	}
 	/*
 	ofstream out, outs[m_ParamTopic.sizeStateVec()];
@@ -1609,7 +1975,7 @@ bool TriCRF3::infer(const std::string& filename, const std::string& outputfile,
 		out.open(name.c_str());
 		out.precision(20);
 		for (size_t i = 0; i < m_ParamTopic.sizeStateVec(); i++) {
-			string name = outputfile + "." + m_ParamTopic.getState().second[i];
+			string name = outputfile + "." + m_ParamTopic.getStateVec()[i];
 			outs[i].open(name.c_str());
 			outs[i].precision(20);
 		}
@@ -1627,9 +1993,10 @@ bool TriCRF3::infer(const std::string& filename, const std::string& outputfile,
 	calculateEdge();
 
 	/// reading the text
-	while (getline(f,line)) {
-		vector<string> tokens = tokenize(line, " \t");
-		if (line.empty()) {
+	DataReader reader(f, &m_Template, true);
+	vector<string> tokens;
+	while (reader.next(tokens)) {
+		if (tokens.size() <= 0) {
 			/// test
 			calculateFactors(triseq);
   			forward();
@@ -1658,7 +2025,7 @@ bool TriCRF3::infer(const std::string& filename, const std::string& outputfile,
 				backward();
 
 			if (outputfile != "") {
-				string outcome_s = m_ParamTopic.getState().second[max_z];
+				string outcome_s = m_ParamTopic.getStateVec()[max_z];
 				out << outcome_s;
 				if (confidence) {
 					double prob = 0.0;
@@ -1670,19 +2037,14 @@ bool TriCRF3::infer(const std::string& filename, const std::string& outputfile,
 					// double prob = m_Alpha[max_z][ZMAT2(max_z, m_seq_size-1, m_default_oid)] * m_Gamma[max_z] / zval;
 					out << " " << prob;
 				}
-				out << endl;
+				out << '\n';
 			}
 
 			size_t prev_y = m_default_oid;
-			vector<string> reference, hypothesis;
 			StringSequence::iterator it = triseq.seq.begin();
 			for (size_t i = 0; it != triseq.seq.end(); ++i, ++it) {	 /// for each node in sequence
-				string y_seq_s = m_ParamSeq[max_z].getState().second[y_seq[i]];
-
-
-
 				if (outputfile != "") {
-					out << y_seq_s;
+					out << m_ParamSeq[max_z].getStateVec()[y_seq[i]];
 					if (confidence) {
 						// double norm = 0.0;
 						// for (size_t j = 0; j < m_state_size[max_z]; j++)
@@ -1692,12 +2054,12 @@ bool TriCRF3::infer(const std::string& filename, const std::string& outputfile,
 						out << " " << y_prob;
 						// prev_y = y_seq[i];
 					}
-					out << endl;
+					out << '\n';
 					//outs[triseq.topic.label] << endl;
 				}
 			}
 			if (outputfile != "")
-				out << endl;
+				out << '\n';
 
 			triseq.seq.clear();
 			seq_count = 0;
@@ -1714,6 +2076,152 @@ bool TriCRF3::infer(const std::string& filename, const std::string& outputfile,
 
 		}	///< else
 	}	///< while
+	return true;
+}
+
+/**	Compile the model for the decoder sessions.
+	The shared features are indexed by the global labels and mapped to the local labels of each topic.
+	@return compiled model (owned by the caller)
+*/
+CompiledModel* TriCRF3::compile() {
+	CompiledModel* model = new CompiledModel();
+	model->setFeatures(m_Param);
+	model->setTopicFeatures(m_ParamTopic);
+
+	calculateEdge();
+	vector<string> topics = m_ParamTopic.getStateVec();
+	for (size_t z = 0; z < m_topic_size; z++) {
+		size_t size = m_state_size[z];
+		vector<string> states = m_ParamSeq[z].getStateVec();
+		vector<size_t> l2g(size, m_Param.sizeStateVec());
+		map<pair<size_t, size_t>, size_t>::iterator it = m_Mapping.begin();
+		for (; it != m_Mapping.end(); ++it) {
+			if (it->first.first == z && it->second < size)
+				l2g[it->second] = it->first.second;
+		}
+		model->addTopic(topics[z], states, l2g);
+		model->addTopicFeatures(z, m_ParamSeq[z]);
+
+		vector<double> start(size), end(size), node(size, 1.0);
+		for (size_t y = 0; y < size; y++) {
+			start[y] = m_M[z][ZMAT2(z, m_default_oid, y)];
+			end[y] = m_M[z][ZMAT2(z, y, m_default_oid)];
+		}
+		model->setEdge(z, start, m_M[z], end, node);
+	}
+	model->setPrune(m_prune_threshold);
+	model->setViterbiBound(m_viterbi_bound);
+	model->setTemplate(m_Template);
+
+	return model;
+}
+
+MaxEnt* TriCRF3::clone() {
+	return new TriCRF3(*this);
+}
+
+vector<Parameter*> TriCRF3::getParams() {
+	vector<Parameter*> params;
+	params.push_back(&m_ParamTopic);
+	for (size_t z = 0; z < m_topic_size; z++)
+		params.push_back(&m_ParamSeq[z]);
+	params.push_back(&m_Param);
+	return params;
+}
+
+MaxEnt* TriCRF3::fold(size_t k, size_t n_fold) {
+	TriCRF3* model = new TriCRF3(*this);
+	model->m_DevSet = m_TrainSet;
+	splitFold(*m_TrainSetCount, k, n_fold, model->m_TrainSetCount.reset(), model->m_DevSetCount.reset());
+	model->countFeatures();
+	return model;
+}
+
+void TriCRF3::countFeatures() {
+	for (size_t z = 0; z < m_topic_size; z++)
+		m_ParamSeq[z].clearCount();
+	m_ParamTopic.clearCount();
+	m_Param.clearCount();
+	vector<vector<size_t> > to_global, to_local;
+	mapLabels(to_global, to_local);
+	const Vec& global_vec = m_Param.getStateVec();
+	for (size_t i = 0; i < m_TrainSet->size(); i++) {
+		const TriStringSequence& triseq = (*m_TrainSet)[i];
+		double count = (*m_TrainSetCount)[i];
+		const Event& topic = triseq.topic;
+		for (size_t k = 0; k < topic.obs.size(); k++)
+			m_ParamTopic.addCount(topic.label, topic.obs[k].first, count * topic.fval);
+
+		Parameter& param = m_ParamSeq[topic.label];
+		const Vec& state_vec = param.getStateVec();
+		for (size_t j = 0; j < triseq.seq.size(); j++) {
+			const StringEvent& ev = triseq.seq[j];
+			for (size_t k = 0; k < ev.obs.size(); k++) {
+				int pid = param.findObs(ev.obs[k].first);
+				if (pid >= 0)
+					param.addCount(ev.label, pid, count * ev.fval);
+			}
+			/// state transition features
+			if (j > 0) {
+				int pid = param.findObs("@" + state_vec[triseq.seq[j-1].label]);
+				if (pid >= 0)
+					param.addCount(ev.label, pid, count * ev.fval);
+			}
+		}
+
+		/// global (topic-independent) features
+		const vector<size_t>& global = to_global[topic.label];
+		for (size_t j = 0; j < triseq.seq.size(); j++) {
+			const StringEvent& ev = triseq.seq[j];
+			for (size_t k = 0; k < ev.obs.size(); k++) {
+				int pid = m_Param.findObs(ev.obs[k].first);
+				if (pid >= 0)
+					m_Param.addCount(global[ev.label], pid, count * ev.fval);
+			}
+			if (j > 0) {
+				int pid = m_Param.findObs("@" + global_vec[global[triseq.seq[j-1].label]]);
+				if (pid >= 0)
+					m_Param.addCount(global[ev.label], pid, count * ev.fval);
+			}
+		}
+	}
+}
+
+size_t TriCRF3::sizeParam() {
+	size_t n = m_Param.size() + m_ParamTopic.size();
+	for (size_t z = 0; z < m_ParamSeq.size(); z++)
+		n += m_ParamSeq[z].size();
+	return n;
+}
+
+/**	Bytes held by the structures of the model ; the tables of each topic are sized to its labels.
+*/
+void TriCRF3::measureMemory(MemoryUsage& usage) {
+	CRF::measureMemory(usage);
+	usage.add("training set", bytesOf(*m_TrainSet));
+	usage.add("dev set", bytesOf(*m_DevSet));
+	usage.add("DP tables", bytesOf(m_Gamma) + bytesOf(m_Z));
+	usage.add("DP tables (per topic)", bytesOf(m_M) + bytesOf(m_R) + bytesOf(m_Alpha) + bytesOf(m_Beta) + bytesOf(m_MaxIn));
+	usage.add("label index", bytesOf(m_Mapping) + bytesOf(m_RMapping) + bytesOf(m_ToLocal));
+	usage.add("PL index", bytesOf(m_PLSeqSet) + bytesOf(m_PLShareSet) + bytesOf(m_ToGlobal) + bytesOf(m_OutSeq) + bytesOf(m_OutShare));
+	usage.add("topic cache", bytesOf(m_TopicCache));
+}
+
+/**	Bytes predicted from the statistics of the training file.
+	The data sets keep the observation strings, and every label is assumed to appear with every topic,
+	which bounds the per-topic parameters and tables.
+*/
+void TriCRF3::estimateMemory(const CorpusStats& stats, MemoryUsage& usage) {
+	size_t L = stats.n_label;
+	size_t heap = (stats.n_obs > 0 ? stats.obs_heap / stats.n_obs : 0);
+	estimateParam(usage, stats.n_feature + L, stats.n_param + L * L, heap);	///< shared
+	estimateParam(usage, stats.n_feature + L, stats.n_param + stats.n_topic * L * L, heap);	///< per topic
+	estimateParam(usage, stats.n_topic_param, stats.n_topic_param, heap);	///< topic
+	usage.add("training set", stats.n_seq * (sizeof(TriStringSequence) + sizeof(double)) + stats.n_event * sizeof(StringEvent)
+		+ (stats.n_obs + stats.n_topic_obs) * sizeof(pair<string, double>) + stats.obs_heap);
+	estimateDedup(usage, stats);
+	usage.add("DP tables", 2 * stats.n_topic * sizeof(double));
+	usage.add("DP tables (per topic)", stats.n_topic * (3 * stats.max_len * L + L * L) * sizeof(double));
 }
 
 }	///< namespace tricrf
@@ -23,41 +23,73 @@ namespace tricrf {
 class TriCRF3 : public CRF {
 protected:
 	/// Data sets
-	Data<TriStringSequence> m_TrainSet;	 ///< Train data
-	Data<TriStringSequence> m_DevSet;	///< Development data (held-out data)
+	Shared<Data<TriStringSequence> > m_TrainSet;	 ///< Train data (shared by the copies of the model)
+	Shared<Data<TriStringSequence> > m_DevSet;	///< Development data (held-out data)
 	std::vector<std::vector<TriSequence> > m_TrainLabelSet;
 
-	std::vector<std::vector<long double> > m_M;			///< M matrix ; edge transition
-	std::vector<std::vector<long double> > m_R;			///< R matrix ; node observation
-	std::vector<std::vector<long double> > m_Alpha;	///< Alpha matrix
-	std::vector<std::vector<long double> > m_Beta;		///< Beta matrix
-	std::vector<long double> m_Gamma;			///< Gamma matrix ; topic prior
-	std::vector<long double> m_Z;			///< Z matrix ; topic prior
+	/// The tables are in double ; alpha and beta of all the topics share the scale at each position (see CRF::scale)
+	std::vector<std::vector<double> > m_M;			///< M matrix ; edge transition
+	std::vector<std::vector<double> > m_R;			///< R matrix ; node observation
+	std::vector<std::vector<double> > m_Alpha;	///< Alpha matrix
+	std::vector<std::vector<double> > m_Beta;		///< Beta matrix
+	std::vector<double> m_Gamma;			///< Gamma matrix ; topic prior
+	std::vector<double> m_Z;			///< Z matrix ; topic prior
 
 	/// Parameters
 	std::vector<Parameter> m_ParamSeq;
 	Parameter m_ParamTopic;
 	std::map<std::pair<size_t, size_t>, size_t> m_Mapping;
+	std::vector<std::vector<size_t> > m_ToLocal;	///< m_Mapping as a table ; local label of each global label (per topic)
 	std::map<std::pair<size_t, size_t>, size_t> m_RMapping;
 
+	/// Topic pruning cache
+	std::vector<std::vector<size_t> > m_TopicCache;	///< surviving topics of each training sequence
+
 	/// Variables for computation
 	size_t m_topic_size;
 	std::vector<size_t> m_state_size;	 ///< re-definition
 	size_t m_state_size2;
 
 	/// Inference
-	void calculateFactors(TriStringSequence &seq);	///< Calculating the factors
+	void calculateFactors(const TriStringSequence &seq);	///< Calculating the factors
 	void calculateEdge();
+	void mapLabels(std::vector<std::vector<size_t> >& to_global, std::vector<std::vector<size_t> >& to_local);	///< label ids between the local and global state spaces
+	void mapShared();	///< m_ToLocal
 	void forward();	 ///< Forward recursion
+	void forward(const std::vector<size_t>& topics);	///< Forward recursion over the given topics
+	void scaleAlpha(const std::vector<size_t>& topics, size_t i);	///< shared scale of the topics at a position
+	void restrictAlpha(const std::vector<size_t>& topics);	///< alpha of a full pass restricted to the given topics
 	void backward();	///< Backward recursion
 	long double getPartitionZ();	///< Z
-	long double calculateProb(TriStringSequence& seq);	///< Prob(y|x)
+	void pruneTopics();	///< Pruning the topics
+	long double calculateProb(const TriStringSequence& seq);	///< Prob(y|x)
 	std::vector<size_t> viterbiSearch(size_t& max_z, long double& prob);	///< Find the best path
+	long double boundPath(size_t z);	///< Bound of the best path of a topic
+
+	/// Viterbi bound
+	std::vector<std::vector<double> > m_MaxIn;	///< largest transition into each label (per topic)
+	size_t m_n_viterbi_topic;	///< topics given to the Viterbi search
+	size_t m_n_viterbi_search;	///< topics actually searched
 
 	/// Parameter Estimation
 	bool estimateWithLBFGS(size_t max_iter, double sigma, bool L1 = false, double eta = 1E-05);
 	bool estimateWithPL(size_t max_iter, double sigma, bool L1 = false, double eta = 1E-05);
-	virtual bool averageParam() {};
+	void countFeatures();
+	std::vector<Parameter*> getParams();
+
+	/// PL training ; the string observations are looked up once, and the transitions are grouped by the previous label
+	std::vector<Sequence> m_PLSeqSet;	///< observation ids of m_ParamSeq[z] of the training sequences
+	std::vector<Sequence> m_PLShareSet;	///< observation ids of m_Param
+	std::vector<std::vector<size_t> > m_ToGlobal;	///< global label of each local label (per topic)
+	std::vector<std::vector<std::vector<StateParam> > > m_OutSeq;	///< transitions of m_ParamSeq[z] from each local label
+	std::vector<std::vector<std::vector<StateParam> > > m_OutShare;	///< transitions of m_Param from each local label of z
+	void makePLIndex();
+	void estimateShard(TrainShard& shard);
+	virtual bool averageParam() { return true; };
+
+	/// Memory accounting
+	void measureMemory(MemoryUsage& usage);
+	void estimateMemory(const CorpusStats& stats, MemoryUsage& usage);
 
 public:
 	TriCRF3();
@@ -70,6 +102,7 @@ public:
 	/// Model
 	bool loadModel(const std::string& filename);
 	bool saveModel(const std::string& filename);
+	size_t compact();
 
 	/// Training
 	void clear();
@@ -79,6 +112,10 @@ public:
 
 	/// Testing
 	bool test(const std::string& filename, const std::string& outputfile = "", bool confidence = false);
+	CompiledModel* compile();
+	MaxEnt* clone();
+	MaxEnt* fold(size_t k, size_t n_fold);
+	size_t sizeParam();
 	bool infer(const std::string& filename, const std::string& outputfile = "", bool confidence = false);
 
 	Parameter& getTopicParam() { return m_ParamTopic; };
@@ -150,6 +150,8 @@ bool Configurator::parse(const string& filename) {
 				throw runtime_error("invalid configuration file");
 			vector<string> values;
 			for (size_t i = 1; i < tokens.size(); i++) {
+				if (tokens[i][0] == '#')	///< trailing comment
+					break;
 				if (tokens[i].find("[") != string::npos) {
 					vector<string> tok = tokenize(tokens[i], "[-]");
 					if (tok.size() < 3)
@@ -161,7 +163,8 @@ bool Configurator::parse(const string& filename) {
 					}
 				} else
 					values.push_back(tokens[i]);			}
-			config.insert(make_pair(tokens[0], values));
+			if (!values.empty())
+				config.insert(make_pair(tokens[0], values));
 		}
 	}
 
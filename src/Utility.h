@@ -74,6 +74,57 @@ private:
 	std::clock_t _start_time;
 }; // timer
 
+/** Object shared by the copies of a model (data sets, dictionaries and counts).
+	A copy of the holder refers to the same object, which is read through * and -> ; edit()
+	makes an own copy first if the object is shared (copy-on-write). The reference count is
+	atomic, since the copies are trained and deleted by different threads.
+	@class Shared
+*/
+template <class T>
+class Shared {
+private:
+	struct Body {
+		T object;
+		int n_ref;
+		Body() : n_ref(1) {}
+		Body(const T& other) : object(other), n_ref(1) {}
+	};
+	Body* m_Body;
+
+	void release() {
+		if (__sync_sub_and_fetch(&m_Body->n_ref, 1) == 0)
+			delete m_Body;
+	}
+
+public:
+	Shared() : m_Body(new Body()) {}
+	Shared(const Shared& other) : m_Body(other.m_Body) { __sync_add_and_fetch(&m_Body->n_ref, 1); }
+	~Shared() { release(); }
+	Shared& operator=(const Shared& other) {
+		__sync_add_and_fetch(&other.m_Body->n_ref, 1);
+		release();
+		m_Body = other.m_Body;
+		return *this;
+	}
+
+	const T& operator*() const { return m_Body->object; }
+	const T* operator->() const { return &m_Body->object; }
+	bool shared() const { return __sync_add_and_fetch(&m_Body->n_ref, 0) > 1; }
+	T& edit() {
+		if (shared()) {
+			Body* body = new Body(m_Body->object);
+			release();
+			m_Body = body;
+		}
+		return m_Body->object;
+	}
+	T& reset() {	///< a new empty object ; the old one is not copied
+		release();
+		m_Body = new Body();
+		return m_Body->object;
+	}
+};
+
 /// finite testing function
 #if defined(_MSC_VER) || defined(__BORLANDC__)
 inline int finite(double x) { return _finite(x); }